@@ -1,4 +1,5 @@
 
+#include <algorithm>
 #include <cstring>
 #include "BTreeNode.h"
 using namespace std;
@@ -26,6 +27,11 @@ void BTreeNode::save() {
     this->file.put(this->block);
 }
 
+void BTreeNode::release_block() {
+    delete this->block;
+    this->block = nullptr;
+}
+
 // Get the record and turn it into a block ID.
 BlockID BTreeNode::get_block_id(RecordID record_id) const {
     Dbt *dbt = this->block->get(record_id);
@@ -46,7 +52,13 @@ Handle BTreeNode::get_handle(RecordID record_id) const {
 // Get the record and turn it into a KeyValue.
 KeyValue *BTreeNode::get_key(RecordID record_id) const {
     Dbt *dbt = this->block->get(record_id);
-    char *bytes = (char*)dbt->get_data();
+    KeyValue *key_value = unmarshal_key((char*)dbt->get_data());
+    delete dbt;
+    return key_value;
+}
+
+// Turn marshaled key bytes into a KeyValue. If size is given, it returns the number of bytes used.
+KeyValue *BTreeNode::unmarshal_key(const char *bytes, uint *size) const {
     KeyValue *key_value = new KeyValue();
     Value value;
     uint offset = 0;
@@ -56,13 +68,10 @@ KeyValue *BTreeNode::get_key(RecordID record_id) const {
             value.n = *(int32_t*)(bytes + offset);
             offset += sizeof(int32_t);
         } else if (data_type == ColumnAttribute::DataType::TEXT) {
-            uint16_t size = *(uint16_t *)(bytes + offset);
+            uint16_t text_size = *(uint16_t *)(bytes + offset);
             offset += sizeof(uint16_t);
-            char buffer[DbBlock::BLOCK_SZ];
-            memcpy(buffer, bytes+offset, size);
-            buffer[size] = '\0';
-            value.s = std::string(buffer);  // assume ascii for now
-            offset += size;
+            value.s = std::string(bytes + offset, text_size);  // assume ascii for now
+            offset += text_size;
         } else if (data_type == ColumnAttribute::DataType::BOOLEAN) {
             value.n = *(uint8_t*)(bytes + offset);
             offset += sizeof(uint8_t);
@@ -71,7 +80,8 @@ KeyValue *BTreeNode::get_key(RecordID record_id) const {
         }
         key_value->push_back(value);
     }
-    delete dbt;
+    if (size != nullptr)
+        *size = offset;
     return key_value;
 }
 
@@ -98,7 +108,7 @@ Dbt *BTreeNode::marshal_key(const KeyValue *key) {
     uint offset = 0;
     uint col_num = 0;
     for (auto const& data_type: this->key_profile) {
-        Value value = (*key)[col_num];
+        Value value = (*key)[col_num++];
 
         if (data_type == ColumnAttribute::DataType::INT) {
             if (offset + 4 > DbBlock::BLOCK_SZ - 4)
@@ -137,18 +147,36 @@ Dbt *BTreeNode::marshal_key(const KeyValue *key) {
     return data;
 }
 
+// Size of the record marshal_key would produce for key (without actually marshaling it).
+uint BTreeNode::marshal_size(const KeyProfile& key_profile, const KeyValue& key) {
+    uint size = 0;
+    uint col_num = 0;
+    for (auto const& data_type: key_profile) {
+        if (data_type == ColumnAttribute::DataType::INT)
+            size += sizeof(int32_t);
+        else if (data_type == ColumnAttribute::DataType::TEXT)
+            size += sizeof(uint16_t) + key[col_num].s.length();
+        else
+            size += sizeof(uint8_t);
+        col_num++;
+    }
+    return size;
+}
+
 
 /******************************
  * BTreeStat statistics block *
  ******************************/
 
 BTreeStat::BTreeStat(HeapFile &file, BlockID stat_id, BlockID new_root, const KeyProfile& key_profile)
-        : BTreeNode(file, stat_id, key_profile, false), root_id(new_root), height(1) {
+        : BTreeNode(file, stat_id, key_profile, false), root_id(new_root), height(1), free_list(0) {
     save();
 }
 
+// An index saved before there was a free list has no FREE record; it starts out empty.
 BTreeStat::BTreeStat(HeapFile &file, BlockID stat_id, const KeyProfile& key_profile)
-        : BTreeNode(file, stat_id, key_profile, false), root_id(get_block_id(ROOT)), height(get_block_id(HEIGHT)) {
+        : BTreeNode(file, stat_id, key_profile, false), root_id(get_block_id(ROOT)), height(get_block_id(HEIGHT)),
+          free_list(this->block->size() >= FREE ? get_block_id(FREE) : 0) {
 }
 
 void BTreeStat::save() {
@@ -169,6 +197,14 @@ void BTreeStat::save() {
     delete[] (char*)dbt->get_data();
     delete dbt;
 
+    dbt = marshal_block_id(this->free_list);
+    if (this->block->size() < FREE)
+        this->block->add(dbt);
+    else
+        this->block->put(FREE, *dbt);
+    delete[] (char*)dbt->get_data();
+    delete dbt;
+
     BTreeNode::save();
 }
 
@@ -178,7 +214,11 @@ void BTreeStat::save() {
  *****************/
 
 BTreeInterior::BTreeInterior(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create)
-        : BTreeNode(file, block_id, key_profile, create), first(0), pointers(), boundaries() {
+        : BTreeNode(file, block_id, key_profile, create), first(0), pointers(), boundaries(), fixed_width(true),
+          fixed_keys() {
+    for (auto const& data_type: key_profile)
+        if (data_type != ColumnAttribute::DataType::INT && data_type != ColumnAttribute::DataType::BOOLEAN)
+            this->fixed_width = false;
     if (!create) {
         RecordIDs *record_id_list = this->block->ids();
         RecordID i = 1;
@@ -192,49 +232,97 @@ BTreeInterior::BTreeInterior(HeapFile &file, BlockID block_id, const KeyProfile&
             } else {
                 // key
                 KeyValue *key_value = get_key(i);
-                this->boundaries.push_back(key_value);
+                this->boundaries.push_back(std::move(*key_value));
+                delete key_value;
             }
             i++;
         }
         delete record_id_list;
+        index_keys();
     }
 }
 
 BTreeInterior::~BTreeInterior() {
-    for (auto key_value: this->boundaries)
-        delete key_value;
-    this->boundaries.clear();
 }
 
-// Get next block down in tree where key must be.
-BTreeNode *BTreeInterior::find(const KeyValue* key, uint depth) const {
-    BlockID down = this->pointers.back();  // last pointer is correct if we don't find an earlier boundary
-    for (uint i = 0; i < this->boundaries.size(); i++) {
-        KeyValue *boundary = this->boundaries[i];
-        if (*boundary > *key) {
-            if (i > 0)
-                down = this->pointers[i - 1];
+// Rebuild the flat copy of the boundaries that find_child searches in the fixed-width case.
+void BTreeInterior::index_keys() {
+    if (!this->fixed_width)
+        return;
+    this->fixed_keys.clear();
+    this->fixed_keys.reserve(this->boundaries.size() * this->key_profile.size());
+    for (auto const& boundary: this->boundaries)
+        for (auto const& value: boundary)
+            this->fixed_keys.push_back(value.n);
+}
+
+// Binary search for the index of the first boundary greater than key (boundaries.size() if none).
+// Key may be a prefix of the full key, in which case it sorts before every boundary that starts with it.
+uint BTreeInterior::upper_bound(const KeyValue& key) const {
+    uint lo = 0, hi = (uint)this->boundaries.size();
+    if (!this->fixed_width) {
+        while (lo < hi) {
+            uint mid = lo + (hi - lo) / 2;
+            if (key < this->boundaries[mid])
+                hi = mid;
             else
-                down = this->first;
-            break;
+                lo = mid + 1;
+        }
+        return lo;
+    }
+
+    uint width = (uint)this->key_profile.size();
+    uint compared = std::min(width, (uint)key.size());
+    if (width == 1 && compared == 1) {
+        auto past = std::upper_bound(this->fixed_keys.begin(), this->fixed_keys.end(), key[0].n);
+        return (uint)(past - this->fixed_keys.begin());
+    }
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        const int32_t *boundary = &this->fixed_keys[mid * width];
+        bool less = compared < width;  // a prefix equal so far is less than the boundary
+        for (uint i = 0; i < compared; i++) {
+            if (key[i].n != boundary[i]) {
+                less = key[i].n < boundary[i];
+                break;
+            }
         }
+        if (less)
+            hi = mid;
+        else
+            lo = mid + 1;
     }
+    return lo;
+}
+
+// Get next block down in tree where key must be. A null key means the leftmost child.
+BTreeNode *BTreeInterior::find(const KeyValue* key, uint depth) const {
+    BlockID down = find_child(key);
     if (depth == 2)
         return new BTreeLeaf(this->file, down, this->key_profile, false);
     else
         return new BTreeInterior(this->file, down, this->key_profile, false);
 }
 
+// Block id of the child where key must be, without reading the child. A null key means the leftmost child.
+BlockID BTreeInterior::find_child(const KeyValue* key) const {
+    if (key == nullptr)
+        return this->first;
+    uint past = upper_bound(*key);
+    return past == 0 ? this->first : this->pointers[past - 1];
+}
+
 // Save the pointers and boundaries in the correct order
 void BTreeInterior::save() {
     Dbt *dbt;
     this->block->clear();
     dbt = marshal_block_id(this->first);
+    this->block->add(dbt);
     delete[] (char *) dbt->get_data();
     delete dbt;
     for (uint i = 0; i < this->boundaries.size(); i++) {
         // key
-        dbt = marshal_key(this->boundaries[i]);
+        dbt = marshal_key(&this->boundaries[i]);
         this->block->add(dbt);
         delete[] (char *) dbt->get_data();
         delete dbt;
@@ -246,27 +334,18 @@ void BTreeInterior::save() {
         delete dbt;
     }
     BTreeNode::save();
+    BTreeNodeCache::instance().invalidate(&this->file, this->id);
 }
 
 // Insert boundary, block_id pair into block.
 Insertion BTreeInterior::insert(const KeyValue* boundary, BlockID block_id) {
     Dbt *dbt;
 
-    bool inserted = false;
-    for (uint i = 0; i < this->boundaries.size(); i++) {
-        KeyValue *check = this->boundaries[i];
-        if (*boundary == *check) {
-            this->boundaries.insert(this->boundaries.begin() + i, new KeyValue(*boundary));
-            this->pointers.insert(this->pointers.begin() + i, block_id);
-            inserted = true;
-            break;
-        }
-    }
-    if (!inserted) {
-        // must go at the end
-        this->boundaries.push_back(new KeyValue(*boundary));
-        this->pointers.push_back(block_id);
-    }
+    // keep the boundaries in order
+    uint i = upper_bound(*boundary);
+    this->boundaries.insert(this->boundaries.begin() + i, *boundary);
+    this->pointers.insert(this->pointers.begin() + i, block_id);
+    index_keys();
     dbt = marshal_block_id(block_id);
     try {
         // following is just a check for size (the save method will redo this in the right order)
@@ -295,9 +374,7 @@ Insertion BTreeInterior::insert(const KeyValue* boundary, BlockID block_id) {
         // the corresponding boundary is moved up to be inserted into the parent node
         u_long split = this->boundaries.size() / 2;
         nnode->first = this->pointers[split];
-        KeyValue *nboundary = this->boundaries[split];
-        Insertion ret(nnode->id, *nboundary);
-        delete nboundary;
+        Insertion ret(nnode->id, this->boundaries[split]);
 
         // move half of the entries to the sister
         for (u_long i = split + 1; i < this->boundaries.size(); i++) {
@@ -306,130 +383,581 @@ Insertion BTreeInterior::insert(const KeyValue* boundary, BlockID block_id) {
         }
         this->boundaries.erase(this->boundaries.begin() + split, this->boundaries.end());
         this->pointers.erase(this->pointers.begin() + split, this->pointers.end());
+        this->index_keys();
+        nnode->index_keys();
 
         // save everything
         nnode->save();
         this->save();
+        delete nnode;
         return ret;
     }
 }
 
+// Add a boundary that sorts after all the current ones. The caller saves once the node is full.
+void BTreeInterior::append(const KeyValue& boundary, BlockID block_id) {
+    this->boundaries.push_back(boundary);
+    this->pointers.push_back(block_id);
+    if (this->fixed_width)
+        for (auto const& value: boundary)
+            this->fixed_keys.push_back(value.n);
+}
+
+void BTreeInterior::set_boundary(uint i, const KeyValue& boundary) {
+    this->boundaries[i - 1] = boundary;
+    index_keys();
+}
+
+void BTreeInterior::del_child(uint i) {
+    this->boundaries.erase(this->boundaries.begin() + (i - 1));
+    this->pointers.erase(this->pointers.begin() + (i - 1));
+    index_keys();
+}
+
+// Take all of right (the next sibling), with separator (the parent's boundary between us) coming down.
+bool BTreeInterior::merge(const KeyValue& separator, BTreeInterior *right) {
+    if (get_used() + entry_size(this->key_profile, separator) + right->get_used() - EMPTY_SIZE > DbBlock::BLOCK_SZ)
+        return false;
+    this->boundaries.push_back(separator);
+    this->pointers.push_back(right->first);
+    this->boundaries.insert(this->boundaries.end(), right->boundaries.begin(), right->boundaries.end());
+    this->pointers.insert(this->pointers.end(), right->pointers.begin(), right->pointers.end());
+    index_keys();
+    return true;
+}
+
+// Even out the bytes used by us and right (the next sibling) by rotating boundaries through the parent.
+KeyValue BTreeInterior::redistribute(const KeyValue& separator, BTreeInterior *right) {
+    BlockPointers children;
+    std::vector<KeyValue> keys;  // keys[j] separates children[j] and children[j + 1]
+    children.push_back(this->first);
+    children.insert(children.end(), this->pointers.begin(), this->pointers.end());
+    children.push_back(right->first);
+    children.insert(children.end(), right->pointers.begin(), right->pointers.end());
+    keys.insert(keys.end(), this->boundaries.begin(), this->boundaries.end());
+    keys.push_back(separator);
+    keys.insert(keys.end(), right->boundaries.begin(), right->boundaries.end());
+
+    uint total = 0;
+    for (auto const& key: keys)
+        total += entry_size(this->key_profile, key);
+    uint split = 0, left = 0;  // keys[split] goes up; we keep children[0..split]
+    while (split < keys.size() - 2 && left + entry_size(this->key_profile, keys[split]) <= total / 2)
+        left += entry_size(this->key_profile, keys[split++]);
+    if (split == 0)
+        split = 1;
+
+    this->pointers.assign(children.begin() + 1, children.begin() + split + 1);
+    this->boundaries.assign(keys.begin(), keys.begin() + split);
+    right->first = children[split + 1];
+    right->pointers.assign(children.begin() + split + 2, children.end());
+    right->boundaries.assign(keys.begin() + split + 1, keys.end());
+    index_keys();
+    right->index_keys();
+    return keys[split];
+}
+
+uint BTreeInterior::get_used() const {
+    uint used = EMPTY_SIZE;
+    for (auto const& boundary: this->boundaries)
+        used += entry_size(this->key_profile, boundary);
+    return used;
+}
+
+// A boundary and its pointer are two slotted-page records, each with a 4-byte header.
+uint BTreeInterior::entry_size(const KeyProfile& key_profile, const KeyValue& boundary) {
+    return 4 + marshal_size(key_profile, boundary) + 4 + sizeof(BlockID);
+}
 
 
 /*************
  * BTreeLeaf *
  *************/
 
+// Postings are varints: 7 bits at a time, low bits first, high bit set on all but the last byte.
+static void put_varint(std::string& bytes, uint32_t n) {
+    while (n >= 0x80) {
+        bytes.push_back((char)((n & 0x7f) | 0x80));
+        n >>= 7;
+    }
+    bytes.push_back((char)n);
+}
+
+static uint32_t get_varint(const char *&bytes) {
+    uint32_t n = 0;
+    for (uint shift = 0; ; shift += 7) {
+        uint8_t b = *(const uint8_t*)bytes++;
+        n |= (uint32_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0)
+            return n;
+    }
+}
+
+// Handles must be in order, so the block id deltas are small and never negative.
+static std::string encode_postings(const Handles& handles) {
+    std::string bytes;
+    put_varint(bytes, (uint32_t)handles.size());
+    BlockID prev = 0;
+    for (auto const& handle: handles) {
+        put_varint(bytes, handle.first - prev);
+        put_varint(bytes, handle.second);
+        prev = handle.first;
+    }
+    return bytes;
+}
+
+static void decode_postings(const char *bytes, Handles *handles) {
+    uint32_t count = get_varint(bytes);
+    handles->reserve(handles->size() + count);
+    BlockID block_id = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        block_id += get_varint(bytes);
+        RecordID record_id = (RecordID)get_varint(bytes);
+        handles->push_back(Handle(block_id, record_id));
+    }
+}
+
 BTreeLeaf::BTreeLeaf(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create)
-        : BTreeNode(file, block_id, key_profile, create), next_leaf(0), key_map() {
-    if (!create) {
-        RecordIDs *record_id_list = this->block->ids();
-        RecordID i = 1;
-        for (auto j = record_id_list->size(); j > 0; j--) {
-            if (i == record_id_list->size()) {
-                // next leaf block
-                this->next_leaf = get_block_id(i);
-            } else if (i%2 == 0) {
-                // record i-1: handle, record i: key
-                KeyValue *key_value = get_key(i);
-                this->key_map[*key_value] = get_handle(i-1);
-            }
-            i++;
-        }
-        delete record_id_list;
+        : BTreeNode(file, block_id, key_profile, create), page((char*)this->block->get_data()) {
+    if (create) {
+        set_count(0);
+        set_heap_start(DbBlock::BLOCK_SZ);
+        set_next_leaf(0);
     }
 }
 
 BTreeLeaf::~BTreeLeaf() {
 }
 
-// Find the handle for a given key
-Handle BTreeLeaf::find_eq(const KeyValue* key) const {
-    return this->key_map.at(*key);
+// Find the handles for a given key
+Handles *BTreeLeaf::find_eq(const KeyValue* key) const {
+    uint i = lower_bound(*key);
+    if (i == size() || key->size() != this->key_profile.size() || compare(i, *key) != 0)
+        return new Handles();
+    return handles_at(i);
 }
 
-// Save the key_map and next_leaf data in the correct order
-void BTreeLeaf::save() {
-    Dbt *dbt;
-    this->block->clear();
-    for (auto const& item: this->key_map) {
-        // handle
-        dbt = marshal_handle(item.second);
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
-        delete dbt;
+// Binary search on the entries in place.
+uint BTreeLeaf::lower_bound(const KeyValue& key) const {
+    uint lo = 0, hi = size();
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        if (compare(mid, key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-        // key
-        dbt = marshal_key(&item.first);
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
-        delete dbt;
+// Compare the marshaled key of entry i with key, column by column, stopping after key's last column.
+int BTreeLeaf::compare(uint i, const KeyValue& key) const {
+    const char *bytes = entry(i);
+    bytes += key_offset(bytes);
+    uint col_num = 0;
+    for (auto const& data_type: this->key_profile) {
+        if (col_num == key.size())
+            break;
+        const Value& value = key[col_num++];
+        if (data_type == ColumnAttribute::DataType::INT) {
+            int32_t n = *(int32_t*)bytes;
+            if (n != value.n)
+                return n < value.n ? -1 : 1;
+            bytes += sizeof(int32_t);
+        } else if (data_type == ColumnAttribute::DataType::TEXT) {
+            uint16_t size = *(uint16_t*)bytes;
+            bytes += sizeof(uint16_t);
+            int cmp = memcmp(bytes, value.s.data(), std::min((size_t)size, value.s.length()));
+            if (cmp != 0)
+                return cmp < 0 ? -1 : 1;
+            if (size != value.s.length())
+                return size < value.s.length() ? -1 : 1;
+            bytes += size;
+        } else {
+            int32_t n = *(uint8_t*)bytes;
+            if (n != value.n)
+                return n < value.n ? -1 : 1;
+            bytes += sizeof(uint8_t);
+        }
     }
-    // next leaf pointer is final record
-    dbt = marshal_block_id(this->next_leaf);
-    this->block->add(dbt);
+    return 0;
+}
+
+Handles *BTreeLeaf::handles_at(uint i) const {
+    const char *bytes = entry(i);
+    Handles *handles = new Handles();
+    if (is_overflow(bytes)) {
+        std::string postings = read_overflow(*(BlockID*)(bytes + sizeof(u_int16_t)));
+        decode_postings(postings.data(), handles);
+    } else {
+        decode_postings(bytes + sizeof(u_int16_t), handles);
+    }
+    return handles;
+}
+
+KeyValue *BTreeLeaf::key_at(uint i) const {
+    const char *bytes = entry(i);
+    return unmarshal_key(bytes + key_offset(bytes));
+}
+
+uint BTreeLeaf::get_used() const {
+    return HEADER_SIZE + size() * sizeof(u_int16_t) + (DbBlock::BLOCK_SZ - get_heap_start());
+}
+
+uint BTreeLeaf::key_offset(const char *bytes) {
+    u_int16_t header = *(u_int16_t*)bytes;
+    return sizeof(u_int16_t) + ((header & OVERFLOW) ? OVERFLOW_SIZE : header);
+}
+
+// Length of the entry (postings plus key) starting at bytes.
+uint BTreeLeaf::entry_length(const char *bytes) const {
+    uint length = key_offset(bytes);
+    for (auto const& data_type: this->key_profile) {
+        if (data_type == ColumnAttribute::DataType::INT)
+            length += sizeof(int32_t);
+        else if (data_type == ColumnAttribute::DataType::TEXT)
+            length += sizeof(uint16_t) + *(uint16_t*)(bytes + length);
+        else
+            length += sizeof(uint8_t);
+    }
+    return length;
+}
+
+// Build the entry bytes for key and its (ordered) handles, spilling the postings to an overflow chain
+// if they're too long to keep inline or if the entry already has a chain.
+std::string BTreeLeaf::make_entry(const KeyValue& key, const Handles& handles, BlockID overflow, BTreeStat *stat) {
+    std::string postings = encode_postings(handles);
+    std::string bytes;
+    if (overflow != 0 || postings.size() > POSTING_INLINE_MAX) {
+        u_int16_t header = OVERFLOW;
+        BlockID head = write_overflow(postings, overflow, stat);
+        uint32_t count = (uint32_t)handles.size();
+        bytes.append((char*)&header, sizeof(header));
+        bytes.append((char*)&head, sizeof(head));
+        bytes.append((char*)&count, sizeof(count));
+    } else {
+        u_int16_t header = (u_int16_t)postings.size();
+        bytes.append((char*)&header, sizeof(header));
+        bytes += postings;
+    }
+    Dbt *dbt = marshal_key(&key);
+    bytes.append((char*)dbt->get_data(), dbt->get_size());
     delete[] (char *) dbt->get_data();
     delete dbt;
+    return bytes;
+}
 
-    BTreeNode::save();
+// Overflow blocks are raw: u32 next block | u16 bytes used | postings bytes.
+std::string BTreeLeaf::read_overflow(BlockID head) const {
+    std::string postings;
+    for (BlockID block_id = head; block_id != 0; ) {
+        SlottedPage *block = this->file.get(block_id);
+        const char *data = (const char*)block->get_data();
+        block_id = *(BlockID*)data;
+        postings.append(data + OVERFLOW_HEADER_SIZE, *(u_int16_t*)(data + sizeof(BlockID)));
+        delete block;
+    }
+    return postings;
 }
 
-// Insert key, handle pair into block.
-Insertion BTreeLeaf::insert(const KeyValue* key, Handle handle) {
-    // check unique
-    if (this->key_map.find(*key) != this->key_map.end())
-        throw DbRelationError("Duplicate keys are not allowed in unique index");
+// Write postings across the chain starting at head (or a new chain if head is 0), extending it as needed,
+// with blocks off stat's free list before any new ones. Blocks past the end of the postings stay on the
+// chain, empty, to be reused if the list grows again.
+BlockID BTreeLeaf::write_overflow(const std::string& postings, BlockID head, BTreeStat *stat) {
+    const uint capacity = DbBlock::BLOCK_SZ - OVERFLOW_HEADER_SIZE;
+    auto new_block = [this, stat]() {
+        SlottedPage *block;
+        if (stat != nullptr && stat->get_free_list() != 0) {
+            block = this->file.get(stat->get_free_list());
+            stat->set_free_list(*(BlockID*)block->get_data());
+            stat->save();
+        } else {
+            block = this->file.get_new();
+        }
+        *(BlockID*)block->get_data() = 0;
+        return block;
+    };
+    SlottedPage *block = head == 0 ? new_block() : this->file.get(head);
+    head = block->get_block_id();
+    uint offset = 0;
+    while (block != nullptr) {
+        char *data = (char*)block->get_data();
+        uint length = std::min(capacity, (uint)postings.size() - offset);
+        *(u_int16_t*)(data + sizeof(BlockID)) = (u_int16_t)length;
+        memcpy(data + OVERFLOW_HEADER_SIZE, postings.data() + offset, length);
+        offset += length;
+
+        SlottedPage *next = nullptr;
+        if (*(BlockID*)data != 0) {
+            next = this->file.get(*(BlockID*)data);
+        } else if (offset < postings.size()) {
+            next = new_block();
+            *(BlockID*)data = next->get_block_id();
+        }
+        this->file.put(block);
+        delete block;
+        block = next;
+    }
+    return head;
+}
 
-    Dbt *dbt;
-    dbt = marshal_handle(handle);
-    try {
-        // following is just a check for size (the save method will redo this in the right order)
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
-        delete dbt;
-        dbt = marshal_key(key);
-        this->block->add(dbt);
-        delete[] (char *) dbt->get_data();
-        delete dbt;
+// Hang the free list off the end of the chain starting at head, and make head its new start.
+void BTreeLeaf::free_overflow(BlockID head, BTreeStat &stat) {
+    SlottedPage *block = this->file.get(head);
+    while (*(BlockID*)block->get_data() != 0) {
+        BlockID next = *(BlockID*)block->get_data();
+        delete block;
+        block = this->file.get(next);
+    }
+    *(BlockID*)block->get_data() = stat.get_free_list();
+    this->file.put(block);
+    delete block;
+    stat.set_free_list(head);
+    stat.save();
+}
 
-        // that worked, so no need to split
-        this->key_map[*key] = handle;
+// Copy an entry into the heap and slide the offsets after position i over to make room for it.
+void BTreeLeaf::put_entry(uint i, const char *bytes, uint length) {
+    u_int16_t heap_start = get_heap_start() - length;
+    memcpy(this->page + heap_start, bytes, length);
+    set_heap_start(heap_start);
+    u_int16_t *offsets = this->offsets();
+    memmove(offsets + i + 1, offsets + i, (size() - i) * sizeof(u_int16_t));
+    offsets[i] = heap_start;
+    set_count(get_count() + 1);
+}
+
+// Put a new entry at position i in place (or split if it doesn't fit).
+Insertion BTreeLeaf::insert_entry(uint i, const std::string& bytes) {
+    if (get_used() + sizeof(u_int16_t) + bytes.size() <= DbBlock::BLOCK_SZ) {
+        put_entry(i, bytes.data(), (uint)bytes.size());
         save();
         return BTreeNode::insertion_none();
+    }
 
-    } catch (DbBlockNoRoomError &e) {
-        delete[] (char *) dbt->get_data();
-        delete dbt;
+    // too big, so split: create the sister and put her to the right
+    BTreeLeaf *nleaf = new BTreeLeaf(this->file, 0, this->key_profile, true);
+    nleaf->set_next_leaf(get_next_leaf());
+    set_next_leaf(nleaf->id);
+
+    // entries vary in size, so split by bytes rather than by count, keeping at least one on each side
+    char copy[DbBlock::BLOCK_SZ];
+    memcpy(copy, this->page, DbBlock::BLOCK_SZ);
+    const u_int16_t *copy_offsets = (u_int16_t*)(copy + HEADER_SIZE);
+    std::vector<std::pair<const char*, uint>> entries;
+    for (uint j = 0; j <= size(); j++) {
+        if (j == i)
+            entries.push_back(std::make_pair(bytes.data(), (uint)bytes.size()));
+        if (j < size())
+            entries.push_back(std::make_pair(copy + copy_offsets[j], entry_length(copy + copy_offsets[j])));
+    }
+    uint total = 0;
+    for (auto const& e: entries)
+        total += e.second + sizeof(u_int16_t);
+    set_count(0);
+    set_heap_start(DbBlock::BLOCK_SZ);
+    uint j = 0, left = 0;
+    for (; j < entries.size() - 1; j++) {
+        uint length = entries[j].second + sizeof(u_int16_t);
+        if (j > 0 && left + length > total / 2)
+            break;
+        put_entry(j, entries[j].first, entries[j].second);
+        left += length;
+    }
+    for (; j < entries.size(); j++)
+        nleaf->put_entry(nleaf->size(), entries[j].first, entries[j].second);
+
+    KeyValue *boundary = nleaf->key_at(0);
+    Insertion ret(nleaf->id, *boundary);
+    delete boundary;
+    nleaf->save();
+    this->save();
+    delete nleaf;
+    return ret;
+}
 
-        // too big, so split
+// Add handle under key. If the key is already here, the handle joins its posting list (unless unique).
+Insertion BTreeLeaf::insert(const KeyValue* key, Handle handle, bool unique, BTreeStat &stat) {
+    uint i = lower_bound(*key);
+    if (i == size() || compare(i, *key) != 0)
+        return insert_entry(i, make_entry(*key, Handles(1, handle)));
 
-        // create the sister and put her to the right
-        BTreeLeaf *nleaf = new BTreeLeaf(this->file, 0, this->key_profile, true);
-        nleaf->next_leaf = this->next_leaf;
-        this->next_leaf = nleaf->id;
+    if (unique)
+        throw DbRelationError("Duplicate keys are not allowed in unique index");
+    Handles *handles = handles_at(i);
+    auto pos = std::lower_bound(handles->begin(), handles->end(), handle);
+    if (pos != handles->end() && *pos == handle) {
+        delete handles;
+        throw DbRelationError("Handle is already in the index");
+    }
+    handles->insert(pos, handle);
+    const char *bytes = entry(i);
+    BlockID overflow = is_overflow(bytes) ? *(BlockID*)(bytes + sizeof(u_int16_t)) : 0;
+    std::string new_entry = make_entry(*key, *handles, overflow, &stat);
+    delete handles;
+    del_entry(i);
+    return insert_entry(i, new_entry);
+}
 
-        // move half of the entries to the sister
-        auto key_list = this->key_map;       // make a copy of my key_map
-        key_list[*key] = handle;             // add key/handle to it
-        u_long split = key_list.size() / 2;  // figure out how many to keep (the rest move to nleaf)
-        this->key_map.clear();               // empty my list
-        u_long i = 0;
-        KeyValue boundary;
-        for (auto const& item: key_list) {
-            if (i < split) {
-                this->key_map[item.first] = item.second;
-            } else if (i == split) {
-                boundary = item.first;
-                nleaf->key_map[boundary] = item.second;
-            } else {
-                nleaf->key_map[item.first] = item.second;
-            }
-            i++;
+// Remove an entry, sliding the entries packed below it up to close the gap.
+void BTreeLeaf::del_entry(uint i) {
+    u_int16_t offset = offsets()[i];
+    uint length = entry_length(this->page + offset);
+    u_int16_t heap_start = get_heap_start();
+    memmove(this->page + heap_start + length, this->page + heap_start, offset - heap_start);
+    set_heap_start(heap_start + length);
+
+    u_int16_t *offsets = this->offsets();
+    uint count = size() - 1;
+    memmove(offsets + i, offsets + i + 1, (count - i) * sizeof(u_int16_t));
+    set_count(count);
+    for (uint j = 0; j < count; j++)
+        if (offsets[j] < offset)
+            offsets[j] += length;
+}
+
+// Take handle off key's posting list, removing the entry once the list is empty. Its overflow chain
+// (if any) goes on the free list then, or as soon as the list fits inline again and there's room for it
+// here; otherwise the rewritten entry is never longer than the old one, so it always fits back in place.
+void BTreeLeaf::del(const KeyValue* key, Handle handle, BTreeStat &stat) {
+    uint i = lower_bound(*key);
+    if (i == size() || compare(i, *key) != 0)
+        throw DbRelationError("Key to delete is not in the index");
+    Handles *handles = handles_at(i);
+    auto pos = std::lower_bound(handles->begin(), handles->end(), handle);
+    if (pos == handles->end() || *pos != handle) {
+        delete handles;
+        throw DbRelationError("Handle to delete is not in the index");
+    }
+    handles->erase(pos);
+    const char *bytes = entry(i);
+    BlockID overflow = is_overflow(bytes) ? *(BlockID*)(bytes + sizeof(u_int16_t)) : 0;
+    if (handles->empty()) {
+        delete handles;
+        if (overflow != 0)
+            free_overflow(overflow, stat);
+        del_entry(i);
+        return;
+    }
+    if (overflow != 0) {
+        uint inline_length = (uint)encode_postings(*handles).size();  // the entry's key stays as it is
+        if (inline_length <= POSTING_INLINE_MAX
+            && get_used() + sizeof(u_int16_t) + inline_length <= DbBlock::BLOCK_SZ + key_offset(bytes)) {
+            free_overflow(overflow, stat);
+            overflow = 0;
         }
+    }
+    std::string new_entry = make_entry(*key, *handles, overflow);
+    delete handles;
+    del_entry(i);
+    put_entry(i, new_entry.data(), (uint)new_entry.size());
+}
 
-        nleaf->save();
-        this->save();
-        return Insertion(nleaf->id, boundary);
+// Take all the entries of right (the next leaf) and its place in the leaf chain.
+bool BTreeLeaf::merge(BTreeLeaf *right) {
+    if (get_used() + right->get_used() - HEADER_SIZE > DbBlock::BLOCK_SZ)
+        return false;
+    for (uint i = 0; i < right->size(); i++)
+        put_entry(size(), right->entry(i), entry_length(right->entry(i)));
+    set_next_leaf(right->get_next_leaf());
+    return true;
+}
+// Even out the bytes used by us and right (the next leaf), keeping key order.
+KeyValue *BTreeLeaf::redistribute(BTreeLeaf *right) {
+    char left_copy[DbBlock::BLOCK_SZ], right_copy[DbBlock::BLOCK_SZ];
+    memcpy(left_copy, this->page, DbBlock::BLOCK_SZ);
+    memcpy(right_copy, right->page, DbBlock::BLOCK_SZ);
+    std::vector<const char*> entries;
+    for (uint i = 0; i < size(); i++)
+        entries.push_back(left_copy + offsets()[i]);
+    for (uint i = 0; i < right->size(); i++)
+        entries.push_back(right_copy + right->offsets()[i]);
+    uint total = get_used() + right->get_used() - 2 * HEADER_SIZE;
+
+    set_count(0);
+    set_heap_start(DbBlock::BLOCK_SZ);
+    right->set_count(0);
+    right->set_heap_start(DbBlock::BLOCK_SZ);
+    uint left = 0;
+    for (auto const& bytes: entries) {
+        uint length = entry_length(bytes);
+        bool keep = size() == 0 || (left + length + sizeof(u_int16_t) <= total / 2 && right->size() == 0);
+        if (keep && &bytes == &entries.back() && right->size() == 0)
+            keep = false;  // right must not end up empty
+        if (keep) {
+            put_entry(size(), bytes, length);
+            left += length + sizeof(u_int16_t);
+        } else {
+            right->put_entry(right->size(), bytes, length);
+        }
+    }
+    return right->key_at(0);
+}
+
+// Add an entry (from make_entry) that sorts after all the current ones, unless that would take the
+// leaf past limit bytes. The caller saves once the leaf is full.
+bool BTreeLeaf::append(const std::string& bytes, uint limit) {
+    if (size() > 0 && get_used() + sizeof(u_int16_t) + bytes.size() > limit)
+        return false;
+    put_entry(size(), bytes.data(), (uint)bytes.size());
+    return true;
+}
+
+/******************
+ * BTreeNodeCache *
+ ******************/
+
+BTreeNodeCache &BTreeNodeCache::instance() {
+    static BTreeNodeCache cache;
+    return cache;
+}
+
+BTreeNodeCache::BTreeNodeCache(uint capacity) : capacity(capacity), lru(), nodes() {
+}
+
+BTreeNodeCache::~BTreeNodeCache() {
+    for (auto &entry: this->lru)
+        delete entry.second;
+}
+
+const BTreeInterior *BTreeNodeCache::interior(HeapFile &file, BlockID block_id, const KeyProfile &key_profile) {
+    NodeKey key(file.get_file_id(), block_id);
+    auto found = this->nodes.find(key);
+    if (found != this->nodes.end()) {
+        this->lru.splice(this->lru.begin(), this->lru, found->second);
+        return found->second->second;
     }
+
+    if (this->nodes.size() >= this->capacity) {
+        delete this->lru.back().second;
+        this->nodes.erase(this->lru.back().first);
+        this->lru.pop_back();
+    }
+    BTreeInterior *node = new BTreeInterior(file, block_id, key_profile, false);
+    node->release_block();
+    this->lru.push_front(std::make_pair(key, node));
+    this->nodes[key] = this->lru.begin();
+    return node;
 }
 
+void BTreeNodeCache::invalidate(const HeapFile *file, BlockID block_id) {
+    auto found = this->nodes.find(NodeKey(file->get_file_id(), block_id));
+    if (found == this->nodes.end())
+        return;
+    delete found->second->second;
+    this->lru.erase(found->second);
+    this->nodes.erase(found);
+}
+
+void BTreeNodeCache::invalidate(const HeapFile *file) {
+    uint file_id = file->get_file_id();
+    for (auto entry = this->lru.begin(); entry != this->lru.end();) {
+        if (entry->first.first == file_id) {
+            delete entry->second;
+            this->nodes.erase(entry->first);
+            entry = this->lru.erase(entry);
+        } else {
+            entry++;
+        }
+    }
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <list>
+#include <string>
+#include <unordered_map>
 #include "storage_engine.h"
 #include "heap_storage.h"
 
@@ -18,9 +21,12 @@ public:
     static Insertion insertion_none() { return Insertion(0, KeyValue()); }
 
     virtual void save();
+    void release_block();  // give up the buffer pool pin; the node can be searched but not saved
 
     BlockID get_id() const { return this->id; }
 
+    static uint marshal_size(const KeyProfile& key_profile, const KeyValue& key);  // bytes marshal_key will use
+
 protected:
     SlottedPage *block;
     HeapFile &file;
@@ -34,12 +40,14 @@ protected:
     virtual BlockID get_block_id(RecordID record_id) const;
     virtual Handle get_handle(RecordID record_id) const;
     virtual KeyValue* get_key(RecordID record_id) const;
+    KeyValue *unmarshal_key(const char *bytes, uint *size = nullptr) const;
 };
 
 class BTreeStat : public BTreeNode {
 public:
     static const RecordID ROOT = 1;  // where we store the root id in the stat block
     static const RecordID HEIGHT = ROOT + 1;  // where we store the height in the stat block
+    static const RecordID FREE = HEIGHT + 1;  // where we store the head of the free overflow blocks (if we have)
 
     BTreeStat(HeapFile &file, BlockID stat_id, BlockID new_root, const KeyProfile& key_profile);
     BTreeStat(HeapFile &file, BlockID stat_id, const KeyProfile& key_profile);
@@ -51,10 +59,13 @@ public:
     void set_root_id(BlockID root_id) { this->root_id = root_id; }
     uint get_height() const { return this->height; }
     void set_height(uint height) { this->height = height; }
+    BlockID get_free_list() const { return this->free_list; }
+    void set_free_list(BlockID free_list) { this->free_list = free_list; }
 
 protected:
     BlockID root_id;
     uint height;
+    BlockID free_list;  // overflow blocks no posting list uses, chained through their next block field
 
 };
 
@@ -64,28 +75,163 @@ public:
     virtual ~BTreeInterior();
 
     BTreeNode *find(const KeyValue* key, uint depth) const;
+    BlockID find_child(const KeyValue* key) const;
     Insertion insert(const KeyValue* boundary, BlockID block_id);
     virtual void save();
 
     void set_first(BlockID first) { this->first = first; }
+    BlockID get_first() const { return this->first; }
+    void append(const KeyValue& boundary, BlockID block_id);  // bulk load: boundary is past all others, no save
+
+    // children are numbered 0 (first) to child_count() - 1; boundary(i) separates children i - 1 and i
+    uint child_count() const { return (uint)this->pointers.size() + 1; }
+    uint child_index(const KeyValue* key) const { return key == nullptr ? 0 : upper_bound(*key); }
+    BlockID get_child(uint i) const { return i == 0 ? this->first : this->pointers[i - 1]; }
+    const KeyValue& get_boundary(uint i) const { return this->boundaries[i - 1]; }
+    void set_boundary(uint i, const KeyValue& boundary);
+    void del_child(uint i);  // remove child i (i > 0) along with boundary(i)
+    bool merge(const KeyValue& separator, BTreeInterior *right);  // false (and no change) if it wouldn't fit
+    KeyValue redistribute(const KeyValue& separator, BTreeInterior *right);  // returns the new separator
+    uint get_used() const;  // bytes of the block in use
+    static uint entry_size(const KeyProfile& key_profile, const KeyValue& boundary);  // bytes a boundary uses
+
+    static const uint EMPTY_SIZE = 13;  // block header plus the first pointer (see SlottedPage::has_room)
 
 protected:
     BlockID first;
     BlockPointers pointers;
-    KeyValues boundaries;
+    std::vector<KeyValue> boundaries;  // in order; boundaries[i] is the lowest key under pointers[i]
+    bool fixed_width;                  // key profile is all INT/BOOLEAN, so fixed_keys mirrors boundaries
+    std::vector<int32_t> fixed_keys;   // boundaries flattened, key_profile.size() values per boundary
+
+    void index_keys();
+    uint upper_bound(const KeyValue& key) const;
 };
 
+/**
+ * Leaf block layout -- entries are searched and inserted in place, never unmarshaled as a whole:
+ *   u16 count | u16 heap_start | u32 next_leaf | u16 offsets[count] (in key order) | free | entries
+ * Each entry holds one key and all the handles with that key:
+ *   u16 posting header | postings | marshaled key
+ * Postings are a varint count followed by (block id delta, record id) varint pairs in handle order.
+ * If they would take more than POSTING_INLINE_MAX bytes, the header's OVERFLOW bit is set and the
+ * postings are written to a chain of overflow blocks instead; the entry then holds just the u32
+ * head of the chain and the u32 handle count. Entries are packed from the end of the block down
+ * to heap_start, in the order they were inserted. A chain whose list empties, or shrinks enough to
+ * go back inline, is given back to the index's free list (kept in its BTreeStat) for the next one.
+ */
 class BTreeLeaf : public BTreeNode {
 public:
+    static const uint POSTING_INLINE_MAX = DbBlock::BLOCK_SZ / 8;
+
     BTreeLeaf(HeapFile &file, BlockID block_id, const KeyProfile& key_profile, bool create);
     virtual ~BTreeLeaf();
 
-    Handle find_eq(const KeyValue* key) const;  // throws if not found
-    Insertion insert(const KeyValue* key, Handle handle);
-    virtual void save();
+    Handles *find_eq(const KeyValue* key) const;  // all handles with key, in handle order (empty if none)
+    Insertion insert(const KeyValue* key, Handle handle, bool unique, BTreeStat &stat);  // stat: holds the free list
+    void del(const KeyValue* key, Handle handle, BTreeStat &stat);  // throws DbRelationError if not found
+    bool merge(BTreeLeaf *right);  // false (and no change) if it wouldn't fit
+    KeyValue *redistribute(BTreeLeaf *right);  // returns the new first key of right
+
+    // overflow: chain to reuse; stat: free list to take new overflow blocks from (if any)
+    std::string make_entry(const KeyValue& key, const Handles& handles, BlockID overflow = 0,
+                           BTreeStat *stat = nullptr);
+    bool append(const std::string& entry, uint limit);  // bulk load: entry is past all others; false if over limit
+
+    uint size() const { return get_count(); }
+    uint lower_bound(const KeyValue& key) const;     // first entry not less than key (key may be a prefix)
+    int compare(uint i, const KeyValue& key) const;  // entry i against key, on key's columns only: <0, 0, >0
+    Handles *handles_at(uint i) const;
+    KeyValue *key_at(uint i) const;
+    uint get_used() const;  // bytes of the block in use
+
+    BlockID get_next_leaf() const { return *(BlockID*)(this->page + 4); }
+    void set_next_leaf(BlockID next_leaf) { *(BlockID*)(this->page + 4) = next_leaf; }
 
 protected:
-    BlockID next_leaf;
-    std::map<KeyValue,Handle> key_map;
+    static const uint HEADER_SIZE = 8;
+    static const u_int16_t OVERFLOW = 0x8000;
+    static const uint OVERFLOW_SIZE = sizeof(BlockID) + sizeof(uint32_t);
+    static const uint OVERFLOW_HEADER_SIZE = sizeof(BlockID) + sizeof(u_int16_t);  // next block, bytes used
+
+    char *page;  // the block's bytes
+
+    u_int16_t get_count() const { return *(u_int16_t*)this->page; }
+    void set_count(u_int16_t count) { *(u_int16_t*)this->page = count; }
+    u_int16_t get_heap_start() const { return *(u_int16_t*)(this->page + 2); }
+    void set_heap_start(u_int16_t heap_start) { *(u_int16_t*)(this->page + 2) = heap_start; }
+    u_int16_t *offsets() const { return (u_int16_t*)(this->page + HEADER_SIZE); }
+    const char *entry(uint i) const { return this->page + offsets()[i]; }
+    static bool is_overflow(const char *bytes) { return (*(u_int16_t*)bytes & OVERFLOW) != 0; }
+    static uint key_offset(const char *bytes);  // where the key starts within the entry
+    uint entry_length(const char *bytes) const;
+
+    void put_entry(uint i, const char *bytes, uint length);  // assumes there's room
+    Insertion insert_entry(uint i, const std::string& entry);  // put it in, splitting if need be
+    void del_entry(uint i);
+
+    std::string read_overflow(BlockID head) const;
+    BlockID write_overflow(const std::string& postings, BlockID head, BTreeStat *stat);  // reuses head's chain, if any
+    void free_overflow(BlockID head, BTreeStat &stat);  // puts the whole chain on stat's free list
 };
 
+/**
+ * @class BTreeNodeCache - decoded interior nodes kept resident between descents
+ *
+ * Cached nodes hold no buffer pool pin and are read-only. BTreeInterior::save() invalidates
+ * the node's entry and BTreeIndex drops all of its entries when it is closed or dropped.
+ * Like the buffer pool's frames, entries are keyed by the file on disk, so these hold for
+ * every HeapFile open on it.
+ * The least recently used node is evicted when the cache is full.
+ */
+class BTreeNodeCache {
+public:
+    /**
+     * number of interior nodes kept (enough for the upper levels of a tree over ~10M INT keys)
+     */
+    static const uint DEFAULT_NODES = 256;
+
+    /**
+     * The process-wide cache used by BTreeIndex.
+     */
+    static BTreeNodeCache &instance();
+
+    BTreeNodeCache(uint capacity = DEFAULT_NODES);
+    virtual ~BTreeNodeCache();
+    BTreeNodeCache(const BTreeNodeCache &other) = delete;
+    BTreeNodeCache(BTreeNodeCache &&temp) = delete;
+    BTreeNodeCache &operator=(const BTreeNodeCache &other) = delete;
+    BTreeNodeCache &operator=(BTreeNodeCache &&temp) = delete;
+
+    /**
+     * Get the decoded interior node, reading and decoding it only if it isn't resident.
+     * @param file         index file
+     * @param block_id     which block of file holds the node
+     * @param key_profile  index key profile (must outlive the cache entry)
+     * @returns            the resident node (owned by the cache, valid until next call)
+     */
+    virtual const BTreeInterior *interior(HeapFile &file, BlockID block_id, const KeyProfile &key_profile);
+
+    /**
+     * Forget one node, e.g. because it was just saved.
+     */
+    virtual void invalidate(const HeapFile *file, BlockID block_id);
+
+    /**
+     * Forget every node of the given file.
+     */
+    virtual void invalidate(const HeapFile *file);
+
+protected:
+    typedef std::pair<uint, BlockID> NodeKey;  // (HeapFile::get_file_id, block id), like the BufferPool's frames
+    struct NodeKeyHash {
+        size_t operator()(const NodeKey &key) const {
+            return std::hash<uint>()(key.first) ^ (std::hash<BlockID>()(key.second) << 1);
+        }
+    };
+    typedef std::list<std::pair<NodeKey, BTreeInterior*>> NodeList;
+
+    uint capacity;
+    NodeList lru;  // most recently used first
+    std::unordered_map<NodeKey, NodeList::iterator, NodeKeyHash> nodes;
+};
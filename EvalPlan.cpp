@@ -1,4 +1,16 @@
+#include <algorithm>
+#include <cmath>
 #include "EvalPlan.h"
+#include "btree.h"
+
+// The cost model, in units of reading one page of a table in sequence.
+static const double SEQ_PAGE_COST = 1.0;
+static const double RANDOM_PAGE_COST = 4.0;  // reading a page out of sequence (e.g., to fetch a row an index found)
+static const double INDEX_PROBE_COST = 1.0;  // descending an index, whose upper levels stay in the buffer pool
+static const double ROW_COST = 0.01;  // decoding a row, testing it, and passing it on
+static const double HASH_ROW_COST = 0.02;  // putting a row into a hash table, or looking one up
+static const double COMPARE_COST = 0.0025;  // comparing two rows while sorting
+static const double ROWS_PER_PAGE = 50.0;  // guessed for a table that hasn't been analyzed
 
 
 class Dummy : public DbRelation {
@@ -21,23 +33,88 @@ public:
 };
 
 EvalPlan::EvalPlan(PlanType type, EvalPlan *relation)
-        : type(type), relation(relation), projection(nullptr), select_conjunction(nullptr), table(Dummy::one()) {
+        : type(type), relation(relation), projection(nullptr), select_conjunction(nullptr), select_ranges(nullptr),
+          table(Dummy::one()), index(nullptr), limit(0), offset(0), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(nullptr), left_input(nullptr), right_input(nullptr), outer_left(false), aggregates(nullptr), sort_keys(nullptr) {
 }
 
 EvalPlan::EvalPlan(ColumnNames *projection, EvalPlan *relation)
-        : type(Project), relation(relation), projection(projection), select_conjunction(nullptr), table(Dummy::one()) {
+        : type(Project), relation(relation), projection(projection), select_conjunction(nullptr), select_ranges(nullptr),
+          table(Dummy::one()), index(nullptr), limit(0), offset(0), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(nullptr), left_input(nullptr), right_input(nullptr), outer_left(false), aggregates(nullptr), sort_keys(nullptr) {
 }
 
 EvalPlan::EvalPlan(ValueDict* conjunction, EvalPlan *relation)
-        : type(Select), relation(relation), projection(nullptr), select_conjunction(conjunction), table(Dummy::one()) {
+        : type(Select), relation(relation), projection(nullptr), select_conjunction(conjunction), select_ranges(nullptr),
+          table(Dummy::one()), index(nullptr), limit(0), offset(0), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(nullptr), left_input(nullptr), right_input(nullptr), outer_left(false), aggregates(nullptr), sort_keys(nullptr) {
+}
+
+EvalPlan::EvalPlan(ValueDict* conjunction, ValueRanges* ranges, EvalPlan *relation)
+        : type(Select), relation(relation), projection(nullptr), select_conjunction(conjunction), select_ranges(ranges),
+          table(Dummy::one()), index(nullptr), limit(0), offset(0), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(nullptr), left_input(nullptr), right_input(nullptr), outer_left(false), aggregates(nullptr), sort_keys(nullptr) {
 }
 
 EvalPlan::EvalPlan(DbRelation &table)
-        : type(TableScan), relation(nullptr), projection(nullptr), select_conjunction(nullptr), table(table) {
+        : type(TableScan), relation(nullptr), projection(nullptr), select_conjunction(nullptr), select_ranges(nullptr),
+          table(table), index(nullptr), limit(0), offset(0), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(nullptr), left_input(nullptr), right_input(nullptr), outer_left(false), aggregates(nullptr), sort_keys(nullptr) {
+}
+
+EvalPlan::EvalPlan(DbRelation &table, const TableIndices &indices)
+        : type(TableScan), relation(nullptr), projection(nullptr), select_conjunction(nullptr), select_ranges(nullptr),
+          table(table), index(nullptr), indices(indices), limit(0), offset(0), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(nullptr), left_input(nullptr), right_input(nullptr), outer_left(false), aggregates(nullptr), sort_keys(nullptr) {
+}
+
+EvalPlan::EvalPlan(DbIndex &index, ValueDict *key, DbRelation &table)
+        : type(IndexLookup), relation(nullptr), projection(nullptr), select_conjunction(key), select_ranges(nullptr),
+          table(table), index(&index), limit(0), offset(0), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(nullptr), left_input(nullptr), right_input(nullptr), outer_left(false), aggregates(nullptr), sort_keys(nullptr) {
+}
+
+EvalPlan::EvalPlan(DbIndex &index, ValueDict *prefix, ValueRanges *range, DbRelation &table)
+        : type(IndexScan), relation(nullptr), projection(nullptr), select_conjunction(prefix), select_ranges(range),
+          table(table), index(&index), limit(0), offset(0), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(nullptr), left_input(nullptr), right_input(nullptr), outer_left(false), aggregates(nullptr), sort_keys(nullptr) {
+}
+
+EvalPlan::EvalPlan(size_t limit, size_t offset, EvalPlan *relation)
+        : type(Limit), relation(relation), projection(nullptr), select_conjunction(nullptr), select_ranges(nullptr),
+          table(Dummy::one()), index(nullptr), limit(limit), offset(offset), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(nullptr), left_input(nullptr), right_input(nullptr), outer_left(false), aggregates(nullptr), sort_keys(nullptr) {
+}
+
+EvalPlan::EvalPlan(ColumnNames *group_by, Aggregates *aggregates, EvalPlan *relation)
+        : type(Aggregate), relation(relation), projection(group_by), select_conjunction(nullptr), select_ranges(nullptr),
+          table(Dummy::one()), index(nullptr), limit(0), offset(0), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(nullptr), left_input(nullptr), right_input(nullptr), outer_left(false), aggregates(aggregates), sort_keys(nullptr) {
+}
+
+EvalPlan::EvalPlan(SortKeys *keys, size_t limit, EvalPlan *relation)
+        : type(Sort), relation(relation), projection(nullptr), select_conjunction(nullptr), select_ranges(nullptr),
+          table(Dummy::one()), index(nullptr), limit(limit), offset(0), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(nullptr), left_input(nullptr), right_input(nullptr), outer_left(false), aggregates(nullptr), sort_keys(keys) {
+}
+
+EvalPlan::EvalPlan(EvalPlan *left, JoinInput *left_input, EvalPlan *right, JoinInput *right_input)
+        : type(Join), relation(left), projection(nullptr), select_conjunction(nullptr), select_ranges(nullptr),
+          table(Dummy::one()), index(nullptr), limit(0), offset(0), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(right), left_input(left_input), right_input(right_input), outer_left(false), aggregates(nullptr), sort_keys(nullptr) {
+}
+
+EvalPlan::EvalPlan(EvalPlan *outer, DbIndex &index, ValueDict *where, ValueRanges *ranges, DbRelation &table,
+                   JoinInput *left_input, JoinInput *right_input, bool outer_left)
+        : type(IndexJoin), relation(outer), projection(nullptr), select_conjunction(where), select_ranges(ranges),
+          table(table), index(&index), limit(0), offset(0), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(nullptr), left_input(left_input), right_input(right_input), outer_left(outer_left), aggregates(nullptr), sort_keys(nullptr) {
 }
 
 EvalPlan::EvalPlan(const EvalPlan *other)
-        : type(other->type), table(other->table) {
+        : type(other->type), table(other->table), index(other->index), indices(other->indices),
+          limit(other->limit), offset(other->offset), running(nullptr, nullptr), position(0), batches(nullptr),
+          right(nullptr), left_input(nullptr), right_input(nullptr), outer_left(other->outer_left), aggregates(nullptr), sort_keys(nullptr) {
     if (other->relation != nullptr)
         relation = new EvalPlan(other->relation);
     else
@@ -50,52 +127,822 @@ EvalPlan::EvalPlan(const EvalPlan *other)
         select_conjunction = new ValueDict(*other->select_conjunction);
     else
         select_conjunction = nullptr;
+    if (other->select_ranges != nullptr)
+        select_ranges = new ValueRanges(*other->select_ranges);
+    else
+        select_ranges = nullptr;
+    if (other->right != nullptr)
+        right = new EvalPlan(other->right);
+    if (other->left_input != nullptr)
+        left_input = new JoinInput(*other->left_input);
+    if (other->right_input != nullptr)
+        right_input = new JoinInput(*other->right_input);
+    if (other->aggregates != nullptr)
+        aggregates = new Aggregates(*other->aggregates);
+    if (other->sort_keys != nullptr)
+        sort_keys = new SortKeys(*other->sort_keys);
 }
 
 EvalPlan::~EvalPlan() {
+    close();
     delete relation;
     delete projection;
     delete select_conjunction;
+    delete select_ranges;
+    delete right;
+    delete left_input;
+    delete right_input;
+    delete aggregates;
+    delete sort_keys;
 }
 
 
 EvalPlan *EvalPlan::optimize() {
-    return new EvalPlan(this);  // For now, we don't know how to do anything better
+    if (this->type == Select && this->relation->type == TableScan) {
+        EvalPlan *probe = index_probe();
+        if (probe != nullptr)
+            return probe;
+    }
+    if (this->type == Sort) {
+        EvalPlan *input = this->relation->optimize();
+        if (input->in_order(*this->sort_keys))
+            return input;
+        EvalPlan *ret = new EvalPlan(this);
+        delete ret->relation;
+        ret->relation = input;
+        EvalPlan *walk = ordered_scan();
+        if (walk != nullptr && walk->walk_cost((double)this->limit) < ret->estimate_cost()) {
+            delete ret;
+            return walk;
+        }
+        delete walk;
+        return ret;
+    }
+    EvalPlan *ret = new EvalPlan(this);
+    if (this->relation != nullptr) {
+        delete ret->relation;
+        ret->relation = this->relation->optimize();
+    }
+    if (this->right != nullptr) {
+        delete ret->right;
+        ret->right = this->right->optimize();
+    }
+    if (this->type == Join) {
+        EvalPlan *join = index_join();
+        if (join != nullptr && join->estimate_cost() < ret->estimate_cost()) {
+            delete ret;
+            return join;
+        }
+        delete join;
+    }
+    return ret;
 }
 
-ValueDicts *EvalPlan::evaluate() {
-    ValueDicts *ret = nullptr;
-    if (this->type != ProjectAll && this->type != Project)
+// A literal can only go into an index probe if it has its column's type: the index would compare it as whatever
+// its bytes happen to mean, where the scan's RowPredicate finds no rows for it.
+static bool same_type(const DbRelation &table, const Identifier &column, const Value &value) {
+    const ColumnNames &column_names = table.get_column_names();
+    auto found = find(column_names.begin(), column_names.end(), column);
+    if (found == column_names.end())
+        return false;
+    ColumnAttribute column_attribute = table.get_column_attributes()[found - column_names.begin()];
+    return value.data_type == column_attribute.get_data_type();
+}
+
+static bool same_type(const DbRelation &table, const Identifier &column, const ValueRange &range) {
+    return (!range.has_min || same_type(table, column, range.min))
+           && (!range.has_max || same_type(table, column, range.max));
+}
+
+// Find the index whose probe costs the least, and build the plan that probes it, with a Select on top for the
+// rest of the conjunction (if any). Returns nullptr if no index of the scanned table costs less than scanning it.
+// An index covers its leading key columns that we have equalities for, plus, if it is ordered, a range on
+// the key column after those. An unordered index only helps if every one of its key columns is covered.
+EvalPlan *EvalPlan::index_probe() const {
+    EvalPlan *best = nullptr;
+    double best_cost = estimate_cost();
+    for (DbIndex *candidate : this->relation->indices) {
+        const ColumnNames &key_columns = candidate->get_key_columns();
+        uint equal = 0;
+        while (equal < key_columns.size() && this->select_conjunction != nullptr
+               && this->select_conjunction->find(key_columns[equal]) != this->select_conjunction->end())
+            equal++;
+        bool range = equal < key_columns.size() && candidate->is_ordered() && this->select_ranges != nullptr
+                     && this->select_ranges->find(key_columns[equal]) != this->select_ranges->end();
+        if ((!candidate->is_ordered() && equal < key_columns.size()) || (equal == 0 && !range))
+            continue;
+        bool typed = !range || same_type(this->relation->table, key_columns[equal],
+                                         this->select_ranges->at(key_columns[equal]));
+        for (uint i = 0; typed && i < equal; i++)
+            typed = same_type(this->relation->table, key_columns[i], this->select_conjunction->at(key_columns[i]));
+        if (!typed)
+            continue;
+
+        ValueDict *key = new ValueDict;
+        ValueDict *residual = this->select_conjunction == nullptr ? new ValueDict : new ValueDict(*this->select_conjunction);
+        for (uint i = 0; i < equal; i++) {
+            (*key)[key_columns[i]] = this->select_conjunction->at(key_columns[i]);
+            residual->erase(key_columns[i]);
+        }
+        ValueRanges *residual_ranges = this->select_ranges == nullptr ? nullptr : new ValueRanges(*this->select_ranges);
+        EvalPlan *probe;
+        if (equal == key_columns.size()) {
+            probe = new EvalPlan(*candidate, key, this->relation->table);
+        } else {
+            ValueRanges *index_range = new ValueRanges;
+            if (range) {
+                (*index_range)[key_columns[equal]] = this->select_ranges->at(key_columns[equal]);
+                residual_ranges->erase(key_columns[equal]);
+            }
+            probe = new EvalPlan(*candidate, key, index_range, this->relation->table);
+        }
+        if (residual->empty() && (residual_ranges == nullptr || residual_ranges->empty())) {
+            delete residual;
+            delete residual_ranges;
+        } else {
+            probe = new EvalPlan(residual, residual_ranges, probe);
+        }
+
+        double cost = probe->estimate_cost();
+        if (cost < best_cost) {
+            delete best;
+            best = probe;
+            best_cost = cost;
+        } else {
+            delete probe;
+        }
+    }
+    return best;
+}
+
+// Find the inputs of our Join that are scans (or Selects on scans) of a table with an index on exactly their join keys,
+// and build the IndexJoin that looks up each row of the other input in that index, for whichever costs less.
+// Returns nullptr if neither input qualifies.
+EvalPlan *EvalPlan::index_join() const {
+    if (this->left_input->keys.empty())
+        return nullptr;  // a cross product
+    EvalPlan *ret = nullptr;
+    for (bool outer_left : {true, false}) {
+        EvalPlan *outer = outer_left ? this->relation : this->right;
+        const EvalPlan *inner = outer_left ? this->right : this->relation;
+        const ColumnNames &keys = (outer_left ? this->right_input : this->left_input)->keys;
+        const EvalPlan *scan = inner->type == Select ? inner->relation : inner;
+        if (scan->type != TableScan)
+            continue;
+        DbIndex *best = nullptr;
+        for (DbIndex *candidate : scan->indices) {
+            const ColumnNames &key_columns = candidate->get_key_columns();
+            bool covered = key_columns.size() == keys.size();
+            for (auto const &key_column : key_columns)
+                covered = covered && find(keys.begin(), keys.end(), key_column) != keys.end();
+            if (covered && (best == nullptr || (candidate->is_unique() && !best->is_unique())))
+                best = candidate;
+        }
+        if (best == nullptr)
+            continue;
+        ValueDict *where = nullptr;
+        ValueRanges *ranges = nullptr;
+        if (inner->type == Select) {
+            if (inner->select_conjunction != nullptr)
+                where = new ValueDict(*inner->select_conjunction);
+            if (inner->select_ranges != nullptr)
+                ranges = new ValueRanges(*inner->select_ranges);
+        }
+        EvalPlan *join = new EvalPlan(outer->optimize(), *best, where, ranges, scan->table,
+                                      new JoinInput(*this->left_input), new JoinInput(*this->right_input), outer_left);
+        if (ret == nullptr || join->estimate_cost() < ret->estimate_cost()) {
+            delete ret;
+            ret = join;
+        } else {
+            delete join;
+        }
+    }
+    return ret;
+}
+
+// Whether the rows of this plan come in the order of keys: an IndexScan (or a Select on one) walks an ordered
+// index in key order, so they do if the keys are ascending and, leaving out the key columns the scan holds
+// equal, lead the rest of the index's key columns. A lookup on a unique index finds at most one row.
+bool EvalPlan::in_order(const SortKeys &keys) const {
+    const EvalPlan *scan = this->type == Select ? this->relation : this;
+    if (scan->type == IndexLookup)
+        return scan->index->is_unique();
+    if (scan->type != IndexScan)
+        return false;
+    const ColumnNames &key_columns = scan->index->get_key_columns();
+    uint next = (uint)scan->select_conjunction->size();  // first key column after the equal prefix
+    for (auto const &key : keys) {
+        if (scan->select_conjunction->find(key.column) != scan->select_conjunction->end())
+            continue;  // the same in every row
+        if (key.descending || next == key_columns.size() || key_columns[next] != key.column)
+            return false;
+        next++;
+    }
+    return true;
+}
+
+// Find an ordered index on the table our input scans (directly or under a Select) whose key columns lead with
+// our keys, and build the plan that walks it instead of sorting. Only worth it if we want few enough rows that we
+// stop early, since each row walked costs a fetch from the table (optimize weighs that with walk_cost).
+// Returns nullptr if there's no such index.
+EvalPlan *EvalPlan::ordered_scan() const {
+    const EvalPlan *filter = this->relation->type == Select ? this->relation : nullptr;
+    const EvalPlan *scan = filter != nullptr ? filter->relation : this->relation;
+    if (scan->type != TableScan || this->limit == SIZE_MAX)
+        return nullptr;
+    for (DbIndex *candidate : scan->indices) {
+        const ColumnNames &key_columns = candidate->get_key_columns();
+        bool leads = candidate->is_ordered() && key_columns.size() >= this->sort_keys->size();
+        for (uint i = 0; leads && i < this->sort_keys->size(); i++)
+            leads = !(*this->sort_keys)[i].descending && key_columns[i] == (*this->sort_keys)[i].column;
+        if (!leads)
+            continue;
+
+        // a range on the leading key column bounds the walk; the rest of the Select filters it
+        ValueRanges *range = new ValueRanges;
+        ValueDict *residual = filter != nullptr && filter->select_conjunction != nullptr
+                              ? new ValueDict(*filter->select_conjunction) : nullptr;
+        ValueRanges *residual_ranges = filter != nullptr && filter->select_ranges != nullptr
+                                       ? new ValueRanges(*filter->select_ranges) : nullptr;
+        if (residual_ranges != nullptr && residual_ranges->find(key_columns[0]) != residual_ranges->end()
+            && same_type(scan->table, key_columns[0], residual_ranges->at(key_columns[0]))) {
+            (*range)[key_columns[0]] = residual_ranges->at(key_columns[0]);
+            residual_ranges->erase(key_columns[0]);
+        }
+        EvalPlan *walk = new EvalPlan(*candidate, new ValueDict, range, scan->table);
+        if ((residual == nullptr || residual->empty()) && (residual_ranges == nullptr || residual_ranges->empty())) {
+            delete residual;
+            delete residual_ranges;
+            return walk;
+        }
+        return new EvalPlan(residual, residual_ranges, walk);
+    }
+    return nullptr;
+}
+
+// Runs the plan a batch at a time; rows are only turned into ValueDicts once they're in the result.
+// The first batch is read before sink.begin, so that a plan that can't run fails before anything is output.
+size_t EvalPlan::evaluate(ResultSink &sink, uint parallelism) {
+    if (this->type != ProjectAll && this->type != Project && this->type != Limit)
         throw DbRelationError("Invalid evaluation plan--not ending with a projection");
 
-    EvalPipeline pipeline = this->relation->pipeline();
-    DbRelation *temp_table = pipeline.first;
-    Handles *handles = pipeline.second;
+    const EvalPlan *projection = this->type == Limit ? this->relation : this;
+    size_t ret = 0;
+    RowBatch batch;
+    try {
+        open_batches(nullptr, parallelism, false);
+        bool more = next(batch);
+        sink.begin(projection->type == Project ? *projection->projection : batch.get_column_names());
+        for (; more; more = next(batch)) {
+            sink.push(batch);
+            ret += batch.count();
+        }
+    } catch (...) {
+        close();
+        throw;
+    }
+    close();
+    sink.end();
+    return ret;
+}
+
+// Start the flow of rows (or handles) from the scans at the bottom of the plan.
+void EvalPlan::open() {
+    close();
+    if (this->type == Limit) {
+        this->relation->open();
+        this->position = 0;
+    } else if (this->type == ProjectAll || this->type == Project) {
+        this->running = this->relation->pipeline();
+    } else {
+        this->running = pipeline();
+    }
+}
+
+// Next row from a ProjectAll, Project, or Limit. Returns false when there are no more.
+bool EvalPlan::next(ValueDict &row) {
+    if (this->type == Limit) {
+        while (this->position < this->offset) {
+            if (!this->relation->next(row))
+                return false;
+            this->position++;
+        }
+        if (this->position - this->offset >= this->limit)
+            return false;  // stop without reading any further
+        if (!this->relation->next(row))
+            return false;
+        this->position++;
+        return true;
+    }
+    if (this->type != ProjectAll && this->type != Project)
+        throw DbRelationError("Only a projection produces rows");
+
+    Handle handle;
+    if (!this->running.second->next(handle))
+        return false;
+    ValueDict *projected;
     if (this->type == ProjectAll)
-        ret = temp_table->project(handles);
-    else if (this->type == Project)
-        ret = temp_table->project(handles, this->projection);
-    delete handles;
+        projected = this->running.first->project(handle);
+    else
+        projected = this->running.first->project(handle, this->projection);
+    row.swap(*projected);
+    delete projected;
+    return true;
+}
+
+// Next handle from any other plan. Returns false when there are no more.
+bool EvalPlan::next(Handle &handle) {
+    if (this->running.second == nullptr)
+        throw DbRelationError("Only a plan below the projection produces handles");
+    return this->running.second->next(handle);
+}
+
+// Release the cursors (and with them any blocks they hold). Safe to call more than once.
+void EvalPlan::close() {
+    delete this->batches;  // first, since a Join's reads from its inputs
+    this->batches = nullptr;
+    if (this->relation != nullptr)
+        this->relation->close();
+    if (this->right != nullptr)
+        this->right->close();
+    delete this->running.second;
+    this->running = EvalPipeline(nullptr, nullptr);
+}
+
+// Adapts a plan that is open for batches to a BatchCursor (for a Join's inputs).
+class PlanBatchCursor : public BatchCursor {
+public:
+    PlanBatchCursor(EvalPlan &plan) : plan(plan) {}
+    virtual bool next(RowBatch &batch) { return this->plan.next(batch); }
+
+protected:
+    EvalPlan &plan;
+};
+
+// Just the columns of a Join input that the Join's callers need.
+static JoinInput join_input(const JoinInput &input, const ColumnNames *needed) {
+    if (needed == nullptr)
+        return input;
+    JoinInput ret;
+    ret.keys = input.keys;
+    for (uint i = 0; i < input.columns.size(); i++) {
+        if (find(needed->begin(), needed->end(), input.names[i]) != needed->end()) {
+            ret.columns.push_back(input.columns[i]);
+            ret.names.push_back(input.names[i]);
+        }
+    }
     return ret;
 }
 
+// Columns a Join needs from an input: the ones it passes on, plus the keys. (At least one, even for
+// a cross product the input contributes no columns to, so that its batches still count its rows.)
+static ColumnNames join_columns(const JoinInput &input, const JoinInput &all) {
+    ColumnNames ret(input.columns);
+    for (auto const &key : input.keys)
+        if (find(ret.begin(), ret.end(), key) == ret.end())
+            ret.push_back(key);
+    if (ret.empty() && !all.columns.empty())
+        ret.push_back(all.columns.front());
+    return ret;
+}
+
+// Start the flow of batches. Each node asks the one below it for the columns it and its callers need,
+// so the scan at the bottom decodes nothing else. A Select on a TableScan hands its predicates to the
+// table's batch cursor, which may then scan on up to parallelism threads.
+void EvalPlan::open_batches(const ColumnNames *needed, uint parallelism, bool ordered, const BatchStep *step) {
+    close();
+    if (this->type == Limit) {
+        this->relation->open_batches(needed, parallelism, true);  // which rows survive depends on the order
+        this->position = 0;
+    } else if (this->type == ProjectAll) {
+        this->relation->open_batches(nullptr, parallelism, ordered);
+    } else if (this->type == Project) {
+        this->relation->open_batches(this->projection, parallelism, ordered);
+    } else if (this->type == Select) {
+        ColumnNames columns;
+        if (needed != nullptr) {
+            columns = *needed;
+            auto need = [&columns](const Identifier &column) {
+                if (find(columns.begin(), columns.end(), column) == columns.end())
+                    columns.push_back(column);
+            };
+            if (this->select_conjunction != nullptr)
+                for (auto const &term : *this->select_conjunction)
+                    need(term.first);
+            if (this->select_ranges != nullptr)
+                for (auto const &term : *this->select_ranges)
+                    need(term.first);
+        }
+        if (this->relation->type == TableScan)
+            this->batches = this->relation->table.batch_cursor(needed != nullptr ? &columns : nullptr,
+                    this->select_conjunction, this->select_ranges, parallelism, ordered, step);
+        else
+            this->relation->open_batches(needed != nullptr ? &columns : nullptr, parallelism, ordered);
+    } else if (this->type == TableScan) {
+        this->batches = this->table.batch_cursor(needed, nullptr, nullptr, parallelism, ordered, step);
+    } else if (this->type == Join) {
+        JoinInput left_input = join_input(*this->left_input, needed), right_input = join_input(*this->right_input, needed);
+        ColumnNames left_columns = join_columns(left_input, *this->left_input);
+        ColumnNames right_columns = join_columns(right_input, *this->right_input);
+        this->relation->open_batches(&left_columns, parallelism, ordered);
+        this->right->open_batches(&right_columns, parallelism, ordered);
+        bool build_left = this->relation->estimate_rows() < this->right->estimate_rows();
+        this->batches = new HashJoinCursor(new PlanBatchCursor(*this->relation), left_input,
+                                           new PlanBatchCursor(*this->right), right_input, build_left);
+    } else if (this->type == IndexJoin) {
+        JoinInput left_input = join_input(*this->left_input, needed), right_input = join_input(*this->right_input, needed);
+        const JoinInput &outer_input = this->outer_left ? left_input : right_input;
+        const JoinInput &inner_input = this->outer_left ? right_input : left_input;
+        ColumnNames outer_columns = join_columns(outer_input, this->outer_left ? *this->left_input : *this->right_input);
+        this->relation->open_batches(&outer_columns, parallelism, ordered);
+        this->index->open();
+        this->batches = new IndexJoinCursor(new PlanBatchCursor(*this->relation), outer_input, this->table, *this->index,
+                                            inner_input, this->select_conjunction, this->select_ranges, this->outer_left);
+    } else if (this->type == Aggregate) {
+        ColumnNames columns(*this->projection);
+        for (auto const &aggregate : *this->aggregates)
+            if (!aggregate.column.empty() && find(columns.begin(), columns.end(), aggregate.column) == columns.end())
+                columns.push_back(aggregate.column);
+        // a scan pre-aggregates each part of the table on its own thread, and we merge the results
+        bool scans = this->relation->type == TableScan
+                     || (this->relation->type == Select && this->relation->relation->type == TableScan);
+        const ColumnNames &group_by = *this->projection;
+        const Aggregates &aggregates = *this->aggregates;
+        BatchStep partial = [&group_by, &aggregates](BatchCursor *scan) -> BatchCursor* {
+            return new HashAggregateCursor(scan, group_by, aggregates, false, true,
+                                           HashAggregateCursor::PARTIAL_MEMORY_BUDGET);
+        };
+        this->relation->open_batches(&columns, parallelism, false, scans ? &partial : nullptr);
+        this->batches = new HashAggregateCursor(new PlanBatchCursor(*this->relation), group_by, aggregates, scans, false);
+    } else if (this->type == Sort) {
+        ColumnNames columns;
+        if (needed != nullptr) {
+            columns = *needed;
+            for (auto const &key : *this->sort_keys)
+                if (find(columns.begin(), columns.end(), key.column) == columns.end())
+                    columns.push_back(key.column);
+        }
+        this->relation->open_batches(needed != nullptr ? &columns : nullptr, parallelism, false);  // we put them in order
+        this->batches = new SortCursor(new PlanBatchCursor(*this->relation), *this->sort_keys, this->limit);
+    } else {
+        EvalPipeline pipeline = this->pipeline();
+        this->batches = new RowBatchCursor(*pipeline.first, pipeline.second, needed);
+    }
+}
+
+// Next batch with at least one selected row. Returns false when there are no more.
+bool EvalPlan::next(RowBatch &batch) {
+    if (this->batches != nullptr)
+        return this->batches->next(batch);
+
+    if (this->type == Select) {
+        while (this->relation->next(batch)) {
+            batch.filter(this->select_conjunction, this->select_ranges);
+            if (batch.count() > 0)
+                return true;
+        }
+        return false;
+    }
+
+    if (this->type == ProjectAll || this->type == Project) {
+        if (!this->relation->next(batch))
+            return false;
+        batch.project(this->type == Project ? *this->projection : ColumnNames(batch.get_column_names()));
+        return true;
+    }
+
+    if (this->type == Limit) {
+        while (this->position - std::min(this->position, this->offset) < this->limit
+               && this->relation->next(batch)) {
+            for (uint row = 0; row < batch.size(); row++) {
+                if (!batch.is_selected(row))
+                    continue;
+                if (this->position < this->offset || this->position - this->offset >= this->limit)
+                    batch.unselect(row);
+                this->position++;
+            }
+            if (batch.count() > 0)
+                return true;
+        }
+        return false;
+    }
+
+    throw DbRelationError("Plan is not open for batches");
+}
+
 EvalPipeline EvalPlan::pipeline() {
     // base cases
     if (this->type == TableScan)
-        return EvalPipeline(&this->table, this->table.select());
+        return EvalPipeline(&this->table, this->table.cursor());
+    if (this->type == IndexScan)
+        return EvalPipeline(&this->table, index_scan_cursor());
+    if (this->type == IndexLookup) {
+        this->index->open();
+        return EvalPipeline(&this->table, new HandlesCursor(this->index->lookup(this->select_conjunction)));
+    }
     if (this->type == Select && this->relation->type == TableScan)
-        return EvalPipeline(&this->relation->table, this->relation->table.select(this->select_conjunction));
+        return EvalPipeline(&this->relation->table,
+                            this->relation->table.cursor(this->select_conjunction, this->select_ranges));
 
     // recursive case
     if (this->type == Select) {
         EvalPipeline pipeline = this->relation->pipeline();
         DbRelation *temp_table = pipeline.first;
-        Handles *handles = pipeline.second;
-        EvalPipeline ret(temp_table, temp_table->select(handles, this->select_conjunction));
-        delete handles;
-        return ret;
+        return EvalPipeline(temp_table,
+                            temp_table->cursor(pipeline.second, this->select_conjunction, this->select_ranges));
     }
 
+    if (this->type == Join || this->type == IndexJoin)
+        throw DbRelationError("A join has no handles--run it a batch at a time");
+    if (this->type == Aggregate)
+        throw DbRelationError("An aggregate has no handles--run it a batch at a time");
+    if (this->type == Sort)
+        throw DbRelationError("A sort has no handles--run it a batch at a time");
     throw DbRelationError("Not implemented: pipeline other than Select or TableScan");
 }
 
+size_t EvalPlan::estimate_rows() const {
+    double rows = cardinality();
+    return rows > 0.0 ? std::max((size_t)1, (size_t)std::llround(rows)) : 0;
+}
+
+// Rows in a table: what ANALYZE counted, or else the storage engine's guess.
+static double table_rows(DbRelation &table) {
+    const TableStatistics *statistics = table.get_statistics();
+    return statistics != nullptr ? (double)statistics->row_count : (double)table.estimate_rows();
+}
+
+static double table_pages(DbRelation &table) {
+    const TableStatistics *statistics = table.get_statistics();
+    return statistics != nullptr ? (double)statistics->page_count : std::ceil(table_rows(table) / ROWS_PER_PAGE);
+}
+
+// Fetching rows that an index found: each is a page read out of sequence, but the buffer pool keeps what's been
+// read, so there are never more reads than the table has pages.
+static double fetch_cost(DbRelation &table, double rows) {
+    return std::min(rows, table_pages(table)) * RANDOM_PAGE_COST + rows * ROW_COST;
+}
+
+// The rows of a join on keys with the given distinct counts (0 where we don't know them): each key divides the
+// cross product by the larger of its two counts, as if every value of the side with fewer were in the other.
+// Knowing none of them, we guess that each row of the larger side matches one row of the other.
+static double join_rows(double left_rows, double right_rows, const std::vector<size_t> &left_distinct,
+                        const std::vector<size_t> &right_distinct) {
+    double ret = left_rows * right_rows;
+    bool known = left_distinct.empty();  // a cross product
+    for (uint i = 0; i < left_distinct.size(); i++) {
+        size_t distinct = std::max(left_distinct[i], right_distinct[i]);
+        if (distinct > 0) {
+            ret /= (double)distinct;
+            known = true;
+        }
+    }
+    return known ? ret : std::max(left_rows, right_rows);
+}
+
+double EvalPlan::estimate_join_rows(const EvalPlan *left, const JoinInput &left_input,
+                                    const EvalPlan *right, const JoinInput &right_input) {
+    std::vector<size_t> left_distinct, right_distinct;
+    for (uint i = 0; i < left_input.keys.size(); i++) {
+        left_distinct.push_back(left->distinct(left_input.keys[i]));
+        right_distinct.push_back(right->distinct(right_input.keys[i]));
+    }
+    return join_rows(left->cardinality(), right->cardinality(), left_distinct, right_distinct);
+}
+
+// The statistics of the table a scan, an index probe, or a Select on one of those reads.
+const TableStatistics *EvalPlan::statistics() const {
+    switch (this->type) {
+        case TableScan:
+        case IndexScan:
+        case IndexLookup:
+            return this->table.get_statistics();
+        case Select:
+            return this->relation->statistics();
+        default:
+            return nullptr;
+    }
+}
+
+// Selectivities come from the tables' statistics (see TableStatistics::selectivity, which has fixed guesses
+// for a table that hasn't been analyzed); a join is estimated by estimate_join_rows; grouping leaves as many
+// rows as the group-by columns have combinations of values, or a tenth if we don't know.
+double EvalPlan::cardinality() const {
+    switch (this->type) {
+        case TableScan:
+            return table_rows(this->table);
+        case IndexLookup: {
+            double rows = table_rows(this->table)
+                          * TableStatistics::selectivity(this->table.get_statistics(), this->select_conjunction, nullptr);
+            return this->index->is_unique() ? std::min(rows, 1.0) : rows;
+        }
+        case IndexScan:
+            return table_rows(this->table) * TableStatistics::selectivity(this->table.get_statistics(),
+                                                                         this->select_conjunction, this->select_ranges);
+        case Select:
+            return this->relation->cardinality()
+                   * TableStatistics::selectivity(statistics(), this->select_conjunction, this->select_ranges);
+        case Join:
+            return estimate_join_rows(this->relation, *this->left_input, this->right, *this->right_input);
+        case IndexJoin:
+            return index_join_matches()
+                   * TableStatistics::selectivity(this->table.get_statistics(), this->select_conjunction, this->select_ranges);
+        case Limit:
+        case Sort:
+            return std::min(this->relation->cardinality(), (double)this->limit);
+        case Aggregate: {
+            if (this->projection->empty())
+                return 1.0;
+            double rows = this->relation->cardinality(), groups = 1.0;
+            for (auto const &column : *this->projection) {
+                size_t distinct = this->relation->distinct(column);
+                if (distinct == 0)
+                    return rows / 10 + 1;
+                groups *= (double)distinct;
+            }
+            return std::min(rows, groups);
+        }
+        default:
+            return this->relation->cardinality();
+    }
+}
+
+// Rows of the inner table an IndexJoin finds by looking up the outer rows (before its where and ranges).
+double EvalPlan::index_join_matches() const {
+    const JoinInput &outer_input = this->outer_left ? *this->left_input : *this->right_input;
+    const JoinInput &inner_input = this->outer_left ? *this->right_input : *this->left_input;
+    std::vector<size_t> outer_distinct, inner_distinct;
+    for (uint i = 0; i < outer_input.keys.size(); i++) {
+        outer_distinct.push_back(this->relation->distinct(outer_input.keys[i]));
+        inner_distinct.push_back(TableStatistics::distinct(this->table.get_statistics(), inner_input.keys[i]));
+    }
+    double outer_rows = this->relation->cardinality();
+    double ret = join_rows(outer_rows, table_rows(this->table), outer_distinct, inner_distinct);
+    return this->index->is_unique() ? std::min(ret, outer_rows) : ret;
+}
+
+// A column held equal has one value; a join passes on its inputs' columns under new names.
+size_t EvalPlan::distinct(const Identifier &column) const {
+    size_t ret = 0;
+    switch (this->type) {
+        case TableScan:
+        case IndexScan:
+        case IndexLookup:
+        case Select:
+            if (this->select_conjunction != nullptr && this->select_conjunction->find(column) != this->select_conjunction->end())
+                return 1;
+            ret = this->type == Select ? this->relation->distinct(column)
+                                       : TableStatistics::distinct(this->table.get_statistics(), column);
+            break;
+        case Join:
+        case IndexJoin: {
+            const JoinInput &left_input = *this->left_input, &right_input = *this->right_input;
+            const JoinInput &outer_input = this->type == IndexJoin && !this->outer_left ? right_input : left_input;
+            const JoinInput &inner_input = this->type == IndexJoin && !this->outer_left ? left_input : right_input;
+            auto outer = find(outer_input.names.begin(), outer_input.names.end(), column);
+            auto inner = find(inner_input.names.begin(), inner_input.names.end(), column);
+            if (outer != outer_input.names.end())
+                ret = this->relation->distinct(outer_input.columns[outer - outer_input.names.begin()]);
+            else if (inner != inner_input.names.end() && this->type == Join)
+                ret = this->right->distinct(inner_input.columns[inner - inner_input.names.begin()]);
+            else if (inner != inner_input.names.end())
+                ret = TableStatistics::distinct(this->table.get_statistics(),
+                                                inner_input.columns[inner - inner_input.names.begin()]);
+            break;
+        }
+        case Aggregate:
+            if (find(this->projection->begin(), this->projection->end(), column) != this->projection->end())
+                ret = this->relation->distinct(column);
+            break;
+        default:
+            ret = this->relation->distinct(column);
+    }
+    return ret == 0 ? 0 : std::max((size_t)1, std::min(ret, estimate_rows()));
+}
+
+// Scans read every page in sequence; index probes fetch each row they find (see fetch_cost); a Join hashes
+// both its inputs; a Sort compares each row with about log2 of the rows it keeps.
+double EvalPlan::estimate_cost() const {
+    switch (this->type) {
+        case TableScan:
+            return table_pages(this->table) * SEQ_PAGE_COST + table_rows(this->table) * ROW_COST;
+        case IndexLookup:
+        case IndexScan:
+            return INDEX_PROBE_COST + fetch_cost(this->table, cardinality());
+        case Select:
+            return this->relation->estimate_cost() + this->relation->cardinality() * ROW_COST;
+        case Join:
+            return this->relation->estimate_cost() + this->right->estimate_cost()
+                   + (this->relation->cardinality() + this->right->cardinality()) * HASH_ROW_COST
+                   + cardinality() * ROW_COST;
+        case IndexJoin: {
+            double matches = index_join_matches();
+            return this->relation->estimate_cost() + this->relation->cardinality() * INDEX_PROBE_COST
+                   + fetch_cost(this->table, matches) + matches * ROW_COST;
+        }
+        case Aggregate:
+            return this->relation->estimate_cost() + this->relation->cardinality() * HASH_ROW_COST;
+        case Sort: {
+            double rows = this->relation->cardinality();
+            double kept = std::max(2.0, std::min(rows, (double)this->limit));
+            return this->relation->estimate_cost() + rows * (ROW_COST + std::log2(kept) * COMPARE_COST);
+        }
+        default:
+            return this->relation->estimate_cost();
+    }
+}
+
+// What an index walk (an IndexScan, or a Select on one) costs to produce its first rows rows: it stops once it
+// has found them, which, if the Select keeps a fraction of the rows walked, means walking rows over that fraction.
+double EvalPlan::walk_cost(double rows) const {
+    const EvalPlan *walk = this->type == Select ? this->relation : this;
+    double found = walk->cardinality(), kept = cardinality();
+    double walked = kept > 0 ? std::min(found, rows * found / kept) : found;
+    return INDEX_PROBE_COST + fetch_cost(walk->table, walked) + (walk != this ? walked * ROW_COST : 0.0);
+}
+
+// Turn our equal key prefix and the range (if any) on the next key column into bounds for the index.
+RowCursor *EvalPlan::index_scan_cursor() {
+    ValueDict min_key(*this->select_conjunction), max_key(*this->select_conjunction);
+    bool has_min = !min_key.empty(), min_inclusive = true;
+    bool has_max = !max_key.empty(), max_inclusive = true;
+    if (!this->select_ranges->empty()) {
+        const Identifier &column = this->select_ranges->begin()->first;
+        const ValueRange &range = this->select_ranges->begin()->second;
+        if (range.has_min) {
+            min_key[column] = range.min;
+            has_min = true;
+            min_inclusive = range.min_inclusive;
+        }
+        if (range.has_max) {
+            max_key[column] = range.max;
+            has_max = true;
+            max_inclusive = range.max_inclusive;
+        }
+    }
+    this->index->open();
+    return this->index->range_cursor(has_min ? &min_key : nullptr, min_inclusive,
+                                     has_max ? &max_key : nullptr, max_inclusive);
+}
+
+
+// test function -- returns true if all tests pass
+bool test_eval_plan() {
+    ColumnNames column_names;
+    column_names.push_back("a");
+    column_names.push_back("b");
+    ColumnAttributes column_attributes;
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+    column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+    HeapTable table("_test_eval_plan_cpp", column_names, column_attributes);
+    table.create();
+    for (int i = 0; i < 1000; i++) {
+        ValueDict row;
+        row["a"] = Value(i);
+        row["b"] = Value("b" + std::to_string(i));
+        table.insert(&row);
+    }
+    ColumnNames key_columns;
+    key_columns.push_back("a");
+    BTreeIndex index(table, "_test_eval_plan_a", key_columns, true);
+    index.create();
+    TableIndices indices;
+    indices.push_back(&index);
+
+    // how many rows a Select over the indexed table finds, once optimize has had its chance at the index
+    auto rows = [&table, &indices](ValueDict *where, ValueRanges *ranges) {
+        EvalPlan *plan = new EvalPlan(EvalPlan::ProjectAll, new EvalPlan(where, ranges, new EvalPlan(table, indices)));
+        EvalPlan *optimized = plan->optimize();
+        DiscardSink sink;
+        size_t count = optimized->evaluate(sink);
+        delete optimized;
+        delete plan;
+        return count;
+    };
+
+    bool ok = true;
+    ValueDict *where = new ValueDict;
+    (*where)["a"] = Value(7);
+    ok = ok && rows(where, new ValueRanges) == 1;
+
+    // a TEXT literal matches no INT column, so it can't be probed for as the int it would be taken for
+    Value text("x");
+    text.n = 7;
+    where = new ValueDict;
+    (*where)["a"] = text;
+    ok = ok && rows(where, new ValueRanges) == 0;
+
+    ValueRanges *ranges = new ValueRanges;
+    (*ranges)["a"].has_min = true;
+    (*ranges)["a"].min = text;
+    ok = ok && rows(new ValueDict, ranges) == 0;
+
+    ranges = new ValueRanges;
+    (*ranges)["a"].has_max = true;
+    (*ranges)["a"].max = Value(9);
+    ok = ok && rows(new ValueDict, ranges) == 10;
+
+    index.drop();
+    table.drop();
+    return ok;
+}
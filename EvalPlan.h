@@ -1,9 +1,16 @@
 #pragma once
 
 #include "storage_engine.h"
+#include "row_batch.h"
+#include "hash_join.h"
+#include "aggregate.h"
+#include "sort.h"
+#include "statistics.h"
+#include "result_sink.h"
 
 
-typedef std::pair<DbRelation*,Handles*> EvalPipeline;
+typedef std::pair<DbRelation*,RowCursor*> EvalPipeline;  // cursor is freed by caller
+typedef std::vector<DbIndex*> TableIndices;  // indices on a TableScan's table that optimize may use
 
 class EvalPlan {
 public:
@@ -11,29 +18,108 @@ public:
         ProjectAll,
         Project,
         Select,
-        TableScan
+        TableScan,
+        IndexScan,
+        IndexLookup,
+        Limit,
+        Join,
+        IndexJoin,
+        Aggregate,
+        Sort
     };
 
     EvalPlan(PlanType type, EvalPlan *relation);  // use for ProjectAll, e.g., EvalPlan(EvalPlan::ProjectAll, table);
     EvalPlan(ColumnNames *projection, EvalPlan *relation); // use for Project
     EvalPlan(ValueDict* conjunction, EvalPlan *relation);  // use for Select
+    EvalPlan(ValueDict* conjunction, ValueRanges* ranges, EvalPlan *relation);  // use for Select with range predicates
     EvalPlan(DbRelation &table);  // use for TableScan
+    EvalPlan(DbRelation &table, const TableIndices &indices);  // use for TableScan that optimize may replace
+    EvalPlan(DbIndex &index, ValueDict *key, DbRelation &table);  // use for IndexLookup (key has every key column)
+    EvalPlan(DbIndex &index, ValueDict *prefix, ValueRanges *range, DbRelation &table);  // use for IndexScan
+    EvalPlan(size_t limit, size_t offset, EvalPlan *relation);  // use for Limit (over a ProjectAll or Project)
+    EvalPlan(ColumnNames *group_by, Aggregates *aggregates, EvalPlan *relation);  // use for Aggregate (under a Project)
+    EvalPlan(SortKeys *keys, size_t limit, EvalPlan *relation);  // use for Sort (under a Project; limit is how many rows are wanted, or SIZE_MAX)
+    EvalPlan(EvalPlan *left, JoinInput *left_input, EvalPlan *right, JoinInput *right_input);  // use for Join
+    EvalPlan(EvalPlan *outer, DbIndex &index, ValueDict *where, ValueRanges *ranges, DbRelation &table,
+             JoinInput *left_input, JoinInput *right_input, bool outer_left);  // use for IndexJoin
     EvalPlan(const EvalPlan *other);  // use for copying
     virtual ~EvalPlan();
 
-    // Attempt to get the best equivalent evaluation plan
+    // Attempt to get the best equivalent evaluation plan, going by estimate_cost: a Select directly over a
+    // TableScan becomes an index probe (plus whatever part of the conjunction the index doesn't cover) if one
+    // of the table's indices covers a prefix of the conjunction and probing it costs less than the scan, a Join
+    // becomes an IndexJoin if one input scans a table indexed on its join keys and looking up each row of the
+    // other input costs less than hashing both, and a Sort goes away if its input walks an ordered index in
+    // the order it wants (or is replaced by such a walk, if few enough rows are wanted)
     EvalPlan *optimize();
 
-    // Evaluate the plan: evaluate gets values, pipeline gets handles
-    ValueDicts *evaluate();
+    // Evaluate the plan: evaluate pushes the rows into sink as they come and returns how many there were,
+    // pipeline gets handles
+    size_t evaluate(ResultSink &sink, uint parallelism = 1);  // parallelism: threads a table scan may use
     EvalPipeline pipeline();
 
+    // Guess how many rows the plan produces (a Join builds its hash table on the smaller input), from the
+    // statistics of the tables it reads if they've been analyzed, or else from fixed guesses at selectivity
+    size_t estimate_rows() const;
+    double cardinality() const;  // the same, before rounding
+
+    // Guess how many different values a column of the plan's rows has (0 if we can't tell)
+    size_t distinct(const Identifier &column) const;
+
+    // Guess what it costs to run the plan, in units of reading one page of a table in sequence
+    double estimate_cost() const;
+
+    // Guess how many rows a Join of two plans would produce (SQLExec orders joins by this)
+    static double estimate_join_rows(const EvalPlan *left, const JoinInput &left_input,
+                                     const EvalPlan *right, const JoinInput &right_input);
+
+    // Or run it one row at a time: open, call next until it returns false, then close.
+    // Rows come from ProjectAll, Project, and Limit; every other plan produces handles. Plans with a Join,
+    // an Aggregate, or a Sort can only be run a batch at a time.
+    void open();
+    bool next(ValueDict &row);
+    bool next(Handle &handle);
+    void close();
+
+    // Or a batch at a time: open_batches, call next(batch) until it returns false, then close.
+    // Only the batch's selected rows count. needed is the columns the caller will look at (nullptr for all).
+    // Table scans may use up to parallelism threads; unless ordered, their batches can come in any order.
+    // A TableScan, or a Select on one, runs each part of the table it scans on its own through step, if given.
+    void open_batches(const ColumnNames *needed = nullptr, uint parallelism = 1, bool ordered = true,
+                      const BatchStep *step = nullptr);
+    bool next(RowBatch &batch);
+
 protected:
 
+    EvalPlan *index_probe() const;
+    EvalPlan *index_join() const;
+    EvalPlan *ordered_scan() const;
+    bool in_order(const SortKeys &keys) const;
+    RowCursor *index_scan_cursor();
+    const TableStatistics *statistics() const;
+    double index_join_matches() const;
+    double walk_cost(double rows) const;
+
     PlanType type;
-    EvalPlan *relation;  // for everything except TableScan
-    ColumnNames *projection;  // for Project
-    ValueDict *select_conjunction;  // for Select
-    DbRelation &table;  // for TableScan
+    EvalPlan *relation;  // for everything except TableScan; the outer input for IndexJoin
+    ColumnNames *projection;  // for Project; the group-by columns for Aggregate
+    ValueDict *select_conjunction;  // for Select; the key for IndexLookup; the equal key prefix for IndexScan; for IndexJoin, on the inner rows
+    ValueRanges *select_ranges;  // for Select; for IndexScan, the range (if any) on the key column after the prefix; for IndexJoin, on the inner rows
+    DbRelation &table;  // for TableScan, IndexScan, and IndexLookup; the inner table for IndexJoin
+    DbIndex *index;  // for IndexScan, IndexLookup, and IndexJoin
+    TableIndices indices;  // for TableScan
+    size_t limit;  // for Limit: the most rows to return; for Sort: the most rows wanted
+    size_t offset;  // for Limit: rows to skip first
+    EvalPipeline running;  // while open: where the handles we project or pass on come from
+    size_t position;  // while open, for Limit: rows read so far
+    BatchCursor *batches;  // while open for batches, for TableScan, IndexScan, IndexLookup, Join, and IndexJoin
+    EvalPlan *right;  // for Join: the right input (relation is the left one)
+    JoinInput *left_input;  // for Join and IndexJoin
+    JoinInput *right_input;  // for Join and IndexJoin
+    bool outer_left;  // for IndexJoin: whether the outer input is the left one
+    Aggregates *aggregates;  // for Aggregate
+    SortKeys *sort_keys;  // for Sort
 };
 
+
+bool test_eval_plan();
@@ -6,43 +6,18 @@
 #include "SQLExec.h"
 #include "EvalPlan.h"
 #include <algorithm>
+#include <cstdint>
+#include <functional>
 using namespace std;
 using namespace hsql;
 
 // define static data
 Tables* SQLExec::tables = nullptr;
 Indices* SQLExec::indices = nullptr;
+uint SQLExec::parallelism = 1;
 
-// make query result be printable
+// make query result be printable (its rows, if it had any, have already gone to its sink)
 ostream &operator<<(ostream &out, const QueryResult &qres) {
-	if (qres.column_names != nullptr) {
-		for (auto const &column_name : *qres.column_names)
-			out << column_name << " ";
-		out << endl << "+";
-		for (unsigned int i = 0; i < qres.column_names->size(); i++)
-			out << "----------+";
-		out << endl;
-		for (auto const &row : *qres.rows) {
-			for (auto const &column_name : *qres.column_names) {
-				Value value = row->at(column_name);
-				switch (value.data_type) {
-				case ColumnAttribute::INT:
-					out << value.n;
-					break;
-				case ColumnAttribute::TEXT:
-					out << "\"" << value.s << "\"";
-					break;
-				case ColumnAttribute::BOOLEAN:
-					out << (value.n == 0 ? "false" : "true");
-					break;
-				default:
-					out << "???";
-				}
-				out << " ";
-			}
-			out << endl;
-		}
-	}
 	out << qres.message;
 	return out;
 }
@@ -53,36 +28,37 @@ QueryResult::~QueryResult() {
 		delete column_names;
 	if (column_attributes)
 		delete column_attributes;
-	if (rows)
-	{
-		for (ValueDict *row : *rows)
-			delete row;
-		delete rows;
-	}
 }
 
-//acts as a triage to call an appropriate method to handle a SQL statement
-QueryResult *SQLExec::execute(const SQLStatement *statement) throw(SQLExecError) {
-	// FIXME: initialize _tables table, if not yet present
+//get hold of the schema tables (and the catalog of them) the first time we need them
+void SQLExec::open_schema_tables() {
 	if (!SQLExec::tables)
 		SQLExec::tables = new Tables();
 	if (!SQLExec::indices)
 		SQLExec::indices = new Indices();
+	Catalog::load(*SQLExec::tables, Tables::get_table(Columns::TABLE_NAME), *SQLExec::indices);
+}
 
+//acts as a triage to call an appropriate method to handle a SQL statement
+QueryResult *SQLExec::execute(const SQLStatement *statement, ResultSink *sink) throw(SQLExecError) {
+	DiscardSink discard;
+	if (sink == nullptr)
+		sink = &discard;
 	try {
+		open_schema_tables();
 		switch (statement->type()) {
 		case kStmtCreate:
 			return create((const CreateStatement *)statement);
 		case kStmtDrop:
 			return drop((const DropStatement *)statement);
 		case kStmtShow:
-			return show((const ShowStatement *)statement);
+			return show((const ShowStatement *)statement, *sink);
 		case kStmtInsert:
 			return insert((const InsertStatement *)statement);
 		case kStmtDelete:
 			return del((const DeleteStatement *)statement);
 		case kStmtSelect:
-			return select((const SelectStatement *)statement);
+			return select((const SelectStatement *)statement, *sink);
 		default:
 			return new QueryResult("not implemented");
 		}
@@ -92,61 +68,165 @@ QueryResult *SQLExec::execute(const SQLStatement *statement) throw(SQLExecError)
 	}
 }
 
-//Pull out conjunctions of equality predicates from parse tree. 
-ValueDict* SQLExec::get_where_conjunction(const hsql::Expr *expr, const ColumnNames *col_names) {
+//set how many threads a SELECT may scan a table with
+void SQLExec::set_parallelism(uint parallelism) {
+	SQLExec::parallelism = parallelism > 0 ? parallelism : 1;
+}
+
+//gather a table's statistics and store them in _statistics for the planner
+QueryResult *SQLExec::analyze(Identifier table_name) throw(SQLExecError) {
+	try {
+		open_schema_tables();
+		if (Catalog::get_table(table_name) == nullptr)
+			throw SQLExecError("no such table " + table_name);
+
+		TableStatistics *statistics = TableStatistics::analyze(SQLExec::tables->get_table(table_name));
+		size_t rows = statistics->row_count, pages = statistics->page_count;
+		Tables::set_statistics(table_name, statistics);
+		return new QueryResult("analyzed " + table_name + ": " + to_string(rows) + " rows in "
+			+ to_string(pages) + " pages");
+	}
+	catch (DbRelationError& e) {
+		throw SQLExecError(string("DbRelationError: ") + e.what());
+	}
+}
+
+//insert the rows of a multi-row INSERT (given as one single-row statement per row) all at once
+QueryResult *SQLExec::insert_many(const vector<const InsertStatement*> &statements) throw(SQLExecError) {
+	if (statements.empty())
+		throw SQLExecError("INSERT needs at least one row");
+	try {
+		open_schema_tables();
+		return insert_rows(statements);
+	}
+	catch (DbRelationError& e) {
+		throw SQLExecError(string("DbRelationError: ") + e.what());
+	}
+}
+
+// A COPY FROM can only go into a heap table of the user's.
+static HeapTable &copy_table(Identifier table_name, bool loading) {
+	if (Catalog::get_table(table_name) == nullptr)
+		throw SQLExecError("no such table " + table_name);
+	if (loading && (table_name == Tables::TABLE_NAME || table_name == Columns::TABLE_NAME
+					|| table_name == Indices::TABLE_NAME || table_name == Statistics::TABLE_NAME))
+		throw SQLExecError("cannot COPY into a schema table");
+	HeapTable *table = dynamic_cast<HeapTable*>(&Tables::get_table(table_name));
+	if (table == nullptr)
+		throw SQLExecError("cannot COPY " + table_name);
+	return *table;
+}
+
+//load a file into a table; its indices are built over again from scratch afterward, which is quicker than
+//adding the new rows one at a time
+QueryResult *SQLExec::copy_from(Identifier table_name, string path, CopyFormat format) throw(SQLExecError) {
+	try {
+		open_schema_tables();
+		HeapTable &table = copy_table(table_name, true);
+		CopyLoad load(table, path, format, SQLExec::parallelism > 1 ? SQLExec::parallelism : 0);
+		size_t rows = load.run();
+
+		IndexNames index_names = SQLExec::indices->get_index_names(table_name);
+		try {
+			for (auto const &index_name : index_names)
+				SQLExec::indices->rebuild(table_name, index_name);
+		} catch (...) {
+			// e.g., a unique index with a duplicate in it: take the rows back out and put the indices back
+			load.rollback();
+			for (auto const &index_name : index_names)
+				SQLExec::indices->rebuild(table_name, index_name);
+			throw;
+		}
+		string message = "copied " + to_string(rows) + " rows from '" + path + "' into " + table_name;
+		if (!index_names.empty())
+			message += " and rebuilt " + to_string(index_names.size()) + " indices";
+		return new QueryResult(message);
+	}
+	catch (DbRelationError& e) {
+		throw SQLExecError(string("DbRelationError: ") + e.what());
+	}
+}
+
+//write a table out to a file
+QueryResult *SQLExec::copy_to(Identifier table_name, string path, CopyFormat format) throw(SQLExecError) {
+	try {
+		open_schema_tables();
+		HeapTable &table = copy_table(table_name, false);
+		size_t rows = CopyDump(table, path, format, SQLExec::parallelism).run();
+		return new QueryResult("copied " + to_string(rows) + " rows from " + table_name + " to '" + path + "'");
+	}
+	catch (DbRelationError& e) {
+		throw SQLExecError(string("DbRelationError: ") + e.what());
+	}
+}
+
+//Convert a literal in the parse tree into a Value
+static Value literal_value(const Expr *expr) {
+	switch (expr->type) {
+	case kExprLiteralString:
+		return Value(expr->name);
+	case kExprLiteralInt:
+		return Value(expr->ival);
+	default:
+		throw SQLExecError("unrecognized type");
+	}
+}
+
+//Pull out conjunctions of equality predicates from parse tree. Comparison (<, <=, >, >=)
+//and BETWEEN predicates go into ranges; if ranges is nullptr they are rejected.
+ValueDict* SQLExec::get_where_conjunction(const hsql::Expr *expr, const ColumnNames *col_names,
+	ValueRanges *ranges) {
 	
 	ValueDict* rows = new ValueDict;
 	//Check if where clause has an operator
 	if (expr->type == kExprOperator) {
 		if (expr->opType == Expr::AND) {
 			//recursively get left expr
-			ValueDict* sub_tree_conj = get_where_conjunction(expr->expr, col_names);
+			ValueDict* sub_tree_conj = get_where_conjunction(expr->expr, col_names, ranges);
 			if (sub_tree_conj != nullptr) {
 				rows->insert(sub_tree_conj->begin(), sub_tree_conj->end());
 			}
+			delete sub_tree_conj;
 			//recursively get right expr
-			sub_tree_conj = get_where_conjunction(expr->expr2, col_names);
+			sub_tree_conj = get_where_conjunction(expr->expr2, col_names, ranges);
 			rows->insert(sub_tree_conj->begin(), sub_tree_conj->end());
-
+			delete sub_tree_conj;
+			return rows;
 		}
-		else if (expr->opType == Expr::SIMPLE_OP) {
-			//Check and handle equality predicate
-			if (expr->opChar == '=') {
-				//Extract column and check if exists in table columns
-				Identifier col_name = expr->expr->name;
-				if (find(col_names->begin(), col_names->end(), col_name) == col_names->end()) {
-					throw SQLExecError("unknown column '" + col_name + "'");
-				}
-
-				//Check if the value type is valid and add to return ValueDict
-					switch (expr->expr2->type) {
-					case kExprLiteralString: 
-					{
-						rows->insert(pair<Identifier, Value>(col_name, Value(expr->expr2->name)));
-						break;
-					}
-					case kExprLiteralInt:
-					{
-						rows->insert(pair<Identifier, Value>(col_name, Value(expr->expr2->ival)));
-						break;
-					}	
-					default:
-						throw SQLExecError("unrecognized type");
-					}
-			}
-			//Throw exception if predicate is other than "=". We can only handle equal
-			//operator at this time
-			else {
-				throw SQLExecError("only equality predicates currently supported");
-			}
 
+		//Everything else is <column> <op> <literal(s)>
+		if (expr->expr == nullptr || expr->expr->type != kExprColumnRef)
+			throw SQLExecError("only predicates of the form column op literal are supported");
+		Identifier col_name = expr->expr->name;
+		if (find(col_names->begin(), col_names->end(), col_name) == col_names->end()) {
+			throw SQLExecError("unknown column '" + col_name + "'");
 		}
-		//Throw exception if conjunction is other "AND". We can only handle AND
-		//conjunction at this time
-		else {
-			throw SQLExecError("only support AND conjunctions");
+
+		//Check and handle equality predicate
+		if (expr->opType == Expr::SIMPLE_OP && expr->opChar == '=') {
+			rows->insert(pair<Identifier, Value>(col_name, literal_value(expr->expr2)));
+			return rows;
 		}
 
+		//Anything else must be a range predicate
+		if (ranges == nullptr)
+			throw SQLExecError("only equality predicates currently supported");
+		ValueRange &range = (*ranges)[col_name];
+		if (expr->opType == Expr::SIMPLE_OP && expr->opChar == '<')
+			range.restrict_max(literal_value(expr->expr2), false);
+		else if (expr->opType == Expr::SIMPLE_OP && expr->opChar == '>')
+			range.restrict_min(literal_value(expr->expr2), false);
+		else if (expr->opType == Expr::LESS_EQ)
+			range.restrict_max(literal_value(expr->expr2), true);
+		else if (expr->opType == Expr::GREATER_EQ)
+			range.restrict_min(literal_value(expr->expr2), true);
+		else if (expr->opType == Expr::BETWEEN && expr->exprList != nullptr && expr->exprList->size() == 2) {
+			range.restrict_min(literal_value(expr->exprList->at(0)), true);
+			range.restrict_max(literal_value(expr->exprList->at(1)), true);
+		}
+		//Throw exception if conjunction is other "AND" or the operator is something we don't know
+		else
+			throw SQLExecError("only support AND conjunctions of =, <, <=, >, >= and BETWEEN");
 		return rows;
 	}
 	//Throw exception if no operators are found at all
@@ -156,91 +236,465 @@ ValueDict* SQLExec::get_where_conjunction(const hsql::Expr *expr, const ColumnNa
 	
 }
 
+//Start a plan with a scan of table that EvalPlan::optimize may replace with a probe of one of its indices
+EvalPlan *SQLExec::table_scan(DbRelation &table) {
+	Identifier tbname = table.get_table_name();
+	TableIndices indices;
+	for (auto const &index_name : SQLExec::indices->get_index_names(tbname))
+		indices.push_back(&SQLExec::indices->get_index(tbname, index_name));
+	return new EvalPlan(table, indices);
+}
+
+//a table in the FROM clause of a join, and the predicates on it alone
+struct FromTable {
+	Identifier qualifier;  // its alias, or else its name
+	DbRelation *table;
+	ValueDict where;
+	ValueRanges ranges;
+};
+
+//a column = column predicate between two tables of a join (left_table comes first in the FROM clause)
+struct JoinPredicate {
+	uint left_table;
+	Identifier left_column;
+	uint right_table;
+	Identifier right_column;
+};
+
+//List the tables of a FROM clause in order, along with the conditions of its joins
+static void from_tables(const TableRef *table_ref, vector<FromTable> &from, vector<const Expr*> &conditions,
+	Tables &tables) {
+	switch (table_ref->type) {
+	case kTableName: {
+		FromTable table;
+		table.qualifier = table_ref->alias != nullptr ? table_ref->alias : table_ref->name;
+		for (auto const &other : from)
+			if (other.qualifier == table.qualifier)
+				throw SQLExecError("table '" + table.qualifier + "' appears more than once (use an alias)");
+		table.table = &tables.get_table(table_ref->name);
+		from.push_back(table);
+		break;
+	}
+	case kTableCrossProduct:
+		for (const TableRef *item : *table_ref->list)
+			from_tables(item, from, conditions, tables);
+		break;
+	case kTableJoin:
+		if (table_ref->join->type != kJoinInner && table_ref->join->type != kJoinCross)
+			throw SQLExecError("only inner joins are supported");
+		from_tables(table_ref->join->left, from, conditions, tables);
+		from_tables(table_ref->join->right, from, conditions, tables);
+		if (table_ref->join->condition != nullptr)
+			conditions.push_back(table_ref->join->condition);
+		break;
+	default:
+		throw SQLExecError("only tables can be joined");
+	}
+}
+
+//Split a conjunction into its terms
+static void conjuncts(const Expr *expr, vector<const Expr*> &terms) {
+	if (expr->type == kExprOperator && expr->opType == Expr::AND) {
+		conjuncts(expr->expr, terms);
+		conjuncts(expr->expr2, terms);
+	} else {
+		terms.push_back(expr);
+	}
+}
+
+//Find the table a column reference is to, by its qualifier or else by being the only one with that column
+static uint resolve_column(const vector<FromTable> &from, const Expr *column_ref, Identifier &column_name) {
+	column_name = column_ref->name;
+	uint found = (uint)from.size();
+	for (uint i = 0; i < from.size(); i++) {
+		if (column_ref->table != nullptr && from[i].qualifier != column_ref->table)
+			continue;
+		const ColumnNames &columns = from[i].table->get_column_names();
+		if (find(columns.begin(), columns.end(), column_name) == columns.end())
+			continue;
+		if (found != from.size())
+			throw SQLExecError("column '" + column_name + "' is ambiguous");
+		found = i;
+	}
+	if (found == from.size())
+		throw SQLExecError("unknown column '" + (column_ref->table != nullptr ? string(column_ref->table) + "." : "")
+			+ column_name + "'");
+	return found;
+}
+
+//Whether a SELECT returns aggregates (of groups, or of all of its rows) rather than rows
+static bool aggregating(const SelectStatement *statement) {
+	if (statement->groupBy != nullptr)
+		return true;
+	for (auto const &expr : *statement->selectList)
+		if (expr->type == kExprFunctionRef)
+			return true;
+	return false;
+}
+
+//The aggregate a function call in a SELECT computes, named by its alias or else like "SUM(amount)". name_of
+//gives the name a column reference has in the plan being aggregated.
+static Aggregate aggregate_of(const Expr *expr, function<Identifier(const Expr*)> name_of) {
+	string function_name = expr->name;
+	transform(function_name.begin(), function_name.end(), function_name.begin(), ::toupper);
+	Aggregate::Function function;
+	if (function_name == "COUNT")
+		function = Aggregate::COUNT;
+	else if (function_name == "SUM")
+		function = Aggregate::SUM;
+	else if (function_name == "MIN")
+		function = Aggregate::MIN;
+	else if (function_name == "MAX")
+		function = Aggregate::MAX;
+	else if (function_name == "AVG")
+		function = Aggregate::AVG;
+	else
+		throw SQLExecError("unknown function " + function_name);
+	if (expr->distinct)
+		throw SQLExecError("DISTINCT aggregates are not supported");
+	Identifier column_name;
+	if (expr->expr != nullptr && expr->expr->type == kExprStar && function == Aggregate::COUNT)
+		column_name = "";
+	else if (expr->expr != nullptr && expr->expr->type == kExprColumnRef)
+		column_name = name_of(expr->expr);
+	else
+		throw SQLExecError(function_name + " can only be applied to a column");
+	Identifier name = expr->alias != nullptr ? expr->alias
+		: function_name + "(" + (column_name.empty() ? "*" : column_name) + ")";
+	return Aggregate(function, column_name, name);
+}
+
+//Put an Aggregate on top of plan for the GROUP BY and aggregate functions of a SELECT, and list its columns
+//in col_names in the order of the select list. name_of gives the name a column reference has in plan.
+static EvalPlan *aggregate_plan(const SelectStatement *statement, EvalPlan *plan, ColumnNames *col_names,
+	function<Identifier(const Expr*)> name_of) {
+	ColumnNames *group_by = new ColumnNames;
+	Aggregates *aggregates = new Aggregates;
+	auto add = [aggregates](const Aggregate &aggregate) {
+		auto same = [&aggregate](const Aggregate &other) { return other.name == aggregate.name; };
+		if (find_if(aggregates->begin(), aggregates->end(), same) == aggregates->end())
+			aggregates->push_back(aggregate);
+	};
+	try {
+		if (statement->groupBy != nullptr) {
+			if (statement->groupBy->having != nullptr)
+				throw SQLExecError("HAVING is not supported");
+			for (auto const &expr : *statement->groupBy->columns) {
+				if (expr->type != kExprColumnRef)
+					throw SQLExecError("can only GROUP BY columns");
+				group_by->push_back(name_of(expr));
+			}
+		}
+		for (auto const &expr : *statement->selectList) {
+			if (expr->type == kExprColumnRef) {
+				Identifier column_name = name_of(expr);
+				if (find(group_by->begin(), group_by->end(), column_name) == group_by->end())
+					throw SQLExecError("column '" + column_name + "' must be in the GROUP BY or in an aggregate function");
+				col_names->push_back(column_name);
+				continue;
+			}
+			if (expr->type != kExprFunctionRef)
+				throw SQLExecError("Unable to handle this type of select");
+			Aggregate aggregate = aggregate_of(expr, name_of);
+			add(aggregate);
+			col_names->push_back(aggregate.name);
+		}
+		if (statement->order != nullptr)
+			for (auto const &order : *statement->order)
+				if (order->expr->type == kExprFunctionRef)
+					add(aggregate_of(order->expr, name_of));  // sorted on, but not in the result
+	}
+	catch (...) {
+		delete group_by;
+		delete aggregates;
+		delete plan;
+		throw;
+	}
+	return new EvalPlan(group_by, aggregates, plan);
+}
+
+//Put a Sort on top of plan for the ORDER BY of a SELECT, if it has one, keeping just as many rows as a LIMIT
+//needs. name_of gives the name a column reference has in plan; for an aggregating SELECT, the terms can
+//also be aggregate functions (see aggregate_plan) or the names of columns of its result (col_names).
+static EvalPlan *order_plan(const SelectStatement *statement, EvalPlan *plan, const ColumnNames *col_names,
+	function<Identifier(const Expr*)> name_of) {
+	if (statement->order == nullptr)
+		return plan;
+	bool grouped = aggregating(statement);
+	SortKeys *keys = new SortKeys;
+	try {
+		for (auto const &order : *statement->order) {
+			const Expr *expr = order->expr;
+			Identifier column_name;
+			if (grouped && expr->type == kExprFunctionRef) {
+				column_name = aggregate_of(expr, name_of).name;
+			} else if (expr->type != kExprColumnRef) {
+				throw SQLExecError("can only ORDER BY columns");
+			} else if (grouped && expr->table == nullptr
+				&& find(col_names->begin(), col_names->end(), expr->name) != col_names->end()) {
+				column_name = expr->name;  // an aggregate's alias, say
+			} else {
+				column_name = name_of(expr);
+				if (grouped && find(col_names->begin(), col_names->end(), column_name) == col_names->end())
+					throw SQLExecError("ORDER BY column '" + column_name + "' must be in the select list");
+			}
+			keys->push_back(SortKey(column_name, order->type == kOrderDesc));
+		}
+	}
+	catch (...) {
+		delete keys;
+		delete plan;
+		throw;
+	}
+	size_t limit = SIZE_MAX;
+	if (statement->limit != nullptr && statement->limit->limit >= 0)
+		limit = (size_t)statement->limit->limit + (statement->limit->offset > 0 ? (size_t)statement->limit->offset : 0);
+	return new EvalPlan(keys, limit, plan);
+}
+
+//Plan a SELECT from a join or cross product of tables. Predicates on one table go in a Select on its scan
+//(so optimize can still use its indices), column = column predicates become the keys of joins, and
+//the tables are joined left to right. Columns come out named "table.column" (or "alias.column").
+EvalPlan *SQLExec::join_plan(const SelectStatement *statement, ColumnNames *col_names) {
+	vector<FromTable> from;
+	vector<const Expr*> terms;
+	from_tables(statement->fromTable, from, terms, *SQLExec::tables);
+	if (statement->whereClause != nullptr)
+		conjuncts(statement->whereClause, terms);
+
+	vector<JoinPredicate> joins;
+	for (const Expr *term : terms) {
+		if (term->type != kExprOperator || term->expr == nullptr || term->expr->type != kExprColumnRef)
+			throw SQLExecError("only predicates of the form column op literal or column = column are supported");
+		if (term->opType == Expr::SIMPLE_OP && term->opChar == '=' && term->expr2 != nullptr
+			&& term->expr2->type == kExprColumnRef) {
+			JoinPredicate join;
+			join.left_table = resolve_column(from, term->expr, join.left_column);
+			join.right_table = resolve_column(from, term->expr2, join.right_column);
+			if (join.left_table == join.right_table)
+				throw SQLExecError("can only compare columns of different tables");
+			if (join.left_table > join.right_table) {
+				swap(join.left_table, join.right_table);
+				swap(join.left_column, join.right_column);
+			}
+			joins.push_back(join);
+		} else {
+			Identifier column_name;
+			FromTable &table = from[resolve_column(from, term->expr, column_name)];
+			ValueDict *conjunction = get_where_conjunction(term, &table.table->get_column_names(), &table.ranges);
+			table.where.insert(conjunction->begin(), conjunction->end());
+			delete conjunction;
+		}
+	}
+
+	//scan each table (with its own predicates)
+	vector<EvalPlan*> scans;
+	vector<JoinInput> inputs;
+	for (auto const &table : from) {
+		if (table.where.empty() && table.ranges.empty())
+			scans.push_back(table_scan(*table.table));
+		else
+			scans.push_back(new EvalPlan(new ValueDict(table.where), new ValueRanges(table.ranges), table_scan(*table.table)));
+		JoinInput input;
+		for (auto const &column_name : table.table->get_column_names()) {
+			input.columns.push_back(column_name);
+			input.names.push_back(table.qualifier + "." + column_name);
+		}
+		inputs.push_back(input);
+	}
+
+	//then join them one at a time, each time taking the table that gives the fewest rows joined onto the ones
+	//so far (going by the planner's estimates), so the later joins get small inputs; a table with no predicate
+	//joining it to the ones so far waits until the rest are in, since it makes a cross product
+	vector<bool> in_plan(from.size(), false);
+	auto join_keys = [&](uint i, JoinInput &left_input, JoinInput &right_input) {
+		for (auto const &join : joins) {
+			uint other;
+			Identifier other_column, column;
+			if (join.right_table == i && in_plan[join.left_table]) {
+				other = join.left_table;
+				other_column = join.left_column;
+				column = join.right_column;
+			} else if (join.left_table == i && in_plan[join.right_table]) {
+				other = join.right_table;
+				other_column = join.right_column;
+				column = join.left_column;
+			} else {
+				continue;
+			}
+			Identifier name = from[other].qualifier + "." + other_column;
+			auto it = find(left_input.names.begin(), left_input.names.end(), name);
+			left_input.keys.push_back(left_input.columns[it - left_input.names.begin()]);
+			right_input.keys.push_back(column);
+		}
+	};
+	EvalPlan *plan = nullptr;
+	JoinInput joined;  // what plan produces, as the left input of the next join
+	for (uint step = 0; step < from.size(); step++) {
+		uint best = 0;
+		bool found = false, best_connected = false;
+		double best_rows = 0.0;
+		for (uint i = 0; i < from.size(); i++) {
+			if (in_plan[i])
+				continue;
+			bool connected = true;
+			double rows = scans[i]->cardinality();
+			if (plan != nullptr) {
+				JoinInput left_input(joined), right_input(inputs[i]);
+				join_keys(i, left_input, right_input);
+				connected = !right_input.keys.empty();
+				rows = EvalPlan::estimate_join_rows(plan, left_input, scans[i], right_input);
+			}
+			if (!found || (connected && !best_connected) || (connected == best_connected && rows < best_rows)) {
+				best = i;
+				found = true;
+				best_connected = connected;
+				best_rows = rows;
+			}
+		}
+
+		if (plan == nullptr) {
+			plan = scans[best];
+			joined = inputs[best];
+		} else {
+			JoinInput *left_input = new JoinInput(joined), *input = new JoinInput(inputs[best]);
+			join_keys(best, *left_input, *input);
+			joined.columns = left_input->names;
+			joined.columns.insert(joined.columns.end(), input->names.begin(), input->names.end());
+			joined.names = joined.columns;
+			plan = new EvalPlan(plan, left_input, scans[best], input);
+		}
+		in_plan[best] = true;
+	}
+
+	//and take the columns of the select list (or the aggregates) from the result, in order
+	auto name_of = [&from](const Expr *column_ref) {
+		Identifier column_name;
+		uint table = resolve_column(from, column_ref, column_name);
+		return from[table].qualifier + "." + column_name;
+	};
+	if (aggregating(statement))
+		return order_plan(statement, aggregate_plan(statement, plan, col_names, name_of), col_names, name_of);
+	for (auto const &expr : *statement->selectList) {
+		switch (expr->type) {
+		case kExprStar:
+			for (auto const &input : inputs)  // in FROM order, whatever order they were joined in
+				col_names->insert(col_names->end(), input.names.begin(), input.names.end());
+			break;
+		case kExprColumnRef:
+			col_names->push_back(name_of(expr));
+			break;
+		default:
+			delete plan;
+			throw SQLExecError("Unable to handle this type of select");
+		}
+	}
+	return order_plan(statement, plan, col_names, name_of);
+}
+
 //insert a row into table
 QueryResult *SQLExec::insert(const InsertStatement *statement) {
+	return insert_rows(vector<const InsertStatement*>(1, statement));
+}
 
-	Identifier tbname = statement->tableName;
+//insert the rows of several single-row INSERT statements into their table all at once
+QueryResult *SQLExec::insert_rows(const vector<const InsertStatement*> &statements) {
+
+	Identifier tbname = statements.front()->tableName;
 	DbRelation& table = SQLExec::tables->get_table(tbname);
-	ValueDict final_row;
-	ColumnNames col_names;
-	vector<Value> col_vals;
-	IndexNames index_names;
-	Handle insert_handle;
-	unsigned int index_size = 0;
+	ValueDicts rows;
 	
-	//populate column values. We can only handle Text and Int at this time.
-	for (auto const &expr : *statement->values) {
-		switch (expr->type) {
-		case kExprLiteralString:
-			col_vals.push_back(Value(expr->name));
-			break;
-		case kExprLiteralInt:
-			col_vals.push_back(Value(expr->ival));
-			break;
-		default:
-			throw SQLExecError("Insert can only handle INT or TEXT");
-		}
-		
-	}
+	try {
+		for (const InsertStatement *statement : statements) {
+			if (tbname != statement->tableName)
+				throw SQLExecError("all the rows of an INSERT go into the same table");
 
-	//populate column names. If SQL statement doesn't explicitly specify
-	//column names, get the column names straight from the schema table
-	if (statement->columns != nullptr) {
-		for (char * column : *statement->columns) {
-			col_names.push_back(column);
-		}
-	}
-	else {
-		for (auto const col: table.get_column_names()) {
-			col_names.push_back(col);
+			//populate column values. We can only handle Text and Int at this time.
+			vector<Value> col_vals;
+			for (auto const &expr : *statement->values) {
+				switch (expr->type) {
+				case kExprLiteralString:
+					col_vals.push_back(Value(expr->name));
+					break;
+				case kExprLiteralInt:
+					col_vals.push_back(Value(expr->ival));
+					break;
+				default:
+					throw SQLExecError("Insert can only handle INT or TEXT");
+				}
+			}
+
+			//populate column names. If SQL statement doesn't explicitly specify
+			//column names, get the column names straight from the schema table
+			ColumnNames col_names;
+			if (statement->columns != nullptr) {
+				for (char * column : *statement->columns)
+					col_names.push_back(column);
+			} else {
+				col_names = table.get_column_names();
+			}
+			if (col_names.size() != col_vals.size())
+				throw SQLExecError("INSERT has " + to_string(col_vals.size()) + " values for "
+					+ to_string(col_names.size()) + " columns");
+
+			//create ValueDict of column name: column value
+			ValueDict *row = new ValueDict();
+			for (unsigned int i = 0; i < col_names.size(); i++)
+				(*row)[col_names[i]] = col_vals[i];
+			rows.push_back(row);
 		}
-		
 	}
-	
-	//create ValueDict of column name: column value
-	for (unsigned int i = 0; i < col_names.size(); i++) {
-		final_row[col_names[i]] = col_vals[i];
+	catch (...) {
+		for (ValueDict *row : rows)
+			delete row;
+		throw;
 	}
 
-
+	//Take those ValueDicts and insert the entries into table, filling a block at a time
+	Handles *handles;
 	try {
-		//Take that ValueDict and insert entry into table
-		insert_handle = table.insert(&final_row);
+		handles = table.insert_many(&rows);
+	}
+	catch (...) {
+		for (ValueDict *row : rows)
+			delete row;
+		throw;
+	}
+	for (ValueDict *row : rows)
+		delete row;
 
-		//update index table
-		try {
-			index_names = SQLExec::indices->get_index_names(tbname);
-			index_size = index_names.size();
-			for (unsigned int i = 0; i < index_names.size(); i++) {
-				DbIndex& index = SQLExec::indices->get_index(tbname, index_names[i]);
-				index.insert(insert_handle);
-			}
-		}
-		//If a row cannot be inserted into the table, delete the index content referenced
-		//to that row in index table
-		catch (exception &e) {
-			try {
-				for (unsigned int i = 0; i < index_names.size(); i++) {
-					DbIndex& index = SQLExec::indices->get_index(tbname, index_names[i]);
-					index.del(insert_handle);
+	//update index table: each index takes all the new entries at once (a B+tree in key order)
+	IndexNames index_names = SQLExec::indices->get_index_names(tbname);
+	unsigned int updated = 0;
+	try {
+		for (; updated < index_names.size(); updated++)
+			SQLExec::indices->get_index(tbname, index_names[updated]).insert_many(handles);
+	}
+	//If the rows cannot be indexed, take their entries back out of the indices and the rows out of the table
+	catch (...) {
+		for (unsigned int i = 0; i <= updated && i < index_names.size(); i++) {
+			DbIndex& index = SQLExec::indices->get_index(tbname, index_names[i]);
+			for (auto const &handle : *handles) {
+				try {
+					index.del(handle);
+				}
+				catch (...) {
+					// this one never made it in
 				}
 			}
-			catch (...) {
-
-			}
-			throw;
 		}
-		
-	}
-	//To throw back to main and display insertion error
-	catch (exception &e) {
+		for (auto const &handle : *handles)
+			table.del(handle);
+		delete handles;
 		throw;
 	}
 
 	//If all goes well, display a successful message
-	string msg = "successfully inserted 1 row into " + tbname;
-	if (index_size != 0)
-		msg += " and " + to_string(index_size) + " indices";
+	size_t count = handles->size();
+	delete handles;
+	string msg = "successfully inserted " + to_string(count) + (count == 1 ? " row" : " rows") + " into " + tbname;
+	if (index_names.size() != 0)
+		msg += " and " + to_string(index_names.size()) + " indices";
 	
 	return new QueryResult(msg);  
 }
@@ -253,35 +707,44 @@ QueryResult *SQLExec::del(const DeleteStatement *statement) {
 	ColumnNames col_names;
 
 	//Get a list of all columns
-	for (auto const col : table.get_column_names()) {
+	for (auto const &col : table.get_column_names()) {
 		col_names.push_back(col);
 	}
 
-	//Start base of plan at a TableScan
-	EvalPlan *plan = new EvalPlan(table);
-
 	//Enclose that in a Delete for where clause
+	EvalPlan *plan;
 	ValueDict* whereCondition = new ValueDict;
 	if (statement->expr != NULL) {
+		ValueRanges* ranges = new ValueRanges;
 		try {
-			whereCondition = get_where_conjunction(statement->expr, &col_names);
+			delete whereCondition;
+			whereCondition = get_where_conjunction(statement->expr, &col_names, ranges);
 		}
 		catch (exception &e) {
+			delete ranges;
 			throw;
 		}
-		plan = new EvalPlan(whereCondition, plan);
-		
+		//Start base of plan at a TableScan (optimize picks an index for it, if one helps)
+		plan = new EvalPlan(new ValueDict(*whereCondition), ranges, table_scan(table));
+	}
+	else {
+		//Start base of plan at a TableScan
+		plan = new EvalPlan(table);
 	}
 
-	//Optimize the plan and pipeline the optimized plan
+	//Optimize the plan and run the optimized plan
 	EvalPlan *optimized = plan->optimize();
-	EvalPipeline pipeline = optimized->pipeline();
 
-	//Remove index content referenced to this row. Since index delete operation
-	//has not been implemented yet. We just added the try catch block to 
-	//throw the exception
+	//Remove index content referenced to each row (while the row can still be read for its key)
 	auto index_names = SQLExec::indices->get_index_names(tbname);
-	Handles *pipeline_handles = pipeline.second;
+	Handles *pipeline_handles = new Handles;  // collect first: we can't delete underneath a live scan
+	Handle handle;
+	optimized->open();
+	while (optimized->next(handle))
+		pipeline_handles->push_back(handle);
+	optimized->close();
+	delete optimized;
+	delete plan;
 	unsigned int index_size = index_names.size();
 	unsigned int handles_size = pipeline_handles->size();
 	for (auto const& handle : *pipeline_handles) {
@@ -302,6 +765,7 @@ QueryResult *SQLExec::del(const DeleteStatement *statement) {
 	}
 	
 	//Handle memory
+	delete pipeline_handles;
 	delete whereCondition;
 
 	//If all goes well, display a successful message
@@ -314,7 +778,7 @@ QueryResult *SQLExec::del(const DeleteStatement *statement) {
 }
 
 //select entries from a table with or without where condition
-QueryResult *SQLExec::select(const SelectStatement *statement) {
+QueryResult *SQLExec::select(const SelectStatement *statement, ResultSink &sink) {
 
 	TableRef *table_ref = statement->fromTable;
 	Identifier tbname;
@@ -326,63 +790,108 @@ QueryResult *SQLExec::select(const SelectStatement *statement) {
 	case kTableName:
 		tbname = table_ref->name;
 		break;
+	case kTableJoin:
+	case kTableCrossProduct:
+		break;
 	default:
-		throw SQLExecError("Can only handle SELECT * FROM table WHERE col_1 = 1 AND col_n = ""three"""
-			" and SELECT col_1, col_2 FROM table");
+		throw SQLExecError("Can only handle SELECT from a table or from joins of tables");
 	}
 
-	//get column names from parser and make sure the SQL statements are standard
-	//select statements. We can't handle advanced select statements at this time
-	for (auto const &expr : *statement->selectList) {
-		switch (expr->type) {
-		case kExprStar:
-			break;
-		case kExprColumnRef:
-			col_names->push_back(expr->name);
-			break;
-		default:
-			return new QueryResult("Unable to handle this type of select");
-		}
+	EvalPlan *plan;
+	ValueDict* whereCondition = new ValueDict;
+	if (tbname.empty()) {
+		plan = join_plan(statement, col_names);
 	}
+	else {
+		//get column names from parser and make sure the SQL statements are standard
+		//select statements. We can't handle advanced select statements at this time
+		for (auto const &expr : *statement->selectList) {
+			switch (expr->type) {
+			case kExprStar:
+				break;
+			case kExprColumnRef:
+				col_names->push_back(expr->name);
+				break;
+			case kExprFunctionRef:
+				break;
+			default:
+				return new QueryResult("Unable to handle this type of select");
+			}
+		}
 
-	//get the table specified from the select statement
-	DbRelation& table = SQLExec::tables->get_table(tbname);
+		//get the table specified from the select statement
+		DbRelation& table = SQLExec::tables->get_table(tbname);
 
-	//get column in select *
-	if (col_names->empty()) {
-		for (auto const col : table.get_column_names()) {
-			col_names->push_back(col);
+		//get column in select *
+		if (col_names->empty()) {
+			for (auto const &col : table.get_column_names()) {
+				col_names->push_back(col);
+			}
 		}
-	}
 	
-	//Start base of plan at a TableScan
-	EvalPlan *plan = new EvalPlan(table);
-
-	//Enclose that in a Select if we have a where clause
-	ValueDict* whereCondition = new ValueDict;
-	if (statement->whereClause != NULL) {
-		try {
-			 whereCondition = get_where_conjunction(statement->whereClause, &table.get_column_names());
-			
+		//Enclose that in a Select if we have a where clause
+		if (statement->whereClause != NULL) {
+			ValueRanges* ranges = new ValueRanges;
+			try {
+				delete whereCondition;
+				whereCondition = get_where_conjunction(statement->whereClause, &table.get_column_names(), ranges);
+			}
+			catch (exception &e) {
+				delete ranges;
+				throw;
+			}
+			//Start base of plan at a TableScan (optimize picks an index for it, if one helps)
+			plan = new EvalPlan(new ValueDict(*whereCondition), ranges, table_scan(table));
 		}
-		catch (exception &e) {
-			throw;
+		else {
+			//Start base of plan at a TableScan (optimize may walk an index instead, for an ORDER BY)
+			plan = table_scan(table);
+		}
+
+		//Return just the aggregates, if there are any, and put the rows in order
+		auto name_of = [&table](const Expr *column_ref) {
+			Identifier column_name = column_ref->name;
+			const ColumnNames &columns = table.get_column_names();
+			if (find(columns.begin(), columns.end(), column_name) == columns.end())
+				throw SQLExecError("unknown column '" + column_name + "'");
+			return column_name;
+		};
+		if (aggregating(statement)) {
+			col_names->clear();
+			plan = aggregate_plan(statement, plan, col_names, name_of);
 		}
-		plan = new EvalPlan(whereCondition, plan); 
+		plan = order_plan(statement, plan, col_names, name_of);
 	}
 
 	//Wrap the whole thing in a ProjectAll or a Project
 	plan = new EvalPlan(col_names, plan);
 
-	//Optimize the plan and evaluate the optimized plan
+	//Stop early if there's a LIMIT (the plan streams, so rows past it are never read)
+	if (statement->limit != nullptr && (statement->limit->limit >= 0 || statement->limit->offset > 0)) {
+		size_t limit = statement->limit->limit >= 0 ? (size_t)statement->limit->limit : SIZE_MAX;
+		size_t offset = statement->limit->offset > 0 ? (size_t)statement->limit->offset : 0;
+		plan = new EvalPlan(limit, offset, plan);
+	}
+
+	//Optimize the plan and evaluate the optimized plan, straight into the sink
 	EvalPlan *optimized = plan->optimize();
-	ValueDicts* rows = optimized->evaluate();
+	size_t rows;
+	try {
+		rows = optimized->evaluate(sink, SQLExec::parallelism);
+	}
+	catch (...) {
+		delete optimized;
+		delete whereCondition;
+		delete col_names;
+		throw;
+	}
+	delete optimized;
 
 	//Handle memory
 	delete whereCondition; 
 
 	//If all goes well, display a successful message
-	string msg = "successfully returned " + to_string(rows->size()) + " rows";
+	string msg = "successfully returned " + to_string(rows) + " rows";
 	return new QueryResult(col_names, NULL, rows, msg);  
 }
 
@@ -560,16 +1069,13 @@ QueryResult *SQLExec::create_index(const CreateStatement *statement) {
 	Identifier indexType = statement->indexType;
 	row["index_type"] = indexType;
 
-	if (indexType == "BTREE")
-		row["is_unique"] = true;
-	else if (indexType == "HASH")
-		row["is_unique"] = false;
-	else
+	// the grammar has no UNIQUE, so no index is unique; a BTREE keeps a posting list per key
+	if (indexType != "BTREE" && indexType != "HASH")
 	{
 		indexType = "BTREE";
 		row["index_type"] = indexType;
-		row["is_unique"] = true;
 	}
+	row["is_unique"] = false;
 
 	// Insert a row for each column in index key into _indices.
 	// I recommend having a static reference to _indices in SQLExec, as we do for _tables.
@@ -631,7 +1137,8 @@ QueryResult *SQLExec::drop_table(const DropStatement *statement) {
 	} //from prompt
 
 	Identifier name = statement->name;
-	if (name == Tables::TABLE_NAME || name == Columns::TABLE_NAME || name == Indices::TABLE_NAME) {
+	if (name == Tables::TABLE_NAME || name == Columns::TABLE_NAME || name == Indices::TABLE_NAME
+		|| name == Statistics::TABLE_NAME) {
 		throw SQLExecError("Cannot drop the schema!");
 	}
 
@@ -687,22 +1194,22 @@ QueryResult *SQLExec::drop_index(const DropStatement *statement) {
 }
 
 //acts as a triage to call appropriate show statement
-QueryResult *SQLExec::show(const ShowStatement *statement) {
+QueryResult *SQLExec::show(const ShowStatement *statement, ResultSink &sink) {
 	switch (statement->type)
 	{
 	case ShowStatement::kTables:
-		return show_tables();
+		return show_tables(sink);
 	case ShowStatement::kColumns:
-		return show_columns(statement);
+		return show_columns(statement, sink);
 	case ShowStatement::kIndex:
-		return show_index(statement);
+		return show_index(statement, sink);
 	default:
 		throw SQLExecError("Can only show _tables or _columns");
 	}
 }
 
 //show index
-QueryResult *SQLExec::show_index(const ShowStatement *statement) {
+QueryResult *SQLExec::show_index(const ShowStatement *statement, ResultSink &sink) {
 	std::string message;
 	int length = 0;
 	ColumnNames* column_names = new ColumnNames;
@@ -723,22 +1230,24 @@ QueryResult *SQLExec::show_index(const ShowStatement *statement) {
 
 	Handles* handles = SQLExec::indices->select(&select_name);
 	length = handles->size();
-	ValueDicts* index_rows = new ValueDicts();
+	sink.begin(*column_names);
 	for (auto const& handle : *handles) {
 		ValueDict* row = SQLExec::indices->project(handle, column_names);
-		index_rows->push_back(row);
+		sink.push(*row);
+		delete row;
 	}
+	sink.end();
 	delete handles;
 
 	message += "Successfully returned ";
 	message += to_string(length);
 	message += " rows";
 
-	return new QueryResult(column_names, attributes, index_rows, message);
+	return new QueryResult(column_names, attributes, length, message);
 }
 
 //show tables
-QueryResult *SQLExec::show_tables() {
+QueryResult *SQLExec::show_tables(ResultSink &sink) {
 	std::string message;
 	int count = 0;
 
@@ -750,27 +1259,31 @@ QueryResult *SQLExec::show_tables() {
 
 	Handles* handles = SQLExec::tables->select();
 
-	ValueDicts* rows = new ValueDicts;
+	sink.begin(*names);
 	for (auto const& handle : *handles) {
 		ValueDict* row = SQLExec::tables->project(handle, names);
 
 		if (row->at("table_name").s != Tables::TABLE_NAME &&
 			row->at("table_name").s != Columns::TABLE_NAME &&
-			row->at("table_name").s != Indices::TABLE_NAME)
+			row->at("table_name").s != Indices::TABLE_NAME &&
+			row->at("table_name").s != Statistics::TABLE_NAME)
 		{
-			rows->push_back(row);
+			sink.push(*row);
 			count++;
 		}
+		delete row;
 	}
+	sink.end();
+	delete handles;
 
 	message += "Successfully returned ";
 	message += to_string(count);
 	message += " rows\n";
-	return new QueryResult(names, attributes, rows, message);
+	return new QueryResult(names, attributes, count, message);
 }
 
 //show columns
-QueryResult *SQLExec::show_columns(const ShowStatement *statement) {
+QueryResult *SQLExec::show_columns(const ShowStatement *statement, ResultSink &sink) {
 	std::string message;
 	int length = 0;
 
@@ -789,13 +1302,15 @@ QueryResult *SQLExec::show_columns(const ShowStatement *statement) {
 	Handles* handles = relation.select(&select_name);
 	length = handles->size();
 
-	ValueDicts* rows = new ValueDicts;
+	sink.begin(*names);
 	for (auto const& index : *handles) {
 		ValueDict* single_row = relation.project(index, names);
-		rows->push_back(single_row);
+		sink.push(*single_row);
+		delete single_row;
 	}
+	sink.end();
 	delete handles;
 
 	message = "Successfully returned " + to_string(length) + " rows";
-	return new QueryResult(names, attributes, rows, message);
+	return new QueryResult(names, attributes, length, message);
 }
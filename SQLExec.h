@@ -9,6 +9,8 @@
 #include <string>
 #include "SQLParser.h"
 #include "schema_tables.h"
+#include "EvalPlan.h"
+#include "copy.h"
 
 /**
  * @class SQLExecError - exception for SQLExec methods
@@ -20,30 +22,31 @@ public:
 
 
 /**
- * @class QueryResult - data structure to hold all the returned data for a query execution
+ * @class QueryResult - what a query execution says about itself: the result's columns, how many rows it
+ * had, and a message. The rows themselves went to the ResultSink the statement was executed with.
  */
 class QueryResult {
 public:
-    QueryResult() : column_names(nullptr), column_attributes(nullptr), rows(nullptr), message("") {}
+    QueryResult() : column_names(nullptr), column_attributes(nullptr), row_count(0), message("") {}
 
-    QueryResult(std::string message) : column_names(nullptr), column_attributes(nullptr), rows(nullptr),
+    QueryResult(std::string message) : column_names(nullptr), column_attributes(nullptr), row_count(0),
                                        message(message) {}
 
-    QueryResult(ColumnNames *column_names, ColumnAttributes *column_attributes, ValueDicts *rows, std::string message)
-            : column_names(column_names), column_attributes(column_attributes), rows(rows), message(message) {}
+    QueryResult(ColumnNames *column_names, ColumnAttributes *column_attributes, size_t row_count, std::string message)
+            : column_names(column_names), column_attributes(column_attributes), row_count(row_count), message(message) {}
 
     virtual ~QueryResult();
 
     ColumnNames *get_column_names() const { return column_names; }
     ColumnAttributes *get_column_attributes() const { return column_attributes; }
-    ValueDicts *get_rows() const { return rows; }
+    size_t get_row_count() const { return row_count; }
     const std::string &get_message() const { return message; }
-    friend std::ostream &operator<<(std::ostream &stream, const QueryResult &qres);
+    friend std::ostream &operator<<(std::ostream &stream, const QueryResult &qres);  // just the message
 
 protected:
     ColumnNames *column_names;
     ColumnAttributes *column_attributes;
-    ValueDicts *rows;
+    size_t row_count;
     std::string message;
 };
 
@@ -56,14 +59,61 @@ public:
 	/**
 	 * Execute the given SQL statement.
 	 * @param statement   the Hyrise AST of the SQL statement to execute
+	 * @param sink        where the rows of a SELECT or SHOW go as they are produced (nullptr to drop them)
 	 * @returns           the query result (freed by caller)
 	 */
-    static QueryResult *execute(const hsql::SQLStatement *statement) throw(SQLExecError);
+    static QueryResult *execute(const hsql::SQLStatement *statement, ResultSink *sink = nullptr) throw(SQLExecError);
+
+	/**
+	 * Set the session's degree of parallelism: how many threads a SELECT may scan a table with.
+	 * @param parallelism  1 (the default) to scan on the calling thread only; 0 is taken as 1
+	 */
+	static void set_parallelism(uint parallelism);
+	static uint get_parallelism() { return parallelism; }
+
+	/**
+	 * Execute: ANALYZE <table_name> (which the parser doesn't know): read the whole table and record
+	 * its row and page counts and each column's distinct count and histogram in _statistics.
+	 * @param table_name  table to analyze
+	 * @returns           the query result (freed by caller)
+	 */
+	static QueryResult *analyze(Identifier table_name) throw(SQLExecError);
+
+	/**
+	 * Execute: INSERT INTO <table_name> [( <columns> )] VALUES ( <row> ), ( <row> ), ...
+	 * The parser takes just one row per INSERT, so each row comes as its own statement; they all go in
+	 * together (or, if one can't, none do), and each index gets their entries in one sorted pass.
+	 * @param statements  single-row INSERT statements into the same table
+	 * @returns           the query result (freed by caller)
+	 */
+	static QueryResult *insert_many(const std::vector<const hsql::InsertStatement*> &statements) throw(SQLExecError);
+
+	/**
+	 * Execute: COPY <table_name> FROM '<path>' [CSV | BINARY] (which the parser doesn't know): append the rows
+	 * in a file to a table, then rebuild its indices. If any row can't go in, none do.
+	 * @param table_name  table to load
+	 * @param path        file to read
+	 * @param format      its format
+	 * @returns           the query result (freed by caller)
+	 */
+	static QueryResult *copy_from(Identifier table_name, std::string path, CopyFormat format) throw(SQLExecError);
+
+	/**
+	 * Execute: COPY <table_name> TO '<path>' [CSV | BINARY]: write every row of a table to a file.
+	 * @param table_name  table to write
+	 * @param path        file to write (replaced if it exists)
+	 * @param format      format to write it in
+	 * @returns           the query result (freed by caller)
+	 */
+	static QueryResult *copy_to(Identifier table_name, std::string path, CopyFormat format) throw(SQLExecError);
 
 protected:
 	// the one place in the system that holds the _tables table and _indices table
     static Tables *tables;
 	static Indices *indices;
+	static uint parallelism;
+
+	static void open_schema_tables();
 
 	// recursive decent into the AST
     static QueryResult *create(const hsql::CreateStatement *statement);
@@ -74,15 +124,19 @@ protected:
     static QueryResult *drop_table(const hsql::DropStatement *statement);
     static QueryResult *drop_index(const hsql::DropStatement *statement);
 
-    static QueryResult *show(const hsql::ShowStatement *statement);
-    static QueryResult *show_tables();
-    static QueryResult *show_columns(const hsql::ShowStatement *statement);
-    static QueryResult *show_index(const hsql::ShowStatement *statement);
-
-	static QueryResult *insert(const hsql::InsertStatement *statement);
-	static QueryResult *del(const hsql::DeleteStatement *statement);
-	static QueryResult *select(const hsql::SelectStatement *statement);
-	static ValueDict *get_where_conjunction(const hsql::Expr *expr, const ColumnNames *col_names);
+    static QueryResult *show(const hsql::ShowStatement *statement, ResultSink &sink);
+    static QueryResult *show_tables(ResultSink &sink);
+    static QueryResult *show_columns(const hsql::ShowStatement *statement, ResultSink &sink);
+    static QueryResult *show_index(const hsql::ShowStatement *statement, ResultSink &sink);
+
+	static QueryResult *insert(const hsql::InsertStatement *statement);
+	static QueryResult *insert_rows(const std::vector<const hsql::InsertStatement*> &statements);
+	static QueryResult *del(const hsql::DeleteStatement *statement);
+	static QueryResult *select(const hsql::SelectStatement *statement, ResultSink &sink);
+	static ValueDict *get_where_conjunction(const hsql::Expr *expr, const ColumnNames *col_names,
+		ValueRanges *ranges = nullptr);
+	static EvalPlan *table_scan(DbRelation &table);
+	static EvalPlan *join_plan(const hsql::SelectStatement *statement, ColumnNames *col_names);
 
 	/**
 	 * Pull out column name and attributes from AST's column definition clause
@@ -0,0 +1,411 @@
+/**
+ * @file aggregate.cpp - implementation of:
+ * HashAggregateCursor
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#include <functional>
+#include <limits>
+#include "aggregate.h"
+using namespace std;
+
+// Narrow a count, sum, or average for output.
+static int32_t to_int(int64_t n) {
+	if (n < numeric_limits<int32_t>::min() || n > numeric_limits<int32_t>::max())
+		throw DbRelationError("aggregate result out of range for INT");
+	return (int32_t) n;
+}
+
+static bool is_extreme(const Aggregate &aggregate) {
+	return aggregate.function == Aggregate::MIN || aggregate.function == Aggregate::MAX;
+}
+
+HashAggregateCursor::HashAggregateCursor(BatchCursor *input, const ColumnNames &group_by, const Aggregates &aggregates,
+		bool partial_input, bool partial_output, size_t memory_budget)
+		: input(input), group_by(group_by), aggregates(aggregates), partial_input(partial_input),
+		  partial_output(partial_output), memory_budget(memory_budget), input_done(false), typed(false),
+		  emitting(false), slots(INITIAL_SLOTS, 0), hashes(), keys(), group_columns(), value_types(),
+		  counts(aggregates.size()), values(aggregates.size()), texts(aggregates.size()), group_bytes(0),
+		  emitted(0), partitions(), partition(0) {
+}
+
+// Release the input and throw away any partitions.
+HashAggregateCursor::~HashAggregateCursor() {
+	delete this->input;
+	for (HeapTable *partition: this->partitions) {
+		if (partition != nullptr) {
+			partition->drop();
+			delete partition;
+		}
+	}
+}
+
+ColumnNames HashAggregateCursor::partial_columns(const ColumnNames &group_by, const Aggregates &aggregates) {
+	ColumnNames ret(group_by);
+	for (auto const &aggregate: aggregates) {
+		ret.push_back(aggregate.name + "#count");
+		ret.push_back(aggregate.name + "#value");
+		ret.push_back(aggregate.name + "#high");
+	}
+	return ret;
+}
+
+// Next batch of groups. The first call reads all of the input (unless we're emitting partial
+// results early); if that spilled, each later one that runs out of groups merges another partition.
+bool HashAggregateCursor::next(RowBatch &batch) {
+	while (true) {
+		if (this->emitting) {
+			if (this->emitted < group_count()) {
+				output(batch, this->partial_output);
+				return true;
+			}
+			this->emitting = false;
+			clear_groups();
+		}
+
+		if (!this->input_done) {
+			RowBatch rows;
+			while (!this->emitting) {
+				if (!this->input->next(rows)) {
+					this->input_done = true;
+					break;
+				}
+				add_batch(rows, this->partial_input);
+				if (this->group_bytes > this->memory_budget) {
+					if (this->partial_output)
+						this->emitting = true;  // whoever merges our output will combine these with later ones
+					else
+						spill_groups();
+				}
+			}
+			if (this->input_done) {
+				if (spilled()) {
+					spill_groups();
+				} else {
+					if (group_count() == 0 && this->group_by.empty() && !this->partial_output)
+						find_group(rows, 0, vector<uint>());  // aggregates of no rows at all
+					this->emitting = true;
+				}
+			}
+			continue;
+		}
+
+		// merge the next spilled partition
+		while (this->partition < this->partitions.size() && this->partitions[this->partition] == nullptr)
+			this->partition++;
+		if (this->partition == this->partitions.size())
+			return false;
+		HeapTable *partition = this->partitions[this->partition];
+		ColumnNames column_names = partial_columns(this->group_by, this->aggregates);
+		BatchCursor *states = partition->batch_cursor(&column_names);
+		RowBatch rows;
+		while (states->next(rows))
+			add_batch(rows, true);  // a partition is assumed to fit
+		delete states;
+		partition->drop();
+		delete partition;
+		this->partitions[this->partition++] = nullptr;
+		this->emitting = true;
+	}
+}
+
+// Fold the selected rows of a batch into their groups. If merging, the batch is in partial_columns form.
+void HashAggregateCursor::add_batch(RowBatch &batch, bool merging) {
+	if (!this->typed)
+		set_types(batch, merging);
+	vector<uint> group_positions;
+	for (auto const &column_name: this->group_by)
+		group_positions.push_back((uint) batch.column_index(column_name));
+	vector<int> positions;  // per aggregate: its column (-1 for COUNT(*)), or if merging, its count column
+	for (auto const &aggregate: this->aggregates) {
+		if (merging)
+			positions.push_back(batch.column_index(aggregate.name + "#count"));
+		else
+			positions.push_back(aggregate.column.empty() ? -1 : batch.column_index(aggregate.column));
+	}
+
+	for (uint row = 0; row < batch.size(); row++) {
+		if (!batch.is_selected(row))
+			continue;
+		uint group = find_group(batch, row, group_positions);
+		for (uint i = 0; i < this->aggregates.size(); i++) {
+			const Aggregate &aggregate = this->aggregates[i];
+			int64_t count = 1;
+			const ColumnVector *column = positions[i] < 0 ? nullptr : &batch.column(positions[i]);
+			if (merging) {
+				count = column->ints[row];
+				if (count == 0)
+					continue;
+				column = &batch.column(positions[i] + 1);
+			}
+			if (aggregate.function == Aggregate::SUM || aggregate.function == Aggregate::AVG) {
+				int64_t value = column->ints[row];
+				if (merging)
+					value = ((int64_t) batch.column(positions[i] + 2).ints[row] << 32) | (uint32_t) value;
+				this->values[i][group] += value;
+			} else if (is_extreme(aggregate) && this->value_types[i] == ColumnAttribute::DataType::TEXT) {
+				string value = column->bytes.substr(column->offsets[row], column->offsets[row + 1] - column->offsets[row]);
+				string &extreme = this->texts[i][group];
+				if (this->counts[i][group] == 0 || (aggregate.function == Aggregate::MIN ? value < extreme : extreme < value)) {
+					if (value.size() > extreme.size())
+						this->group_bytes += value.size() - extreme.size();
+					extreme.swap(value);
+				}
+			} else if (is_extreme(aggregate)) {
+				int64_t value = column->ints[row];
+				int64_t &extreme = this->values[i][group];
+				if (this->counts[i][group] == 0 || (aggregate.function == Aggregate::MIN ? value < extreme : extreme < value))
+					extreme = value;
+			}
+			this->counts[i][group] += count;
+		}
+	}
+}
+
+// The group for a row, adding it if it's new. The hash table is open addressing with linear probing,
+// kept no more than 70% full.
+uint HashAggregateCursor::find_group(RowBatch &batch, uint row, const vector<uint> &group_positions) {
+	string key;
+	for (uint position: group_positions)
+		batch.column(position).append_key(key, row);
+	size_t hash = std::hash<string>()(key);
+	size_t mask = this->slots.size() - 1;
+	size_t slot = hash & mask;
+	for (; this->slots[slot] != 0; slot = (slot + 1) & mask) {
+		uint group = this->slots[slot] - 1;
+		if (this->hashes[group] == hash && this->keys[group] == key)
+			return group;
+	}
+
+	uint group = group_count();
+	this->slots[slot] = group + 1;
+	this->hashes.push_back(hash);
+	this->group_bytes += 2 * key.size() + 64 + this->aggregates.size() * 2 * sizeof(int64_t);
+	this->keys.push_back(key);
+	for (uint i = 0; i < group_positions.size(); i++)
+		this->group_columns[i].push(batch.column(group_positions[i]), row);
+	for (uint i = 0; i < this->aggregates.size(); i++) {
+		this->counts[i].push_back(0);
+		this->values[i].push_back(0);
+		if (this->typed && this->value_types[i] == ColumnAttribute::DataType::TEXT)
+			this->texts[i].push_back(string());
+	}
+	if ((size_t) group_count() * 10 > this->slots.size() * 7)
+		grow();
+	return group;
+}
+
+// Double the hash table.
+void HashAggregateCursor::grow() {
+	this->slots.assign(this->slots.size() * 2, 0);
+	size_t mask = this->slots.size() - 1;
+	for (uint group = 0; group < group_count(); group++) {
+		size_t slot = this->hashes[group] & mask;
+		while (this->slots[slot] != 0)
+			slot = (slot + 1) & mask;
+		this->slots[slot] = group + 1;
+	}
+}
+
+void HashAggregateCursor::clear_groups() {
+	this->slots.assign(INITIAL_SLOTS, 0);
+	this->hashes.clear();
+	this->keys.clear();
+	for (auto &column: this->group_columns)
+		column.clear();
+	for (uint i = 0; i < this->aggregates.size(); i++) {
+		this->counts[i].clear();
+		this->values[i].clear();
+		this->texts[i].clear();
+	}
+	this->group_bytes = 0;
+	this->emitted = 0;
+}
+
+// Too many groups: move the states of the ones we have out to the partitions for their keys.
+void HashAggregateCursor::spill_groups() {
+	static uint serial = 0;
+	if (this->partitions.empty()) {
+		this->partitions.assign(SPILL_PARTITIONS, nullptr);
+		serial++;
+	}
+	ColumnNames column_names = partial_columns(this->group_by, this->aggregates);
+	ColumnAttributes column_attributes = output_attributes(true);
+	RowBatch batch;
+	while (this->emitted < group_count()) {
+		uint first = this->emitted;
+		output(batch, true);
+		for (uint row = 0; row < batch.size(); row++) {
+			uint which = (uint) (this->hashes[first + row] % SPILL_PARTITIONS);
+			if (this->partitions[which] == nullptr) {
+				this->partitions[which] = new HeapTable("_hash_aggregate_" + to_string(serial) + "_" + to_string(which),
+						column_names, column_attributes);
+				this->partitions[which]->create();
+			}
+			ValueDict *state = batch.row(row);
+			this->partitions[which]->insert(state);
+			delete state;
+		}
+	}
+	clear_groups();
+}
+
+// Learn the group-by columns' types, and the types of the columns the aggregates are applied to.
+void HashAggregateCursor::set_types(RowBatch &batch, bool merging) {
+	this->typed = true;
+	for (auto const &column_name: this->group_by)
+		this->group_columns.push_back(ColumnVector(batch.column(batch.column_index(column_name)).data_type));
+	for (auto const &aggregate: this->aggregates) {
+		ColumnAttribute::DataType data_type = ColumnAttribute::DataType::INT;
+		if (merging && is_extreme(aggregate))
+			data_type = batch.column(batch.column_index(aggregate.name + "#value")).data_type;
+		else if (!merging && !aggregate.column.empty())
+			data_type = batch.column(batch.column_index(aggregate.column)).data_type;
+		if (data_type == ColumnAttribute::DataType::TEXT
+				&& (aggregate.function == Aggregate::SUM || aggregate.function == Aggregate::AVG))
+			throw DbRelationError("cannot add up TEXT column '" + aggregate.column + "'");
+		this->value_types.push_back(data_type);
+	}
+}
+
+// Types of the output columns (or of partial_columns).
+ColumnAttributes HashAggregateCursor::output_attributes(bool partial) const {
+	ColumnAttributes ret;
+	for (auto const &column: this->group_columns)
+		ret.push_back(ColumnAttribute(column.data_type));
+	for (uint i = 0; i < this->aggregates.size(); i++) {
+		ColumnAttribute::DataType data_type = ColumnAttribute::DataType::INT;
+		if (this->typed && is_extreme(this->aggregates[i]))
+			data_type = this->value_types[i];
+		if (partial)
+			ret.push_back(ColumnAttribute(ColumnAttribute::DataType::INT));
+		ret.push_back(ColumnAttribute(data_type));
+		if (partial)
+			ret.push_back(ColumnAttribute(ColumnAttribute::DataType::INT));
+	}
+	return ret;
+}
+
+// Fill batch with the next groups, as results or (if partial) as states.
+void HashAggregateCursor::output(RowBatch &batch, bool partial) {
+	ColumnNames column_names(this->group_by);
+	for (auto const &aggregate: this->aggregates)
+		column_names.push_back(aggregate.name);
+	batch.reset(partial ? partial_columns(this->group_by, this->aggregates) : column_names, output_attributes(partial));
+	while (!batch.full() && this->emitted < group_count()) {
+		uint group = this->emitted++;
+		uint column = 0;
+		for (auto const &group_column: this->group_columns)
+			batch.column(column++).push(group_column, group);
+		for (uint i = 0; i < this->aggregates.size(); i++) {
+			int64_t count = this->counts[i][group], value = this->values[i][group];
+			bool text = this->typed && this->value_types[i] == ColumnAttribute::DataType::TEXT;
+			if (partial) {
+				batch.column(column++).push_int(to_int(count));
+				if (text)
+					batch.column(column++).push_text(this->texts[i][group].data(), (uint) this->texts[i][group].size());
+				else
+					batch.column(column++).push_int((int32_t) (uint32_t) value);
+				batch.column(column++).push_int((int32_t) (value >> 32));
+				continue;
+			}
+			switch (this->aggregates[i].function) {
+				case Aggregate::COUNT:
+					batch.column(column++).push_int(to_int(count));
+					break;
+				case Aggregate::SUM:
+					batch.column(column++).push_int(to_int(value));
+					break;
+				case Aggregate::AVG:
+					batch.column(column++).push_int(to_int(count == 0 ? 0 : value / count));
+					break;
+				default:
+					if (text)
+						batch.column(column++).push_text(this->texts[i][group].data(), (uint) this->texts[i][group].size());
+					else
+						batch.column(column++).push_int((int32_t) value);
+			}
+		}
+		batch.add_row(Handle());
+	}
+}
+
+// test function -- returns true if all tests pass
+bool test_aggregate() {
+	ColumnNames column_names;
+	column_names.push_back("id");
+	column_names.push_back("grp");
+	column_names.push_back("name");
+	ColumnAttributes column_attributes;
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+	HeapTable table("_test_aggregate", column_names, column_attributes);
+	table.create();
+	ValueDict row;
+	const int ROWS = 6000, GROUPS = 7;
+	for (int i = 0; i < ROWS; i++) {
+		row["id"] = Value(i);
+		row["grp"] = Value(i % GROUPS);
+		row["name"] = Value("n" + to_string(i));
+		table.insert(&row);
+	}
+
+	Aggregates aggregates;
+	aggregates.push_back(Aggregate(Aggregate::COUNT, "", "n"));
+	aggregates.push_back(Aggregate(Aggregate::SUM, "id", "sum"));
+	aggregates.push_back(Aggregate(Aggregate::MIN, "name", "min"));
+	aggregates.push_back(Aggregate(Aggregate::MAX, "id", "max"));
+	aggregates.push_back(Aggregate(Aggregate::AVG, "id", "avg"));
+	ColumnNames group_by(1, "grp");
+	BatchStep partial = [&group_by, &aggregates](BatchCursor *scan) -> BatchCursor* {
+		return new HashAggregateCursor(scan, group_by, aggregates, false, true, 4096);
+	};
+
+	// each group g has the ids g, g + 7, ..., so its count, sum, max, and (text) min are easy to work out
+	bool ok = true;
+	for (int how = 0; how < 3; how++) {  // in one go; spilling; pre-aggregated on four threads
+		HashAggregateCursor *aggregate;
+		if (how == 2)
+			aggregate = new HashAggregateCursor(table.batch_cursor(nullptr, nullptr, nullptr, 4, false, &partial),
+					group_by, aggregates, true, false);
+		else
+			aggregate = new HashAggregateCursor(table.batch_cursor(), group_by, aggregates, false, false,
+					how == 1 ? 256 : HashAggregateCursor::DEFAULT_MEMORY_BUDGET);
+		RowBatch batch;
+		int groups = 0;
+		while (aggregate->next(batch)) {
+			if (batch.get_column_names() != ColumnNames({"grp", "n", "sum", "min", "max", "avg"}))
+				return false;
+			for (uint i = 0; i < batch.size(); i++) {
+				int g = batch.column(0).ints[i];
+				int n = (ROWS - g + GROUPS - 1) / GROUPS;
+				int max = g + (n - 1) * GROUPS;
+				long sum = (long) n * (g + max) / 2;
+				string min = "n" + to_string(g);
+				for (int id = g; id < ROWS; id += GROUPS)
+					if ("n" + to_string(id) < min)
+						min = "n" + to_string(id);
+				if (batch.column(1).ints[i] != n || batch.column(2).ints[i] != sum || batch.column(3).value(i).s != min
+						|| batch.column(4).ints[i] != max || batch.column(5).ints[i] != sum / n)
+					ok = false;
+				groups++;
+			}
+		}
+		if (groups != GROUPS || aggregate->spilled() != (how == 1))
+			ok = false;
+		delete aggregate;
+	}
+	cout << "group by " << (ok ? "ok" : "failed") << endl;
+
+	// no group-by columns: one row, even with no input
+	ValueDict where;
+	where["grp"] = Value(GROUPS);
+	HashAggregateCursor none(table.batch_cursor(nullptr, &where), ColumnNames(), aggregates, false, false);
+	RowBatch batch;
+	bool none_ok = none.next(batch) && batch.size() == 1 && batch.column(0).ints[0] == 0 && !none.next(batch);
+	cout << "aggregate of nothing " << (none_ok ? "ok" : "failed") << endl;
+
+	table.drop();
+	return ok && none_ok;
+}
@@ -0,0 +1,125 @@
+/**
+ * @file aggregate.h - Grouping and aggregate functions over a stream of RowBatches.
+ * Aggregate
+ * HashAggregateCursor
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include "row_batch.h"
+#include "heap_storage.h"
+
+/**
+ * @class Aggregate - one aggregate function of a SELECT list, e.g., SUM(amount)
+ *
+ * There are no NULLs, so COUNT(column) is the same as COUNT(*), and over no rows at all SUM, MIN,
+ * MAX, and AVG are 0 (or "" for the MIN or MAX of a TEXT column). AVG is an INT, rounded toward zero.
+ */
+class Aggregate {
+public:
+	enum Function {
+		COUNT,
+		SUM,
+		MIN,
+		MAX,
+		AVG
+	};
+
+	Aggregate(Function function, const Identifier &column, const Identifier &name)
+			: function(function), column(column), name(name) {}
+
+	Function function;
+	Identifier column;  // what it's applied to (empty for COUNT(*))
+	Identifier name;    // what its result column is called
+};
+typedef std::vector<Aggregate> Aggregates;
+
+/**
+ * @class HashAggregateCursor - BatchCursor over the groups of a BatchCursor's rows, with their aggregates
+ *
+ * Groups are found in an open-addressing (linear probing) hash table on their marshaled group-by
+ * values. Output columns are the group-by columns followed by the aggregates' names, a group per
+ * row, in the order the groups were first seen. With no group-by columns there is exactly one group.
+ *
+ * Aggregation can be split in two: cursors with partial output (one per scan thread, say) emit just
+ * the running state of each of their groups (a count and a sum or extreme per aggregate; see
+ * partial_columns), and a cursor with partial input merges those. A partial cursor that goes over its
+ * memory_budget emits what it has and starts over. Any other one spills its groups' states to
+ * SPILL_PARTITIONS temporary HeapTables, split on the hash of their keys, and merges the partitions
+ * one at a time once its input is used up.
+ */
+class HashAggregateCursor : public BatchCursor {
+public:
+	static const size_t DEFAULT_MEMORY_BUDGET = 16 * 1024 * 1024;
+	static const size_t PARTIAL_MEMORY_BUDGET = 1024 * 1024;
+	static const uint SPILL_PARTITIONS = 16;
+
+	/**
+	 * @param input           rows to aggregate (owned by the cursor)
+	 * @param group_by        columns to group on
+	 * @param aggregates      what to compute for each group
+	 * @param partial_input   the input is the partial output of cursors with the same group_by and aggregates
+	 * @param partial_output  emit each group's running state instead of its aggregates
+	 * @param memory_budget   bytes the groups may use before being emitted (partial output) or spilled
+	 */
+	HashAggregateCursor(BatchCursor *input, const ColumnNames &group_by, const Aggregates &aggregates,
+			bool partial_input, bool partial_output, size_t memory_budget = DEFAULT_MEMORY_BUDGET);
+	virtual ~HashAggregateCursor();
+
+	virtual bool next(RowBatch &batch);
+
+	bool spilled() const { return !this->partitions.empty(); }
+
+	/**
+	 * The columns of partial output: the group-by columns, then each aggregate's count, value, and
+	 * (for the 64-bit sums of INTs) the value's high 32 bits.
+	 * @param group_by    columns grouped on
+	 * @param aggregates  aggregates computed
+	 * @returns           the column names
+	 */
+	static ColumnNames partial_columns(const ColumnNames &group_by, const Aggregates &aggregates);
+
+protected:
+	static const uint INITIAL_SLOTS = 1024;
+
+	BatchCursor *input;
+	ColumnNames group_by;
+	Aggregates aggregates;
+	bool partial_input;
+	bool partial_output;
+	size_t memory_budget;
+	bool input_done;
+	bool typed;     // we've seen a batch of input, so we know the types of the columns
+	bool emitting;  // the groups in memory are complete and being output
+
+	// the groups in memory
+	std::vector<uint32_t> slots;    // the hash table: a group's number plus one, or 0 for an empty slot
+	std::vector<size_t> hashes;     // per group: the hash of its key
+	std::vector<std::string> keys;  // per group: its marshaled group-by values
+	std::vector<ColumnVector> group_columns;  // per group-by column: its value for each group
+	std::vector<ColumnAttribute::DataType> value_types;  // per aggregate: type of the column it's applied to
+	std::vector<std::vector<int64_t>> counts;     // per aggregate, per group: rows seen
+	std::vector<std::vector<int64_t>> values;     // per aggregate, per group: sum, or extreme of an INT column
+	std::vector<std::vector<std::string>> texts;  // per aggregate, per group: extreme of a TEXT column
+	size_t group_bytes;
+	uint emitted;  // groups output so far
+
+	// spilled groups' states, in partial_columns form
+	std::vector<HeapTable*> partitions;
+	uint partition;  // next one to merge
+
+	uint group_count() const { return (uint) this->keys.size(); }
+	void add_batch(RowBatch &batch, bool merging);
+	uint find_group(RowBatch &batch, uint row, const std::vector<uint> &group_positions);
+	void grow();
+	void clear_groups();
+	void spill_groups();
+	void set_types(RowBatch &batch, bool merging);
+	ColumnAttributes output_attributes(bool partial) const;
+	void output(RowBatch &batch, bool partial);
+};
+
+bool test_aggregate();
@@ -5,13 +5,15 @@
 * @see "Seattle University, CPSC5300, Summer 2018"
 */
 #include "btree.h"
+#include <algorithm>
 #include <string>
 #include <map>
+#include <queue>
 using namespace std;
 
 /**The B+ Tree index.
-Only unique indices are supported.Try adding the primary key value to the index key to make it unique,
-if necessary. Only insertion and lookup for the moment.
+Each key is stored once, with a posting list of the handles of every row that has it. A unique index
+rejects a second handle for a key. Supports insertion, deletion, lookup, and range scans.
 */
 BTreeIndex::BTreeIndex(DbRelation& relation, Identifier name, ColumnNames key_columns, bool unique)
         : DbIndex(relation, name, key_columns, unique),
@@ -19,9 +21,9 @@ BTreeIndex::BTreeIndex(DbRelation& relation, Identifier name, ColumnNames key_co
           stat(nullptr),
           root(nullptr),
           file(relation.get_table_name() + "-" + name),
-          key_profile() {
-    if (!unique)
-        throw DbRelationError("BTree index must have unique key");
+          key_profile(),
+          fill_percent(DEFAULT_FILL_PERCENT),
+          run_entries(DEFAULT_RUN_ENTRIES) {
 	build_key_profile();
 }
 
@@ -37,6 +39,7 @@ void BTreeIndex::build_key_profile() {
 
 /**Free up stuff*/
 BTreeIndex::~BTreeIndex() {
+	BTreeNodeCache::instance().invalidate(&this->file);
 	delete this->stat;
 	delete this->root;
 	this->stat = nullptr;
@@ -44,21 +47,130 @@ BTreeIndex::~BTreeIndex() {
 	
 }
 
-/**Create the index.*/
+/**Create the index by bulk loading: sort every (key, handle) in the relation, spilling sorted
+runs of run_entries keys to temporary tables if need be, then pack the tree bottom-up.*/
 void BTreeIndex::create() {
 	this->file.create();
-	this->stat =  new BTreeStat(file, STAT, STAT + 1, key_profile);
-	this->root = new BTreeLeaf(file, stat->get_root_id(), key_profile, true);
+	BTreeBulkLoad loader(this->file, this->key_profile, this->fill_percent, this->unique);
+
+	KeyHandles entries;
+	vector<HeapTable*> runs;
+	RowCursor *rows = relation.cursor();
+	Handle handle;
+	while (rows->next(handle)) {
+		ValueDict *row = relation.project(handle, &this->key_columns);
+		KeyValue *key = tkey(row);
+		entries.push_back(KeyHandle(*key, handle));
+		delete key;
+		delete row;
+		if (entries.size() >= this->run_entries)
+			runs.push_back(spill_run(entries, runs.size()));
+	}
+	delete rows;
+
+	if (runs.empty()) {
+		sort(entries.begin(), entries.end());
+		for (auto const &entry : entries)
+			loader.add(entry.first, entry.second);
+	} else {
+		if (!entries.empty())
+			runs.push_back(spill_run(entries, runs.size()));
+		merge_runs(runs, loader);
+	}
+
+	BlockID root_id;
+	uint height;
+	loader.finish(root_id, height);
+	this->stat = new BTreeStat(file, STAT, root_id, key_profile);
+	this->stat->set_height(height);
+	this->stat->save();
+	if (height == 1)
+		this->root = new BTreeLeaf(file, root_id, key_profile, false);
+	else
+		this->root = new BTreeInterior(file, root_id, key_profile, false);
 	this->closed = false;
+}
+
+/**Sort entries and write them out as a temporary table (key columns plus the handle). Empties entries.*/
+HeapTable *BTreeIndex::spill_run(KeyHandles &entries, uint run_number) {
+	sort(entries.begin(), entries.end());
+	ColumnNames column_names = this->key_columns;
+	column_names.push_back("_block");
+	column_names.push_back("_record");
+	ColumnAttributes *column_attributes = relation.get_column_attributes(this->key_columns);
+	column_attributes->push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes->push_back(ColumnAttribute(ColumnAttribute::INT));
+	HeapTable *run = new HeapTable(relation.get_table_name() + "-" + this->name + "-run" + to_string(run_number),
+			column_names, *column_attributes);
+	delete column_attributes;
+
+	run->create();
+	for (auto const &entry : entries) {
+		ValueDict row;
+		for (uint i = 0; i < this->key_columns.size(); i++)
+			row[this->key_columns[i]] = entry.first[i];
+		row["_block"] = Value((int)entry.second.first);
+		row["_record"] = Value((int)entry.second.second);
+		run->insert(&row);
+	}
+	entries.clear();
+	entries.shrink_to_fit();
+	return run;
+}
+
+/**One sorted run being merged: its cursor and current (key, handle)*/
+struct MergeRun {
+	HeapTable *table;
+	RowCursor *rows;
+	KeyHandle current;
+};
+
+/**K-way merge of the sorted runs into loader. Drops the runs.*/
+void BTreeIndex::merge_runs(vector<HeapTable*> &runs, BTreeBulkLoad &loader) {
+	vector<MergeRun> merging;
+	for (HeapTable *run : runs)
+		merging.push_back(MergeRun{run, run->cursor(), KeyHandle()});
+
+	// advance one run to its next entry; false when it's exhausted
+	auto advance = [this](MergeRun &run) {
+		Handle handle;
+		if (!run.rows->next(handle))
+			return false;
+		ValueDict *row = run.table->project(handle);
+		run.current.first.clear();
+		for (Identifier &column : this->key_columns)
+			run.current.first.push_back(row->at(column));
+		run.current.second = Handle((BlockID)row->at("_block").n, (RecordID)row->at("_record").n);
+		delete row;
+		return true;
+	};
+	auto later = [&merging](uint a, uint b) {
+		return merging[b].current < merging[a].current;
+	};
+	priority_queue<uint, vector<uint>, decltype(later)> heads(later);
+	for (uint i = 0; i < merging.size(); i++)
+		if (advance(merging[i]))
+			heads.push(i);
 
-	//Build the index- add every row from relation into index
-	for (auto const handle : *relation.select()) {
-		insert(handle);
+	while (!heads.empty()) {
+		uint i = heads.top();
+		heads.pop();
+		loader.add(merging[i].current.first, merging[i].current.second);
+		if (advance(merging[i]))
+			heads.push(i);
 	}
+
+	for (MergeRun &run : merging) {
+		delete run.rows;
+		run.table->drop();
+		delete run.table;
+	}
+	runs.clear();
 }
 
 /**Drop the index.*/
 void BTreeIndex::drop() {
+	BTreeNodeCache::instance().invalidate(&this->file);
 	file.drop();
 }
 
@@ -80,46 +192,134 @@ void BTreeIndex::open() {
 
 /**Closes the index. Disables: lookup, range, insert, delete, update.*/
 void BTreeIndex::close() {
-	file.close();
+	BTreeNodeCache::instance().invalidate(&this->file);
+	delete this->stat;
+	delete this->root;
 	this->stat = nullptr;
 	this->root = nullptr;
+	file.close();
 	this->closed = true;
 }
 
 /** Find all the rows whose columns are equal to key. Assumes key is a dictionary whose keys are the column
- names in the index. Returns a list of row handles.*/
+ names in the index. Returns a list of row handles, sorted by block.*/
 Handles* BTreeIndex::lookup(ValueDict* key_dict) const {
-	return _lookup(root, stat->get_height(), tkey(key_dict));
+	KeyValue* key = tkey(key_dict);
+	BTreeLeaf* leaf;
+	if (this->stat->get_height() == 1)
+		leaf = (BTreeLeaf*)this->root;
+	else
+		leaf = new BTreeLeaf(this->file, _find_leaf(key), this->key_profile, false);
+	Handles* handles = leaf->find_eq(key);
+	if (leaf != this->root)
+		delete leaf;
+	delete key;
+	return handles;
 }
 
-/**Recursive lookup*/
-Handles* BTreeIndex::_lookup(BTreeNode *node, uint height, const KeyValue* key) const {
-	Handles* handles = new Handles;
-	if (height == 1) {
-		BTreeLeaf *leaf_node = (BTreeLeaf*)node;
-		try{
-			Handle handle = leaf_node->find_eq(key);
-			handles->push_back(handle);
+/**Lookup many keys, in key order rather than the order given, so that each leaf is read once for all the keys
+ that fall in it. A key past the end of the current leaf tries the next leaf before descending from the root again.*/
+void BTreeIndex::lookup_many(const ValueDicts& key_dicts, std::vector<Handles*>& results) const {
+	KeyValues keys;
+	for (ValueDict* key_dict : key_dicts)
+		keys.push_back(tkey(key_dict));
+	std::vector<uint> order(keys.size());
+	for (uint i = 0; i < order.size(); i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&keys](uint a, uint b) { return *keys[a] < *keys[b]; });
+
+	results.assign(keys.size(), nullptr);
+	bool one_leaf = this->stat->get_height() == 1;
+	BTreeLeaf* leaf = one_leaf ? (BTreeLeaf*)this->root : nullptr;
+	for (uint i = 0; i < order.size(); i++) {
+		const KeyValue* key = keys[order[i]];
+		if (i > 0 && *key == *keys[order[i - 1]]) {
+			results[order[i]] = new Handles(*results[order[i - 1]]);
+			continue;
 		}
-		//To handle null result from lookup
-		catch (std::out_of_range) {}
-		return handles;	
-	}
-	else {
-		BTreeInterior *interior_node = (BTreeInterior*)node;
-		return _lookup(interior_node->find(key, height),
-			height - 1, key);
+		if (!one_leaf && leaf != nullptr && leaf->size() > 0 && leaf->compare(leaf->size() - 1, *key) < 0
+				&& leaf->get_next_leaf() != 0) {
+			BTreeLeaf* next = new BTreeLeaf(this->file, leaf->get_next_leaf(), this->key_profile, false);
+			delete leaf;
+			leaf = next;  // if key isn't past this one too, it's here or nowhere
+		}
+		if (!one_leaf && (leaf == nullptr || leaf->size() == 0 || leaf->compare(0, *key) > 0
+				|| leaf->compare(leaf->size() - 1, *key) < 0)) {
+			delete leaf;
+			leaf = new BTreeLeaf(this->file, _find_leaf(key), this->key_profile, false);
+		}
+		results[order[i]] = leaf->find_eq(key);
 	}
+	if (!one_leaf)
+		delete leaf;
+	for (KeyValue* key : keys)
+		delete key;
 }
 
+/**Find all the rows whose keys are between min_key and max_key (inclusive). Returns a list of row handles.*/
 Handles* BTreeIndex::range(ValueDict* min_key, ValueDict* max_key) const {
-    throw DbRelationError("Don't know how to do a range query on Btree index yet");
-    // FIXME: Not in scope of M6
+	Handles* handles = new Handles;
+	RowCursor* rows = range_cursor(min_key, true, max_key, true);
+	Handle handle;
+	while (rows->next(handle))
+		handles->push_back(handle);
+	delete rows;
+	return handles;
+}
+
+/**Descend once to the leaf where min_key would be and stream along the leaf chain from there.
+Either bound may be nullptr, and may name just the leading key columns.*/
+RowCursor* BTreeIndex::range_cursor(const ValueDict* min_key, bool min_inclusive,
+		const ValueDict* max_key, bool max_inclusive) const {
+	KeyValue* min = min_key == nullptr ? nullptr : tkey_prefix(min_key);
+	KeyValue* max = max_key == nullptr ? nullptr : tkey_prefix(max_key);
+	return new BTreeRangeCursor(this->file, this->key_profile, _find_leaf(min), min, min_inclusive, max, max_inclusive);
+}
+
+/**Block id of the leaf where key belongs (leftmost leaf for a null key).
+Interior nodes below the root come decoded from the node cache.*/
+BlockID BTreeIndex::_find_leaf(const KeyValue* key) const {
+	uint height = this->stat->get_height();
+	if (height == 1)
+		return this->root->get_id();
+	BlockID down = ((BTreeInterior*)this->root)->find_child(key);
+	for (; height > 2; height--)
+		down = BTreeNodeCache::instance().interior(this->file, down, this->key_profile)->find_child(key);
+	return down;
 }
 
 /**Insert a row with the given handle. Row must exist in relation already.*/
 void BTreeIndex::insert(Handle handle) {
-	KeyValue* keyval = tkey(relation.project(handle, &this->key_columns));
+	open();
+	ValueDict* row = relation.project(handle, &this->key_columns);
+	KeyValue* keyval = tkey(row);
+	delete row;
+	insert_key(keyval, handle);
+	delete keyval;
+}
+
+/**Insert many rows at once (e.g., the rows of a multi-row INSERT), in key order rather than the order given:
+the (key, handle) pairs are sorted first and then put in with one pass from the least key to the greatest, so
+the inserts that land in the same leaf come one after another, while it and the path down to it are still in
+the buffer pool and node cache, and the leaf stays dirty in the pool across all of them.*/
+void BTreeIndex::insert_many(const Handles* handles) {
+	open();
+	KeyHandles entries;
+	entries.reserve(handles->size());
+	for (auto const &handle : *handles) {
+		ValueDict *row = relation.project(handle, &this->key_columns);
+		KeyValue *key = tkey(row);
+		entries.push_back(KeyHandle(*key, handle));
+		delete key;
+		delete row;
+	}
+	sort(entries.begin(), entries.end());
+	for (auto const &entry : entries)
+		insert_key(&entry.first, entry.second);
+}
+
+/**Insert one (key, handle) pair from the root down.*/
+void BTreeIndex::insert_key(const KeyValue* keyval, Handle handle) {
 	Insertion split_root = _insert(this->root,
 		this->stat->get_height(), keyval, handle);
 	
@@ -147,7 +347,7 @@ Insertion BTreeIndex::_insert(BTreeNode *node, uint height, const KeyValue* key,
 	if (height == 1) {
 			BTreeLeaf *leaf_node = (BTreeLeaf*)node;
 			Insertion insert;
-			insert = leaf_node->insert(key, handle);
+			insert = leaf_node->insert(key, handle, this->unique, *this->stat);
 			leaf_node->save();
 			return insert;
 			
@@ -155,8 +355,9 @@ Insertion BTreeIndex::_insert(BTreeNode *node, uint height, const KeyValue* key,
 	else {
 		//recursive case
 		BTreeInterior *interior_node = (BTreeInterior*)node;
-		Insertion new_kid = _insert(interior_node->find(key, height)
-			, height - 1, key, handle);
+		BTreeNode *child = interior_node->find(key, height);
+		Insertion new_kid = _insert(child, height - 1, key, handle);
+		delete child;  // release the child's buffer pool pin
 		if (!node->insertion_is_none(new_kid)) {
 			//Insert method handles splitting node automatically. Don't have to
 			//account for case that a node is too full to insert
@@ -168,9 +369,100 @@ Insertion BTreeIndex::_insert(BTreeNode *node, uint height, const KeyValue* key,
 	}
 }
 
+/**Delete the index entry for a row. Row must still exist in relation.*/
 void BTreeIndex::del(Handle handle) {
-    throw DbRelationError("Don't know how to delete from a BTree index yet");
-	// FIXME: Not in scope of M6
+	open();
+	ValueDict* row = relation.project(handle, &this->key_columns);
+	KeyValue* key = tkey(row);
+	delete row;
+	_del(this->root, this->stat->get_height(), key, handle);
+	delete key;
+
+	//If merging left the root with a single child, that child is the new root
+	while (this->stat->get_height() > 1 && ((BTreeInterior*)this->root)->child_count() == 1) {
+		BlockID child = ((BTreeInterior*)this->root)->get_first();
+		BTreeNodeCache::instance().invalidate(&this->file, this->root->get_id());
+		delete this->root;
+		this->stat->set_height(this->stat->get_height() - 1);
+		if (this->stat->get_height() == 1)
+			this->root = new BTreeLeaf(file, child, key_profile, false);
+		else
+			this->root = new BTreeInterior(file, child, key_profile, false);
+		this->stat->set_root_id(child);
+		this->stat->save();
+	}
+}
+
+/**Recursive delete. Returns whether node is now underfull, so its parent should
+merge it with a sibling or even it out with one.*/
+bool BTreeIndex::_del(BTreeNode *node, uint height, const KeyValue* key, Handle handle) {
+	if (height == 1) {
+		BTreeLeaf *leaf_node = (BTreeLeaf*)node;
+		leaf_node->del(key, handle, *this->stat);
+		leaf_node->save();
+		return leaf_node->get_used() < UNDERFULL;
+	}
+	BTreeInterior *interior_node = (BTreeInterior*)node;
+	BTreeNode *child = interior_node->find(key, height);
+	bool underfull = _del(child, height - 1, key, handle);
+	delete child;  // release the child's buffer pool pin
+	if (!underfull)
+		return false;
+	_rebalance(interior_node, interior_node->child_index(key), height);
+	interior_node->save();
+	return interior_node->get_used() < UNDERFULL;
+}
+
+/**Fix up underfull child i of parent (at the given height) by merging it with a sibling,
+or if they won't both fit in one block, by evening out their entries.*/
+void BTreeIndex::_rebalance(BTreeInterior *parent, uint i, uint height) {
+	if (parent->child_count() < 2)
+		return;
+	uint right_i = i > 0 ? i : 1;  // pair child i with its left sibling if it has one
+	BlockID left_id = parent->get_child(right_i - 1);
+	BlockID right_id = parent->get_child(right_i);
+	if (height == 2) {
+		BTreeLeaf *left = new BTreeLeaf(file, left_id, key_profile, false);
+		BTreeLeaf *right = new BTreeLeaf(file, right_id, key_profile, false);
+		if (left->merge(right)) {
+			parent->del_child(right_i);
+		} else {
+			KeyValue *separator = left->redistribute(right);
+			parent->set_boundary(right_i, *separator);
+			delete separator;
+			right->save();
+		}
+		left->save();
+		delete left;
+		delete right;
+	} else {
+		BTreeInterior *left = new BTreeInterior(file, left_id, key_profile, false);
+		BTreeInterior *right = new BTreeInterior(file, right_id, key_profile, false);
+		if (left->merge(parent->get_boundary(right_i), right)) {
+			parent->del_child(right_i);
+			BTreeNodeCache::instance().invalidate(&this->file, right_id);
+		} else {
+			parent->set_boundary(right_i, left->redistribute(parent->get_boundary(right_i), right));
+			right->save();
+		}
+		left->save();
+		delete left;
+		delete right;
+	}
+}
+
+/**How full (1-100 percent) create() packs each node; the rest is left for later inserts.*/
+void BTreeIndex::set_fill_percent(uint fill_percent) {
+	if (fill_percent < 1 || fill_percent > 100)
+		throw DbRelationError("BTree fill factor must be between 1 and 100 percent");
+	this->fill_percent = fill_percent;
+}
+
+/**How many keys create() sorts in memory before spilling a sorted run to disk.*/
+void BTreeIndex::set_run_entries(uint run_entries) {
+	if (run_entries < 1)
+		throw DbRelationError("BTree sort runs must hold at least one key");
+	this->run_entries = run_entries;
 }
 
 /**pull out the key values from the ValueDict in order*/
@@ -183,6 +475,158 @@ KeyValue *BTreeIndex::tkey(const ValueDict *key) const {
 
 }
 
+/**pull out the values of the leading key columns that are present in the ValueDict*/
+KeyValue *BTreeIndex::tkey_prefix(const ValueDict *key) const {
+	KeyValue* val = new KeyValue;
+	for (Identifier col : this->key_columns) {
+		ValueDict::const_iterator found = key->find(col);
+		if (found == key->end())
+			break;
+		val->push_back(found->second);
+	}
+	return val;
+}
+
+BTreeRangeCursor::BTreeRangeCursor(HeapFile &file, const KeyProfile &key_profile, BlockID leaf_id,
+		KeyValue *min_key, bool min_inclusive, KeyValue *max_key, bool max_inclusive)
+		: file(file), key_profile(key_profile), leaf(nullptr), pos(0), postings(nullptr), posting(0),
+		  min_key(min_key), min_inclusive(min_inclusive), max_key(max_key), max_inclusive(max_inclusive) {
+	this->leaf = new BTreeLeaf(file, leaf_id, key_profile, false);
+	if (min_key != nullptr)
+		this->pos = this->leaf->lower_bound(*min_key);
+}
+
+BTreeRangeCursor::~BTreeRangeCursor() {
+	delete this->postings;
+	delete this->leaf;
+	delete this->min_key;
+	delete this->max_key;
+}
+
+/**Next handle in key order, following next_leaf when a leaf runs out*/
+bool BTreeRangeCursor::next(Handle &handle) {
+	while (this->leaf != nullptr) {
+		if (this->postings != nullptr) {
+			if (this->posting < this->postings->size()) {
+				handle = (*this->postings)[this->posting++];
+				return true;
+			}
+			delete this->postings;
+			this->postings = nullptr;
+		}
+		if (this->pos == this->leaf->size()) {
+			BlockID next_leaf = this->leaf->get_next_leaf();
+			delete this->leaf;
+			this->leaf = nullptr;
+			if (next_leaf == 0)
+				return false;
+			this->leaf = new BTreeLeaf(this->file, next_leaf, this->key_profile, false);
+			this->pos = 0;
+			continue;
+		}
+		if (this->max_key != nullptr) {
+			int cmp = this->leaf->compare(this->pos, *this->max_key);
+			if (cmp > 0 || (cmp == 0 && !this->max_inclusive)) {
+				delete this->leaf;
+				this->leaf = nullptr;
+				return false;
+			}
+		}
+		if (this->min_key != nullptr && !this->min_inclusive && this->leaf->compare(this->pos, *this->min_key) == 0) {
+			this->pos++;
+			continue;
+		}
+		this->postings = this->leaf->handles_at(this->pos++);
+		this->posting = 0;
+	}
+	return false;
+}
+
+BTreeBulkLoad::BTreeBulkLoad(HeapFile &file, const KeyProfile &key_profile, uint fill_percent, bool unique)
+		: file(file), key_profile(key_profile), limit(DbBlock::BLOCK_SZ * fill_percent / 100),
+		  unique(unique), pending_key(), pending(), leaf(nullptr), level() {
+}
+
+BTreeBulkLoad::~BTreeBulkLoad() {
+	delete this->leaf;
+}
+
+/**Gather the handles for key; a new key sends the previous one's posting list to the leaves.*/
+void BTreeBulkLoad::add(const KeyValue &key, Handle handle) {
+	if (!this->pending.empty()) {
+		if (key < this->pending_key)
+			throw DbRelationError("Bulk load keys must arrive in order");
+		if (key == this->pending_key) {
+			if (this->unique)
+				throw DbRelationError("Duplicate keys are not allowed in unique index");
+			this->pending.push_back(handle);
+			return;
+		}
+		flush_pending();
+	}
+	this->pending_key = key;
+	this->pending.push_back(handle);
+}
+
+/**Append the pending entry to the current leaf, starting (and linking to) a new leaf once it's full.*/
+void BTreeBulkLoad::flush_pending() {
+	if (this->leaf == nullptr)
+		this->leaf = new BTreeLeaf(this->file, 0, this->key_profile, true);
+	sort(this->pending.begin(), this->pending.end());
+	string entry = this->leaf->make_entry(this->pending_key, this->pending);
+	if (!this->leaf->append(entry, this->limit)) {
+		BTreeLeaf *next = new BTreeLeaf(this->file, 0, this->key_profile, true);
+		this->leaf->set_next_leaf(next->get_id());
+		this->leaf->save();
+		delete this->leaf;
+		this->leaf = next;
+		this->leaf->append(entry, this->limit);
+	}
+	if (this->leaf->size() == 1)
+		this->level.push_back(Insertion(this->leaf->get_id(), this->pending_key));
+	this->pending.clear();
+}
+
+/**Save the last leaf and build the interior levels above the leaves. Returns the new root and height.*/
+void BTreeBulkLoad::finish(BlockID &root_id, uint &height) {
+	if (!this->pending.empty())
+		flush_pending();
+	if (this->leaf == nullptr)  // empty relation: the root is an empty leaf
+		this->leaf = new BTreeLeaf(this->file, 0, this->key_profile, true);
+	root_id = this->leaf->get_id();
+	this->leaf->save();
+	delete this->leaf;
+	this->leaf = nullptr;
+	height = 1;
+
+	while (this->level.size() > 1) {
+		vector<Insertion> parents;
+		BTreeInterior *node = nullptr;
+		uint used = 0;
+		for (auto const &child : this->level) {
+			uint size = BTreeInterior::entry_size(this->key_profile, child.second);
+			if (node != nullptr && used + size <= this->limit) {
+				node->append(child.second, child.first);
+				used += size;
+				continue;
+			}
+			if (node != nullptr) {
+				node->save();
+				delete node;
+			}
+			node = new BTreeInterior(this->file, 0, this->key_profile, true);
+			node->set_first(child.first);
+			parents.push_back(Insertion(node->get_id(), child.second));
+			used = BTreeInterior::EMPTY_SIZE;
+		}
+		root_id = node->get_id();
+		node->save();
+		delete node;
+		this->level = parents;
+		height++;
+	}
+}
+
 /**To test B-Tree implementation (insert and lookup)*/
 bool test_btree() {
 	ColumnNames column_names;
@@ -248,6 +692,229 @@ bool test_btree() {
 		}
 	}
 
+	// range scans over the leaf chain: a is 100..1099 plus 12 and 88
+	ValueDict min_key, max_key;
+	min_key["a"] = 150;
+	max_key["a"] = 650;
+	Handles* range_handles = indx.range(&min_key, &max_key);
+	if (range_handles->size() != 501)
+		result = false;
+	int expected = 150;
+	for (Handle& h : *range_handles) {
+		ValueDict* row = table1.project(h);
+		if ((*row)["a"].n != expected++)
+			result = false;
+		delete row;
+	}
+	delete range_handles;
+
+	uint count = 0;
+	RowCursor* rows = indx.range_cursor(&min_key, false, nullptr, false);
+	Handle h;
+	while (rows->next(h))
+		count++;
+	delete rows;
+	if (count != 1099 - 150)
+		result = false;
+
+	count = 0;
+	rows = indx.range_cursor(nullptr, false, &min_key, false);
+	while (rows->next(h))
+		count++;
+	delete rows;
+	if (count != 2 + 50)
+		result = false;
+
+	// bulk load through sorted runs on disk, packing every node full, then read it back from disk
+	BTreeIndex spilled(table1, "fooindex_spilled", indx_col, true);
+	spilled.set_run_entries(300);
+	spilled.set_fill_percent(100);
+	spilled.create();
+	spilled.close();
+	BTreeIndex spilled_back(table1, "fooindex_spilled", indx_col, true);
+	spilled_back.open();
+	range_handles = spilled_back.range(&min_key, &max_key);
+	if (range_handles->size() != 501)
+		result = false;
+	delete range_handles;
+	for (unsigned int i = 0; i < 1000; i += 7) {
+		(*test_row)["a"] = i + 100;
+		(*test_row)["b"] = -i;
+		if (!testbtree_compare(spilled_back, table1, test_row, test_row))
+			result = false;
+	}
+	spilled_back.drop();
+
+	// a nearly empty fill factor makes a tall tree, so descents go through (and overflow) the node cache;
+	// splitting the first and last leaves then saves interior nodes that are already cached, and
+	// the new boundaries have to go at the front as well as the back of their parents
+	BTreeIndex sparse(table1, "fooindex_sparse", indx_col, true);
+	sparse.set_fill_percent(1);
+	sparse.create();
+	for (int i = 0; i < 300; i++) {
+		for (int a : {i + 2000, -1 - i}) {
+			ValueDict batch_row;
+			batch_row["a"] = a;
+			batch_row["b"] = i;
+			sparse.insert(table1.insert(&batch_row));
+			if (!testbtree_compare(sparse, table1, &batch_row, &batch_row))
+				result = false;
+		}
+	}
+	for (unsigned int i = 0; i < 1000; i += 7) {
+		(*test_row)["a"] = i + 100;
+		(*test_row)["b"] = -i;
+		if (!testbtree_compare(sparse, table1, test_row, test_row))
+			result = false;
+	}
+
+	// delete two thirds of the rows from both trees (merging and evening out nodes as they empty)
+	RowCursor* all_rows = table1.cursor();
+	Handles all_handles;
+	while (all_rows->next(h))
+		all_handles.push_back(h);
+	delete all_rows;
+	uint kept = 0;
+	for (uint i = 0; i < all_handles.size(); i++) {
+		if (i % 3 == 0) {
+			kept++;
+			continue;
+		}
+		if (i < 1002)  // indx has only the rows it was created with
+			indx.del(all_handles[i]);
+		sparse.del(all_handles[i]);
+	}
+	for (uint i = 0; i < all_handles.size(); i++) {
+		ValueDict* row = table1.project(all_handles[i]);
+		if (!testbtree_compare(sparse, table1, row, i % 3 == 0 ? row : empty_row))
+			result = false;
+		delete row;
+	}
+	count = 0;
+	rows = sparse.range_cursor(nullptr, false, nullptr, false);
+	while (rows->next(h))
+		count++;
+	delete rows;
+	if (count != kept)
+		result = false;
+	range_handles = indx.range(&min_key, &max_key);
+	if (range_handles->size() != 167)  // 150..650 with (a - 100) % 3 == 1
+		result = false;
+	delete range_handles;
+
+	// ... and then the rest, shrinking the tree back down to a single empty leaf
+	for (uint i = 0; i < all_handles.size(); i += 3)
+		sparse.del(all_handles[i]);
+	rows = sparse.range_cursor(nullptr, false, nullptr, false);
+	if (rows->next(h))
+		result = false;
+	delete rows;
+	ValueDict last_row;
+	last_row["a"] = 5000;
+	last_row["b"] = 0;
+	sparse.insert(table1.insert(&last_row));
+	if (!testbtree_compare(sparse, table1, &last_row, &last_row))
+		result = false;
+
+	// rows going in together, keys out of order: the index takes them in key order, splitting its way up
+	ValueDicts many_rows;
+	for (int i = 0; i < 400; i++) {
+		ValueDict *many_row = new ValueDict;
+		(*many_row)["a"] = 3000 + (i * 149) % 400;
+		(*many_row)["b"] = 50000 + i;  // b values the later tests don't count
+		many_rows.push_back(many_row);
+	}
+	Handles *many_handles = table1.insert_many(&many_rows);
+	sparse.insert_many(many_handles);
+	for (uint i = 0; i < many_rows.size(); i++) {
+		if (!testbtree_compare(sparse, table1, many_rows[i], many_rows[i]))
+			result = false;
+		delete many_rows[i];
+	}
+	delete many_handles;
+	sparse.drop();
+
+	// a non-unique index on b: b is 0 for four rows, and 7777 for enough rows that the posting list
+	// overflows the leaf, both when bulk loaded and when it grows through insert
+	Handles dup_handles;
+	for (int i = 0; i < 1500; i++) {
+		ValueDict batch_row;
+		batch_row["a"] = 10000 + i;
+		batch_row["b"] = 7777;
+		dup_handles.push_back(table1.insert(&batch_row));
+	}
+	ColumnNames dup_col;
+	dup_col.push_back(column_names.at(1));
+	BTreeIndex dups(table1, "fooindex_dups", dup_col, false);
+	dups.create();
+	ValueDict dup_key;
+	auto check_dups = [&](BTreeIndex &index, int b, uint expected) {
+		dup_key["b"] = b;
+		Handles *handles = index.lookup(&dup_key);
+		bool ok = handles->size() == expected && is_sorted(handles->begin(), handles->end());
+		for (Handle &handle : *handles) {
+			ValueDict *row = table1.project(handle);
+			if ((*row)["b"].n != b)
+				ok = false;
+			delete row;
+		}
+		delete handles;
+		return ok;
+	};
+	if (!check_dups(dups, 7777, 1500) || !check_dups(dups, 0, 4) || !check_dups(dups, 5, 2) || !check_dups(dups, -5, 1)
+		|| !check_dups(dups, 6666, 0))
+		result = false;
+	for (int i = 0; i < 500; i++) {
+		ValueDict batch_row;
+		batch_row["a"] = 20000 + i;
+		batch_row["b"] = i % 2 == 0 ? 7777 : 5;
+		Handle handle = table1.insert(&batch_row);
+		dups.insert(handle);
+		dup_handles.push_back(handle);
+	}
+	if (!check_dups(dups, 7777, 1750) || !check_dups(dups, 5, 252))
+		result = false;
+	range_handles = dups.range(&dup_key, &dup_key);
+	if (range_handles->size() != 252)
+		result = false;
+	delete range_handles;
+	// the posting lists persist: read them back (and delete through) a second BTreeIndex on the same name
+	dups.close();
+	BTreeIndex dups_back(table1, "fooindex_dups", dup_col, false);
+	dups_back.open();
+	if (!check_dups(dups_back, 7777, 1750) || !check_dups(dups_back, 5, 252))
+		result = false;
+	for (uint i = 0; i < dup_handles.size(); i += 2)
+		dups_back.del(dup_handles[i]);
+	if (!check_dups(dups_back, 7777, 750) || !check_dups(dups_back, 5, 252))
+		result = false;
+	for (uint i = 1; i < dup_handles.size(); i += 2)
+		dups_back.del(dup_handles[i]);
+	if (!check_dups(dups_back, 7777, 0) || !check_dups(dups_back, 5, 2) || !check_dups(dups_back, 0, 4))
+		result = false;
+
+	// emptied posting lists give their overflow blocks back, so once the leaves have room for the keys
+	// again (after the first round), filling and emptying the lists takes no new blocks
+	HeapFile dups_file("_test_btree_cpp-fooindex_dups");
+	dups_file.open();
+	BlockID dups_blocks = 0;
+	for (int round = 0; round < 4; round++) {
+		if (round == 1)
+			dups_blocks = dups_file.get_last_block_id();
+		for (Handle &handle : dup_handles)
+			dups_back.insert(handle);
+		if (!check_dups(dups_back, 7777, 1750) || !check_dups(dups_back, 5, 252))
+			result = false;
+		for (Handle &handle : dup_handles)
+			dups_back.del(handle);
+		if (!check_dups(dups_back, 7777, 0) || !check_dups(dups_back, 5, 2))
+			result = false;
+	}
+	if (dups_file.get_last_block_id() != dups_blocks)
+		result = false;
+	dups_file.close();
+	dups_back.drop();
+
 	indx.drop();
 	table1.drop();
 
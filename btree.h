@@ -2,8 +2,17 @@
 
 #include "BTreeNode.h"
 
+typedef std::pair<KeyValue,Handle> KeyHandle;
+typedef std::vector<KeyHandle> KeyHandles;
+
+class BTreeBulkLoad;
+
 class BTreeIndex : public DbIndex {
 public:
+    static const uint DEFAULT_FILL_PERCENT = 90;      // how full create() packs each node
+    static const uint DEFAULT_RUN_ENTRIES = 250000;   // keys create() sorts in memory before spilling a run
+    static const uint UNDERFULL = DbBlock::BLOCK_SZ / 4;  // del() merges or refills nodes using fewer bytes
+
     BTreeIndex(DbRelation& relation, Identifier name, ColumnNames key_columns, bool unique);
     virtual ~BTreeIndex();
 
@@ -14,24 +23,98 @@ public:
     virtual void close();
 
     virtual Handles* lookup(ValueDict* key) const;
+    virtual void lookup_many(const ValueDicts& keys, std::vector<Handles*>& results) const;
     virtual Handles* range(ValueDict* min_key, ValueDict* max_key) const;
+    virtual RowCursor* range_cursor(const ValueDict* min_key, bool min_inclusive,
+                                    const ValueDict* max_key, bool max_inclusive) const;
+    virtual bool is_ordered() const { return true; }
 
     virtual void insert(Handle handle);
+    virtual void insert_many(const Handles* handles);
     virtual void del(Handle handle);
 
     virtual KeyValue *tkey(const ValueDict *key) const; // pull out the key values from the ValueDict in order
 
+    void set_fill_percent(uint fill_percent);
+    void set_run_entries(uint run_entries);
+
 protected:
     static const BlockID STAT = 1;
     bool closed;
     BTreeStat *stat;
     BTreeNode *root;
-    HeapFile file;
+    mutable HeapFile file;  // reading the index still pins blocks
     KeyProfile key_profile;
+    uint fill_percent;
+    uint run_entries;
 
     void build_key_profile();
-    Handles* _lookup(BTreeNode *node, uint height, const KeyValue* key) const;
+    HeapTable *spill_run(KeyHandles &entries, uint run_number);
+    void merge_runs(std::vector<HeapTable*> &runs, BTreeBulkLoad &loader);
+    KeyValue *tkey_prefix(const ValueDict *key) const;  // leading key columns present in key
+    BlockID _find_leaf(const KeyValue* key) const;
+    void insert_key(const KeyValue* key, Handle handle);
     Insertion _insert(BTreeNode *node, uint height, const KeyValue* key, Handle handle);
+    bool _del(BTreeNode *node, uint height, const KeyValue* key, Handle handle);
+    void _rebalance(BTreeInterior *parent, uint i, uint height);
+};
+
+/**
+ * @class BTreeRangeCursor - walks the leaf chain from a lower bound to an upper bound
+ *
+ * Only the current leaf is held, and its keys are compared in place. Bounds may be prefixes
+ * of the full key, in which case only the leading key columns are compared. The handles of
+ * each matching entry are returned in handle order.
+ */
+class BTreeRangeCursor : public RowCursor {
+public:
+    // takes ownership of min_key and max_key (either may be nullptr for an open bound)
+    BTreeRangeCursor(HeapFile &file, const KeyProfile &key_profile, BlockID leaf_id,
+                     KeyValue *min_key, bool min_inclusive, KeyValue *max_key, bool max_inclusive);
+    virtual ~BTreeRangeCursor();
+
+    virtual bool next(Handle &handle);
+
+protected:
+    HeapFile &file;
+    const KeyProfile &key_profile;
+    BTreeLeaf *leaf;
+    uint pos;  // next entry of leaf
+    Handles *postings;  // handles of the current entry not yet returned (nullptr between entries)
+    uint posting;       // next of postings
+    KeyValue *min_key;
+    bool min_inclusive;
+    KeyValue *max_key;
+    bool max_inclusive;
+};
+
+/**
+ * @class BTreeBulkLoad - packs (key, handle) pairs, arriving in (key, handle) order, into a new tree bottom-up
+ *
+ * The handles of equal keys are gathered into one posting list per key (or rejected if the index
+ * is unique). Leaves are filled left to right up to the fill factor. A leaf is saved once, when the next
+ * one is started and its next_leaf pointer is known. finish() then builds each interior level
+ * the same way from the first key of every node on the level below.
+ */
+class BTreeBulkLoad {
+public:
+    BTreeBulkLoad(HeapFile &file, const KeyProfile &key_profile, uint fill_percent, bool unique);
+    virtual ~BTreeBulkLoad();
+
+    void add(const KeyValue &key, Handle handle);  // throws if out of order (or a duplicate key, if unique)
+    void finish(BlockID &root_id, uint &height);
+
+protected:
+    HeapFile &file;
+    const KeyProfile &key_profile;
+    uint limit;                   // bytes we let a node use
+    bool unique;
+    KeyValue pending_key;         // key whose handles are still arriving
+    Handles pending;              // its handles so far
+    BTreeLeaf *leaf;              // leaf being filled
+    std::vector<Insertion> level; // (block id, lowest key) of each node in the level being built
+
+    void flush_pending();
 };
 
 bool test_btree();
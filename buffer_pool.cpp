@@ -0,0 +1,172 @@
+/**
+ * @file buffer_pool.cpp - implementation of:
+ * BufferPool
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#include <algorithm>
+#include <memory.h>
+#include "buffer_pool.h"
+#include "heap_storage.h"
+using namespace std;
+
+BufferPool &BufferPool::instance() {
+	static BufferPool pool;
+	return pool;
+}
+
+BufferPool::BufferPool(uint n_frames)
+		: frames(n_frames), page_table(), open_files(), next_file_id(1), clock_hand(0), lock() {
+}
+
+// Nothing is written from here (see flush_all): the Db handles may be gone by now.
+BufferPool::~BufferPool() {
+	for (auto &entry: this->open_files)
+		delete entry.second;
+}
+
+// Handles on the same file on disk share one OpenFile, found by the file's name.
+OpenFile *BufferPool::attach(HeapFile *file) {
+	lock_guard<mutex> guard(this->lock);
+	OpenFile *&open_file = this->open_files[file->dbfilename];
+	if (open_file == nullptr)
+		open_file = new OpenFile(this->next_file_id++);
+	open_file->handles.push_back(file);
+	return open_file;
+}
+
+// The last handle out writes back and forgets the file's frames; until then, they stay for the others.
+void BufferPool::detach(HeapFile *file) {
+	lock_guard<mutex> guard(this->lock);
+	auto found = this->open_files.find(file->dbfilename);
+	if (found == this->open_files.end())
+		return;
+	OpenFile *open_file = found->second;
+	if (open_file->handles.size() == 1) {
+		for (auto &frame: this->frames) {
+			if (frame.file == open_file) {
+				write_back(frame);
+				this->page_table.erase(FrameKey(open_file->id, frame.block_id));
+				frame.file = nullptr;
+				frame.referenced = false;
+			}
+		}
+	}
+	auto handle = find(open_file->handles.begin(), open_file->handles.end(), file);
+	if (handle != open_file->handles.end())
+		open_file->handles.erase(handle);
+	if (open_file->handles.empty()) {
+		this->open_files.erase(found);
+		delete open_file;
+	}
+}
+
+// Find (or load) the frame for the given block and pin it.
+BufferFrame *BufferPool::pin(HeapFile *file, BlockID block_id, bool is_new) {
+	lock_guard<mutex> guard(this->lock);
+	OpenFile *open_file = file->open_file;
+	auto found = this->page_table.find(FrameKey(open_file->id, block_id));
+	if (found != this->page_table.end()) {
+		BufferFrame &frame = this->frames[found->second];
+		frame.pin_count++;
+		frame.referenced = true;
+		if (is_new) {
+			memset(frame.data, 0, sizeof(frame.data));
+			frame.dirty = true;
+		}
+		return &frame;
+	}
+
+	uint which = victim();
+	BufferFrame &frame = this->frames[which];
+	if (frame.file != nullptr) {
+		write_back(frame);
+		this->page_table.erase(FrameKey(frame.file->id, frame.block_id));
+	}
+	frame.file = open_file;
+	frame.block_id = block_id;
+	frame.pin_count = 1;
+	frame.referenced = true;
+	frame.dirty = false;
+	if (is_new) {
+		memset(frame.data, 0, sizeof(frame.data));
+	} else {
+		try {
+			file->read_block(block_id, frame.data);
+		} catch (...) {
+			frame.file = nullptr;  // nothing was read: give the frame back
+			frame.pin_count = 0;
+			frame.referenced = false;
+			throw;
+		}
+	}
+	this->page_table[FrameKey(open_file->id, block_id)] = which;
+	return &frame;
+}
+
+void BufferPool::unpin(BufferFrame *frame) {
+	lock_guard<mutex> guard(this->lock);
+	if (frame->pin_count > 0)
+		frame->pin_count--;
+}
+
+void BufferPool::mark_dirty(BufferFrame *frame) {
+	lock_guard<mutex> guard(this->lock);
+	frame->dirty = true;
+}
+
+// Write back every dirty frame of the given file (frames stay cached).
+void BufferPool::flush(HeapFile *file) {
+	lock_guard<mutex> guard(this->lock);
+	for (auto &frame: this->frames)
+		if (frame.file != nullptr && frame.file == file->open_file)
+			write_back(frame);
+}
+
+// Drop every frame of the given file without writing it.
+void BufferPool::discard(HeapFile *file) {
+	lock_guard<mutex> guard(this->lock);
+	for (auto &frame: this->frames) {
+		if (frame.file != nullptr && frame.file == file->open_file) {
+			this->page_table.erase(FrameKey(frame.file->id, frame.block_id));
+			frame.file = nullptr;
+			frame.dirty = false;
+			frame.referenced = false;
+		}
+	}
+}
+
+void BufferPool::flush_all() {
+	lock_guard<mutex> guard(this->lock);
+	for (auto &frame: this->frames)
+		if (frame.file != nullptr)
+			write_back(frame);
+	for (auto &entry: this->open_files)
+		entry.second->handles.front()->sync();
+}
+
+// CLOCK: sweep the frames, giving referenced ones a second chance, until we find an unpinned frame.
+// Free frames are taken immediately.
+uint BufferPool::victim() {
+	uint n = (uint) this->frames.size();
+	for (uint sweep = 0; sweep < 2 * n; sweep++) {
+		uint which = this->clock_hand;
+		this->clock_hand = (this->clock_hand + 1) % n;
+		BufferFrame &frame = this->frames[which];
+		if (frame.pin_count > 0)
+			continue;
+		if (frame.file != nullptr && frame.referenced) {
+			frame.referenced = false;
+			continue;
+		}
+		return which;
+	}
+	throw DbRelationError("buffer pool exhausted: every frame is pinned");
+}
+
+void BufferPool::write_back(BufferFrame &frame) {
+	if (frame.dirty) {
+		frame.file->handles.front()->write_block(frame.block_id, frame.data);
+		frame.dirty = false;
+	}
+}
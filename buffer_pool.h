@@ -0,0 +1,158 @@
+/**
+ * @file buffer_pool.h - Page cache between HeapFile and BerkeleyDB.
+ * BufferFrame
+ * BufferPool
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "storage_engine.h"
+
+class HeapFile;
+
+/**
+ * @class OpenFile - a file on disk, as the BufferPool knows it while any HeapFile has it open
+ *
+ * Its blocks are cached under id rather than under any one HeapFile, so every handle open on
+ * the file sees the same copy of each block, and last is shared since any of them may add one.
+ */
+class OpenFile {
+public:
+	OpenFile(uint id) : id(id), last(0), handles() {}
+
+	uint id;                         // what the file's frames are keyed by (never reused)
+	BlockID last;                    // the file's final block
+	std::vector<HeapFile*> handles;  // open on the file; dirty blocks are written through the first
+};
+
+/**
+ * @class BufferFrame - one cached block along with its bookkeeping
+ *
+ * A frame is owned by at most one (file, block_id) at a time, whichever HeapFile asked for it. While pin_count is
+ * non-zero the frame cannot be evicted, so any SlottedPage built on top of it
+ * stays valid until it is deleted (which unpins the frame).
+ */
+class BufferFrame {
+public:
+	BufferFrame() : file(nullptr), block_id(0), pin_count(0), dirty(false), referenced(false) {}
+
+	OpenFile *file;     // owner of the cached block (nullptr if the frame is free)
+	BlockID block_id;   // which block of file is cached here
+	uint pin_count;     // number of outstanding users
+	bool dirty;         // block must be written back before the frame is reused
+	bool referenced;    // CLOCK reference bit
+	char data[DbBlock::BLOCK_SZ];
+};
+
+/**
+ * @class BufferPool - fixed set of page frames shared by all HeapFiles
+ *
+ * HeapFile::get and HeapFile::get_new pin a frame; deleting the returned block
+ * unpins it. HeapFile::put only marks the frame dirty -- the block is written to
+ * BerkeleyDB when the frame is evicted or the last handle on the file is closed.
+ * Victims are chosen with the CLOCK (second-chance) algorithm among unpinned frames.
+ * Frames are keyed by the file on disk (see OpenFile), not by the HeapFile asking.
+ *
+ * Every operation holds the pool's lock, so parallel scans can pin and unpin blocks
+ * from several threads (reads from BerkeleyDB are serialized along with them).
+ */
+class BufferPool {
+public:
+	/**
+	 * number of frames in the shared pool (2MB of 4kB blocks)
+	 */
+	static const uint DEFAULT_FRAMES = 512;
+
+	/**
+	 * The process-wide pool used by HeapFile.
+	 */
+	static BufferPool &instance();
+
+	BufferPool(uint n_frames = DEFAULT_FRAMES);
+	virtual ~BufferPool();
+	BufferPool(const BufferPool &other) = delete;
+	BufferPool(BufferPool &&temp) = delete;
+	BufferPool &operator=(const BufferPool &other) = delete;
+	BufferPool &operator=(BufferPool &&temp) = delete;
+
+	/**
+	 * Register a HeapFile that has just opened its file on disk.
+	 * @param file  the handle
+	 * @returns     what it shares with the other handles open on the same file, if any
+	 *              (last is left for the first handle to set)
+	 */
+	virtual OpenFile *attach(HeapFile *file);
+
+	/**
+	 * Unregister a HeapFile that is closing. If it was the last handle on its file, the file's
+	 * dirty frames are written back and all its frames forgotten; otherwise they stay cached.
+	 * @param file  the handle
+	 */
+	virtual void detach(HeapFile *file);
+
+	/**
+	 * Pin the frame holding the given block, reading it in if necessary.
+	 * @param file      file the block belongs to
+	 * @param block_id  which block
+	 * @param is_new    if true, the block is not read from disk; the frame is zeroed
+	 * @returns         pinned frame (release with unpin)
+	 * @throws          DbRelationError if every frame is pinned, or the block isn't on disk (or is short)
+	 */
+	virtual BufferFrame *pin(HeapFile *file, BlockID block_id, bool is_new = false);
+
+	/**
+	 * Release one pin on a frame.
+	 * @param frame  frame previously returned by pin
+	 */
+	virtual void unpin(BufferFrame *frame);
+
+	/**
+	 * Note that the frame's block has changed and must be written back.
+	 * @param frame  a pinned frame
+	 */
+	virtual void mark_dirty(BufferFrame *frame);
+
+	/**
+	 * Write all dirty frames belonging to file (through any handle) back to disk.
+	 * @param file  which file to flush
+	 */
+	virtual void flush(HeapFile *file);
+
+	/**
+	 * Forget all the frames belonging to file (through any handle) without writing them.
+	 * Frames that are still pinned are detached from file and freed when unpinned.
+	 * @param file  which file to discard
+	 */
+	virtual void discard(HeapFile *file);
+
+	/**
+	 * Write every dirty frame in the pool back to disk, and have BerkeleyDB sync every open file.
+	 * Call this before the process exits: the pool's destructor writes nothing, since by the time
+	 * statics are destroyed the files' Db handles and the DbEnv may already be gone.
+	 */
+	virtual void flush_all();
+
+protected:
+	typedef std::pair<uint, BlockID> FrameKey;
+	struct FrameKeyHash {
+		size_t operator()(const FrameKey &key) const {
+			return std::hash<uint>()(key.first) ^ (std::hash<BlockID>()(key.second) << 1);
+		}
+	};
+
+	std::vector<BufferFrame> frames;
+	std::unordered_map<FrameKey, uint, FrameKeyHash> page_table;  // (file id, block_id) -> index into frames
+	std::unordered_map<std::string, OpenFile*> open_files;  // dbfilename -> the file, while any handle has it open
+	uint next_file_id;
+	uint clock_hand;
+	std::mutex lock;
+
+	virtual uint victim();
+	virtual void write_back(BufferFrame &frame);
+};
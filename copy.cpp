@@ -0,0 +1,700 @@
+/**
+ * @file copy.cpp - implementation of:
+ * CopyLoad
+ * CopyDump
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <strings.h>
+#include "copy.h"
+#include "row_batch.h"
+using namespace std;
+
+const char CopyLoad::SIGNATURE[8] = {'S', 'Q', 'L', '5', '3', '0', '0', 'B'};
+
+// the error for a file we couldn't open, read, or write
+static DbRelationError file_error(const string &what, const string &path) {
+	return DbRelationError("can't " + what + " " + path + ": " + strerror(errno));
+}
+
+
+/*
+ * CopyLoad
+ */
+
+// Leave a thread each for the reader and the writer.
+CopyLoad::CopyLoad(HeapTable &table, const string &path, CopyFormat format, uint parsers, size_t chunk_bytes)
+		: table(table), path(path), format(format), parsers(parsers), chunk_bytes(max(chunk_bytes, (size_t)1)),
+		  data_types(), loader(table), unparsed(), parsed(), read_count(0), written(0), reading_done(false),
+		  stopping(false), error(), lock(), changed(), threads() {
+	if (this->parsers == 0) {
+		uint hardware = thread::hardware_concurrency();
+		this->parsers = hardware > 3 ? hardware - 2 : 1;
+	}
+	for (ColumnAttribute column_attribute : table.get_column_attributes())
+		this->data_types.push_back(column_attribute.get_data_type());
+}
+
+CopyLoad::~CopyLoad() {
+	stop();
+}
+
+// The reader, parsers, and writer (this thread) pass the chunks along; if any of them fails, everyone stops
+// and whatever was already appended comes back out.
+size_t CopyLoad::run() {
+	this->threads.push_back(thread(&CopyLoad::read, this));
+	for (uint i = 0; i < this->parsers; i++)
+		this->threads.push_back(thread(&CopyLoad::parse, this));
+	try {
+		while (true) {
+			Chunk *chunk;
+			{
+				unique_lock<mutex> guard(this->lock);
+				this->changed.wait(guard, [this] {
+					return this->stopping || this->parsed.count(this->written) > 0
+						   || (this->reading_done && this->written == this->read_count);
+				});
+				auto next = this->parsed.find(this->written);
+				if (this->stopping || next == this->parsed.end())
+					break;
+				chunk = next->second;
+				this->parsed.erase(next);
+			}
+			try {
+				write(chunk);
+			} catch (...) {
+				delete chunk;
+				throw;
+			}
+			delete chunk;
+			{
+				lock_guard<mutex> guard(this->lock);
+				this->written++;
+			}
+			this->changed.notify_all();
+		}
+	} catch (...) {
+		fail();
+	}
+	stop();
+	if (this->error) {
+		this->loader.rollback();
+		rethrow_exception(this->error);
+	}
+	this->loader.finish();
+	return this->loader.count();
+}
+
+void CopyLoad::rollback() {
+	this->loader.rollback();
+}
+
+// Keep the first error; it's the one that says what went wrong.
+void CopyLoad::fail() {
+	{
+		lock_guard<mutex> guard(this->lock);
+		if (!this->error)
+			this->error = current_exception();
+		this->stopping = true;
+	}
+	this->changed.notify_all();
+}
+
+// Wait for the threads and throw away any chunks they left.
+void CopyLoad::stop() {
+	{
+		lock_guard<mutex> guard(this->lock);
+		this->stopping = true;
+	}
+	this->changed.notify_all();
+	for (auto &t : this->threads)
+		t.join();
+	this->threads.clear();
+	for (Chunk *chunk : this->unparsed)
+		delete chunk;
+	this->unparsed.clear();
+	for (auto const &entry : this->parsed)
+		delete entry.second;
+	this->parsed.clear();
+}
+
+// Queue a chunk for the parsers, once there's room. Returns false if we're stopping instead.
+bool CopyLoad::add_chunk(Chunk *chunk) {
+	{
+		unique_lock<mutex> guard(this->lock);
+		size_t most = (size_t)this->parsers * QUEUED_CHUNKS_PER_PARSER;
+		this->changed.wait(guard, [this, most] { return this->stopping || this->read_count - this->written < most; });
+		if (this->stopping) {
+			delete chunk;
+			return false;
+		}
+		chunk->sequence = this->read_count++;
+		this->unparsed.push_back(chunk);
+	}
+	this->changed.notify_all();
+	return true;
+}
+
+// Reader thread: the file a chunk_bytes at a time, each cut after the last whole row in what we have; the rest
+// starts the next chunk.
+void CopyLoad::read() {
+	FILE *file = nullptr;
+	try {
+		file = fopen(this->path.c_str(), "rb");
+		if (file == nullptr)
+			throw file_error("open", this->path);
+		string text;
+		size_t row = 1;
+		bool header = this->format == COPY_BINARY;  // still to be read
+		while (true) {
+			size_t had = text.size();
+			text.resize(had + this->chunk_bytes);
+			size_t got = fread(&text[had], 1, this->chunk_bytes, file);
+			text.resize(had + got);
+			if (got == 0) {
+				if (ferror(file))
+					throw file_error("read", this->path);
+				break;
+			}
+			size_t start = 0;
+			if (header) {
+				start = read_header(text);
+				if (start == 0)
+					continue;  // not all here yet
+				header = false;
+			}
+			size_t rows = 0;
+			size_t end = cut(text, start, rows);
+			if (end == start) {
+				text.erase(0, start);
+				continue;
+			}
+			Chunk *chunk = new Chunk();
+			chunk->text = text.substr(start, end - start);
+			chunk->first_row = row;
+			row += rows;
+			text.erase(0, end);
+			if (!add_chunk(chunk))
+				break;
+		}
+		fclose(file);
+		file = nullptr;
+
+		if (header)
+			throw DbRelationError(this->path + " is not a COPY BINARY file");
+		if (!text.empty()) {
+			// a last row without a line break after it (anything left of a binary file is a row cut short)
+			if (this->format == COPY_BINARY)
+				throw row_error(row, "cut short");
+			Chunk *chunk = new Chunk();
+			chunk->text = text;
+			chunk->first_row = row;
+			add_chunk(chunk);
+		}
+	} catch (...) {
+		if (file != nullptr)
+			fclose(file);
+		fail();
+	}
+	{
+		lock_guard<mutex> guard(this->lock);
+		this->reading_done = true;
+	}
+	this->changed.notify_all();
+}
+
+// Parser thread: take the next chunk to be parsed, parse it, and hand it on to the writer.
+void CopyLoad::parse() {
+	while (true) {
+		Chunk *chunk;
+		{
+			unique_lock<mutex> guard(this->lock);
+			this->changed.wait(guard, [this] { return this->stopping || !this->unparsed.empty() || this->reading_done; });
+			if (this->stopping || this->unparsed.empty())
+				return;
+			chunk = this->unparsed.front();
+			this->unparsed.pop_front();
+		}
+		try {
+			if (this->format == COPY_CSV)
+				parse_csv(chunk);
+			else
+				parse_binary(chunk);
+			chunk->text.clear();
+			chunk->text.shrink_to_fit();
+		} catch (...) {
+			delete chunk;
+			fail();
+			return;
+		}
+		{
+			lock_guard<mutex> guard(this->lock);
+			this->parsed[chunk->sequence] = chunk;
+		}
+		this->changed.notify_all();
+	}
+}
+
+// Writer (the calling thread): append a chunk's records to the table.
+void CopyLoad::write(const Chunk *chunk) {
+	const char *records = chunk->records.data();
+	size_t row = chunk->first_row;
+	for (size_t offset = 0; offset < chunk->records.size(); row++) {
+		u16 size;
+		memcpy(&size, records + offset, sizeof(u16));
+		offset += sizeof(u16);
+		try {
+			this->loader.add(records + offset, size);
+		} catch (DbRelationError &e) {
+			throw row_error(row, e.what());
+		}
+		offset += size;
+	}
+}
+
+DbRelationError CopyLoad::row_error(size_t row, const string &problem) const {
+	return DbRelationError(this->path + ", row " + to_string(row) + ": " + problem);
+}
+
+// Check a COPY_BINARY file's header against the table. Returns how long it is, or 0 if it isn't all in text yet.
+size_t CopyLoad::read_header(const string &text) const {
+	size_t length = sizeof(SIGNATURE) + sizeof(u16) + this->data_types.size();
+	if (text.size() < sizeof(SIGNATURE) + sizeof(u16))
+		return 0;
+	if (memcmp(text.data(), SIGNATURE, sizeof(SIGNATURE)) != 0)
+		throw DbRelationError(this->path + " is not a COPY BINARY file");
+	u16 columns;
+	memcpy(&columns, text.data() + sizeof(SIGNATURE), sizeof(u16));
+	if (columns != this->data_types.size())
+		throw DbRelationError(this->path + " has " + to_string(columns) + " columns, not "
+							  + to_string(this->data_types.size()));
+	if (text.size() < length)
+		return 0;
+	for (size_t i = 0; i < this->data_types.size(); i++)
+		if ((uint8_t)text[sizeof(SIGNATURE) + sizeof(u16) + i] != (uint8_t)this->data_types[i])
+			throw DbRelationError(this->path + " has a column " + to_string(i + 1) + " of another type");
+	return length;
+}
+
+// Find the end of the last whole row in text from start on, and count the rows up to there. A CSV row ends
+// at a line break outside quotes; a binary row is as long as its size says.
+size_t CopyLoad::cut(const string &text, size_t start, size_t &rows) const {
+	const char *bytes = text.data();
+	size_t end = start;
+	if (this->format == COPY_BINARY) {
+		while (end + sizeof(u16) <= text.size()) {
+			u16 size;
+			memcpy(&size, bytes + end, sizeof(u16));
+			if (end + sizeof(u16) + size > text.size())
+				break;
+			end += sizeof(u16) + size;
+			rows++;
+		}
+		return end;
+	}
+	bool quoted = false;
+	for (size_t i = start; i < text.size(); i++) {
+		if (bytes[i] == '"') {
+			quoted = !quoted;  // a doubled quote inside quotes flips it twice
+		} else if (bytes[i] == '\n' && !quoted) {
+			end = i + 1;
+			rows++;
+		}
+	}
+	return end;
+}
+
+// Put a field's value into record at offset, as HeapTable::marshal would. Returns the offset after it.
+static uint encode(ColumnAttribute::DataType data_type, const char *text, size_t length, char *record, uint offset) {
+	if (data_type == ColumnAttribute::DataType::TEXT) {
+		if (length > UINT16_MAX)
+			throw DbRelationError("text field too long");
+		if (offset + sizeof(u16) + length > DbBlock::BLOCK_SZ)
+			throw DbRelationError("row too big");
+		u16 size = (u16)length;
+		memcpy(record + offset, &size, sizeof(u16));
+		memcpy(record + offset + sizeof(u16), text, length);
+		return offset + sizeof(u16) + (uint)length;
+	}
+
+	string field(text, length);
+	if (data_type == ColumnAttribute::DataType::INT) {
+		if (offset + sizeof(int32_t) > DbBlock::BLOCK_SZ)
+			throw DbRelationError("row too big");
+		size_t i = 0;
+		bool negative = false;
+		if (i < length && (text[i] == '-' || text[i] == '+'))
+			negative = text[i++] == '-';
+		int64_t n = 0;
+		if (i == length)
+			throw DbRelationError("'" + field + "' is not an INT");
+		for (; i < length; i++) {
+			if (text[i] < '0' || text[i] > '9')
+				throw DbRelationError("'" + field + "' is not an INT");
+			n = n * 10 + (text[i] - '0');
+			if (n > (int64_t)INT32_MAX + 1)
+				throw DbRelationError(field + " is too big for an INT");
+		}
+		if (negative)
+			n = -n;
+		if (n > INT32_MAX)
+			throw DbRelationError(field + " is too big for an INT");
+		int32_t value = (int32_t)n;
+		memcpy(record + offset, &value, sizeof(int32_t));
+		return offset + sizeof(int32_t);
+	}
+
+	if (data_type == ColumnAttribute::DataType::BOOLEAN) {
+		if (offset + sizeof(uint8_t) > DbBlock::BLOCK_SZ)
+			throw DbRelationError("row too big");
+		uint8_t value;
+		if (strcasecmp(field.c_str(), "true") == 0 || strcasecmp(field.c_str(), "t") == 0 || field == "1")
+			value = 1;
+		else if (strcasecmp(field.c_str(), "false") == 0 || strcasecmp(field.c_str(), "f") == 0 || field == "0")
+			value = 0;
+		else
+			throw DbRelationError("'" + field + "' is not a BOOLEAN");
+		record[offset] = (char)value;
+		return offset + sizeof(uint8_t);
+	}
+	throw DbRelationError("Only know how to copy INT, TEXT, and BOOLEAN");
+}
+
+// Each line is a row, with a field for every column; blank lines are skipped, and a \r before a line break is
+// dropped. Quoted fields are unquoted into field; unquoted ones are used where they are.
+void CopyLoad::parse_csv(Chunk *chunk) const {
+	const char *p = chunk->text.data(), *end = p + chunk->text.size();
+	size_t row = chunk->first_row;
+	char record[DbBlock::BLOCK_SZ];
+	string field;
+	size_t columns = this->data_types.size();
+	chunk->records.reserve(chunk->text.size() + chunk->text.size() / 4);
+	for (; p < end; row++) {
+		if (*p == '\n' || (*p == '\r' && p + 1 < end && p[1] == '\n')) {
+			p += *p == '\n' ? 1 : 2;
+			continue;
+		}
+		uint offset = 0;
+		try {
+			for (size_t i = 0; i < columns; i++) {
+				const char *text;
+				size_t length;
+				bool quoted = p < end && *p == '"';
+				if (quoted) {
+					field.clear();
+					p++;
+					while (true) {
+						const char *quote = (const char *)memchr(p, '"', (size_t)(end - p));
+						if (quote == nullptr)
+							throw DbRelationError("quoted field never ends");
+						field.append(p, (size_t)(quote - p));
+						p = quote + 1;
+						if (p < end && *p == '"') {
+							field += '"';
+							p++;
+						} else {
+							break;
+						}
+					}
+					text = field.data();
+					length = field.size();
+				} else {
+					text = p;
+					while (p < end && *p != ',' && *p != '\n')
+						p++;
+					length = (size_t)(p - text);
+					if (length > 0 && text[length - 1] == '\r' && (p == end || *p == '\n'))
+						length--;
+				}
+				if (i + 1 < columns) {
+					if (p == end || *p != ',')
+						throw DbRelationError("has " + to_string(i + 1) + " fields, not " + to_string(columns));
+					p++;
+				} else {
+					if (quoted && p < end && *p == '\r')
+						p++;
+					if (p < end && *p != '\n')
+						throw DbRelationError("has more than " + to_string(columns) + " fields");
+					if (p < end)
+						p++;
+				}
+				offset = encode(this->data_types[i], text, length, record, offset);
+			}
+		} catch (DbRelationError &e) {
+			throw row_error(row, e.what());
+		}
+		u16 size = (u16)offset;
+		chunk->records.append((const char *)&size, sizeof(u16));
+		chunk->records.append(record, offset);
+	}
+}
+
+// The records are already marshaled; just make sure each one is laid out the way the table's columns say.
+void CopyLoad::parse_binary(Chunk *chunk) const {
+	const char *bytes = chunk->text.data();
+	size_t row = chunk->first_row;
+	for (size_t offset = 0; offset < chunk->text.size(); row++) {
+		u16 size;
+		memcpy(&size, bytes + offset, sizeof(u16));
+		offset += sizeof(u16);
+		size_t field = 0;
+		for (auto data_type : this->data_types) {
+			if (data_type == ColumnAttribute::DataType::INT) {
+				field += sizeof(int32_t);
+			} else if (data_type == ColumnAttribute::DataType::BOOLEAN) {
+				field += sizeof(uint8_t);
+			} else if (field + sizeof(u16) <= size) {
+				u16 length;
+				memcpy(&length, bytes + offset + field, sizeof(u16));
+				field += sizeof(u16) + length;
+			} else {
+				field = SIZE_MAX;
+				break;
+			}
+			if (field > size)
+				break;
+		}
+		if (field != size)
+			throw row_error(row, "doesn't match the table's columns");
+		offset += size;
+	}
+	chunk->records.swap(chunk->text);
+}
+
+
+/*
+ * CopyDump
+ */
+
+CopyDump::CopyDump(HeapTable &table, const string &path, CopyFormat format, uint parallelism, size_t chunk_bytes)
+		: table(table), path(path), format(format), parallelism(parallelism), chunk_bytes(chunk_bytes),
+		  file(nullptr), out() {
+}
+
+CopyDump::~CopyDump() {
+	if (this->file != nullptr)
+		fclose(this->file);
+}
+
+size_t CopyDump::run() {
+	this->file = fopen(this->path.c_str(), "wb");
+	if (this->file == nullptr)
+		throw file_error("open", this->path);
+	this->out.reserve(this->chunk_bytes + DbBlock::BLOCK_SZ);
+	size_t rows = 0;
+	const ColumnAttributes &column_attributes = this->table.get_column_attributes();
+
+	if (this->format == COPY_BINARY) {
+		this->out.append(CopyLoad::SIGNATURE, sizeof(CopyLoad::SIGNATURE));
+		u16 columns = (u16)column_attributes.size();
+		this->out.append((const char *)&columns, sizeof(u16));
+		for (ColumnAttribute column_attribute : column_attributes)
+			this->out += (char)column_attribute.get_data_type();
+		this->table.scan_records([this, &rows](const char *bytes, u16 size) {
+			this->out.append((const char *)&size, sizeof(u16));
+			this->out.append(bytes, size);
+			rows++;
+			if (this->out.size() >= this->chunk_bytes)
+				flush();
+		});
+	} else {
+		BatchCursor *batches = this->table.batch_cursor(&this->table.get_column_names(), nullptr, nullptr,
+														this->parallelism, true);
+		RowBatch batch;
+		try {
+			while (batches->next(batch)) {
+				for (uint row = 0; row < batch.size(); row++) {
+					if (!batch.is_selected(row))
+						continue;
+					for (uint i = 0; i < column_attributes.size(); i++) {
+						if (i > 0)
+							this->out += ',';
+						ColumnVector &column = batch.column(i);
+						if (column.data_type == ColumnAttribute::DataType::TEXT)
+							write_text(column.bytes.data() + column.offsets[row],
+									   column.offsets[row + 1] - column.offsets[row]);
+						else if (column.data_type == ColumnAttribute::DataType::BOOLEAN)
+							this->out += column.ints[row] ? "true" : "false";
+						else
+							this->out += to_string(column.ints[row]);
+					}
+					this->out += '\n';
+					rows++;
+				}
+				if (this->out.size() >= this->chunk_bytes)
+					flush();
+			}
+		} catch (...) {
+			delete batches;
+			throw;
+		}
+		delete batches;
+	}
+
+	flush();
+	FILE *file = this->file;
+	this->file = nullptr;
+	if (fclose(file) != 0)
+		throw file_error("write", this->path);
+	return rows;
+}
+
+void CopyDump::flush() {
+	if (!this->out.empty() && fwrite(this->out.data(), 1, this->out.size(), this->file) != this->out.size())
+		throw file_error("write", this->path);
+	this->out.clear();
+}
+
+// Quote a TEXT only if it has to be: if it's empty, or it has a comma, quote, or line break in it.
+void CopyDump::write_text(const char *text, uint length) {
+	bool quote = length == 0;
+	for (uint i = 0; i < length && !quote; i++)
+		quote = text[i] == ',' || text[i] == '"' || text[i] == '\n' || text[i] == '\r';
+	if (!quote) {
+		this->out.append(text, length);
+		return;
+	}
+	this->out += '"';
+	for (uint i = 0; i < length; i++) {
+		if (text[i] == '"')
+			this->out += '"';
+		this->out += text[i];
+	}
+	this->out += '"';
+}
+
+
+// test function -- returns true if all tests pass
+static bool same_file(const char *a, const char *b) {
+	FILE *fa = fopen(a, "rb"), *fb = fopen(b, "rb");
+	bool ret = fa != nullptr && fb != nullptr;
+	while (ret) {
+		int ca = fgetc(fa), cb = fgetc(fb);
+		ret = ca == cb;
+		if (ca == EOF)
+			break;
+	}
+	if (fa != nullptr)
+		fclose(fa);
+	if (fb != nullptr)
+		fclose(fb);
+	return ret;
+}
+
+static string test_name(int i) {
+	return i % 3 == 0 ? "a, \"quoted\"\nname " + to_string(i) : i % 7 == 0 ? "" : "name" + to_string(i);
+}
+
+bool test_copy() {
+	ColumnNames column_names;
+	column_names.push_back("id");
+	column_names.push_back("name");
+	column_names.push_back("ok");
+	ColumnAttributes column_attributes;
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::BOOLEAN));
+	HeapTable table("_test_copy", column_names, column_attributes);
+	table.create();
+	HeapTable again("_test_copy_again", column_names, column_attributes);
+	again.create();
+	HeapTable binary("_test_copy_binary", column_names, column_attributes);
+	binary.create();
+
+	// every kind of field, in chunks small enough that rows (and quoted line breaks) straddle them
+	const int ROWS = 3000;
+	FILE *f = fopen("_test_copy.csv", "wb");
+	for (int i = 0; i < ROWS; i++) {
+		string name = test_name(i);
+		if (i % 3 == 0)
+			name = "\"a, \"\"quoted\"\"\nname " + to_string(i) + "\"";
+		else if (i % 7 == 0)
+			name = "\"\"";
+		fprintf(f, "%d,%s,%s%s", i - ROWS / 2, name.c_str(), i % 2 ? "true" : "f", i % 5 ? "\n" : "\r\n");
+		if (i == 10)
+			fprintf(f, "\n");  // a blank line
+	}
+	fprintf(f, "-2147483648,last,0");  // no line break at the end
+	fclose(f);
+	CopyLoad load(table, "_test_copy.csv", COPY_CSV, 3, 100);
+	bool ok = load.run() == (size_t)ROWS + 1;
+
+	Handles* handles = table.select();
+	ok = ok && handles->size() == (size_t)ROWS + 1;
+	int i = 0;
+	for (auto const &handle : *handles) {
+		ValueDict *row = table.project(handle);
+		if (i < ROWS)
+			ok = ok && (*row)["id"].n == i - ROWS / 2 && (*row)["name"].s == test_name(i)
+				 && (*row)["ok"].n == i % 2;
+		else
+			ok = ok && (*row)["id"].n == INT32_MIN && (*row)["name"].s == "last" && (*row)["ok"].n == 0;
+		delete row;
+		i++;
+	}
+	delete handles;
+
+	// writing it out and back in gives the same table, in either format
+	ok = ok && CopyDump(table, "_test_copy.out.csv", COPY_CSV, 2, 1000).run() == (size_t)ROWS + 1;
+	ok = ok && CopyLoad(again, "_test_copy.out.csv", COPY_CSV, 2, 1000).run() == (size_t)ROWS + 1;
+	ok = ok && CopyDump(again, "_test_copy.again.csv", COPY_CSV).run() == (size_t)ROWS + 1;
+	ok = ok && same_file("_test_copy.out.csv", "_test_copy.again.csv");
+	ok = ok && CopyDump(table, "_test_copy.bin", COPY_BINARY, 1, 1000).run() == (size_t)ROWS + 1;
+	ok = ok && CopyLoad(binary, "_test_copy.bin", COPY_BINARY, 2, 777).run() == (size_t)ROWS + 1;
+	ok = ok && CopyDump(binary, "_test_copy.again.csv", COPY_CSV).run() == (size_t)ROWS + 1;
+	ok = ok && same_file("_test_copy.out.csv", "_test_copy.again.csv");
+
+	// a bad row anywhere means none of the rows go in, and the error says which one
+	f = fopen("_test_copy.csv", "wb");
+	for (int i = 0; i < 500; i++)
+		fprintf(f, "%d,x,t\n", i);
+	fprintf(f, "12x,x,t\n");
+	fclose(f);
+	bool threw = false;
+	try {
+		CopyLoad(again, "_test_copy.csv", COPY_CSV, 2, 64).run();
+	} catch (DbRelationError &e) {
+		threw = string(e.what()).find("row 501") != string::npos;
+	}
+	ok = ok && threw;
+	handles = again.select();
+	ok = ok && handles->size() == (size_t)ROWS + 1;
+	delete handles;
+	for (auto const &bad : {"1,x\n", "1,x,t,2\n", "1,\"x,t\n", "99999999999,x,t\n", "1,x,maybe\n"}) {
+		f = fopen("_test_copy.csv", "wb");
+		fputs(bad, f);
+		fclose(f);
+		threw = false;
+		try {
+			CopyLoad(again, "_test_copy.csv", COPY_CSV, 1).run();
+		} catch (DbRelationError &e) {
+			threw = true;
+		}
+		ok = ok && threw;
+	}
+	threw = false;
+	try {
+		CopyLoad(again, "_test_copy.csv", COPY_BINARY).run();  // not a binary file
+	} catch (DbRelationError &e) {
+		threw = true;
+	}
+	ok = ok && threw;
+
+	// rollback() takes back what run() loaded
+	CopyLoad reload(again, "_test_copy.bin", COPY_BINARY);
+	ok = ok && reload.run() == (size_t)ROWS + 1;
+	reload.rollback();
+	handles = again.select();
+	ok = ok && handles->size() == (size_t)ROWS + 1;
+	delete handles;
+
+	for (auto const &name : {"_test_copy.csv", "_test_copy.out.csv", "_test_copy.again.csv", "_test_copy.bin"})
+		remove(name);
+	binary.drop();
+	again.drop();
+	table.drop();
+	return ok;
+}
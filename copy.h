@@ -0,0 +1,151 @@
+/**
+ * @file copy.h - COPY: bulk loading a table from a file, and writing one out to a file.
+ * CopyLoad
+ * CopyDump
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "heap_storage.h"
+
+/**
+ * The file formats COPY reads and writes:
+ *   COPY_CSV     one row per line, with its fields separated by commas. A field with a comma, a double quote,
+ *                or a line break in it (or an empty TEXT) is quoted with double quotes, and a double quote inside
+ *                it is doubled. BOOLEANs are true or false (t, f, 1, and 0 are also read).
+ *   COPY_BINARY  the 8-byte SIGNATURE, the u16 number of columns, and a byte for each column's type; then each
+ *                row as its u16 size followed by the row as HeapTable marshals it, so loading is just copying.
+ */
+enum CopyFormat { COPY_CSV, COPY_BINARY };
+
+/**
+ * @class CopyLoad - appends the rows in a file to a table, on a pipeline of threads
+ *
+ * A reader thread reads the file a chunk of about chunk_bytes at a time, cut at the end of the last whole
+ * row in it. Parser threads turn each chunk's rows into records, marshaled as HeapTable would, and the
+ * calling thread appends the records, in file order, to the end of the table through a HeapLoader, so
+ * each block is written once, in order. The reader stalls once parsers * QUEUED_CHUNKS_PER_PARSER chunks
+ * are waiting to be parsed or written. Indices are left alone: the caller rebuilds them afterward.
+ */
+class CopyLoad {
+public:
+	static const size_t DEFAULT_CHUNK_BYTES = 1024 * 1024;
+	static const uint QUEUED_CHUNKS_PER_PARSER = 4;
+	static const char SIGNATURE[8];  // starts a COPY_BINARY file
+
+	/**
+	 * @param table        table to load
+	 * @param path         file to read
+	 * @param format       its format
+	 * @param parsers      number of parser threads (0 for as many as there are hardware threads to spare)
+	 * @param chunk_bytes  about how much of the file to read at a time
+	 */
+	CopyLoad(HeapTable &table, const std::string &path, CopyFormat format, uint parsers = 0,
+			size_t chunk_bytes = DEFAULT_CHUNK_BYTES);
+	virtual ~CopyLoad();
+
+	/**
+	 * Read the whole file into the table. If a row can't go in (or the file can't be read), none of the rows
+	 * do, and the DbRelationError says which row it was.
+	 * @returns  number of rows loaded
+	 */
+	size_t run();
+
+	/**
+	 * Take the rows run() loaded back out of the table (e.g., when an index can't be rebuilt with them).
+	 */
+	void rollback();
+
+protected:
+	// a piece of the file: whole rows, to be parsed into records
+	struct Chunk {
+		Chunk() : sequence(0), text(), first_row(0), records() {}
+		size_t sequence;      // where it is among the chunks, from 0
+		std::string text;     // the rows as they are in the file
+		size_t first_row;     // 1-based row number of its first row in the file
+		std::string records;  // once parsed: each record as its u16 size and then its bytes
+	};
+
+	HeapTable &table;
+	std::string path;
+	CopyFormat format;
+	uint parsers;
+	size_t chunk_bytes;
+	std::vector<ColumnAttribute::DataType> data_types;  // of the table's columns
+	HeapLoader loader;
+
+	// the pipeline
+	std::deque<Chunk*> unparsed;     // read but not yet taken by a parser
+	std::map<size_t, Chunk*> parsed; // by sequence number, not yet written
+	size_t read_count;               // chunks read so far
+	size_t written;                  // chunks written so far
+	bool reading_done;               // no more chunks are coming
+	bool stopping;                   // an error means everyone should give up
+	std::exception_ptr error;        // first exception thrown on a pipeline thread
+	std::mutex lock;                 // guards everything above from unparsed on
+	std::condition_variable changed;
+	std::vector<std::thread> threads;
+
+	void read();
+	void parse();
+	void fail();
+	void stop();
+	bool add_chunk(Chunk *chunk);
+	size_t read_header(const std::string &text) const;
+	size_t cut(const std::string &text, size_t start, size_t &rows) const;
+	void parse_csv(Chunk *chunk) const;
+	void parse_binary(Chunk *chunk) const;
+	void write(const Chunk *chunk);
+	DbRelationError row_error(size_t row, const std::string &problem) const;
+};
+
+/**
+ * @class CopyDump - writes every row of a table to a file
+ *
+ * COPY_BINARY copies the records straight from the table's blocks. COPY_CSV formats the batches of a
+ * batch scan (decoded on up to parallelism threads). Either way the output goes out about chunk_bytes
+ * at a time.
+ */
+class CopyDump {
+public:
+	/**
+	 * @param table        table to write
+	 * @param path         file to write it to (replaced if it exists)
+	 * @param format       format to write it in
+	 * @param parallelism  threads the table may be scanned with
+	 * @param chunk_bytes  about how much to write at a time
+	 */
+	CopyDump(HeapTable &table, const std::string &path, CopyFormat format, uint parallelism = 1,
+			size_t chunk_bytes = CopyLoad::DEFAULT_CHUNK_BYTES);
+	virtual ~CopyDump();
+
+	/**
+	 * Write the file.
+	 * @returns  number of rows written
+	 */
+	size_t run();
+
+protected:
+	HeapTable &table;
+	std::string path;
+	CopyFormat format;
+	uint parallelism;
+	size_t chunk_bytes;
+	FILE *file;
+	std::string out;  // written but not yet flushed to file
+
+	void flush();
+	void write_text(const char *text, uint length);
+};
+
+bool test_copy();
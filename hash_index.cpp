@@ -0,0 +1,446 @@
+/**
+ * @file hash_index.cpp - implementation of the linear hashing index.
+ * HashIndex: DbIndex
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#include "hash_index.h"
+#include <algorithm>
+#include <cstring>
+using namespace std;
+
+// raw block accessors (see the layout in hash_index.h)
+static u_int16_t &block_count(char *data) { return *(u_int16_t*)data; }
+static u_int16_t &block_used(char *data) { return *(u_int16_t*)(data + 2); }
+static BlockID &block_next(char *data) { return *(BlockID*)(data + 4); }
+
+HashIndex::HashIndex(DbRelation& relation, Identifier name, ColumnNames key_columns, bool unique)
+		: DbIndex(relation, name, key_columns, unique),
+		  closed(true),
+		  file(relation.get_table_name() + "-" + name),
+		  overflow(relation.get_table_name() + "-" + name + "-overflow"),
+		  key_profile(),
+		  fill_percent(DEFAULT_FILL_PERCENT),
+		  level(INITIAL_LEVEL),
+		  split(0),
+		  entries(0),
+		  used(0),
+		  free_list(0) {
+	ColumnAttributes *column_attributes = relation.get_column_attributes(this->key_columns);
+	for (ColumnAttribute &column_attribute : *column_attributes)
+		this->key_profile.push_back(column_attribute.get_data_type());
+	delete column_attributes;
+}
+
+HashIndex::~HashIndex() {
+}
+
+/**Create the index with 2^INITIAL_LEVEL empty buckets, then insert every row of the relation,
+splitting buckets as they fill.*/
+void HashIndex::create() {
+	this->file.create();  // makes block 1, the META block
+	this->overflow.create();  // its block 1 goes unused; a next pointer of 0 ends a chain
+	this->level = INITIAL_LEVEL;
+	this->split = 0;
+	this->entries = 0;
+	this->used = 0;
+	this->free_list = 0;
+	for (uint b = 0; b < bucket_count(); b++) {
+		SlottedPage *block = this->file.get_new();
+		init_bucket(block);
+		this->file.put(block);
+		delete block;
+	}
+	save_meta();
+	this->closed = false;
+
+	RowCursor *rows = relation.cursor();
+	Handle handle;
+	while (rows->next(handle))
+		insert(handle);
+	delete rows;
+}
+
+/**Drop the index.*/
+void HashIndex::drop() {
+	this->file.drop();
+	this->overflow.drop();
+	this->closed = true;
+}
+
+/**Open existing index. Enables: lookup, insert, delete.*/
+void HashIndex::open() {
+	if (this->closed) {
+		this->file.open();
+		this->overflow.open();
+		read_meta();
+		this->closed = false;
+	}
+}
+
+/**Closes the index. Disables: lookup, insert, delete.*/
+void HashIndex::close() {
+	this->file.close();
+	this->overflow.close();
+	this->closed = true;
+}
+
+void HashIndex::set_fill_percent(uint fill_percent) {
+	if (fill_percent == 0 || fill_percent > 100)
+		throw DbRelationError("fill percent must be between 1 and 100");
+	this->fill_percent = fill_percent;
+}
+
+/** Find all the rows whose columns are equal to key. Assumes key is a dictionary whose keys are the column
+ names in the index. Returns a list of row handles, sorted by block.*/
+Handles* HashIndex::lookup(ValueDict* key_dict) const {
+	string key = marshal_key(key_dict);
+	Handles *handles = find(key, hash(key), false);
+	sort(handles->begin(), handles->end());
+	return handles;
+}
+
+/**Insert a row with the given handle. Row must exist in relation already.*/
+void HashIndex::insert(Handle handle) {
+	open();
+	ValueDict *row = relation.project(handle, &this->key_columns);
+	string key = marshal_key(row);
+	delete row;
+	uint32_t h = hash(key);
+	if (this->unique) {
+		Handles *found = find(key, h, true);
+		bool duplicate = !found->empty();
+		delete found;
+		if (duplicate)
+			throw DbRelationError("Duplicate keys are not allowed in unique index");
+	}
+
+	string entry(ENTRY_HEADER_SIZE, '\0');
+	*(uint32_t*)&entry[0] = h;
+	*(BlockID*)&entry[4] = handle.first;
+	*(RecordID*)&entry[8] = handle.second;
+	*(u_int16_t*)&entry[10] = (u_int16_t)key.size();
+	entry += key;
+	if (entry.size() > CAPACITY)
+		throw DbRelationError("key is too big to index");
+	add_entry(bucket(h), entry);
+	this->entries++;
+	this->used += entry.size();
+	if (this->used > (uint64_t)bucket_count() * CAPACITY * this->fill_percent / 100)
+		split_bucket();
+	save_meta();
+}
+
+/**Delete the index entry for a row. Row must still exist in relation. Emptied overflow blocks
+stay on their chain to take later inserts.*/
+void HashIndex::del(Handle handle) {
+	open();
+	ValueDict *row = relation.project(handle, &this->key_columns);
+	string key = marshal_key(row);
+	delete row;
+	uint32_t h = hash(key);
+
+	SlottedPage *block = this->file.get(bucket_block(bucket(h)));
+	HeapFile *block_file = &this->file;
+	while (block != nullptr) {
+		char *data = (char*)block->get_data();
+		char *entry = data + HEADER_SIZE, *end = entry + block_used(data);
+		while (entry < end) {
+			uint length = ENTRY_HEADER_SIZE + *(u_int16_t*)(entry + 10);
+			if (*(uint32_t*)entry == h && *(BlockID*)(entry + 4) == handle.first
+					&& *(RecordID*)(entry + 8) == handle.second && length == ENTRY_HEADER_SIZE + key.size()
+					&& memcmp(entry + ENTRY_HEADER_SIZE, key.data(), key.size()) == 0) {
+				memmove(entry, entry + length, end - entry - length);
+				block_count(data)--;
+				block_used(data) -= length;
+				block_file->put(block);
+				delete block;
+				this->entries--;
+				this->used -= length;
+				save_meta();
+				return;
+			}
+			entry += length;
+		}
+		BlockID next = block_next(data);
+		delete block;
+		block = next == 0 ? nullptr : this->overflow.get(next);
+		block_file = &this->overflow;
+	}
+	throw DbRelationError("Key to delete is not in the index");
+}
+
+/**Turn the key columns of key into bytes, in key column order.*/
+string HashIndex::marshal_key(const ValueDict* key) const {
+	string bytes;
+	uint col_num = 0;
+	for (auto const &column_name : this->key_columns) {
+		ValueDict::const_iterator found = key->find(column_name);
+		if (found == key->end())
+			throw DbRelationError("hash index lookup needs a value for every key column");
+		const Value &value = found->second;
+		ColumnAttribute::DataType data_type = this->key_profile[col_num++];
+		if (data_type == ColumnAttribute::DataType::INT) {
+			int32_t n = value.n;
+			bytes.append((char*)&n, sizeof(n));
+		} else if (data_type == ColumnAttribute::DataType::TEXT) {
+			u_int16_t size = (u_int16_t)value.s.length();
+			bytes.append((char*)&size, sizeof(size));
+			bytes += value.s;
+		} else if (data_type == ColumnAttribute::DataType::BOOLEAN) {
+			bytes.push_back((char)(value.n != 0));
+		} else {
+			throw DbRelationError("Only know how to marshal INT, TEXT, or BOOLEAN");
+		}
+	}
+	return bytes;
+}
+
+/**FNV-1a, with a final mix so the low bits we address buckets by depend on every byte.*/
+uint32_t HashIndex::hash(const string& key) {
+	uint32_t h = 2166136261U;
+	for (char c : key) {
+		h ^= (uint8_t)c;
+		h *= 16777619U;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
+
+/**Linear hashing address: buckets already split this round use one more bit of the hash.*/
+uint HashIndex::bucket(uint32_t hash) const {
+	uint b = hash & ((1U << this->level) - 1);
+	if (b < this->split)
+		b = hash & ((2U << this->level) - 1);
+	return b;
+}
+
+void HashIndex::read_meta() {
+	SlottedPage *block = this->file.get(META);
+	const uint32_t *meta = (const uint32_t*)block->get_data();
+	this->level = meta[0];
+	this->split = meta[1];
+	this->entries = meta[2];
+	this->used = meta[3];
+	this->free_list = meta[4];
+	delete block;
+}
+
+void HashIndex::save_meta() {
+	SlottedPage *block = this->file.get(META);
+	uint32_t *meta = (uint32_t*)block->get_data();
+	meta[0] = this->level;
+	meta[1] = this->split;
+	meta[2] = this->entries;
+	meta[3] = this->used;
+	meta[4] = this->free_list;
+	this->file.put(block);
+	delete block;
+}
+
+void HashIndex::init_bucket(SlottedPage *block) {
+	char *data = (char*)block->get_data();
+	block_count(data) = 0;
+	block_used(data) = 0;
+	block_next(data) = 0;
+}
+
+/**Put entry in the first block of the bucket's chain with room for it, extending the chain if none has.*/
+void HashIndex::add_entry(uint bucket, const string& entry) {
+	SlottedPage *block = this->file.get(bucket_block(bucket));
+	HeapFile *block_file = &this->file;
+	while (true) {
+		char *data = (char*)block->get_data();
+		if (block_used(data) + entry.size() <= CAPACITY) {
+			memcpy(data + HEADER_SIZE + block_used(data), entry.data(), entry.size());
+			block_count(data)++;
+			block_used(data) += entry.size();
+			block_file->put(block);
+			delete block;
+			return;
+		}
+		SlottedPage *next;
+		if (block_next(data) != 0) {
+			next = this->overflow.get(block_next(data));
+		} else {
+			if (this->free_list != 0) {
+				next = this->overflow.get(this->free_list);
+				this->free_list = block_next((char*)next->get_data());
+			} else {
+				next = this->overflow.get_new();
+			}
+			init_bucket(next);
+			block_next(data) = next->get_block_id();
+			block_file->put(block);
+		}
+		delete block;
+		block = next;
+		block_file = &this->overflow;
+	}
+}
+
+/**Split the bucket at the split pointer: its entries are spread between it and a new bucket at the
+end of the file, according to one more bit of their hashes. Its overflow blocks go on the free list.*/
+void HashIndex::split_bucket() {
+	uint old_bucket = this->split;
+	SlottedPage *block = this->file.get_new();
+	if (block->get_block_id() != bucket_block(bucket_count()))
+		throw DbRelationError("hash index buckets are out of sequence");
+	init_bucket(block);
+	this->file.put(block);
+	delete block;
+
+	vector<string> moving;
+	block = this->file.get(bucket_block(old_bucket));
+	bool primary = true;
+	while (block != nullptr) {
+		char *data = (char*)block->get_data();
+		char *entry = data + HEADER_SIZE, *end = entry + block_used(data);
+		while (entry < end) {
+			uint length = ENTRY_HEADER_SIZE + *(u_int16_t*)(entry + 10);
+			moving.push_back(string(entry, length));
+			entry += length;
+		}
+		BlockID next = block_next(data);
+		block_count(data) = 0;
+		block_used(data) = 0;
+		if (primary) {
+			block_next(data) = 0;
+			this->file.put(block);
+		} else {
+			block_next(data) = this->free_list;
+			this->free_list = block->get_block_id();
+			this->overflow.put(block);
+		}
+		delete block;
+		block = next == 0 ? nullptr : this->overflow.get(next);
+		primary = false;
+	}
+
+	if (++this->split == (1U << this->level)) {
+		this->level++;
+		this->split = 0;
+	}
+	for (auto const &entry : moving)
+		add_entry(bucket(*(const uint32_t*)entry.data()), entry);
+}
+
+/**All the handles in key's bucket chain with key (just the first, if first_only).*/
+Handles *HashIndex::find(const string& key, uint32_t hash, bool first_only) const {
+	Handles *handles = new Handles();
+	SlottedPage *block = this->file.get(bucket_block(bucket(hash)));
+	while (block != nullptr) {
+		char *data = (char*)block->get_data();
+		const char *entry = data + HEADER_SIZE, *end = entry + block_used(data);
+		while (entry < end) {
+			uint key_size = *(const u_int16_t*)(entry + 10);
+			if (*(const uint32_t*)entry == hash && key_size == key.size()
+					&& memcmp(entry + ENTRY_HEADER_SIZE, key.data(), key_size) == 0) {
+				handles->push_back(Handle(*(const BlockID*)(entry + 4), *(const RecordID*)(entry + 8)));
+				if (first_only) {
+					delete block;
+					return handles;
+				}
+			}
+			entry += ENTRY_HEADER_SIZE + key_size;
+		}
+		BlockID next = block_next(data);
+		delete block;
+		block = next == 0 ? nullptr : this->overflow.get(next);
+	}
+	return handles;
+}
+
+/**To test the hash index (insert, lookup, splits, and delete)*/
+bool test_hash_index() {
+	ColumnNames column_names;
+	column_names.push_back("a");
+	column_names.push_back("b");
+	ColumnAttributes column_attributes;
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+	HeapTable table1("_test_hash_index_cpp", column_names, column_attributes);
+	table1.create();
+	bool result = true;
+
+	Handles all_handles;
+	for (int i = 0; i < 3000; i++) {
+		ValueDict row;
+		row["a"] = i;
+		row["b"] = Value("group" + to_string(i % 10));
+		all_handles.push_back(table1.insert(&row));
+	}
+
+	ColumnNames a_col{"a"}, b_col{"b"};
+	HashIndex by_a(table1, "fooindex_a", a_col, true);
+	HashIndex by_b(table1, "fooindex_b", b_col, false);
+	by_a.create();
+	by_b.create();
+	if (by_a.bucket_count() <= (1U << HashIndex::INITIAL_LEVEL) || by_b.bucket_count() <= (1U << HashIndex::INITIAL_LEVEL))
+		result = false;
+
+	// every a is found, and every b group holds a tenth of the rows, sorted by block
+	ValueDict key;
+	for (int i = 0; i < 3000; i++) {
+		key["a"] = i;
+		Handles *handles = by_a.lookup(&key);
+		if (handles->size() != 1 || (*handles)[0] != all_handles[i])
+			result = false;
+		delete handles;
+	}
+	auto group_size = [&](HashIndex &index, int group) {
+		ValueDict group_key;
+		group_key["b"] = Value("group" + to_string(group));
+		Handles *handles = index.lookup(&group_key);
+		uint size = (uint)handles->size();
+		if (!is_sorted(handles->begin(), handles->end()))
+			size = (uint)-1;
+		delete handles;
+		return size;
+	};
+	for (int group = 0; group < 10; group++)
+		if (group_size(by_b, group) != 300)
+			result = false;
+	if (group_size(by_b, 10) != 0)
+		result = false;
+
+	// a unique index rejects a second row with the same key
+	ValueDict dup_row;
+	dup_row["a"] = 7;
+	dup_row["b"] = Value("group7");
+	Handle dup = table1.insert(&dup_row);
+	try {
+		by_a.insert(dup);
+		result = false;
+	} catch (DbRelationError &) {}
+	by_b.insert(dup);
+	if (group_size(by_b, 7) != 301)
+		result = false;
+
+	// state survives close and a new HashIndex on the same name; deleting every other row of group 3 leaves the rest
+	by_b.close();
+	HashIndex by_b_back(table1, "fooindex_b", b_col, false);
+	by_b_back.open();
+	if (group_size(by_b_back, 7) != 301)
+		result = false;
+	for (int i = 3; i < 3000; i += 20)
+		by_b_back.del(all_handles[i]);
+	if (group_size(by_b_back, 3) != 150 || group_size(by_b_back, 4) != 300)
+		result = false;
+	by_b_back.del(dup);
+	if (group_size(by_b_back, 7) != 300)
+		result = false;
+	try {
+		by_b_back.del(dup);
+		result = false;
+	} catch (DbRelationError &) {}
+
+	by_a.drop();
+	by_b_back.drop();
+	table1.drop();
+	return result;
+}
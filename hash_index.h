@@ -0,0 +1,79 @@
+/**
+ * @file hash_index.h - Linear hashing index on top of HeapFile buckets.
+ * HashIndex
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include "storage_engine.h"
+#include "heap_storage.h"
+
+/**
+ * @class HashIndex - equality-only index using linear hashing
+ *
+ * Block 1 of the index file holds the hashing state; bucket b is block b + 2. Full buckets
+ * chain to overflow blocks kept in a second file. Whenever the entries average more than
+ * fill_percent of a bucket, the bucket at the split pointer is split in two, so the table
+ * grows one bucket at a time and a lookup reads a single chain.
+ *
+ * Bucket and overflow block layout (raw, not slotted):
+ *   u16 count | u16 bytes used | u32 next overflow block | entries
+ * Entry layout:
+ *   u32 hash | u32 block id | u16 record id | u16 key size | marshaled key
+ * Every (key, handle) pair is its own entry, so keys need not be unique.
+ */
+class HashIndex : public DbIndex {
+public:
+    static const uint DEFAULT_FILL_PERCENT = 75;  // split once entries average this full
+    static const uint INITIAL_LEVEL = 2;          // a new index has 2^INITIAL_LEVEL buckets
+
+    HashIndex(DbRelation& relation, Identifier name, ColumnNames key_columns, bool unique);
+    virtual ~HashIndex();
+
+    virtual void create();
+    virtual void drop();
+
+    virtual void open();
+    virtual void close();
+
+    virtual Handles* lookup(ValueDict* key) const;
+
+    virtual void insert(Handle handle);
+    virtual void del(Handle handle);
+
+    void set_fill_percent(uint fill_percent);
+    uint bucket_count() const { return (1U << this->level) + this->split; }
+
+protected:
+    static const BlockID META = 1;
+    static const uint HEADER_SIZE = 8;
+    static const uint ENTRY_HEADER_SIZE = 12;
+    static const uint CAPACITY = DbBlock::BLOCK_SZ - HEADER_SIZE;  // entry bytes a block holds
+
+    bool closed;
+    mutable HeapFile file;      // hashing state and primary buckets
+    mutable HeapFile overflow;  // overflow blocks chained off full buckets
+    std::vector<ColumnAttribute::DataType> key_profile;
+    uint fill_percent;
+    uint level;          // buckets below the split pointer are addressed with level + 1 bits, the rest with level
+    uint split;          // next bucket to split
+    uint32_t entries;    // number of (key, handle) entries
+    uint32_t used;       // bytes of all the entries
+    BlockID free_list;   // overflow blocks released by splits, chained through their next pointers
+
+    std::string marshal_key(const ValueDict* key) const;
+    static uint32_t hash(const std::string& key);
+    uint bucket(uint32_t hash) const;
+    static BlockID bucket_block(uint bucket) { return bucket + META + 1; }
+    void read_meta();
+    void save_meta();
+    void init_bucket(SlottedPage *block);
+    void add_entry(uint bucket, const std::string& entry);
+    void split_bucket();
+    Handles *find(const std::string& key, uint32_t hash, bool first_only) const;
+};
+
+bool test_hash_index();
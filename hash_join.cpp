@@ -0,0 +1,513 @@
+/**
+ * @file hash_join.cpp - implementation of:
+ * HashJoinCursor
+ * IndexJoinCursor
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#include <algorithm>
+#include <functional>
+#include "hash_join.h"
+#include "btree.h"
+using namespace std;
+
+// Positions of the given columns in a batch.
+static vector<uint> column_positions(RowBatch &batch, const ColumnNames &column_names) {
+	vector<uint> ret;
+	for (auto const& column_name: column_names)
+		ret.push_back((uint) batch.column_index(column_name));
+	return ret;
+}
+
+static ColumnAttributes column_attributes(RowBatch &batch) {
+	ColumnAttributes ret;
+	for (uint i = 0; i < batch.get_column_names().size(); i++)
+		ret.push_back(ColumnAttribute(batch.column(i).data_type));
+	return ret;
+}
+
+HashJoinCursor::HashJoinCursor(BatchCursor *left, const JoinInput &left_input, BatchCursor *right,
+		const JoinInput &right_input, bool build_left, size_t memory_budget)
+		: build_source(build_left ? left : right), probe_source(build_left ? right : left),
+		  build_input(build_left ? left_input : right_input), probe_input(build_left ? right_input : left_input),
+		  build_left(build_left), memory_budget(memory_budget), built(false), build_names(), build_attributes(),
+		  build_keys(), build_columns(), table(), build_bytes(0), build_partitions(), probe_partitions(),
+		  partition(0), probe(nullptr), probe_names(), probe_attributes(), probe_keys(), probe_batch(), probe_row(0),
+		  match_row(0), matches(), output_names(), output_attributes(), output_sources() {
+	if (left_input.keys.size() != right_input.keys.size())
+		throw DbRelationError("join inputs have different numbers of key columns");
+	this->matches = make_pair(this->table.end(), this->table.end());
+}
+
+// Release the inputs and throw away any partitions.
+HashJoinCursor::~HashJoinCursor() {
+	if (this->probe != this->probe_source)
+		delete this->probe;
+	delete this->build_source;
+	delete this->probe_source;
+	for (auto partitions: {&this->build_partitions, &this->probe_partitions}) {
+		for (HeapTable *partition: *partitions) {
+			if (partition != nullptr) {
+				partition->drop();
+				delete partition;
+			}
+		}
+	}
+}
+
+// Next batch of joined rows. The first call reads all of the build input (and, if that spills,
+// all of the probe input, too).
+bool HashJoinCursor::next(RowBatch &batch) {
+	if (!this->built)
+		build();
+	if (this->build_names.empty() || this->probe_names.empty())
+		return false;  // one of the inputs was empty
+	batch.reset(this->output_names, this->output_attributes);
+	while (!batch.full()) {
+		if (this->matches.first != this->matches.second) {
+			uint build_row = this->matches.first->second;
+			for (uint i = 0; i < this->output_sources.size(); i++) {
+				const pair<bool, uint> &source = this->output_sources[i];
+				if (source.first)
+					batch.column(i).push(this->build_columns[source.second], build_row);
+				else
+					batch.column(i).push(this->probe_batch.column(source.second), this->match_row);
+			}
+			batch.add_row(Handle());
+			this->matches.first++;
+			continue;
+		}
+		if (this->probe_row >= this->probe_batch.size()) {
+			if (!next_probe_batch())
+				break;
+			continue;
+		}
+		if (this->probe_batch.is_selected(this->probe_row)) {
+			string key;
+			for (uint column: this->probe_keys)
+				this->probe_batch.column(column).append_key(key, this->probe_row);
+			this->matches = this->table.equal_range(key);
+			this->match_row = this->probe_row;
+		}
+		this->probe_row++;
+	}
+	return batch.size() > 0;
+}
+
+// Read the build input into the hash table (or its partitions), partition the probe input too if we
+// spilled, then get the first probe batch so that we know the output columns' types.
+void HashJoinCursor::build() {
+	this->built = true;
+	RowBatch batch;
+	while (this->build_source->next(batch)) {
+		if (this->build_names.empty()) {
+			this->build_names = batch.get_column_names();
+			this->build_attributes = column_attributes(batch);
+			this->build_keys = column_positions(batch, this->build_input.keys);
+			for (uint i = 0; i < this->build_names.size(); i++)
+				this->build_columns.push_back(ColumnVector(batch.column(i).data_type));
+		}
+		for (uint row = 0; row < batch.size(); row++)
+			if (batch.is_selected(row))
+				add_build_row(batch, row, true);
+	}
+	if (this->build_names.empty())
+		return;  // nothing to join with
+
+	if (spilled()) {
+		while (this->probe_source->next(batch)) {
+			if (this->probe_names.empty()) {
+				this->probe_names = batch.get_column_names();
+				this->probe_attributes = column_attributes(batch);
+				this->probe_keys = column_positions(batch, this->probe_input.keys);
+			}
+			for (uint row = 0; row < batch.size(); row++) {
+				if (!batch.is_selected(row))
+					continue;
+				string key;
+				for (uint column: this->probe_keys)
+					batch.column(column).append_key(key, row);
+				spill_row(this->probe_partitions, this->probe_names, this->probe_attributes, key, batch.row(row), 'p');
+			}
+		}
+		if (this->probe_names.empty())
+			return;
+	} else {
+		this->probe = this->probe_source;
+	}
+	if (next_probe_batch())
+		set_output();
+}
+
+void HashJoinCursor::add_build_row(RowBatch &batch, uint row, bool spill_allowed) {
+	string key;
+	for (uint column: this->build_keys)
+		batch.column(column).append_key(key, row);
+	if (spilled() && spill_allowed) {
+		spill_row(this->build_partitions, this->build_names, this->build_attributes, key, batch.row(row), 'b');
+		return;
+	}
+	uint build_row = (uint) this->table.size();
+	size_t bytes = key.size() + 32;  // about what the hash table's node costs
+	for (uint i = 0; i < this->build_columns.size(); i++) {
+		this->build_columns[i].push(batch.column(i), row);
+		if (this->build_columns[i].data_type == ColumnAttribute::DataType::TEXT)
+			bytes += sizeof(uint32_t) + this->build_columns[i].offsets[build_row + 1] - this->build_columns[i].offsets[build_row];
+		else
+			bytes += sizeof(int32_t);
+	}
+	this->table.emplace(key, build_row);
+	this->build_bytes += bytes;
+	if (spill_allowed && this->build_bytes > this->memory_budget)
+		spill();
+}
+
+// The build input is too big: move what we have so far out to partitions.
+void HashJoinCursor::spill() {
+	this->build_partitions.assign(SPILL_PARTITIONS, nullptr);
+	this->probe_partitions.assign(SPILL_PARTITIONS, nullptr);
+	for (auto const& entry: this->table) {
+		ValueDict *row = new ValueDict();
+		for (uint i = 0; i < this->build_names.size(); i++)
+			(*row)[this->build_names[i]] = this->build_columns[i].value(entry.second);
+		spill_row(this->build_partitions, this->build_names, this->build_attributes, entry.first, row, 'b');
+	}
+	this->table.clear();
+	for (auto &column: this->build_columns)
+		column.clear();
+	this->build_bytes = 0;
+}
+
+// Add a row (which we free) to the partition for its key, creating the partition if need be.
+void HashJoinCursor::spill_row(vector<HeapTable*> &partitions, const ColumnNames &names,
+		const ColumnAttributes &attributes, const string &key, ValueDict *row, char side) {
+	static uint serial = 0;
+	uint which = (uint) (hash<string>()(key) % SPILL_PARTITIONS);
+	if (partitions[which] == nullptr) {
+		partitions[which] = new HeapTable("_hash_join_" + to_string(++serial) + side + to_string(which), names, attributes);
+		partitions[which]->create();
+	}
+	partitions[which]->insert(row);
+	delete row;
+}
+
+// Move on to the next probe batch, going on to the next pair of partitions once one is used up.
+bool HashJoinCursor::next_probe_batch() {
+	while (true) {
+		if (this->probe != nullptr && this->probe->next(this->probe_batch)) {
+			if (this->probe_names.empty()) {
+				this->probe_names = this->probe_batch.get_column_names();
+				this->probe_attributes = column_attributes(this->probe_batch);
+				this->probe_keys = column_positions(this->probe_batch, this->probe_input.keys);
+			}
+			this->probe_row = 0;
+			return true;
+		}
+		if (!spilled())
+			return false;
+
+		// load the next pair of partitions that both have rows
+		delete this->probe;
+		this->probe = nullptr;
+		while (this->partition < SPILL_PARTITIONS
+		       && (this->build_partitions[this->partition] == nullptr || this->probe_partitions[this->partition] == nullptr))
+			this->partition++;
+		if (this->partition == SPILL_PARTITIONS)
+			return false;
+		this->table.clear();
+		for (auto &column: this->build_columns)
+			column.clear();
+		this->matches = make_pair(this->table.end(), this->table.end());
+		BatchCursor *build_partition = this->build_partitions[this->partition]->batch_cursor(&this->build_names);
+		RowBatch batch;
+		while (build_partition->next(batch))
+			for (uint row = 0; row < batch.size(); row++)
+				add_build_row(batch, row, false);  // a partition is assumed to fit
+		delete build_partition;
+		this->probe = this->probe_partitions[this->partition]->batch_cursor(&this->probe_names);
+		this->partition++;
+	}
+}
+
+// Work out where each output column comes from: left columns first, then right.
+void HashJoinCursor::set_output() {
+	const JoinInput &left = this->build_left ? this->build_input : this->probe_input;
+	const JoinInput &right = this->build_left ? this->probe_input : this->build_input;
+	for (auto input: {&left, &right}) {
+		bool from_build = input == &this->build_input;
+		const ColumnNames &names = from_build ? this->build_names : this->probe_names;
+		const ColumnAttributes &attributes = from_build ? this->build_attributes : this->probe_attributes;
+		for (uint i = 0; i < input->columns.size(); i++) {
+			auto it = find(names.begin(), names.end(), input->columns[i]);
+			if (it == names.end())
+				throw DbRelationError("join input does not have column named '" + input->columns[i] + "'");
+			uint position = (uint) (it - names.begin());
+			this->output_names.push_back(input->names[i]);
+			this->output_attributes.push_back(attributes[position]);
+			this->output_sources.push_back(make_pair(from_build, position));
+		}
+	}
+}
+
+IndexJoinCursor::IndexJoinCursor(BatchCursor *outer, const JoinInput &outer_input, DbRelation &inner, DbIndex &index,
+		const JoinInput &inner_input, const ValueDict *where, const ValueRanges *ranges, bool outer_left)
+		: outer(outer), outer_input(outer_input), inner(inner), index(index), inner_input(inner_input), where(),
+		  ranges(), outer_left(outer_left), inner_names(inner_input.columns), inner_attributes(), outer_batch(),
+		  outer_keys(), outer_rows(), matches(), outer_row(0), match(0), inner_batch(), inner_outer_rows(),
+		  output_names(), output_attributes(), output_sources() {
+	const ColumnNames &key_columns = index.get_key_columns();
+	if (outer_input.keys.size() != inner_input.keys.size() || key_columns.size() != inner_input.keys.size())
+		throw DbRelationError("index join keys do not match the index");
+	for (auto const &key_column: key_columns)
+		if (find(inner_input.keys.begin(), inner_input.keys.end(), key_column) == inner_input.keys.end())
+			throw DbRelationError("index join keys do not match the index");
+	if (where != nullptr)
+		this->where = *where;
+	if (ranges != nullptr)
+		this->ranges = *ranges;
+	auto need = [this](const Identifier &column) {
+		if (find(this->inner_names.begin(), this->inner_names.end(), column) == this->inner_names.end())
+			this->inner_names.push_back(column);
+	};
+	for (auto const &term: this->where)
+		need(term.first);
+	for (auto const &term: this->ranges)
+		need(term.first);
+	ColumnAttributes *attributes = inner.get_column_attributes(this->inner_names);
+	this->inner_attributes = *attributes;
+	delete attributes;
+}
+
+IndexJoinCursor::~IndexJoinCursor() {
+	free_matches();
+	delete this->outer;
+}
+
+// Next batch of joined rows: read the next batch's worth of inner rows the current outer rows match,
+// filter them, and pair each survivor with its outer row.
+bool IndexJoinCursor::next(RowBatch &batch) {
+	while (true) {
+		if (this->outer_row >= this->outer_rows.size() && !next_outer_batch())
+			return false;
+
+		this->inner_batch.reset(this->inner_names, this->inner_attributes);
+		this->inner_outer_rows.clear();
+		while (!this->inner_batch.full() && this->outer_row < this->outer_rows.size()) {
+			Handles *handles = this->matches[this->outer_row];
+			if (this->match >= handles->size()) {
+				this->outer_row++;
+				this->match = 0;
+				continue;
+			}
+			Handle handle = (*handles)[this->match++];
+			ValueDict *row = this->inner.project(handle, &this->inner_names);
+			for (uint i = 0; i < this->inner_names.size(); i++)
+				this->inner_batch.column(i).push_value((*row)[this->inner_names[i]]);
+			delete row;
+			this->inner_batch.add_row(handle);
+			this->inner_outer_rows.push_back(this->outer_rows[this->outer_row]);
+		}
+		if (!this->where.empty() || !this->ranges.empty())
+			this->inner_batch.filter(&this->where, &this->ranges);
+
+		batch.reset(this->output_names, this->output_attributes);
+		for (uint row = 0; row < this->inner_batch.size(); row++) {
+			if (!this->inner_batch.is_selected(row))
+				continue;
+			for (uint i = 0; i < this->output_sources.size(); i++) {
+				const pair<bool, uint> &source = this->output_sources[i];
+				if (source.first)
+					batch.column(i).push(this->inner_batch.column(source.second), row);
+				else
+					batch.column(i).push(this->outer_batch.column(source.second), this->inner_outer_rows[row]);
+			}
+			batch.add_row(Handle());
+		}
+		if (batch.size() > 0)
+			return true;
+	}
+}
+
+// Read outer batches until one has a selected row, and look all of its selected rows up in the index.
+bool IndexJoinCursor::next_outer_batch() {
+	free_matches();
+	this->outer_row = 0;
+	this->match = 0;
+	while (this->outer->next(this->outer_batch)) {
+		if (this->outer_keys.empty()) {
+			for (auto const &key_column: this->index.get_key_columns()) {
+				uint i = (uint) (find(this->inner_input.keys.begin(), this->inner_input.keys.end(), key_column)
+						- this->inner_input.keys.begin());
+				this->outer_keys.push_back((uint) this->outer_batch.column_index(this->outer_input.keys[i]));
+			}
+			set_output();
+		}
+		for (uint row = 0; row < this->outer_batch.size(); row++)
+			if (this->outer_batch.is_selected(row))
+				this->outer_rows.push_back(row);
+		if (this->outer_rows.empty())
+			continue;
+
+		ValueDicts keys;
+		for (uint row: this->outer_rows) {
+			ValueDict *key = new ValueDict();
+			for (uint i = 0; i < this->outer_keys.size(); i++)
+				(*key)[this->index.get_key_columns()[i]] = this->outer_batch.column(this->outer_keys[i]).value(row);
+			keys.push_back(key);
+		}
+		this->index.lookup_many(keys, this->matches);
+		for (ValueDict *key: keys)
+			delete key;
+		return true;
+	}
+	return false;
+}
+
+void IndexJoinCursor::free_matches() {
+	for (Handles *handles: this->matches)
+		delete handles;
+	this->matches.clear();
+	this->outer_rows.clear();
+}
+
+// Work out where each output column comes from: left columns first, then right.
+void IndexJoinCursor::set_output() {
+	const ColumnNames &outer_names = this->outer_batch.get_column_names();
+	for (bool from_inner: {!this->outer_left, this->outer_left}) {
+		const JoinInput &input = from_inner ? this->inner_input : this->outer_input;
+		const ColumnNames &names = from_inner ? this->inner_names : outer_names;
+		for (uint i = 0; i < input.columns.size(); i++) {
+			auto it = find(names.begin(), names.end(), input.columns[i]);
+			if (it == names.end())
+				throw DbRelationError("join input does not have column named '" + input.columns[i] + "'");
+			uint position = (uint) (it - names.begin());
+			this->output_names.push_back(input.names[i]);
+			if (from_inner)
+				this->output_attributes.push_back(this->inner_attributes[position]);
+			else
+				this->output_attributes.push_back(ColumnAttribute(this->outer_batch.column(position).data_type));
+			this->output_sources.push_back(make_pair(from_inner, position));
+		}
+	}
+}
+
+// test function -- returns true if all tests pass
+bool test_hash_join() {
+	ColumnNames column_names;
+	column_names.push_back("id");
+	column_names.push_back("name");
+	ColumnAttributes column_attributes;
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+	HeapTable left("_test_join_left", column_names, column_attributes);
+	left.create();
+	HeapTable right("_test_join_right", column_names, column_attributes);
+	right.create();
+	ValueDict row;
+	for (int i = 0; i < 2000; i++) {
+		row["id"] = Value(i);
+		row["name"] = Value("left" + to_string(i));
+		left.insert(&row);
+	}
+	for (int i = 0; i < 3000; i++) {
+		row["id"] = Value(i % 500);  // each of 0..499 six times over
+		row["name"] = Value("right" + to_string(i));
+		right.insert(&row);
+	}
+
+	JoinInput left_input, right_input;
+	left_input.columns = column_names;
+	left_input.names.push_back("l.id");
+	left_input.names.push_back("l.name");
+	right_input.columns.push_back("name");
+	right_input.names.push_back("r.name");
+	bool ok = true;
+	for (size_t memory_budget: {HashJoinCursor::DEFAULT_MEMORY_BUDGET, (size_t) 4096}) {
+		for (bool build_left: {true, false}) {
+			left_input.keys = ColumnNames(1, "id");
+			right_input.keys = ColumnNames(1, "id");
+			HashJoinCursor join(left.batch_cursor(), left_input, right.batch_cursor(), right_input, build_left,
+					memory_budget);
+			RowBatch batch;
+			int count = 0;
+			long sum = 0;
+			while (join.next(batch)) {
+				if (batch.get_column_names() != ColumnNames({"l.id", "l.name", "r.name"})) {
+					ok = false;  // still drop the tables below
+					break;
+				}
+				for (uint i = 0; i < batch.size(); i++) {
+					int id = batch.column(0).ints[i];
+					string name = batch.column(2).value(i).s;
+					if (stoi(name.substr(5)) % 500 != id)
+						ok = false;
+					sum += id;
+					count++;
+				}
+			}
+			if (count != 3000 || sum != 6 * 499 * 500 / 2 || join.spilled() != (memory_budget == 4096))
+				ok = false;
+		}
+	}
+	cout << "hash join " << (ok ? "ok" : "failed") << endl;
+
+	left_input.keys.clear();
+	right_input.keys.clear();
+	HashJoinCursor cross(left.batch_cursor(), left_input, right.batch_cursor(), right_input, false);
+	RowBatch batch;
+	size_t count = 0;
+	while (cross.next(batch))
+		count += batch.size();
+	if (count != 2000 * 3000)
+		ok = false;
+	cout << "cross product " << (count == 2000 * 3000 ? "ok" : "failed") << endl;
+
+	// index joins: each right row finds its one left row through a unique index, and each left row
+	// finds its six right rows (or none, for ids past 499) through a non-unique one
+	BTreeIndex left_id(left, "_test_join_left_id", ColumnNames(1, "id"), true);
+	left_id.create();
+	BTreeIndex right_id(right, "_test_join_right_id", ColumnNames(1, "id"), false);
+	right_id.create();
+	left_input.keys = ColumnNames(1, "id");
+	right_input.keys = ColumnNames(1, "id");
+	right_input.columns.push_back("id");
+	right_input.names.push_back("r.id");
+	ValueRanges ranges;
+	ranges["id"].restrict_max(Value(100), false);
+	bool index_ok = true;
+	for (bool outer_left: {true, false}) {
+		for (const ValueRanges *inner_ranges: {(const ValueRanges*) nullptr, (const ValueRanges*) &ranges}) {
+			IndexJoinCursor join(outer_left ? left.batch_cursor() : right.batch_cursor(),
+					outer_left ? left_input : right_input, outer_left ? (DbRelation&) right : (DbRelation&) left,
+					outer_left ? right_id : left_id, outer_left ? right_input : left_input, nullptr, inner_ranges,
+					outer_left);
+			count = 0;
+			long sum = 0;
+			while (join.next(batch)) {
+				if (batch.get_column_names() != ColumnNames({"l.id", "l.name", "r.name", "r.id"})) {
+					index_ok = false;
+					break;
+				}
+				for (uint i = 0; i < batch.size(); i++) {
+					if (batch.column(0).ints[i] != batch.column(3).ints[i])
+						index_ok = false;
+					sum += batch.column(0).ints[i];
+					count++;
+				}
+			}
+			size_t expected = inner_ranges == nullptr ? 3000 : 600;
+			long expected_sum = inner_ranges == nullptr ? 6 * 499 * 500 / 2 : 6 * 99 * 100 / 2;
+			if (count != expected || sum != expected_sum)
+				index_ok = false;
+		}
+	}
+	if (!index_ok)
+		ok = false;
+	cout << "index join " << (index_ok ? "ok" : "failed") << endl;
+
+	left_id.drop();
+	right_id.drop();
+	left.drop();
+	right.drop();
+	return ok;
+}
@@ -0,0 +1,171 @@
+/**
+ * @file hash_join.h - Equi-joins (and cross products) of two streams of RowBatches.
+ * JoinInput
+ * HashJoinCursor
+ * IndexJoinCursor
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "row_batch.h"
+#include "heap_storage.h"
+
+/**
+ * @class JoinInput - how a join reads one of its two inputs
+ *
+ * The join outputs each of columns under the corresponding name in names (e.g., "table.column"),
+ * and matches rows whose keys equal the other input's keys, column by column. With no keys at
+ * all, every row matches every row of the other input (a cross product).
+ */
+class JoinInput {
+public:
+	JoinInput() : columns(), names(), keys() {}
+
+	ColumnNames columns;  // columns of the input the join passes on
+	ColumnNames names;    // what the join calls them, parallel to columns
+	ColumnNames keys;     // columns of the input to match on, parallel to the other input's keys
+};
+
+/**
+ * @class HashJoinCursor - BatchCursor over the inner join of two BatchCursors
+ *
+ * All of the build input is read into a hash table on its keys; the probe input is then streamed
+ * past it. If the build input turns out to need more than memory_budget bytes, both inputs are
+ * split on the hash of their keys into SPILL_PARTITIONS temporary HeapTables instead, and the
+ * partitions are joined one pair at a time (Grace hash join). Output columns are the left input's
+ * names followed by the right input's, whichever side is built.
+ */
+class HashJoinCursor : public BatchCursor {
+public:
+	static const size_t DEFAULT_MEMORY_BUDGET = 16 * 1024 * 1024;
+	static const uint SPILL_PARTITIONS = 16;
+
+	/**
+	 * @param left           the left input (owned by the join)
+	 * @param left_input     how to read it
+	 * @param right          the right input (owned by the join)
+	 * @param right_input    how to read it
+	 * @param build_left     build the hash table on the left input (it should be the smaller)
+	 * @param memory_budget  bytes the hash table may use before spilling
+	 */
+	HashJoinCursor(BatchCursor *left, const JoinInput &left_input, BatchCursor *right, const JoinInput &right_input,
+			bool build_left, size_t memory_budget = DEFAULT_MEMORY_BUDGET);
+	virtual ~HashJoinCursor();
+
+	virtual bool next(RowBatch &batch);
+
+	bool spilled() const { return !this->build_partitions.empty(); }
+
+protected:
+	typedef std::unordered_multimap<std::string, uint> BuildTable;  // key -> row of build_columns
+
+	BatchCursor *build_source;
+	BatchCursor *probe_source;
+	JoinInput build_input;
+	JoinInput probe_input;
+	bool build_left;
+	size_t memory_budget;
+	bool built;
+
+	// the build rows in memory, with every column the build input gave us
+	ColumnNames build_names;
+	ColumnAttributes build_attributes;
+	std::vector<uint> build_keys;  // key columns, as indices into build_names
+	std::vector<ColumnVector> build_columns;
+	BuildTable table;
+	size_t build_bytes;
+
+	// Grace partitions, once spilled
+	std::vector<HeapTable*> build_partitions;
+	std::vector<HeapTable*> probe_partitions;
+	uint partition;  // next pair of partitions to join
+
+	// where probing is up to
+	BatchCursor *probe;  // probe_source or a cursor over a probe partition (owned if the latter)
+	ColumnNames probe_names;
+	ColumnAttributes probe_attributes;
+	std::vector<uint> probe_keys;
+	RowBatch probe_batch;
+	uint probe_row;  // next row of probe_batch to look up
+	uint match_row;  // row of probe_batch whose matches are being output
+	std::pair<BuildTable::iterator, BuildTable::iterator> matches;
+
+	// output columns: from the build rows (true) or probe_batch (false), and which column
+	ColumnNames output_names;
+	ColumnAttributes output_attributes;
+	std::vector<std::pair<bool, uint>> output_sources;
+
+	void build();
+	void add_build_row(RowBatch &batch, uint row, bool spill_allowed);
+	void spill();
+	void spill_row(std::vector<HeapTable*> &partitions, const ColumnNames &names,
+			const ColumnAttributes &attributes, const std::string &key, ValueDict *row, char side);
+	bool next_probe_batch();
+	void set_output();
+};
+
+/**
+ * @class IndexJoinCursor - BatchCursor over the inner join of a BatchCursor and an indexed table
+ *
+ * An index nested-loop join: for each batch of the outer input, the keys of its selected rows are
+ * looked up in the inner table's index all at once (see DbIndex::lookup_many), and just the matching
+ * inner rows are read. Those that also satisfy the inner predicates are joined to their outer rows.
+ * Output columns are the left input's names followed by the right input's, whichever side is outer.
+ */
+class IndexJoinCursor : public BatchCursor {
+public:
+	/**
+	 * @param outer        the outer input (owned by the join)
+	 * @param outer_input  how to read it
+	 * @param inner        the table to look the outer rows up in
+	 * @param index        an index of inner whose key columns are inner_input's keys (in any order)
+	 * @param inner_input  how to read inner
+	 * @param where        equality predicates the inner rows must also satisfy (may be nullptr)
+	 * @param ranges       range predicates the inner rows must also satisfy (may be nullptr)
+	 * @param outer_left   whether the outer input is the join's left input
+	 */
+	IndexJoinCursor(BatchCursor *outer, const JoinInput &outer_input, DbRelation &inner, DbIndex &index,
+			const JoinInput &inner_input, const ValueDict *where, const ValueRanges *ranges, bool outer_left);
+	virtual ~IndexJoinCursor();
+
+	virtual bool next(RowBatch &batch);
+
+protected:
+	BatchCursor *outer;
+	JoinInput outer_input;
+	DbRelation &inner;
+	DbIndex &index;
+	JoinInput inner_input;
+	ValueDict where;
+	ValueRanges ranges;
+	bool outer_left;
+
+	// the inner columns we read: the ones we pass on, then any more the predicates need
+	ColumnNames inner_names;
+	ColumnAttributes inner_attributes;
+
+	// where looking up is up to
+	RowBatch outer_batch;
+	std::vector<uint> outer_keys;      // key columns, as positions in outer_batch, parallel to the index's key columns
+	std::vector<uint> outer_rows;      // selected rows of outer_batch
+	std::vector<Handles*> matches;     // handles of their inner rows, parallel to outer_rows
+	uint outer_row;                    // index into outer_rows of the row being joined
+	uint match;                        // next of its matches to read
+	RowBatch inner_batch;              // inner rows read, before the predicates
+	std::vector<uint> inner_outer_rows;  // row of outer_batch for each row of inner_batch
+
+	// output columns: from inner_batch (true) or outer_batch (false), and which column
+	ColumnNames output_names;
+	ColumnAttributes output_attributes;
+	std::vector<std::pair<bool, uint>> output_sources;
+
+	bool next_outer_batch();
+	void free_matches();
+	void set_output();
+};
+
+bool test_hash_join();
@@ -3,6 +3,7 @@
  * SlottedPage
  * HeapFile
  * HeapTable
+ * HeapLoader
  *
  * @author Kevin Lundeen
  * @see "Seattle University, CPSC5300, Summer 2018"
@@ -10,12 +11,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <memory.h>
+#include <algorithm>
 #include "heap_storage.h"
+#include "parallel_scan.h"
 using namespace std;
 
 typedef uint16_t u16;
 
-SlottedPage::SlottedPage(Dbt &block, BlockID block_id, bool is_new) : DbBlock(block, block_id, is_new) {
+SlottedPage::SlottedPage(Dbt &block, BlockID block_id, bool is_new, BufferFrame *frame)
+		: DbBlock(block, block_id, is_new), frame(frame) {
 	if (is_new) {
 		this->num_records = 0;
 		this->end_free = DbBlock::BLOCK_SZ - 1;
@@ -25,6 +29,12 @@ SlottedPage::SlottedPage(Dbt &block, BlockID block_id, bool is_new) : DbBlock(bl
 	}
 }
 
+// Give back our pin on the buffer pool frame (if we have one).
+SlottedPage::~SlottedPage() {
+	if (this->frame != nullptr)
+		BufferPool::instance().unpin(this->frame);
+}
+
 // Add a new record to the block. Return its id.
 RecordID SlottedPage::add(const Dbt* data) throw(DbBlockNoRoomError) {
 	if (!has_room((u16)data->get_size()))
@@ -48,6 +58,15 @@ Dbt* SlottedPage::get(RecordID record_id) const {
     return new Dbt(this->address(loc), size);
 }
 
+// Look at a record in place. Return nullptr if it has been deleted.
+const char* SlottedPage::peek(RecordID record_id, u16 &size) const {
+	u16 loc;
+	get_header(size, loc, record_id);
+	if (loc == 0)
+		return nullptr;
+	return (const char*)this->address(loc);
+}
+
 // Replace the record with the given data. Raises DbBlockNoRoomError if it won't fit.
 void SlottedPage::put(RecordID record_id, const Dbt &data) throw(DbBlockNoRoomError) {
 	u16 size, loc;
@@ -126,7 +145,10 @@ void SlottedPage::put_header(RecordID id, u16 size, u16 loc) {
 // Calculate if we have room to store a record with given size. The size should include the 4 bytes
 // for the header, too, if this is an add.
 bool SlottedPage::has_room(u16 size) const {
-	u16 available = this->end_free - (u16)(4*(this->num_records+2));
+	u16 headers = (u16)(4*(this->num_records+2));
+	if (this->end_free < headers)  // a block of tiny records can fill right up to the headers
+		return false;
+	u16 available = this->end_free - headers;
 	return size <= available;
 }
 
@@ -185,10 +207,16 @@ void* SlottedPage::address(u16 offset) const {
  * *******************
  */
 
-HeapFile::HeapFile(string name) : DbFile(name), dbfilename(""), last(0), closed(true), db(_DB_ENV, 0) {
+HeapFile::HeapFile(string name) : DbFile(name), dbfilename(""), open_file(nullptr), closed(true), db(_DB_ENV, 0) {
 	this->dbfilename = this->name + ".db";
 }
 
+// Make sure our cached blocks don't outlive us.
+HeapFile::~HeapFile() {
+	if (!this->closed)
+		close();
+}
+
 // Create physical file.
 void HeapFile::create(void) {
 	db_open(DB_CREATE|DB_EXCL);
@@ -198,6 +226,7 @@ void HeapFile::create(void) {
 
 // Delete the physical file.
 void HeapFile::drop(void) {
+	BufferPool::instance().discard(this);
 	close();
 	Db db(_DB_ENV, 0);
 	db.remove(this->dbfilename.c_str(), nullptr, 0);
@@ -208,8 +237,11 @@ void HeapFile::open(void) {
     db_open();
 }
 
-// Close the physical file.
+// Close the physical file (after writing back any dirty blocks, if no other handle has it open).
 void HeapFile::close(void) {
+	if (!this->closed)
+		BufferPool::instance().detach(this);
+	this->open_file = nullptr;
 	this->db.close(0);
 	this->closed = true;
 }
@@ -217,44 +249,67 @@ void HeapFile::close(void) {
 // Allocate a new block for the database file.
 // Returns the new empty DbBlock that is managing the records in this block and its block id.
 SlottedPage* HeapFile::get_new(void) {
-	char block[DbBlock::BLOCK_SZ];
-	memset(block, 0, sizeof(block));
-	Dbt data(block, sizeof(block));
-
-	int block_id = ++this->last;
-	Dbt key(&block_id, sizeof(block_id));
+	BlockID block_id = ++this->open_file->last;
+	BufferFrame *frame = BufferPool::instance().pin(this, block_id, true);
+	Dbt data(frame->data, DbBlock::BLOCK_SZ);
+	SlottedPage* page = new SlottedPage(data, block_id, true, frame);
 
-	// write out an empty block and read it back in so Berkeley DB is managing the memory
-	SlottedPage* page = new SlottedPage(data, this->last, true);
-	this->db.put(nullptr, &key, &data, 0); // write it out with initialization done to it
-	delete page;
-	this->db.get(nullptr, &key, &data, 0);
-	return new SlottedPage(data, this->last);
+	// write out the initialized block right away so Berkeley DB's record count stays accurate
+	write_block(block_id, frame->data);
+	return page;
 }
 
 // Get a block from the database file.
 SlottedPage* HeapFile::get(BlockID block_id) {
-	Dbt key(&block_id, sizeof(block_id));
-	Dbt data;
-	this->db.get(nullptr, &key, &data, 0);
-	return new SlottedPage(data, block_id, false);
+	BufferFrame *frame = BufferPool::instance().pin(this, block_id);
+	Dbt data(frame->data, DbBlock::BLOCK_SZ);
+	return new SlottedPage(data, block_id, false, frame);
 }
 
 // Write a block back to the database file.
+// Blocks from our buffer pool are just marked dirty; they get written on eviction or close.
 void HeapFile::put(DbBlock* block) {
-	int block_id = block->get_block_id();
-	Dbt key(&block_id, sizeof(block_id));
-	this->db.put(nullptr, &key, block->get_block(), 0);
+	SlottedPage* page = dynamic_cast<SlottedPage*>(block);
+	if (page != nullptr && page->get_frame() != nullptr && page->get_frame()->file == this->open_file) {
+		BufferPool::instance().mark_dirty(page->get_frame());
+		return;
+	}
+	write_block(block->get_block_id(), (const char*)block->get_data());
 }
 
 // Sequence of all block ids.
 BlockIDs* HeapFile::block_ids() const {
 	BlockIDs* vec = new BlockIDs();
-	for (BlockID block_id = 1; block_id <= this->last; block_id++)
+	BlockID last = this->open_file == nullptr ? 0 : this->open_file->last;
+	for (BlockID block_id = 1; block_id <= last; block_id++)
 		vec->push_back(block_id);
 	return vec;
 }
 
+// Read a block from Berkeley DB into the given buffer (used by the BufferPool).
+// Only get_new's blocks start out zeroed; one that should be there and isn't (or is short) is an error.
+void HeapFile::read_block(BlockID block_id, char *into) {
+	Dbt key(&block_id, sizeof(block_id));
+	Dbt data;
+	if (this->db.get(nullptr, &key, &data, 0) != 0)
+		throw DbRelationError("no block " + to_string(block_id) + " in " + this->dbfilename);
+	if (data.get_size() < DbBlock::BLOCK_SZ)
+		throw DbRelationError("block " + to_string(block_id) + " of " + this->dbfilename + " is short");
+	memcpy(into, data.get_data(), DbBlock::BLOCK_SZ);
+}
+
+// Write a block from the given buffer to Berkeley DB (used by the BufferPool).
+void HeapFile::write_block(BlockID block_id, const char *from) {
+	Dbt key(&block_id, sizeof(block_id));
+	Dbt data((void*)from, DbBlock::BLOCK_SZ);
+	this->db.put(nullptr, &key, &data, 0);
+}
+
+// Have Berkeley DB write what it has cached of the file to disk (used by the BufferPool).
+void HeapFile::sync() {
+	this->db.sync(0);
+}
+
 uint32_t HeapFile::get_block_count() {
 	DB_BTREE_STAT* stat;
 	this->db.stat(nullptr, &stat, DB_FAST_STAT);
@@ -268,11 +323,141 @@ void HeapFile::db_open(uint flags) {
     this->db.set_re_len(DbBlock::BLOCK_SZ); // record length - will be ignored if file already exists
     this->db.open(nullptr, this->dbfilename.c_str(), nullptr, DB_RECNO, flags, 0644);
 
-	this->last = flags ? 0 : get_block_count();
+	this->open_file = BufferPool::instance().attach(this);
+	if (this->open_file->handles.size() == 1)
+		this->open_file->last = flags ? 0 : get_block_count();  // else the first handle has it
     this->closed = false;
 }
 
 
+/*
+ * *******************
+ * RowPredicate class
+ * *******************
+ */
+
+// Decode the where clause into terms ordered by column position.
+RowPredicate::RowPredicate(const ColumnNames &column_names, const ColumnAttributes &column_attributes,
+		const ValueDict* where, const ValueRanges* ranges) : terms(), data_types() {
+	ValueDict no_where;
+	ValueRanges no_ranges;
+	if (where == nullptr)
+		where = &no_where;
+	if (ranges == nullptr)
+		ranges = &no_ranges;
+	for (auto const& item: *where)
+		if (find(column_names.begin(), column_names.end(), item.first) == column_names.end())
+			throw DbRelationError("table does not have column named '" + item.first + "'");
+	for (auto const& item: *ranges)
+		if (find(column_names.begin(), column_names.end(), item.first) == column_names.end())
+			throw DbRelationError("table does not have column named '" + item.first + "'");
+
+	int offset = 0;  // stays valid until we pass a variable-length column
+	for (uint col_num = 0; col_num < column_names.size(); col_num++) {
+		ColumnAttribute::DataType data_type = ColumnAttribute(column_attributes[col_num]).get_data_type();
+		this->data_types.push_back(data_type);
+		Term term;
+		term.column = col_num;
+		term.data_type = data_type;
+		term.fixed_offset = offset;
+		ValueDict::const_iterator column = where->find(column_names[col_num]);
+		if (column != where->end()) {
+			term.is_range = false;
+			term.impossible = column->second.data_type != data_type;
+			term.value = column->second;
+			this->terms.push_back(term);
+		}
+		ValueRanges::const_iterator range = ranges->find(column_names[col_num]);
+		if (range != ranges->end()) {
+			term.is_range = true;
+			term.impossible = (range->second.has_min && range->second.min.data_type != data_type)
+					|| (range->second.has_max && range->second.max.data_type != data_type);
+			term.range = range->second;
+			this->terms.push_back(term);
+		}
+		if (offset >= 0) {
+			if (data_type == ColumnAttribute::DataType::INT)
+				offset += sizeof(int32_t);
+			else if (data_type == ColumnAttribute::DataType::BOOLEAN)
+				offset += sizeof(uint8_t);
+			else
+				offset = -1;
+		}
+	}
+}
+
+// Compare a marshaled field against a constant of the same type: <0, 0, >0 like memcmp.
+static int compare_field(ColumnAttribute::DataType data_type, const char* field, const Value &value) {
+	if (data_type == ColumnAttribute::DataType::TEXT) {
+		u16 length = *(u16*)field;
+		size_t common = min((size_t)length, value.s.length());
+		int cmp = memcmp(field + sizeof(u16), value.s.data(), common);
+		if (cmp != 0)
+			return cmp;
+		return length < value.s.length() ? -1 : (length > value.s.length() ? 1 : 0);
+	}
+	int32_t n = data_type == ColumnAttribute::DataType::INT ? *(int32_t*)field : *(uint8_t*)field;
+	return n < value.n ? -1 : (n > value.n ? 1 : 0);
+}
+
+// Walk the marshaled record (see HeapTable::marshal) just far enough to check each term.
+bool RowPredicate::matches(const char* bytes, u16 size) const {
+	uint offset = 0;
+	uint col_num = 0;
+	for (auto const& term: this->terms) {
+		if (term.impossible)
+			return false;
+		if (term.fixed_offset >= 0) {
+			offset = (uint)term.fixed_offset;
+			col_num = term.column;
+		}
+		for (; col_num < term.column; col_num++) {
+			ColumnAttribute::DataType data_type = this->data_types[col_num];
+			if (data_type == ColumnAttribute::DataType::INT)
+				offset += sizeof(int32_t);
+			else if (data_type == ColumnAttribute::DataType::BOOLEAN)
+				offset += sizeof(uint8_t);
+			else if (offset + sizeof(u16) <= size)
+				offset += sizeof(u16) + *(u16*)(bytes + offset);
+			else
+				return false;
+		}
+
+		// make sure the whole field is inside the record
+		uint width;
+		if (term.data_type == ColumnAttribute::DataType::INT)
+			width = sizeof(int32_t);
+		else if (term.data_type == ColumnAttribute::DataType::BOOLEAN)
+			width = sizeof(uint8_t);
+		else if (offset + sizeof(u16) <= size)
+			width = sizeof(u16) + *(u16*)(bytes + offset);
+		else
+			return false;
+		if (offset + width > size)
+			return false;
+
+		const char* field = bytes + offset;
+		if (!term.is_range) {
+			if (compare_field(term.data_type, field, term.value) != 0)
+				return false;
+		} else {
+			const ValueRange &range = term.range;
+			if (range.has_min) {
+				int cmp = compare_field(term.data_type, field, range.min);
+				if (cmp < 0 || (cmp == 0 && !range.min_inclusive))
+					return false;
+			}
+			if (range.has_max) {
+				int cmp = compare_field(term.data_type, field, range.max);
+				if (cmp > 0 || (cmp == 0 && !range.max_inclusive))
+					return false;
+			}
+		}
+	}
+	return true;
+}
+
+
 /*
  * *******************
  * HeapTable class
@@ -325,6 +510,40 @@ Handle HeapTable::insert(const ValueDict* row) {
     return handle;
 }
 
+// Insert many rows at once. Every row is validated before any goes in, then each is marshaled into one
+// buffer and handed to a HeapLoader, which fills the table a block at a time. If a row still can't be
+// added, the ones already in are deleted again.
+Handles* HeapTable::insert_many(const ValueDicts* rows) {
+    open();
+    ValueDicts full_rows;
+    try {
+        for (auto const& row: *rows)
+            full_rows.push_back(validate(row));
+    } catch (...) {
+        for (auto const& full_row: full_rows)
+            delete full_row;
+        throw;
+    }
+
+    Handles* handles = new Handles();
+    char bytes[DbBlock::BLOCK_SZ];
+    HeapLoader loader(*this);
+    try {
+        for (auto const& full_row: full_rows)
+            handles->push_back(loader.add(bytes, marshal(full_row, bytes)));
+        loader.finish();
+    } catch (...) {
+        loader.rollback();
+        delete handles;
+        for (auto const& full_row: full_rows)
+            delete full_row;
+        throw;
+    }
+    for (auto const& full_row: full_rows)
+        delete full_row;
+    return handles;
+}
+
 // Expect new_values to be a dictionary with column name keys.
 // Conceptually, execute: UPDATE INTO <table_name> SET <new_values> WHERE <handle>
 // where handle is sufficient to identify one specific record (e.g., returned from an insert
@@ -355,29 +574,32 @@ Handles* HeapTable::select() {
 // Conceptually, execute: SELECT <handle> FROM <table_name> WHERE <where>
 // Returns a list of handles for qualifying rows.
 Handles* HeapTable::select(const ValueDict* where) {
-	open();
 	Handles* handles = new Handles();
-	BlockIDs* block_ids = file.block_ids();
-    for (auto const& block_id: *block_ids) {
-    	SlottedPage* block = file.get(block_id);
-    	RecordIDs* record_ids = block->ids();
-    	for (auto const& record_id: *record_ids) {
-			Handle handle(block_id, record_id);
-			if (selected(handle, where))
-    			handles->push_back(handle);
-		}
-    	delete record_ids;
-    	delete block;
-    }
-    delete block_ids;
+	RowCursor* rows = cursor(where);
+	Handle handle;
+	while (rows->next(handle))
+		handles->push_back(handle);
+	delete rows;
 	return handles;
 }
 
+// Streaming version of select(where), optionally also restricted by ranges.
+RowCursor* HeapTable::cursor(const ValueDict* where, const ValueRanges* ranges) {
+	open();
+	return new HeapTableCursor(*this, where, ranges);
+}
+
+// Streaming refinement of another cursor; the conjunction is compiled once and tested in place.
+RowCursor* HeapTable::cursor(RowCursor* source, const ValueDict* where, const ValueRanges* ranges) {
+	return new HeapFilterCursor(*this, source, where, ranges);
+}
+
 // Refine another selection
 Handles* HeapTable::select(Handles *current_selection, const ValueDict* where) {
+    RowPredicate predicate(this->column_names, this->column_attributes, where);
     Handles* handles = new Handles();
     for (auto const& handle: *current_selection)
-        if (selected(handle , where))
+        if (selected(handle, predicate))
             handles->push_back(handle);
     return handles;
 }
@@ -408,6 +630,28 @@ ValueDict* HeapTable::project(Handle handle, const ColumnNames* column_names) {
     return result;
 }
 
+// Walk the blocks in order, keeping just the current one pinned.
+void HeapTable::scan_records(const std::function<void(const char* bytes, u16 size)> &visit) {
+	open();
+	for (BlockID block_id = 1; block_id <= this->file.get_last_block_id(); block_id++) {
+		SlottedPage* block = this->file.get(block_id);
+		RecordIDs* record_ids = block->ids();
+		try {
+			for (auto const& record_id: *record_ids) {
+				u16 size;
+				const char* bytes = block->peek(record_id, size);
+				visit(bytes, size);
+			}
+		} catch (...) {
+			delete record_ids;
+			delete block;
+			throw;
+		}
+		delete record_ids;
+		delete block;
+	}
+}
+
 // Check if the given row is acceptable to insert. Raise ValueError if not.
 // Otherwise return the full row dictionary.
 ValueDict* HeapTable::validate(const ValueDict* row) const {
@@ -433,6 +677,7 @@ Handle HeapTable::append(const ValueDict* row) {
         record_id = block->add(data);
     } catch (DbBlockNoRoomError& e) {
     	// need a new block
+    	delete block;
     	block = this->file.get_new();
     	record_id = block->add(data);
     }
@@ -447,6 +692,22 @@ Handle HeapTable::append(const ValueDict* row) {
 // caller responsible for freeing the returned Dbt and its enclosed ret->get_data().
 Dbt* HeapTable::marshal(const ValueDict* row) const {
 	char *bytes = new char[DbBlock::BLOCK_SZ]; // more than we need (we insist that one row fits into DbBlock::BLOCK_SZ)
+	uint offset;
+	try {
+		offset = marshal(row, bytes);
+	} catch (...) {
+		delete[] bytes;
+		throw;
+	}
+	char *right_size_bytes = new char[offset];
+	memcpy(right_size_bytes, bytes, offset);
+	delete[] bytes;
+	Dbt *data = new Dbt(right_size_bytes, offset);
+	return data;
+}
+
+// write the bits to go into the file into bytes (which has room for a whole block)
+u16 HeapTable::marshal(const ValueDict* row, char* bytes) const {
     uint offset = 0;
     uint col_num = 0;
     for (auto const& column_name: this->column_names) {
@@ -478,11 +739,7 @@ Dbt* HeapTable::marshal(const ValueDict* row) const {
 			throw DbRelationError("Only know how to marshal INT, TEXT, and BOOLEAN");
 		}
 	}
-	char *right_size_bytes = new char[offset];
-	memcpy(right_size_bytes, bytes, offset);
-	delete[] bytes;
-	Dbt *data = new Dbt(right_size_bytes, offset);
-	return data;
+	return (u16) offset;
 }
 
 ValueDict* HeapTable::unmarshal(Dbt* data) const {
@@ -520,8 +777,280 @@ ValueDict* HeapTable::unmarshal(Dbt* data) const {
 bool HeapTable::selected(Handle handle, const ValueDict* where) {
 	if (where == nullptr)
 		return true;
-	ValueDict* row = this->project(handle, where);
-	return *row == *where;
+	return selected(handle, RowPredicate(this->column_names, this->column_attributes, where));
+}
+
+// See if the row at the given handle satisfies an already-compiled where clause
+bool HeapTable::selected(Handle handle, const RowPredicate &predicate) {
+	if (predicate.empty())
+		return true;
+	SlottedPage* block = this->file.get(handle.first);
+	u16 size;
+	const char* bytes = block->peek(handle.second, size);
+	bool match = bytes != nullptr && predicate.matches(bytes, size);
+	delete block;
+	return match;
+}
+
+
+/*
+ * *******************
+ * HeapLoader class
+ * *******************
+ */
+
+HeapLoader::HeapLoader(HeapTable &table) : table(table), block(nullptr), changed(false), first(0, 0), added(0) {
+	table.open();
+}
+
+// Don't leave the block pinned.
+HeapLoader::~HeapLoader() {
+	finish();
+}
+
+// Start with the table's last block, which may have room left.
+Handle HeapLoader::add(const char* bytes, u16 size) {
+	if (this->block == nullptr)
+		this->block = this->table.file.get(this->table.file.get_last_block_id());
+	Dbt data((void*)bytes, size);
+	RecordID record_id;
+	try {
+		record_id = this->block->add(&data);
+	} catch (DbBlockNoRoomError& e) {
+		// need a new block
+		finish();
+		this->block = this->table.file.get_new();
+		try {
+			record_id = this->block->add(&data);
+		} catch (DbBlockNoRoomError& e) {
+			throw DbRelationError("row too big to fit in a block");
+		}
+	}
+	this->changed = true;
+	Handle handle(this->block->get_block_id(), record_id);
+	if (this->added++ == 0)
+		this->first = handle;
+	return handle;
+}
+
+void HeapLoader::finish() {
+	if (this->block == nullptr)
+		return;
+	if (this->changed)
+		this->table.file.put(this->block);
+	delete this->block;
+	this->block = nullptr;
+	this->changed = false;
+}
+
+// Everything from the first record added on is ours: the rest of its block, and every block after it.
+void HeapLoader::rollback() {
+	finish();
+	if (this->added == 0)
+		return;
+	for (BlockID block_id = this->first.first; block_id <= this->table.file.get_last_block_id(); block_id++) {
+		SlottedPage* block = this->table.file.get(block_id);
+		RecordIDs* record_ids = block->ids();
+		for (auto const& record_id: *record_ids)
+			if (block_id > this->first.first || record_id >= this->first.second)
+				block->del(record_id);
+		delete record_ids;
+		this->table.file.put(block);
+		delete block;
+	}
+	this->added = 0;
+}
+
+
+/*
+ * *******************
+ * HeapTableCursor class
+ * *******************
+ */
+
+HeapTableCursor::HeapTableCursor(HeapTable &table, const ValueDict* where, const ValueRanges* ranges)
+		: table(table), predicate(table.column_names, table.column_attributes, where, ranges),
+		  block_id(0), block(nullptr), record_ids(nullptr), pos(0) {
+}
+
+HeapTableCursor::~HeapTableCursor() {
+	release_block();
+}
+
+// Move through the current block's records, fetching the following block when it runs out.
+bool HeapTableCursor::next(Handle &handle) {
+	while (true) {
+		if (this->block == nullptr) {
+			if (this->block_id >= this->table.file.get_last_block_id())
+				return false;
+			this->block = this->table.file.get(++this->block_id);
+			this->record_ids = this->block->ids();
+			this->pos = 0;
+		}
+		while (this->pos < this->record_ids->size()) {
+			RecordID record_id = (*this->record_ids)[this->pos++];
+			u16 size;
+			const char* bytes = this->block->peek(record_id, size);
+			if (this->predicate.empty() || (bytes != nullptr && this->predicate.matches(bytes, size))) {
+				handle = Handle(this->block_id, record_id);
+				return true;
+			}
+		}
+		release_block();
+	}
+}
+
+// Unpin the current block.
+void HeapTableCursor::release_block() {
+	delete this->record_ids;
+	delete this->block;
+	this->record_ids = nullptr;
+	this->block = nullptr;
+}
+
+// Scan in batches, decoding only the given columns. With parallelism, big tables are scanned
+// morsel by morsel on that many threads, each morsel through its own step.
+BatchCursor* HeapTable::batch_cursor(const ColumnNames* column_names, const ValueDict* where,
+		const ValueRanges* ranges, uint parallelism, bool ordered, const BatchStep* step) {
+	open();
+	BlockID last = this->file.get_last_block_id();
+	if (parallelism <= 1 || last <= ParallelScanCursor::DEFAULT_MORSEL_BLOCKS) {
+		BatchCursor* batches = new HeapBatchCursor(*this, column_names, where, ranges);
+		return step != nullptr ? (*step)(batches) : batches;
+	}
+	ColumnNames names = column_names != nullptr ? *column_names : this->column_names;
+	BatchStep morsel_step = step != nullptr ? *step : BatchStep();
+	auto scan = [this, names, where, ranges, morsel_step](BlockID first, BlockID last) {
+		BatchCursor* batches = new HeapBatchCursor(*this, &names, where, ranges, first, last);
+		return morsel_step ? morsel_step(batches) : batches;
+	};
+	return new ParallelScanCursor(scan, last, parallelism, ordered);
+}
+
+// Blocks times the average number of records in a few blocks spread across the file.
+size_t HeapTable::estimate_rows() {
+	static const BlockID SAMPLES = 4;
+	open();
+	BlockID last = this->file.get_last_block_id();
+	if (last == 0)
+		return 0;
+	BlockID samples = min(SAMPLES, last);
+	size_t records = 0;
+	for (BlockID i = 0; i < samples; i++) {
+		SlottedPage* block = this->file.get(1 + i * (last - 1) / max(samples - 1, (BlockID) 1));
+		records += block->size();
+		delete block;
+	}
+	return records * last / samples;
+}
+
+HeapBatchCursor::HeapBatchCursor(HeapTable &table, const ColumnNames* column_names, const ValueDict* where,
+		const ValueRanges* ranges, BlockID first_block, BlockID last_block)
+		: table(table), column_names(), column_attributes(), batch_columns(), where(where), ranges(ranges),
+		  last_block(last_block), block_id(first_block - 1), block(nullptr), record_ids(nullptr), pos(0) {
+	this->column_names = column_names != nullptr ? *column_names : table.column_names;
+	auto need = [this](const Identifier &column_name) {
+		if (find(this->column_names.begin(), this->column_names.end(), column_name) == this->column_names.end())
+			this->column_names.push_back(column_name);
+	};
+	if (where != nullptr)
+		for (auto const& term: *where)
+			need(term.first);
+	if (ranges != nullptr)
+		for (auto const& term: *ranges)
+			need(term.first);
+	if (this->last_block == 0)
+		this->last_block = table.file.get_last_block_id();
+	ColumnAttributes* column_attributes = table.get_column_attributes(this->column_names);
+	this->column_attributes = *column_attributes;
+	delete column_attributes;
+	for (auto const& column_name: table.column_names) {
+		auto it = find(this->column_names.begin(), this->column_names.end(), column_name);
+		this->batch_columns.push_back(it == this->column_names.end() ? -1 : (int)(it - this->column_names.begin()));
+	}
+}
+
+HeapBatchCursor::~HeapBatchCursor() {
+	release_block();
+}
+
+// Decode records (see HeapTable::marshal) until the batch is full, fetching blocks as they run out.
+// Batches in which the where clause leaves nothing selected are skipped.
+bool HeapBatchCursor::next(RowBatch &batch) {
+	do {
+		batch.reset(this->column_names, this->column_attributes);
+		while (!batch.full()) {
+			if (this->block == nullptr) {
+				if (this->block_id >= this->last_block)
+					break;
+				this->block = this->table.file.get(++this->block_id);
+				this->record_ids = this->block->ids();
+				this->pos = 0;
+			}
+			while (this->pos < this->record_ids->size() && !batch.full()) {
+				RecordID record_id = (*this->record_ids)[this->pos++];
+				u16 size;
+				const char* bytes = this->block->peek(record_id, size);
+				if (bytes == nullptr)
+					continue;
+				uint offset = 0;
+				for (uint col_num = 0; col_num < this->batch_columns.size(); col_num++) {
+					int batch_column = this->batch_columns[col_num];
+					ColumnAttribute::DataType data_type = this->table.column_attributes[col_num].get_data_type();
+					if (data_type == ColumnAttribute::DataType::INT) {
+						if (batch_column >= 0)
+							batch.column(batch_column).push_int(*(int32_t*)(bytes + offset));
+						offset += sizeof(int32_t);
+					} else if (data_type == ColumnAttribute::DataType::TEXT) {
+						u16 length = *(u16*)(bytes + offset);
+						if (batch_column >= 0)
+							batch.column(batch_column).push_text(bytes + offset + sizeof(u16), length);
+						offset += sizeof(u16) + length;
+					} else {
+						if (batch_column >= 0)
+							batch.column(batch_column).push_int(*(uint8_t*)(bytes + offset));
+						offset += sizeof(uint8_t);
+					}
+				}
+				batch.add_row(Handle(this->block_id, record_id));
+			}
+			if (this->pos == this->record_ids->size())
+				release_block();
+		}
+		if (batch.size() == 0)
+			return false;
+		if (this->where != nullptr || this->ranges != nullptr)
+			batch.filter(this->where, this->ranges);
+	} while (batch.count() == 0);
+	return true;
+}
+
+// Unpin the current block.
+void HeapBatchCursor::release_block() {
+	delete this->record_ids;
+	delete this->block;
+	this->record_ids = nullptr;
+	this->block = nullptr;
+}
+
+HeapFilterCursor::HeapFilterCursor(HeapTable &table, RowCursor* source, const ValueDict* where,
+		const ValueRanges* ranges)
+		: table(table), source(source), predicate(table.column_names, table.column_attributes, where, ranges) {
+}
+
+HeapFilterCursor::~HeapFilterCursor() {
+	delete this->source;
+}
+
+bool HeapFilterCursor::next(Handle &handle) {
+	Handle candidate;
+	while (this->source->next(candidate)) {
+		if (this->table.selected(candidate, this->predicate)) {
+			handle = candidate;
+			return true;
+		}
+	}
+	return false;
 }
 
 void test_set_row(ValueDict &row, int a, string b) {
@@ -538,10 +1067,12 @@ bool test_compare(DbRelation &table, Handle handle, int a, string b) {
 		return false;
 	}
 	value = (*result)["b"];
-	delete result;
-    if (value.s != b)
+    if (value.s != b) {
+        delete result;
         return false;
+    }
     value = (*result)["c"];
+	delete result;
     if (value.n != (a%2 == 0))
         return false;
     return true;
@@ -566,6 +1097,19 @@ bool test_heap_storage() {
     cout << "create ok" << endl;
     table1.drop();  // drop makes the object unusable because of BerkeleyDB restriction -- maybe want to fix this some day
     cout << "drop ok" << endl;
+
+    HeapFile file("_test_blocks_cpp");
+    file.create();
+    try {
+        delete file.get(2);  // past the end: an error, not an empty block
+        file.drop();
+        return false;
+    } catch (DbRelationError& e) {
+    }
+    SlottedPage* block = file.get(1);
+    delete block;
+    file.drop();
+    cout << "missing block ok" << endl;
     
 	HeapTable table("_test_data_cpp", column_names, column_attributes);
     table.create_if_not_exists();
@@ -598,6 +1142,71 @@ bool test_heap_storage() {
     cout << "many inserts/select/projects ok" << endl;
 	delete handles;
 
+    ValueDict where;
+    where["a"] = Value(500);
+    RowCursor* rows = table.cursor(&where);
+    Handle found;
+    int count = 0;
+    while (rows->next(found)) {
+        if (!test_compare(table, found, 500, b)) {
+            delete rows;
+            return false;
+        }
+        count++;
+    }
+    delete rows;
+    if (count != 1)
+        return false;
+    cout << "cursor ok" << endl;
+
+    ColumnNames batch_columns;
+    batch_columns.push_back("c");
+    batch_columns.push_back("a");
+    ValueRanges ranges;
+    ranges["a"].restrict_min(Value(100), true);
+    ranges["a"].restrict_max(Value(200), false);
+    where.clear();
+    where["c"] = Value(true);
+    where["c"].data_type = ColumnAttribute::BOOLEAN;
+    BatchCursor* batches = table.batch_cursor(&batch_columns);
+    RowBatch batch;
+    count = 0;
+    int rows_read = 0;
+    while (batches->next(batch)) {
+        rows_read += batch.size();
+        batch.filter(&where, &ranges);
+        batch.project(ColumnNames(1, "a"));
+        for (uint row = 0; row < batch.size(); row++) {
+            if (batch.column(0).ints[row] != 100 + 2 * count++) {
+                delete batches;
+                return false;
+            }
+        }
+    }
+    delete batches;
+    if (rows_read != 1001 || count != 50)
+        return false;
+    cout << "batch cursor ok" << endl;
+
+    ranges.clear();
+    ranges["a"].restrict_min(Value(100), true);
+    for (uint parallelism = 2; parallelism <= 8; parallelism *= 2) {
+        batches = table.batch_cursor(&batch_columns, &where, &ranges, parallelism, true);
+        count = 0;
+        while (batches->next(batch)) {
+            for (uint row = 0; row < batch.size(); row++) {
+                if (!batch.is_selected(row) || batch.column(1).ints[row] != 100 + 2 * count++) {
+                    delete batches;
+                    return false;
+                }
+            }
+        }
+        delete batches;
+        if (count != 450)
+            return false;
+    }
+    cout << "parallel batch cursor ok" << endl;
+
     table.del(last_handle);
     handles = table.select();
     if (handles->size() != 1000)
@@ -607,8 +1216,58 @@ bool test_heap_storage() {
         if (!test_compare(table, handle, i++, b))
             return false;
     cout << "del ok" << endl;
- 
-    table.drop();
 	delete handles;
+
+    ValueDicts new_rows;
+    for (int j = 0; j < 500; j++) {
+        ValueDict* new_row = new ValueDict();
+        test_set_row(*new_row, 1000 + j, b);
+        new_rows.push_back(new_row);
+    }
+    handles = table.insert_many(&new_rows);
+    bool ok = handles->size() == new_rows.size() && (*handles)[0].first < handles->back().first;
+    for (int j = 0; ok && j < (int)handles->size(); j++)
+        ok = test_compare(table, (*handles)[j], 1000 + j, b);
+    delete handles;
+    new_rows.back()->erase("b");  // a row that can't go in keeps all the others out too
+    try {
+        delete table.insert_many(&new_rows);
+        ok = false;
+    } catch (DbRelationError& e) {
+    }
+    for (auto const& new_row: new_rows)
+        delete new_row;
+    handles = table.select();
+    if (!ok || handles->size() != 1500)
+        return false;
+    cout << "insert_many ok" << endl;
+	delete handles;
+
+    // a second handle on the same file sees the first one's cached changes, and adds blocks after its last
+    {
+        HeapTable other("_test_data_cpp", column_names, column_attributes);
+        other.open();
+        test_set_row(row, 5000, b);
+        Handle added = table.insert(&row);
+        if (!test_compare(other, added, 5000, b))
+            return false;
+        for (int j = 0; j < 100; j++) {
+            test_set_row(row, 6000 + j, b);
+            other.insert(&row);
+        }
+        handles = table.select();
+        ok = handles->size() == 1601 && test_compare(table, handles->back(), 6099, b);
+        delete handles;
+        other.del(added);
+        other.close();
+        handles = table.select();
+        ok = ok && handles->size() == 1600;
+        delete handles;
+        if (!ok)
+            return false;
+    }
+    cout << "two handles ok" << endl;
+
+    table.drop();
     return true;
 }
@@ -3,14 +3,18 @@
  * SlottedPage: DbBlock
  * HeapFile: DbFile
  * HeapTable: DbRelation
+ * HeapLoader
  *
  * @author Kevin Lundeen
  * @see "Seattle University, CPSC5300, Summer 2018"
  */
 #pragma once
 
+#include <functional>
 #include "db_cxx.h"
 #include "storage_engine.h"
+#include "buffer_pool.h"
+#include "row_batch.h"
 typedef uint16_t u16;
 /**
  * @class SlottedPage - heap file implementation of DbBlock.
@@ -25,14 +29,17 @@ typedef uint16_t u16;
             Bytes 0x04 - 0x05: size of record 1
             Bytes 0x06 - 0x07: offset to record 1
             etc.
+
+        A page handed out by HeapFile lives in a BufferPool frame; the frame stays pinned
+        until the page is deleted.
  *
  */
 class SlottedPage : public DbBlock {
 public:
-	SlottedPage(Dbt &block, BlockID block_id, bool is_new=false);
+	SlottedPage(Dbt &block, BlockID block_id, bool is_new=false, BufferFrame *frame=nullptr);
 	// Big 5 - we only need the destructor, copy-ctor, move-ctor, and op= are unnecessary
 	// but we delete them explicitly just to make sure we don't use them accidentally
-	virtual ~SlottedPage() {}
+	virtual ~SlottedPage();
 	SlottedPage(const SlottedPage& other) = delete;
 	SlottedPage(SlottedPage&& temp) = delete;
 	SlottedPage& operator=(const SlottedPage& other) = delete;
@@ -46,8 +53,22 @@ public:
 	virtual void clear();
 	virtual u_int16_t size() const;
 
+	/**
+	 * Look at a record's bytes in place, without copying or allocating.
+	 * @param record_id  which record to look at
+	 * @param size       returned by reference: size of the record
+	 * @returns          pointer into the block (nullptr if deleted), valid while the block is alive
+	 */
+	virtual const char* peek(RecordID record_id, u16 &size) const;
+
+	/**
+	 * The buffer pool frame this page lives in, if any.
+	 * @returns  pinned frame or nullptr for a free-standing page
+	 */
+	virtual BufferFrame* get_frame() const {return frame;}
+
 protected:
-	
+	BufferFrame *frame;
 	uint16_t num_records;
 	uint16_t end_free;
 
@@ -64,14 +85,17 @@ protected:
  * @class HeapFile - heap file implementation of DbFile
  *
  * Heap file organization. Built on top of Berkeley DB RecNo file. There is one of our
-        database blocks for each Berkeley DB record in the RecNo file. In this way we are using Berkeley DB
-        for buffer management and file management.
+        database blocks for each Berkeley DB record in the RecNo file. Berkeley DB handles file management;
+        blocks are cached in the shared BufferPool, so get/put pin and dirty frames rather than copying
+        the block on every access. Dirty blocks are written back on eviction or when the last handle on
+        the file closes; every HeapFile open on the same file shares its cached blocks and its last block.
         Uses SlottedPage for storing records within blocks.
  */
 class HeapFile : public DbFile {
+	friend class BufferPool;
 public:
 	HeapFile(std::string name);
-	virtual ~HeapFile() {}
+	virtual ~HeapFile();
 	HeapFile(const HeapFile& other) = delete;
 	HeapFile(HeapFile&& temp) = delete;
 	HeapFile& operator=(const HeapFile& other) = delete;
@@ -90,15 +114,66 @@ public:
 	 * Get the id of the current final block in the heap file.
 	 * @returns  block id of last block
 	 */
-	virtual uint32_t get_last_block_id() {return last;}
+	virtual uint32_t get_last_block_id() {return open_file == nullptr ? 0 : open_file->last;}
+
+	/**
+	 * Get the id the file's blocks are cached under, the same for every handle open on it.
+	 * @returns  the id, or 0 if the file isn't open
+	 */
+	virtual uint get_file_id() const {return open_file == nullptr ? 0 : open_file->id;}
 
 protected:
 	std::string dbfilename;
-	uint32_t last;
+	OpenFile *open_file;  // shared with the other handles on the file while we have it open
 	bool closed;
 	Db db;
 	virtual void db_open(uint flags=0);
 	virtual uint32_t get_block_count();
+	virtual void read_block(BlockID block_id, char *into);
+	virtual void write_block(BlockID block_id, const char *from);
+	virtual void sync();
+};
+
+/**
+ * @class RowPredicate - conjunction compiled against a table's record layout
+ *
+ * The where clause (equalities plus optional ranges) is decoded once into
+ * (column position, typed constant) terms, with
+ * the byte offset precomputed for any column that has only fixed-width columns in front
+ * of it. Records are then tested directly against their marshaled bytes, so rows that
+ * don't qualify are never unmarshaled.
+ */
+class RowPredicate {
+public:
+	RowPredicate(const ColumnNames &column_names, const ColumnAttributes &column_attributes,
+			const ValueDict* where, const ValueRanges* ranges = nullptr);
+	virtual ~RowPredicate() {}
+
+	/**
+	 * Test a marshaled record.
+	 * @param bytes  start of the record
+	 * @param size   length of the record
+	 * @returns      true if every term of the conjunction holds
+	 */
+	virtual bool matches(const char* bytes, u16 size) const;
+
+	/**
+	 * @returns  true if there is nothing to test (every record matches)
+	 */
+	bool empty() const {return terms.empty();}
+
+protected:
+	struct Term {
+		uint column;                          // position in the record
+		ColumnAttribute::DataType data_type;  // the column's type
+		int fixed_offset;                     // byte offset in the record, or -1 if it must be found by walking
+		bool impossible;                      // constant has a different type than the column
+		bool is_range;                        // test against range rather than value
+		Value value;
+		ValueRange range;
+	};
+	std::vector<Term> terms;  // in column order
+	std::vector<ColumnAttribute::DataType> data_types;  // of every column in the record
 };
 
 /**
@@ -106,6 +181,10 @@ protected:
  */
 
 class HeapTable : public DbRelation {
+	friend class HeapTableCursor;
+	friend class HeapFilterCursor;
+	friend class HeapBatchCursor;
+	friend class HeapLoader;
 public:
 	HeapTable(Identifier table_name, ColumnNames column_names, ColumnAttributes column_attributes );
 	virtual ~HeapTable() {}
@@ -122,16 +201,31 @@ public:
 	virtual void close();
 
 	virtual Handle insert(const ValueDict* row);
+	virtual Handles* insert_many(const ValueDicts* rows);
 	virtual void update(const Handle handle, const ValueDict* new_values);
 	virtual void del(const Handle handle);
 
 	virtual Handles* select();
 	virtual Handles* select(const ValueDict* where);
 	virtual Handles* select(Handles *current_selection, const ValueDict* where);
+	virtual RowCursor* cursor(const ValueDict* where = nullptr, const ValueRanges* ranges = nullptr);
+	virtual RowCursor* cursor(RowCursor* source, const ValueDict* where, const ValueRanges* ranges = nullptr);
+	virtual BatchCursor* batch_cursor(const ColumnNames* column_names = nullptr, const ValueDict* where = nullptr,
+			const ValueRanges* ranges = nullptr, uint parallelism = 1, bool ordered = true,
+			const BatchStep* step = nullptr);
+	virtual size_t estimate_rows();
 	virtual ValueDict* project(Handle handle);
 	virtual ValueDict* project(Handle handle, const ColumnNames* column_names);
 	using DbRelation::project;
 
+	/**
+	 * Look at every record's bytes in place, in block order, without unmarshaling them (e.g., to copy them out).
+	 * @param visit  called with each record's bytes and size (which are only good until it returns)
+	 */
+	virtual void scan_records(const std::function<void(const char* bytes, u16 size)> &visit);
+
+	virtual u16 marshal(const ValueDict* row, char* bytes) const;  // into a DbBlock::BLOCK_SZ buffer; returns the size
+
 protected:
 	HeapFile file;
 	virtual ValueDict* validate(const ValueDict* row) const;
@@ -139,6 +233,124 @@ protected:
 	virtual Dbt* marshal(const ValueDict* row) const;
 	virtual ValueDict* unmarshal(Dbt* data) const;
 	virtual bool selected(Handle handle, const ValueDict* where);
+	virtual bool selected(Handle handle, const RowPredicate &predicate);
+};
+
+/**
+ * @class HeapLoader - appends records that are already marshaled to the end of a HeapTable, for bulk inserts
+ *
+ * The last block stays pinned while records are added to it; once it is full it is put (just once) and
+ * a new block is started, so the table grows a block at a time, in order. rollback() deletes every record
+ * added so far (the blocks started for them stay, empty).
+ */
+class HeapLoader {
+public:
+	HeapLoader(HeapTable &table);
+	virtual ~HeapLoader();
+	HeapLoader(const HeapLoader& other) = delete;
+	HeapLoader& operator=(const HeapLoader& other) = delete;
+
+	/**
+	 * Append a record.
+	 * @param bytes  the record, as HeapTable::marshal lays it out
+	 * @param size   its size
+	 * @returns      its handle
+	 */
+	Handle add(const char* bytes, u16 size);
+
+	/**
+	 * Put the last block the loader added to.
+	 */
+	void finish();
+
+	/**
+	 * Delete every record added so far.
+	 */
+	void rollback();
+
+	size_t count() const { return this->added; }  // records added (and not rolled back)
+
+protected:
+	HeapTable &table;
+	SlottedPage* block;  // block being filled (nullptr if none)
+	bool changed;        // records have been added to block since it was pinned
+	Handle first;        // the first record added
+	size_t added;
+};
+
+/**
+ * @class HeapTableCursor - streaming scan of a HeapTable
+ *
+ * Walks the heap file one block at a time, keeping only the current block pinned,
+ * and yields the handles of records that satisfy the where clause. Records are
+ * tested in place against the block's bytes.
+ */
+class HeapTableCursor : public RowCursor {
+public:
+	HeapTableCursor(HeapTable &table, const ValueDict* where, const ValueRanges* ranges = nullptr);
+	virtual ~HeapTableCursor();
+
+	virtual bool next(Handle &handle);
+
+protected:
+	HeapTable &table;
+	RowPredicate predicate;
+	BlockID block_id;
+	SlottedPage* block;
+	RecordIDs* record_ids;
+	size_t pos;
+
+	virtual void release_block();
+};
+
+/**
+ * @class HeapBatchCursor - streaming scan of a HeapTable into RowBatches
+ *
+ * Like HeapTableCursor, only the current block is pinned. Each record's wanted columns are
+ * decoded straight from the block's bytes onto the batch's column vectors; the rest are skipped.
+ * A where clause is applied to each batch with RowBatch::filter.
+ */
+class HeapBatchCursor : public BatchCursor {
+public:
+	// column_names nullptr means all of them (any others the where clause needs are added);
+	// last_block 0 means the end of the file
+	HeapBatchCursor(HeapTable &table, const ColumnNames* column_names, const ValueDict* where = nullptr,
+			const ValueRanges* ranges = nullptr, BlockID first_block = 1, BlockID last_block = 0);
+	virtual ~HeapBatchCursor();
+
+	virtual bool next(RowBatch &batch);
+
+protected:
+	HeapTable &table;
+	ColumnNames column_names;
+	ColumnAttributes column_attributes;
+	std::vector<int> batch_columns;  // for each column of the table, its column in the batch (-1 if not wanted)
+	const ValueDict* where;
+	const ValueRanges* ranges;
+	BlockID last_block;
+	BlockID block_id;
+	SlottedPage* block;
+	RecordIDs* record_ids;
+	size_t pos;
+
+	virtual void release_block();
+};
+
+/**
+ * @class HeapFilterCursor - restricts another cursor over a HeapTable, testing records in place
+ */
+class HeapFilterCursor : public RowCursor {
+public:
+	// takes ownership of source
+	HeapFilterCursor(HeapTable &table, RowCursor* source, const ValueDict* where, const ValueRanges* ranges = nullptr);
+	virtual ~HeapFilterCursor();
+
+	virtual bool next(Handle &handle);
+
+protected:
+	HeapTable &table;
+	RowCursor* source;
+	RowPredicate predicate;
 };
 
 bool test_heap_storage();
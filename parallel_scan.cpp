@@ -0,0 +1,155 @@
+/**
+ * @file parallel_scan.cpp - implementation of:
+ * MorselQueues
+ * ParallelScanCursor
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#include <algorithm>
+#include "parallel_scan.h"
+using namespace std;
+
+MorselQueues::MorselQueues(uint n_morsels, uint n_workers) : queues(n_workers), locks(n_workers) {
+	for (uint morsel = 0; morsel < n_morsels; morsel++)
+		this->queues[morsel % n_workers].push_back(morsel);
+}
+
+bool MorselQueues::take(uint worker, uint &morsel) {
+	uint n = (uint) this->queues.size();
+	for (uint i = 0; i < n; i++) {
+		uint victim = (worker + i) % n;
+		lock_guard<mutex> guard(this->locks[victim]);
+		deque<uint> &queue = this->queues[victim];
+		if (queue.empty())
+			continue;
+		if (victim == worker) {
+			morsel = queue.front();
+			queue.pop_front();
+		} else {
+			morsel = queue.back();
+			queue.pop_back();
+		}
+		return true;
+	}
+	return false;
+}
+
+ParallelScanCursor::ParallelScanCursor(MorselScan scan, BlockID last_block, uint parallelism, bool ordered,
+		uint morsel_blocks)
+		: scan(scan), last_block(last_block), morsel_blocks(morsel_blocks), ordered(ordered), max_buffered(0),
+		  queues((last_block + morsel_blocks - 1) / morsel_blocks, max(parallelism, 1U)),
+		  morsels((last_block + morsel_blocks - 1) / morsel_blocks), ready(), current(0), buffered(0), finished(0),
+		  stopping(false), error(), lock(), changed(), workers() {
+	uint n_workers = min(max(parallelism, 1U), (uint) this->morsels.size());
+	this->max_buffered = n_workers * BUFFERED_BATCHES_PER_WORKER;
+	for (uint worker = 0; worker < n_workers; worker++)
+		this->workers.push_back(thread(&ParallelScanCursor::work, this, worker));
+}
+
+// Stop the workers (they may be blocked waiting for room) and throw away what they've scanned.
+ParallelScanCursor::~ParallelScanCursor() {
+	{
+		lock_guard<mutex> guard(this->lock);
+		this->stopping = true;
+	}
+	this->changed.notify_all();
+	for (auto &worker: this->workers)
+		worker.join();
+	for (auto &morsel: this->morsels)
+		for (auto batch: morsel.batches)
+			delete batch;
+	for (auto batch: this->ready)
+		delete batch;
+}
+
+bool ParallelScanCursor::next(RowBatch &batch) {
+	unique_lock<mutex> guard(this->lock);
+	while (true) {
+		if (this->error)
+			rethrow_exception(this->error);
+		deque<RowBatch*> *batches = nullptr;
+		if (!this->ordered) {
+			batches = &this->ready;
+		} else if (this->current < this->morsels.size()) {
+			batches = &this->morsels[this->current].batches;
+		}
+		if (batches != nullptr && !batches->empty()) {
+			RowBatch *scanned = batches->front();
+			batches->pop_front();
+			this->buffered--;
+			guard.unlock();
+			this->changed.notify_all();
+			batch.swap(*scanned);
+			delete scanned;
+			return true;
+		}
+		if (this->ordered && this->current < this->morsels.size() && this->morsels[this->current].done) {
+			this->current++;  // let the worker on the next morsel past the buffer limit
+			this->changed.notify_all();
+			continue;
+		}
+		if (this->finished == this->morsels.size() && (!this->ordered || this->current == this->morsels.size()))
+			return false;
+		this->changed.wait(guard);
+	}
+}
+
+// Worker thread: scan morsels until there are none left (or we're told to stop).
+void ParallelScanCursor::work(uint worker) {
+	uint morsel;
+	try {
+		while (this->queues.take(worker, morsel)) {
+			BlockID first = morsel * this->morsel_blocks + 1;
+			BlockID last = min(first + this->morsel_blocks - 1, this->last_block);
+			BatchCursor *cursor = this->scan(first, last);
+			bool more = true;
+			while (more) {
+				RowBatch *batch = new RowBatch();
+				try {
+					more = cursor->next(*batch);
+				} catch (...) {
+					delete batch;
+					delete cursor;
+					throw;
+				}
+				if (!more) {
+					delete batch;
+				} else {
+					batch->project(batch->get_column_names());  // just the selected rows
+					more = add(morsel, batch);
+				}
+			}
+			delete cursor;
+			lock_guard<mutex> guard(this->lock);
+			if (this->stopping)
+				return;
+			this->morsels[morsel].done = true;
+			this->finished++;
+			this->changed.notify_all();
+		}
+	} catch (...) {
+		lock_guard<mutex> guard(this->lock);
+		if (!this->error)
+			this->error = current_exception();
+		this->stopping = true;
+		this->changed.notify_all();
+	}
+}
+
+// Hand a scanned batch over to next(), waiting for room first. Returns false if we should stop.
+bool ParallelScanCursor::add(uint morsel, RowBatch *batch) {
+	unique_lock<mutex> guard(this->lock);
+	while (!this->stopping && this->buffered >= this->max_buffered && !(this->ordered && morsel == this->current))
+		this->changed.wait(guard);
+	if (this->stopping) {
+		delete batch;
+		return false;
+	}
+	if (this->ordered)
+		this->morsels[morsel].batches.push_back(batch);
+	else
+		this->ready.push_back(batch);
+	this->buffered++;
+	this->changed.notify_all();
+	return true;
+}
@@ -0,0 +1,101 @@
+/**
+ * @file parallel_scan.h - Morsel-driven parallel scans.
+ * MorselQueues
+ * ParallelScanCursor
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "row_batch.h"
+
+/**
+ * @class MorselQueues - work-stealing scheduler for a fixed set of morsels
+ *
+ * The morsels are dealt round-robin onto one deque per worker. A worker takes from the front
+ * of its own deque (so it works through its share in order) and, once that is empty, steals
+ * from the back of the others', where the morsels their owners would get to last are.
+ */
+class MorselQueues {
+public:
+	MorselQueues(uint n_morsels, uint n_workers);
+	virtual ~MorselQueues() {}
+
+	/**
+	 * Get a morsel for a worker to scan.
+	 * @param worker  which worker is asking
+	 * @param morsel  set to the morsel to scan
+	 * @returns       false when every morsel has been taken
+	 */
+	bool take(uint worker, uint &morsel);
+
+protected:
+	std::vector<std::deque<uint>> queues;  // one per worker
+	std::vector<std::mutex> locks;         // parallel to queues
+};
+
+/**
+ * @class ParallelScanCursor - BatchCursor that scans a file's blocks on several threads at once
+ *
+ * The blocks are cut into morsels of morsel_blocks consecutive blocks. Each worker thread scans
+ * morsel after morsel with its own BatchCursor (from scan), which does the decoding and
+ * filtering, then compacts each batch to just its selected rows and hands it to next().
+ * If ordered, next() returns the batches in block order; otherwise as soon as they're ready.
+ * Workers stall once parallelism * BUFFERED_BATCHES_PER_WORKER batches are waiting, except
+ * for the one next() is waiting on in ordered mode.
+ */
+class ParallelScanCursor : public BatchCursor {
+public:
+	static const uint DEFAULT_MORSEL_BLOCKS = 16;
+	static const uint BUFFERED_BATCHES_PER_WORKER = 4;
+
+	typedef std::function<BatchCursor*(BlockID first, BlockID last)> MorselScan;  // cursor is freed by caller
+
+	/**
+	 * Start the workers.
+	 * @param scan           makes a cursor over blocks first through last (called from the worker threads)
+	 * @param last_block     last block of the file (blocks are numbered from 1)
+	 * @param parallelism    number of worker threads
+	 * @param ordered        whether batches must come back in block order
+	 * @param morsel_blocks  blocks per morsel
+	 */
+	ParallelScanCursor(MorselScan scan, BlockID last_block, uint parallelism, bool ordered = true,
+			uint morsel_blocks = DEFAULT_MORSEL_BLOCKS);
+	virtual ~ParallelScanCursor();
+
+	virtual bool next(RowBatch &batch);
+
+protected:
+	struct Morsel {
+		Morsel() : batches(), done(false) {}
+		std::deque<RowBatch*> batches;  // scanned but not yet returned (ordered only)
+		bool done;                      // all its batches have been added
+	};
+
+	MorselScan scan;
+	BlockID last_block;
+	uint morsel_blocks;
+	bool ordered;
+	uint max_buffered;
+	MorselQueues queues;
+	std::vector<Morsel> morsels;
+	std::deque<RowBatch*> ready;  // scanned but not yet returned (unordered only)
+	uint current;                 // morsel next() is returning from (ordered only)
+	uint buffered;                // batches scanned but not yet returned
+	uint finished;                // morsels done
+	bool stopping;
+	std::exception_ptr error;     // first exception thrown by a worker
+	std::mutex lock;              // guards everything above from morsels on
+	std::condition_variable changed;
+	std::vector<std::thread> workers;
+
+	void work(uint worker);
+	bool add(uint morsel, RowBatch *batch);
+};
@@ -0,0 +1,191 @@
+/**
+ * @file result_sink.cpp - implementation of:
+ * TextSink
+ * StreamSink
+ * DescriptorSink
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <unistd.h>
+#include "result_sink.h"
+using namespace std;
+
+// a value as the shell shows it, and the space after it
+static void format_int(string &out, int32_t n, ColumnAttribute::DataType data_type) {
+	if (data_type == ColumnAttribute::DataType::BOOLEAN)
+		out += n == 0 ? "false " : "true ";
+	else
+		(out += to_string(n)) += ' ';
+}
+
+static void format_text(string &out, const char *text, size_t length) {
+	out += '"';
+	out.append(text, length);
+	out += "\" ";
+}
+
+void TextSink::begin(const ColumnNames &column_names) {
+	this->column_names = column_names;
+	this->flushed = false;
+	for (auto const &column_name : column_names)
+		(this->buffer += column_name) += ' ';
+	this->buffer += "\n+";
+	for (size_t i = 0; i < column_names.size(); i++)
+		this->buffer += "----------+";
+	this->buffer += '\n';
+}
+
+// Straight from the column vectors, without making a ValueDict of any row.
+void TextSink::push(RowBatch &batch) {
+	vector<ColumnVector*> columns;
+	for (auto const &column_name : this->column_names)
+		columns.push_back(&batch.column((uint)batch.column_index(column_name)));
+	for (uint row = 0; row < batch.size(); row++) {
+		if (!batch.is_selected(row))
+			continue;
+		for (ColumnVector *column : columns) {
+			if (column->data_type == ColumnAttribute::DataType::TEXT)
+				format_text(this->buffer, column->bytes.data() + column->offsets[row],
+							column->offsets[row + 1] - column->offsets[row]);
+			else
+				format_int(this->buffer, column->ints[row], column->data_type);
+		}
+		this->buffer += '\n';
+	}
+	if (this->buffer.size() >= FLUSH_BYTES || !this->flushed)
+		flush();
+}
+
+void TextSink::push(const ValueDict &row) {
+	for (auto const &column_name : this->column_names) {
+		const Value &value = row.at(column_name);
+		if (value.data_type == ColumnAttribute::DataType::TEXT)
+			format_text(this->buffer, value.s.data(), value.s.length());
+		else
+			format_int(this->buffer, value.n, value.data_type);
+	}
+	this->buffer += '\n';
+	if (this->buffer.size() >= FLUSH_BYTES || !this->flushed)
+		flush();
+}
+
+void TextSink::end() {
+	flush();
+}
+
+void TextSink::flush() {
+	if (this->buffer.empty())
+		return;
+	write(this->buffer.data(), this->buffer.size());
+	this->buffer.clear();
+	this->flushed = true;
+}
+
+void StreamSink::write(const char *bytes, size_t length) {
+	this->out.write(bytes, (streamsize)length);
+	this->out.flush();
+}
+
+// Keep at it until it's all written: a socket may take only part of it at a time.
+void DescriptorSink::write(const char *bytes, size_t length) {
+	while (length > 0) {
+		ssize_t written = ::write(this->fd, bytes, length);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			throw DbRelationError(string("can't write the result: ") + strerror(errno));
+		}
+		bytes += written;
+		length -= (size_t)written;
+	}
+}
+
+
+// test function -- returns true if all tests pass
+bool test_result_sink() {
+	ColumnNames column_names;
+	column_names.push_back("id");
+	column_names.push_back("name");
+	column_names.push_back("ok");
+	ColumnAttributes column_attributes;
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::BOOLEAN));
+
+	// rows pushed a batch at a time (with one unselected, and the columns in another order) or one at a time
+	// look the same
+	RowBatch batch;
+	ColumnNames batch_names;
+	batch_names.push_back("ok");
+	batch_names.push_back("id");
+	batch_names.push_back("name");
+	ColumnAttributes batch_attributes;
+	batch_attributes.push_back(column_attributes[2]);
+	batch_attributes.push_back(column_attributes[0]);
+	batch_attributes.push_back(column_attributes[1]);
+	batch.reset(batch_names, batch_attributes);
+	for (int i = 0; i < 3; i++) {
+		string name = "n" + to_string(i);
+		batch.column(0).push_int(i % 2);
+		batch.column(1).push_int(i - 1);
+		batch.column(2).push_text(name.data(), (uint)name.length());
+		batch.add_row(Handle(1, (RecordID)(i + 1)));
+	}
+	batch.unselect(1);
+	ostringstream out;
+	StreamSink sink(out);
+	sink.begin(column_names);
+	sink.push(batch);
+	ValueDict row;
+	row["id"] = Value(7);
+	row["name"] = Value("seven");
+	row["ok"] = Value(1);
+	row["ok"].data_type = ColumnAttribute::DataType::BOOLEAN;
+	sink.push(row);
+	sink.end();
+	bool ok = out.str() == "id name ok \n+----------+----------+----------+\n"
+						   "-1 \"n0\" false \n1 \"n2\" false \n7 \"seven\" true \n";
+
+	// the first rows go out right away; after that, only once FLUSH_BYTES are waiting
+	ostringstream big;
+	StreamSink big_sink(big);
+	big_sink.begin(column_names);
+	row["name"] = Value(string(100, 'x'));
+	string line = "7 \"" + string(100, 'x') + "\" true \n";
+	size_t header = out.str().find("-1");
+	big_sink.push(row);
+	ok = ok && big.str().size() == header + line.size();
+	size_t more = TextSink::FLUSH_BYTES / line.size() / 2 + 1;  // twice that is just over FLUSH_BYTES
+	for (size_t i = 0; i < more; i++)
+		big_sink.push(row);
+	ok = ok && big.str().size() == header + line.size();
+	for (size_t i = 0; i < more; i++)
+		big_sink.push(row);
+	ok = ok && big.str().size() > header + line.size();
+	big_sink.end();
+	ok = ok && big.str().size() == header + (1 + 2 * more) * line.size();
+
+	// a file descriptor (here, a pipe) gets the same text
+	int fds[2];
+	ok = ok && pipe(fds) == 0;
+	if (ok) {
+		{
+			DescriptorSink pipe_sink(fds[1]);
+			pipe_sink.begin(column_names);
+			pipe_sink.push(batch);
+			pipe_sink.end();
+		}
+		close(fds[1]);
+		string got;
+		char bytes[7];
+		ssize_t n;
+		while ((n = read(fds[0], bytes, sizeof(bytes))) > 0)
+			got.append(bytes, (size_t)n);
+		close(fds[0]);
+		ok = ok && got == "id name ok \n+----------+----------+----------+\n-1 \"n0\" false \n1 \"n2\" false \n";
+	}
+	return ok;
+}
@@ -0,0 +1,107 @@
+/**
+ * @file result_sink.h - Where a query's rows go as they are produced.
+ * ResultSink
+ * DiscardSink
+ * TextSink
+ * StreamSink
+ * DescriptorSink
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#pragma once
+
+#include <ostream>
+#include <string>
+#include "row_batch.h"
+
+/**
+ * @class ResultSink - interface for taking a query's rows as its plan produces them
+ *
+ * begin is called once with the result's columns, then push with the rows as they come (the selected
+ * rows of a batch, or a single row), then end. Nothing of a row need be kept once push returns, so a
+ * result never has to be held in memory all at once.
+ */
+class ResultSink {
+public:
+	ResultSink() {}
+	virtual ~ResultSink() {}
+	ResultSink(const ResultSink& other) = delete;
+	ResultSink& operator=(const ResultSink& other) = delete;
+
+	virtual void begin(const ColumnNames &column_names) = 0;
+	virtual void push(RowBatch &batch) = 0;
+	virtual void push(const ValueDict &row) = 0;
+	virtual void end() = 0;
+};
+
+/**
+ * @class DiscardSink - ResultSink that drops every row (for when only the counts are wanted)
+ */
+class DiscardSink : public ResultSink {
+public:
+	DiscardSink() : ResultSink() {}
+	virtual void begin(const ColumnNames &column_names) {}
+	virtual void push(RowBatch &batch) {}
+	virtual void push(const ValueDict &row) {}
+	virtual void end() {}
+};
+
+/**
+ * @class TextSink - ResultSink that formats the rows the way the shell shows them
+ *
+ * The column names, a rule, and then a line per row, with TEXT values in double quotes. The text is built
+ * up in a buffer that is written out (by the subclass) once it reaches FLUSH_BYTES, and also as soon as the
+ * first rows are in, so they show up without waiting for the rest of the result.
+ */
+class TextSink : public ResultSink {
+public:
+	static const size_t FLUSH_BYTES = 64 * 1024;
+
+	TextSink() : ResultSink(), column_names(), buffer(), flushed(false) {}
+	virtual ~TextSink() {}
+
+	virtual void begin(const ColumnNames &column_names);
+	virtual void push(RowBatch &batch);
+	virtual void push(const ValueDict &row);
+	virtual void end();
+
+protected:
+	ColumnNames column_names;
+	std::string buffer;  // formatted but not yet written
+	bool flushed;        // rows have been written since begin
+
+	void flush();
+	virtual void write(const char *bytes, size_t length) = 0;
+};
+
+/**
+ * @class StreamSink - TextSink that writes to an ostream (e.g., std::cout)
+ */
+class StreamSink : public TextSink {
+public:
+	StreamSink(std::ostream &out) : TextSink(), out(out) {}
+	virtual ~StreamSink() {}
+
+protected:
+	std::ostream &out;
+
+	virtual void write(const char *bytes, size_t length);
+};
+
+/**
+ * @class DescriptorSink - TextSink that writes to a file descriptor (e.g., a client's socket)
+ *
+ * The descriptor is the caller's; it isn't closed. A write that fails throws DbRelationError.
+ */
+class DescriptorSink : public TextSink {
+public:
+	DescriptorSink(int fd) : TextSink(), fd(fd) {}
+	virtual ~DescriptorSink() {}
+
+protected:
+	int fd;
+
+	virtual void write(const char *bytes, size_t length);
+};
+
+bool test_result_sink();
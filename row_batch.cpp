@@ -0,0 +1,320 @@
+/**
+ * @file row_batch.cpp - implementation of:
+ * ColumnVector
+ * RowBatch
+ * RowBatchCursor
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include "row_batch.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ROW_BATCH_X86
+#endif
+using namespace std;
+
+void ColumnVector::clear() {
+	this->ints.clear();
+	this->offsets.resize(1);
+	this->bytes.clear();
+}
+
+Value ColumnVector::value(uint row) const {
+	if (this->data_type == ColumnAttribute::DataType::TEXT)
+		return Value(this->bytes.substr(this->offsets[row], this->offsets[row + 1] - this->offsets[row]));
+	Value value(this->ints[row]);
+	value.data_type = this->data_type;
+	return value;
+}
+
+// A type tag, then the value, so that values of different types never match.
+void ColumnVector::append_key(string &key, uint row) const {
+	key += (char) this->data_type;
+	if (this->data_type == ColumnAttribute::DataType::TEXT) {
+		uint32_t length = this->offsets[row + 1] - this->offsets[row];
+		key.append((const char*) &length, sizeof(length));
+		key.append(this->bytes, this->offsets[row], length);
+	} else {
+		key.append((const char*) &this->ints[row], sizeof(int32_t));
+	}
+}
+
+/*
+ * Filter kernels: each one tests a whole column and ANDs the result into the selection bitmap
+ * 64 rows at a time. The loops have no branches on the data, so the compiler can vectorize them.
+ *
+ * INT (and BOOLEAN, which are kept as ints) ranges also have hand-written SSE2 and AVX2 versions
+ * that test 4 or 8 rows per instruction. The best one this CPU supports is picked at startup;
+ * the scalar one is used for the last partial word and on other architectures.
+ */
+
+typedef void (*IntRangeKernel)(const int32_t *values, uint n, int32_t min, int32_t max, uint64_t *selection);
+
+// Rows whose value is in [min, max].
+static void filter_int_range_scalar(const int32_t *values, uint n, int32_t min, int32_t max, uint64_t *selection) {
+	for (uint base = 0; base < n; base += 64) {
+		uint count = std::min(64U, n - base);
+		uint64_t mask = 0;
+		for (uint i = 0; i < count; i++) {
+			int32_t v = values[base + i];
+			mask |= (uint64_t)(v >= min && v <= max) << i;
+		}
+		selection[base / 64] &= mask;
+	}
+}
+
+#ifdef ROW_BATCH_X86
+// A row is out of range if min > v or v > max; movemask collects one bit per row, in row order.
+__attribute__((target("sse2")))
+static void filter_int_range_sse2(const int32_t *values, uint n, int32_t min, int32_t max, uint64_t *selection) {
+	const __m128i lo = _mm_set1_epi32(min), hi = _mm_set1_epi32(max);
+	uint words = n / 64;
+	for (uint word = 0; word < words; word++) {
+		const int32_t *v = values + word * 64;
+		uint64_t mask = 0;
+		for (uint i = 0; i < 64; i += 4) {
+			__m128i x = _mm_loadu_si128((const __m128i *)(v + i));
+			__m128i out = _mm_or_si128(_mm_cmpgt_epi32(lo, x), _mm_cmpgt_epi32(x, hi));
+			mask |= (uint64_t)(~_mm_movemask_ps(_mm_castsi128_ps(out)) & 0xF) << i;
+		}
+		selection[word] &= mask;
+	}
+	if (n > words * 64)
+		filter_int_range_scalar(values + words * 64, n - words * 64, min, max, selection + words);
+}
+
+__attribute__((target("avx2")))
+static void filter_int_range_avx2(const int32_t *values, uint n, int32_t min, int32_t max, uint64_t *selection) {
+	const __m256i lo = _mm256_set1_epi32(min), hi = _mm256_set1_epi32(max);
+	uint words = n / 64;
+	for (uint word = 0; word < words; word++) {
+		const int32_t *v = values + word * 64;
+		uint64_t mask = 0;
+		for (uint i = 0; i < 64; i += 8) {
+			__m256i x = _mm256_loadu_si256((const __m256i *)(v + i));
+			__m256i out = _mm256_or_si256(_mm256_cmpgt_epi32(lo, x), _mm256_cmpgt_epi32(x, hi));
+			mask |= (uint64_t)(~_mm256_movemask_ps(_mm256_castsi256_ps(out)) & 0xFF) << i;
+		}
+		selection[word] &= mask;
+	}
+	if (n > words * 64)
+		filter_int_range_scalar(values + words * 64, n - words * 64, min, max, selection + words);
+}
+#endif
+
+static IntRangeKernel choose_int_range_kernel() {
+#ifdef ROW_BATCH_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return filter_int_range_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return filter_int_range_sse2;
+#endif
+	return filter_int_range_scalar;
+}
+
+static const IntRangeKernel int_range_kernel = choose_int_range_kernel();
+
+// Rows whose value is in [min, max], given as 64-bit inclusive bounds so that exclusive bounds can't overflow.
+static void filter_int_range(const int32_t *values, uint n, int64_t min, int64_t max, uint64_t *selection) {
+	if (min > max || min > numeric_limits<int32_t>::max() || max < numeric_limits<int32_t>::min()) {
+		fill(selection, selection + (n + 63) / 64, 0);  // no int32 is in range
+		return;
+	}
+	min = std::max(min, (int64_t)numeric_limits<int32_t>::min());
+	max = std::min(max, (int64_t)numeric_limits<int32_t>::max());
+	int_range_kernel(values, n, (int32_t)min, (int32_t)max, selection);
+}
+
+// Compare one TEXT value with a constant: <0, 0, >0 like memcmp.
+static int compare_text(const char *text, uint length, const string &constant) {
+	int cmp = memcmp(text, constant.data(), std::min((size_t)length, constant.length()));
+	if (cmp != 0)
+		return cmp;
+	return length < constant.length() ? -1 : (length > constant.length() ? 1 : 0);
+}
+
+// Rows whose value is within the given bounds (either may be nullptr for none).
+static void filter_text_range(const ColumnVector &column, uint n, const Value *min, bool min_inclusive,
+		const Value *max, bool max_inclusive, uint64_t *selection) {
+	const char *bytes = column.bytes.data();
+	const uint32_t *offsets = column.offsets.data();
+	for (uint base = 0; base < n; base += 64) {
+		uint count = std::min(64U, n - base);
+		uint64_t mask = 0;
+		for (uint i = 0; i < count; i++) {
+			const char *text = bytes + offsets[base + i];
+			uint length = offsets[base + i + 1] - offsets[base + i];
+			bool in = true;
+			if (min != nullptr) {
+				int cmp = compare_text(text, length, min->s);
+				in = cmp > 0 || (cmp == 0 && min_inclusive);
+			}
+			if (in && max != nullptr) {
+				int cmp = compare_text(text, length, max->s);
+				in = cmp < 0 || (cmp == 0 && max_inclusive);
+			}
+			mask |= (uint64_t)in << i;
+		}
+		selection[base / 64] &= mask;
+	}
+}
+
+/*
+ * Projection kernels: copy the selected rows of a column, densely, onto the end of another.
+ */
+
+static void gather_ints(const vector<int32_t> &from, const vector<uint64_t> &selection, vector<int32_t> &to) {
+	for (uint word = 0; word < selection.size(); word++)
+		for (uint64_t bits = selection[word]; bits != 0; bits &= bits - 1)
+			to.push_back(from[word * 64 + __builtin_ctzll(bits)]);
+}
+
+static void gather_text(const ColumnVector &from, const vector<uint64_t> &selection, ColumnVector &to) {
+	for (uint word = 0; word < selection.size(); word++) {
+		for (uint64_t bits = selection[word]; bits != 0; bits &= bits - 1) {
+			uint row = word * 64 + __builtin_ctzll(bits);
+			to.push_text(from.bytes.data() + from.offsets[row], from.offsets[row + 1] - from.offsets[row]);
+		}
+	}
+}
+
+void RowBatch::reset(const ColumnNames &column_names, const ColumnAttributes &column_attributes) {
+	if (column_names != this->column_names) {
+		this->column_names = column_names;
+		this->columns.clear();
+		for (auto column_attribute : column_attributes)
+			this->columns.push_back(ColumnVector(column_attribute.get_data_type()));
+	} else {
+		for (auto &column : this->columns)
+			column.clear();
+	}
+	this->handles.clear();
+	this->selection.clear();
+}
+
+void RowBatch::add_row(Handle handle) {
+	uint row = size();
+	this->handles.push_back(handle);
+	if (row % 64 == 0)
+		this->selection.push_back(0);
+	this->selection.back() |= (uint64_t)1 << (row % 64);
+}
+
+uint RowBatch::count() const {
+	uint count = 0;
+	for (uint64_t bits : this->selection)
+		count += __builtin_popcountll(bits);
+	return count;
+}
+
+void RowBatch::filter(const ValueDict *where, const ValueRanges *ranges) {
+	uint n = size();
+	if (where != nullptr) {
+		for (auto const &term : *where) {
+			const ColumnVector &column = this->columns[column_index(term.first)];
+			const Value &value = term.second;
+			if (value.data_type != column.data_type)
+				select_none();  // like RowPredicate, a constant of another type never matches
+			else if (column.data_type == ColumnAttribute::DataType::TEXT)
+				filter_text_range(column, n, &value, true, &value, true, this->selection.data());
+			else
+				filter_int_range(column.ints.data(), n, value.n, value.n, this->selection.data());
+		}
+	}
+	if (ranges != nullptr) {
+		for (auto const &term : *ranges) {
+			const ColumnVector &column = this->columns[column_index(term.first)];
+			const ValueRange &range = term.second;
+			if ((range.has_min && range.min.data_type != column.data_type)
+					|| (range.has_max && range.max.data_type != column.data_type)) {
+				select_none();
+			} else if (column.data_type == ColumnAttribute::DataType::TEXT) {
+				filter_text_range(column, n, range.has_min ? &range.min : nullptr, range.min_inclusive,
+						range.has_max ? &range.max : nullptr, range.max_inclusive, this->selection.data());
+			} else {
+				int64_t min = numeric_limits<int64_t>::min(), max = numeric_limits<int64_t>::max();
+				if (range.has_min)
+					min = (int64_t)range.min.n + (range.min_inclusive ? 0 : 1);
+				if (range.has_max)
+					max = (int64_t)range.max.n - (range.max_inclusive ? 0 : 1);
+				filter_int_range(column.ints.data(), n, min, max, this->selection.data());
+			}
+		}
+	}
+}
+
+void RowBatch::project(const ColumnNames &column_names) {
+	if (column_names == this->column_names && count() == size())
+		return;  // nothing to drop
+	vector<ColumnVector> columns;
+	for (auto const &column_name : column_names) {
+		const ColumnVector &from = this->columns[column_index(column_name)];
+		columns.push_back(ColumnVector(from.data_type));
+		if (from.data_type == ColumnAttribute::DataType::TEXT)
+			gather_text(from, this->selection, columns.back());
+		else
+			gather_ints(from.ints, this->selection, columns.back().ints);
+	}
+	Handles handles;
+	for (uint word = 0; word < this->selection.size(); word++)
+		for (uint64_t bits = this->selection[word]; bits != 0; bits &= bits - 1)
+			handles.push_back(this->handles[word * 64 + __builtin_ctzll(bits)]);
+
+	this->column_names = column_names;
+	this->columns.swap(columns);
+	this->handles.clear();
+	this->selection.clear();
+	for (auto const &handle : handles)
+		add_row(handle);
+}
+
+ValueDict *RowBatch::row(uint row) const {
+	ValueDict *ret = new ValueDict();
+	for (uint i = 0; i < this->column_names.size(); i++)
+		(*ret)[this->column_names[i]] = this->columns[i].value(row);
+	return ret;
+}
+
+void RowBatch::swap(RowBatch &other) {
+	std::swap(this->capacity, other.capacity);
+	this->column_names.swap(other.column_names);
+	this->columns.swap(other.columns);
+	this->handles.swap(other.handles);
+	this->selection.swap(other.selection);
+}
+
+int RowBatch::column_index(const Identifier &column_name) const {
+	auto it = find(this->column_names.begin(), this->column_names.end(), column_name);
+	if (it == this->column_names.end())
+		throw DbRelationError("batch does not have column named '" + column_name + "'");
+	return (int)(it - this->column_names.begin());
+}
+
+void RowBatch::select_none() {
+	fill(this->selection.begin(), this->selection.end(), 0);
+}
+
+RowBatchCursor::RowBatchCursor(DbRelation &relation, RowCursor *source, const ColumnNames *column_names)
+		: relation(relation), source(source), column_names(), column_attributes() {
+	this->column_names = column_names != nullptr ? *column_names : relation.get_column_names();
+	ColumnAttributes *column_attributes = relation.get_column_attributes(this->column_names);
+	this->column_attributes = *column_attributes;
+	delete column_attributes;
+}
+
+bool RowBatchCursor::next(RowBatch &batch) {
+	batch.reset(this->column_names, this->column_attributes);
+	Handle handle;
+	while (!batch.full() && this->source->next(handle)) {
+		ValueDict *row = this->relation.project(handle, &this->column_names);
+		for (uint i = 0; i < this->column_names.size(); i++)
+			batch.column(i).push_value((*row)[this->column_names[i]]);
+		delete row;
+		batch.add_row(handle);
+	}
+	return batch.size() > 0;
+}
@@ -0,0 +1,168 @@
+/**
+ * @file row_batch.h - Columnar batches of rows for batch-at-a-time evaluation.
+ * ColumnVector
+ * RowBatch
+ * BatchCursor
+ * RowBatchCursor
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#pragma once
+
+#include <string>
+#include <vector>
+#include "storage_engine.h"
+
+/**
+ * @class ColumnVector - the values of one column for every row of a batch
+ *
+ * INT and BOOLEAN values are kept in ints. TEXT values are kept back to back in bytes,
+ * with value i running from offsets[i] to offsets[i + 1].
+ */
+class ColumnVector {
+public:
+	ColumnVector(ColumnAttribute::DataType data_type) : data_type(data_type), ints(), offsets(1, 0), bytes() {}
+
+	ColumnAttribute::DataType data_type;
+	std::vector<int32_t> ints;
+	std::vector<uint32_t> offsets;
+	std::string bytes;
+
+	void clear();
+	void push_int(int32_t n) { ints.push_back(n); }
+	void push_text(const char *text, uint length) {
+		bytes.append(text, length);
+		offsets.push_back((uint32_t)bytes.size());
+	}
+	void push_value(const Value &value) {
+		if (data_type == ColumnAttribute::DataType::TEXT)
+			push_text(value.s.data(), (uint)value.s.length());
+		else
+			push_int(value.n);
+	}
+	void push(const ColumnVector &from, uint row) {  // append row of another column of the same type
+		if (data_type == ColumnAttribute::DataType::TEXT)
+			push_text(from.bytes.data() + from.offsets[row], from.offsets[row + 1] - from.offsets[row]);
+		else
+			push_int(from.ints[row]);
+	}
+	Value value(uint row) const;
+	void append_key(std::string &key, uint row) const;  // marshal row's value onto key (for hashing and matching)
+};
+
+/**
+ * @class RowBatch - up to capacity rows, stored a column at a time, plus a selection bitmap
+ *
+ * Scans fill a batch with every row they read; filters then only clear bits of the
+ * selection, so the column vectors are never rearranged until project() gathers the
+ * rows that are still selected into dense vectors of just the projected columns.
+ */
+class RowBatch {
+public:
+	static const uint DEFAULT_ROWS = 1024;
+
+	RowBatch(uint capacity = DEFAULT_ROWS) : capacity(capacity), column_names(), columns(), handles(), selection() {}
+	virtual ~RowBatch() {}
+
+	/**
+	 * Empty the batch, (re)setting its columns if they've changed.
+	 * @param column_names       columns the batch will hold
+	 * @param column_attributes  their types
+	 */
+	void reset(const ColumnNames &column_names, const ColumnAttributes &column_attributes);
+
+	/**
+	 * Add a row whose column values have already been pushed onto each column vector.
+	 * @param handle  where the row came from
+	 */
+	void add_row(Handle handle);
+
+	uint size() const { return (uint)this->handles.size(); }  // rows, selected or not
+	uint count() const;  // selected rows
+	bool full() const { return size() >= this->capacity; }
+	bool is_selected(uint row) const { return (this->selection[row / 64] >> (row % 64)) & 1; }
+	void unselect(uint row) { this->selection[row / 64] &= ~((uint64_t)1 << (row % 64)); }
+
+	const ColumnNames &get_column_names() const { return this->column_names; }
+	ColumnVector &column(uint i) { return this->columns[i]; }
+	Handle handle(uint row) const { return this->handles[row]; }
+
+	/**
+	 * Unselect the rows that don't satisfy a conjunction, one column at a time.
+	 * @param where   equality predicates (may be nullptr)
+	 * @param ranges  range predicates (may be nullptr)
+	 */
+	void filter(const ValueDict *where, const ValueRanges *ranges);
+
+	/**
+	 * Keep just the given columns (in that order) and just the selected rows.
+	 * @param column_names  columns to keep (each must be in the batch)
+	 */
+	void project(const ColumnNames &column_names);
+
+	/**
+	 * @param row  which row
+	 * @returns    the row's values (freed by caller)
+	 */
+	ValueDict *row(uint row) const;
+
+	/**
+	 * @param column_name  a column of the batch
+	 * @returns            its position among the batch's columns
+	 * @throws             DbRelationError if the batch doesn't have it
+	 */
+	int column_index(const Identifier &column_name) const;
+
+	/**
+	 * Exchange contents (and capacities) with another batch.
+	 * @param other  the other batch
+	 */
+	void swap(RowBatch &other);
+
+protected:
+	uint capacity;
+	ColumnNames column_names;
+	std::vector<ColumnVector> columns;  // parallel to column_names
+	Handles handles;                    // one per row
+	std::vector<uint64_t> selection;    // bit per row
+
+	void select_none();
+};
+
+/**
+ * @class BatchCursor - interface for streaming a relation's rows a batch at a time
+ */
+class BatchCursor {
+public:
+	BatchCursor() {}
+	virtual ~BatchCursor() {}
+	BatchCursor(const BatchCursor& other) = delete;
+	BatchCursor& operator=(const BatchCursor& other) = delete;
+
+	/**
+	 * Refill batch with the next rows.
+	 * @param batch  emptied, then filled with up to its capacity of rows
+	 * @returns      false (with batch empty) when there are no more rows
+	 */
+	virtual bool next(RowBatch &batch) = 0;
+};
+
+/**
+ * @class RowBatchCursor - BatchCursor that builds batches from a RowCursor, projecting one row at a time
+ *
+ * Works for any relation; HeapTable has a faster one that decodes the blocks directly.
+ */
+class RowBatchCursor : public BatchCursor {
+public:
+	// takes ownership of source; column_names nullptr means all of them
+	RowBatchCursor(DbRelation &relation, RowCursor *source, const ColumnNames *column_names);
+	virtual ~RowBatchCursor() { delete source; }
+
+	virtual bool next(RowBatch &batch);
+
+protected:
+	DbRelation &relation;
+	RowCursor *source;
+	ColumnNames column_names;
+	ColumnAttributes column_attributes;
+};
@@ -3,9 +3,11 @@
  * @author Kevin Lundeen
  * @see "Seattle University, CPSC5300, Summer 2018"
  */
+#include <algorithm>
 #include "schema_tables.h"
 #include "ParseTreeToString.h"
 #include "btree.h"
+#include "hash_index.h"
 
 
 void initialize_schema_tables() {
@@ -18,6 +20,9 @@ void initialize_schema_tables() {
 	Indices indices;
 	indices.create_if_not_exists();
 	indices.close();
+	Statistics statistics;
+	statistics.create_if_not_exists();
+	statistics.close();
 }
 
 // Not terribly useful since the parser weeds most of these out
@@ -40,6 +45,18 @@ bool is_acceptable_data_type(std::string dt) {
     return dt == "INT" || dt == "TEXT" || dt == "BOOLEAN";  // for now
 }
 
+// the DataType for a _columns data_type
+static ColumnAttribute::DataType data_type_of(std::string dt) {
+    if (dt == "INT")
+        return ColumnAttribute::INT;
+    else if (dt == "TEXT")
+        return ColumnAttribute::TEXT;
+    else if (dt == "BOOLEAN")
+        return ColumnAttribute::BOOLEAN;
+    else
+        throw DbRelationError("Unknown data type");
+}
+
 
 /*
  * ***************************
@@ -48,6 +65,7 @@ bool is_acceptable_data_type(std::string dt) {
  */
 const Identifier Tables::TABLE_NAME = "_tables";
 Columns* Tables::columns_table = nullptr;
+Statistics* Tables::statistics_table = nullptr;
 std::map<Identifier,DbRelation*> Tables::table_cache;
 
 // get the column name for _tables column
@@ -74,6 +92,9 @@ Tables::Tables() : HeapTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES()) {
     if (Tables::columns_table == nullptr)
         columns_table = new Columns();
     Tables::table_cache[columns_table->TABLE_NAME] = columns_table;
+    if (Tables::statistics_table == nullptr)
+        statistics_table = new Statistics();
+    Tables::table_cache[statistics_table->TABLE_NAME] = statistics_table;
 }
 
 // Create the file and also, manually add schema tables.
@@ -86,35 +107,57 @@ void Tables::create() {
     insert(&row);
 	row["table_name"] = Value("_indices");
 	insert(&row);
+	row["table_name"] = Value("_statistics");
+	insert(&row);
 }
 
 // Manually check that table_name is unique.
 Handle Tables::insert(const ValueDict* row) {
-    // Try SELECT * FROM _tables WHERE table_name = row["table_name"] and it should return nothing
-    Handles* handles = select(row);
-    bool unique = handles->empty();
-    delete handles;
+    bool unique;
+    if (Catalog::is_loaded()) {
+        unique = Catalog::get_table(row->at("table_name").s) == nullptr;
+    } else {
+        // Try SELECT * FROM _tables WHERE table_name = row["table_name"] and it should return nothing
+        Handles* handles = select(row);
+        unique = handles->empty();
+        delete handles;
+    }
     if (!unique)
         throw DbRelationError(row->at("table_name").s + " already exists");
-    return HeapTable::insert(row);
+    Handle handle = HeapTable::insert(row);
+    Catalog::add_table(row->at("table_name").s);
+    return handle;
 }
 
-// Remove a row, but first remove from table cache if there
+// Remove a row, but first remove from table cache if there (and forget the table's statistics)
 // NOTE: once the row is deleted, any reference to the table (from get_table() below) is gone! So drop the table first.
 void Tables::del(Handle handle) {
     // remove from cache, if there
     ValueDict* row = project(handle);
     Identifier table_name = row->at("table_name").s;
+    delete row;
     if (Tables::table_cache.find(table_name) != Tables::table_cache.end()) {
         DbRelation* table = Tables::table_cache.at(table_name);
         Tables::table_cache.erase(table_name);
         delete table;
     }
+    Tables::statistics_table->remove(table_name);
     HeapTable::del(handle);
+    Catalog::remove_table(table_name);
 }
 
 // Return a list of column names and column attributes for given table.
 void Tables::get_columns(Identifier table_name, ColumnNames &column_names, ColumnAttributes &column_attributes) {
+    if (Catalog::is_loaded()) {
+        const Catalog::TableEntry *entry = Catalog::get_table(table_name);
+        if (entry != nullptr) {
+            column_names.insert(column_names.end(), entry->column_names.begin(), entry->column_names.end());
+            column_attributes.insert(column_attributes.end(), entry->column_attributes.begin(),
+                                     entry->column_attributes.end());
+        }
+        return;
+    }
+
     // SELECT * FROM _columns WHERE table_name = <table_name>
     ValueDict where;
     where["table_name"] = table_name;
@@ -127,16 +170,7 @@ void Tables::get_columns(Identifier table_name, ColumnNames &column_names, Colum
         Identifier column_name = (*row)["column_name"].s;
         column_names.push_back(column_name);
 
-        ColumnAttribute::DataType data_type;
-        if ((*row)["data_type"].s == "INT")
-            data_type = ColumnAttribute::INT;
-        else if ((*row)["data_type"].s == "TEXT")
-            data_type = ColumnAttribute::TEXT;
-        else if ((*row)["data_type"].s == "BOOLEAN")
-            data_type = ColumnAttribute::BOOLEAN;
-        else
-            throw DbRelationError("Unknown data type");
-        column_attribute.set_data_type(data_type);
+        column_attribute.set_data_type(data_type_of((*row)["data_type"].s));
         column_attributes.push_back(column_attribute);
 
         delete row;
@@ -155,10 +189,23 @@ DbRelation& Tables::get_table(Identifier table_name) {
     ColumnAttributes column_attributes;
     get_columns(table_name, column_names, column_attributes);
     DbRelation* table = new HeapTable(table_name, column_names, column_attributes);
+    table->set_statistics(Tables::statistics_table->load(*table));
     Tables::table_cache[table_name] = table;
     return *table;
 }
 
+// Store the statistics, then hand them to the table (so the planner sees them without reloading it).
+void Tables::set_statistics(Identifier table_name, TableStatistics *statistics) {
+    try {
+        Tables::statistics_table->save(table_name, *statistics);
+    } catch (...) {
+        delete statistics;
+        throw;
+    }
+    get_table(table_name).set_statistics(statistics);
+    Catalog::bump_version();  // plans made with the old statistics may no longer be the best
+}
+
 
 /*
  * ****************************
@@ -226,6 +273,25 @@ void Columns::create() {
     row["column_name"] = Value("is_unique");
     row["data_type"] = Value("BOOLEAN");
     insert(&row); 
+
+    row["table_name"] = Value("_statistics");
+    row["data_type"] = Value("TEXT");
+    row["column_name"] = Value("table_name");
+    insert(&row);
+    row["column_name"] = Value("column_name");
+    insert(&row);
+    row["data_type"] = Value("INT");
+    row["column_name"] = Value("row_count");
+    insert(&row);
+    row["column_name"] = Value("page_count");
+    insert(&row);
+    row["column_name"] = Value("distinct_count");
+    insert(&row);
+    row["column_name"] = Value("null_count");
+    insert(&row);
+    row["data_type"] = Value("TEXT");
+    row["column_name"] = Value("histogram");
+    insert(&row);
 }
 
 // Manually check that (table_name, column_name) is unique.
@@ -238,18 +304,37 @@ Handle Columns::insert(const ValueDict* row) {
     if (!is_acceptable_data_type(row->at("data_type").s))
         throw DbRelationError("unacceptable data type '" + row->at("data_type").s + "'");
 
-    // Try SELECT * FROM _columns WHERE table_name = row["table_name"] AND column_name = column_name["column_name"]
-    // and it should return nothing
-    ValueDict where;
-    where["table_name"] = row->at("table_name");
-    where["column_name"] = row->at("column_name");
-    Handles* handles = select(&where);
-    bool unique = handles->empty();
-    delete handles;
+    bool unique;
+    if (Catalog::is_loaded()) {
+        const Catalog::TableEntry *entry = Catalog::get_table(row->at("table_name").s);
+        unique = entry == nullptr || std::find(entry->column_names.begin(), entry->column_names.end(),
+                                               row->at("column_name").s) == entry->column_names.end();
+    } else {
+        // Try SELECT * FROM _columns WHERE table_name = row["table_name"] AND column_name = column_name["column_name"]
+        // and it should return nothing
+        ValueDict where;
+        where["table_name"] = row->at("table_name");
+        where["column_name"] = row->at("column_name");
+        Handles* handles = select(&where);
+        unique = handles->empty();
+        delete handles;
+    }
     if (!unique)
         throw DbRelationError("duplicate column " + row->at("table_name").s + "." + row->at("column_name").s);
 
-    return HeapTable::insert(row);
+    Handle handle = HeapTable::insert(row);
+    Catalog::add_column(row->at("table_name").s, row->at("column_name").s, data_type_of(row->at("data_type").s));
+    return handle;
+}
+
+// Remove a row, and the column from the catalog.
+void Columns::del(Handle handle) {
+    ValueDict* row = project(handle);
+    Identifier table_name = row->at("table_name").s;
+    Identifier column_name = row->at("column_name").s;
+    delete row;
+    HeapTable::del(handle);
+    Catalog::remove_column(table_name, column_name);
 }
 
 
@@ -303,20 +388,32 @@ Handle Indices::insert(const ValueDict* row) {
     if (!is_acceptable_identifier(row->at("index_name").s))
         throw DbRelationError("unacceptable index name '" + row->at("index_name").s + "'");
 
-    // Try SELECT * FROM _indices WHERE table_name = row["table_name"] AND index_name = row["index_name"]
-    //     AND column_name = column_name["column_name"]
-    // and it should return nothing
-    ValueDict where;
-    where["table_name"] = row->at("table_name");
-    where["index_name"] = row->at("index_name");
-    if (row->at("seq_in_index").n > 1)
-        where["column_name"] = row->at("column_name");  // check for duplicate columns on the same index
-    Handles* handles = select(&where);
-    bool unique = handles->empty();
-    delete handles;
+    bool unique;
+    if (Catalog::is_loaded()) {
+        const Catalog::IndexEntry *entry = Catalog::get_index(row->at("table_name").s, row->at("index_name").s);
+        unique = entry == nullptr || (row->at("seq_in_index").n > 1 &&
+                 std::find(entry->column_names.begin(), entry->column_names.end(),
+                           row->at("column_name").s) == entry->column_names.end());
+    } else {
+        // Try SELECT * FROM _indices WHERE table_name = row["table_name"] AND index_name = row["index_name"]
+        //     AND column_name = column_name["column_name"]
+        // and it should return nothing
+        ValueDict where;
+        where["table_name"] = row->at("table_name");
+        where["index_name"] = row->at("index_name");
+        if (row->at("seq_in_index").n > 1)
+            where["column_name"] = row->at("column_name");  // check for duplicate columns on the same index
+        Handles* handles = select(&where);
+        unique = handles->empty();
+        delete handles;
+    }
     if (!unique)
         throw DbRelationError("duplicate index " + row->at("table_name").s + " " + row->at("index_name").s);
-    return HeapTable::insert(row);
+    Handle handle = HeapTable::insert(row);
+    Catalog::add_index_column(row->at("table_name").s, row->at("index_name").s, (uint) row->at("seq_in_index").n,
+                              row->at("column_name").s, row->at("index_type").s == "HASH",
+                              row->at("is_unique").n != 0);
+    return handle;
 }
 
 // Remove a row, but first remove from index cache if there
@@ -332,12 +429,24 @@ void Indices::del(Handle handle) {
         Indices::index_cache.erase(cache_key);
         delete index;
     }
+    delete row;
     HeapTable::del(handle);
+    Catalog::remove_index(table_name, index_name);
 }
 
 // Return a list of column names and column attributes for given table.
 void Indices::get_columns(Identifier table_name, Identifier index_name,
                           ColumnNames &column_names, bool &is_hash, bool &is_unique) {
+    if (Catalog::is_loaded()) {
+        const Catalog::IndexEntry *entry = Catalog::get_index(table_name, index_name);
+        if (entry != nullptr) {
+            column_names.insert(column_names.end(), entry->column_names.begin(), entry->column_names.end());
+            is_hash = entry->is_hash;
+            is_unique = entry->is_unique;
+        }
+        return;
+    }
+
     // SELECT * FROM _indices WHERE table_name = <table_name> AND index_name = <index_name>
     ValueDict where;
     where["table_name"] = table_name;
@@ -363,20 +472,6 @@ void Indices::get_columns(Identifier table_name, Identifier index_name,
     delete handles;
 }
 
-// FIXME - use this for now until we have BTreeIndex and HashIndex
-class DummyIndex : public DbIndex {
-public:
-    DummyIndex(DbRelation& rel, Identifier idx, ColumnNames key, bool unq) : DbIndex(rel, idx, key, unq) {}
-    void create() {}
-    void drop() {}
-    void open() {}
-    void close() {}
-    Handles* lookup(ValueDict* key_values) const {return nullptr;}
-    void insert(Handle handle) {}
-    void del(Handle handle) {}
-};
-
-
 // Return a table for given table_name.
 DbIndex& Indices::get_index(Identifier table_name, Identifier index_name) {
     // if they are asking about an index we've once constructed, then just return that one
@@ -384,14 +479,14 @@ DbIndex& Indices::get_index(Identifier table_name, Identifier index_name) {
     if (Indices::index_cache.find(cache_key) != Indices::index_cache.end())
         return  *Indices::index_cache[cache_key];
 
-    // otherwise assume it is a DummyIndex (for now)
+    // otherwise construct it from its _indices rows
     ColumnNames column_names;
     bool is_hash, is_unique;
     get_columns(table_name, index_name, column_names, is_hash, is_unique);
     DbRelation& table = Tables::get_table(table_name);
     DbIndex* index;
     if (is_hash) {
-        index = new DummyIndex(table, index_name, column_names, is_unique);  // FIXME - change to HashIndex
+        index = new HashIndex(table, index_name, column_names, is_unique);
     } else {
         index = new BTreeIndex(table, index_name, column_names, is_unique);
     }
@@ -399,7 +494,26 @@ DbIndex& Indices::get_index(Identifier table_name, Identifier index_name) {
     return *index;
 }
 
+// Drop the index's file and bulk load a new one. A new DbIndex does the loading, since a Berkeley DB
+// handle can't be opened again once it has been closed.
+DbIndex& Indices::rebuild(Identifier table_name, Identifier index_name) {
+    std::pair<Identifier,Identifier> cache_key(table_name, index_name);
+    DbIndex& old = get_index(table_name, index_name);
+    old.drop();
+    Indices::index_cache.erase(cache_key);
+    delete &old;
+    Catalog::bump_version();  // plans made before may still point at the old index
+    DbIndex& index = get_index(table_name, index_name);
+    index.create();
+    return index;
+}
+
 IndexNames Indices::get_index_names(Identifier table_name) {
+    if (Catalog::is_loaded()) {
+        const Catalog::TableEntry *entry = Catalog::get_table(table_name);
+        return entry == nullptr ? IndexNames() : entry->index_names;
+    }
+
     IndexNames ret;
     ValueDict where;
     where["table_name"] = Value(table_name);
@@ -414,3 +528,246 @@ IndexNames Indices::get_index_names(Identifier table_name) {
     return ret;
 }
 
+
+
+/*
+ * *******************************
+ * Statistics class implementation
+ * *******************************
+ */
+const Identifier Statistics::TABLE_NAME = "_statistics";
+
+// get the column name for _statistics column
+ColumnNames& Statistics::COLUMN_NAMES() {
+    static ColumnNames cn;
+    if (cn.empty()) {
+        cn.push_back("table_name");
+        cn.push_back("column_name");
+        cn.push_back("row_count");
+        cn.push_back("page_count");
+        cn.push_back("distinct_count");
+        cn.push_back("null_count");
+        cn.push_back("histogram");
+    }
+    return cn;
+}
+
+// get the column attribute for _statistics column
+ColumnAttributes& Statistics::COLUMN_ATTRIBUTES() {
+    static ColumnAttributes cas;
+    if (cas.empty()) {
+        ColumnAttribute ca(ColumnAttribute::TEXT);
+        cas.push_back(ca);  // table_name
+        cas.push_back(ca);  // column_name
+        ca.set_data_type(ColumnAttribute::INT);
+        cas.push_back(ca);  // row_count
+        cas.push_back(ca);  // page_count
+        cas.push_back(ca);  // distinct_count
+        cas.push_back(ca);  // null_count
+        ca.set_data_type(ColumnAttribute::TEXT);
+        cas.push_back(ca);  // histogram
+    }
+    return cas;
+}
+
+// ctor - we have a fixed table structure
+Statistics::Statistics() : HeapTable(TABLE_NAME, COLUMN_NAMES(), COLUMN_ATTRIBUTES()) {
+}
+
+// Delete the old rows for the table and insert one for each of its columns.
+void Statistics::save(Identifier table_name, const TableStatistics &statistics) {
+    remove(table_name);
+    ValueDict row;
+    row["table_name"] = Value(table_name);
+    row["row_count"] = Value((int32_t) statistics.row_count);
+    row["page_count"] = Value((int32_t) statistics.page_count);
+    for (auto const& column: statistics.columns) {
+        row["column_name"] = Value(column.first);
+        row["distinct_count"] = Value((int32_t) column.second.distinct_count);
+        row["null_count"] = Value((int32_t) column.second.null_count);
+        std::string histogram;
+        for (auto const& bound: column.second.bounds) {
+            std::string text = bound.data_type == ColumnAttribute::TEXT ? bound.s : std::to_string(bound.n);
+            histogram += std::to_string(text.length()) + ":" + text;
+        }
+        row["histogram"] = Value(histogram);
+        insert(&row);
+    }
+}
+
+// Rebuild the TableStatistics from the table's rows, decoding the bounds by the types of the table's columns.
+TableStatistics *Statistics::load(const DbRelation &table) {
+    ValueDict where;
+    where["table_name"] = Value(table.get_table_name());
+    Handles* handles = select(&where);
+    if (handles->empty()) {
+        delete handles;
+        return nullptr;
+    }
+
+    const ColumnNames &column_names = table.get_column_names();
+    ColumnAttributes column_attributes = table.get_column_attributes();
+    TableStatistics *ret = new TableStatistics();
+    for (auto const& handle: *handles) {
+        ValueDict* row = project(handle);
+        ret->row_count = (size_t) (*row)["row_count"].n;
+        ret->page_count = (size_t) (*row)["page_count"].n;
+        Identifier column_name = (*row)["column_name"].s;
+        auto it = std::find(column_names.begin(), column_names.end(), column_name);
+        if (it != column_names.end()) {
+            ColumnAttribute::DataType data_type = column_attributes[it - column_names.begin()].get_data_type();
+            ColumnStatistics &column = ret->columns[column_name];
+            column.distinct_count = (size_t) (*row)["distinct_count"].n;
+            column.null_count = (size_t) (*row)["null_count"].n;
+            const std::string &histogram = (*row)["histogram"].s;
+            for (size_t pos = 0; pos < histogram.length(); ) {
+                size_t colon = histogram.find(':', pos);
+                size_t length = std::stoul(histogram.substr(pos, colon - pos));
+                std::string text = histogram.substr(colon + 1, length);
+                pos = colon + 1 + length;
+                if (data_type == ColumnAttribute::TEXT) {
+                    column.bounds.push_back(Value(text));
+                } else {
+                    Value bound(std::stoi(text));
+                    bound.data_type = data_type;
+                    column.bounds.push_back(bound);
+                }
+            }
+        }
+        delete row;
+    }
+    delete handles;
+    return ret;
+}
+
+void Statistics::remove(Identifier table_name) {
+    ValueDict where;
+    where["table_name"] = Value(table_name);
+    Handles* handles = select(&where);
+    for (auto const& handle: *handles)
+        del(handle);
+    delete handles;
+}
+
+
+/*
+ * ****************************
+ * Catalog class implementation
+ * ****************************
+ */
+bool Catalog::loaded = false;
+uint64_t Catalog::version = 0;
+std::unordered_map<Identifier, Catalog::TableEntry> Catalog::tables;
+
+// One scan of each schema table. _columns and _indices rows are in the order they were inserted,
+// which is the order of the columns in each table and of the indices created on it.
+void Catalog::load(DbRelation &tables, DbRelation &columns, DbRelation &indices) {
+    if (Catalog::loaded)
+        return;
+    Catalog::tables.clear();
+
+    Handles* handles = tables.select();
+    for (auto const& handle: *handles) {
+        ValueDict* row = tables.project(handle);
+        Catalog::tables[(*row)["table_name"].s];
+        delete row;
+    }
+    delete handles;
+
+    handles = columns.select();
+    for (auto const& handle: *handles) {
+        ValueDict* row = columns.project(handle);
+        TableEntry &entry = Catalog::tables[(*row)["table_name"].s];
+        entry.column_names.push_back((*row)["column_name"].s);
+        entry.column_attributes.push_back(ColumnAttribute(data_type_of((*row)["data_type"].s)));
+        delete row;
+    }
+    delete handles;
+
+    Catalog::loaded = true;  // so add_index_column keeps what it's given
+    handles = indices.select();
+    for (auto const& handle: *handles) {
+        ValueDict* row = indices.project(handle);
+        add_index_column((*row)["table_name"].s, (*row)["index_name"].s, (uint) (*row)["seq_in_index"].n,
+                         (*row)["column_name"].s, (*row)["index_type"].s == "HASH", (*row)["is_unique"].n != 0);
+        delete row;
+    }
+    delete handles;
+    Catalog::version++;
+}
+
+const Catalog::TableEntry *Catalog::get_table(const Identifier &table_name) {
+    auto it = Catalog::tables.find(table_name);
+    return it == Catalog::tables.end() ? nullptr : &it->second;
+}
+
+const Catalog::IndexEntry *Catalog::get_index(const Identifier &table_name, const Identifier &index_name) {
+    const TableEntry *table = get_table(table_name);
+    if (table == nullptr)
+        return nullptr;
+    auto it = table->indices.find(index_name);
+    return it == table->indices.end() ? nullptr : &it->second;
+}
+
+// Until the catalog is loaded there is nothing to keep in step, but the version still moves.
+void Catalog::add_table(const Identifier &table_name) {
+    if (Catalog::loaded)
+        Catalog::tables[table_name];
+    Catalog::version++;
+}
+
+void Catalog::remove_table(const Identifier &table_name) {
+    if (Catalog::loaded)
+        Catalog::tables.erase(table_name);
+    Catalog::version++;
+}
+
+void Catalog::add_column(const Identifier &table_name, const Identifier &column_name,
+                         ColumnAttribute::DataType data_type) {
+    if (Catalog::loaded) {
+        TableEntry &entry = Catalog::tables[table_name];
+        entry.column_names.push_back(column_name);
+        entry.column_attributes.push_back(ColumnAttribute(data_type));
+    }
+    Catalog::version++;
+}
+
+void Catalog::remove_column(const Identifier &table_name, const Identifier &column_name) {
+    auto table = Catalog::tables.find(table_name);
+    if (Catalog::loaded && table != Catalog::tables.end()) {
+        TableEntry &entry = table->second;
+        auto it = std::find(entry.column_names.begin(), entry.column_names.end(), column_name);
+        if (it != entry.column_names.end()) {
+            entry.column_attributes.erase(entry.column_attributes.begin() + (it - entry.column_names.begin()));
+            entry.column_names.erase(it);
+        }
+    }
+    Catalog::version++;
+}
+
+// An index's columns may come in any order; each goes where its seq_in_index (1-based) says.
+void Catalog::add_index_column(const Identifier &table_name, const Identifier &index_name, uint seq_in_index,
+                               const Identifier &column_name, bool is_hash, bool is_unique) {
+    if (Catalog::loaded) {
+        TableEntry &table = Catalog::tables[table_name];
+        if (table.indices.find(index_name) == table.indices.end())
+            table.index_names.push_back(index_name);
+        IndexEntry &entry = table.indices[index_name];
+        if (entry.column_names.size() < seq_in_index)
+            entry.column_names.resize(seq_in_index);
+        entry.column_names[seq_in_index - 1] = column_name;
+        entry.is_hash = is_hash;
+        entry.is_unique = is_unique;
+    }
+    Catalog::version++;
+}
+
+// Dropping an index deletes each of its _indices rows; the first one takes it out of the catalog.
+void Catalog::remove_index(const Identifier &table_name, const Identifier &index_name) {
+    auto table = Catalog::tables.find(table_name);
+    if (Catalog::loaded && table != Catalog::tables.end() && table->second.indices.erase(index_name) > 0) {
+        IndexNames &names = table->second.index_names;
+        names.erase(std::find(names.begin(), names.end(), index_name));
+    }
+    Catalog::version++;
+}
@@ -2,12 +2,17 @@
  * @file schema_tables.h - schema table classes:
  * 		Columns
  * 		Tables
+ * 		Statistics
+ * 		Indices
+ * 		Catalog
  * @author Kevin Lundeen
  * @see "Seattle University, CPSC5300, Summer 2018"
  */
 #pragma once
 
+#include <unordered_map>
 #include "heap_storage.h"
+#include "statistics.h"
 
 /**
  * Initialize access to the schema tables.
@@ -18,6 +23,7 @@ void initialize_schema_tables();
 
 
 class Columns; // forward declare
+class Statistics;
 
 /**
  * @class Tables - The singleton table that stores the metadata for all other tables.
@@ -57,6 +63,13 @@ public:
 	 */
     static DbRelation& get_table(Identifier table_name);
 
+	/**
+	 * Record new statistics for a table, both in _statistics and on its DbRelation.
+	 * @param table_name  table that was analyzed
+	 * @param statistics  what was found (owned by the table from now on)
+	 */
+    static void set_statistics(Identifier table_name, TableStatistics *statistics);
+
 protected:
 	// hard-coded columns for _tables table
     static ColumnNames& COLUMN_NAMES();
@@ -65,6 +78,9 @@ protected:
 	// keep a reference to the columns table (for get_columns method)
     static Columns* columns_table;
 
+	// and to the statistics table (for get_table and set_statistics)
+    static Statistics* statistics_table;
+
 private:
 	// keep a cache of all the tables we've instantiated so far
     static std::map<Identifier,DbRelation*> table_cache;
@@ -88,6 +104,7 @@ public:
 	// HeapTable overrides
     virtual void create();
     virtual Handle insert(const ValueDict* row);
+    virtual void del(Handle handle);
 
 protected:
 	// hard-coded columns for the _columns table
@@ -95,6 +112,48 @@ protected:
     static ColumnAttributes& COLUMN_ATTRIBUTES();
 };
 
+
+/**
+ * @class Statistics - The singleton table that stores what ANALYZE found out about each table:
+ * one row per column, with the table's row and page counts repeated on each.
+ * The histogram bounds are stored as one TEXT value, each bound as its length, a colon, and its text.
+ */
+class Statistics : public HeapTable {
+public:
+	/**
+	 * Name of the statistics table ("_statistics")
+	 */
+	static const Identifier TABLE_NAME;
+
+	// ctor/dtor
+	Statistics();
+	virtual ~Statistics() {}
+
+	/**
+	 * Replace the statistics stored for a table.
+	 * @param table_name  table the statistics are for
+	 * @param statistics  what ANALYZE found
+	 */
+	virtual void save(Identifier table_name, const TableStatistics &statistics);
+
+	/**
+	 * Get the statistics stored for a table.
+	 * @param table  table to get statistics for
+	 * @returns      its statistics (freed by caller), or nullptr if it hasn't been analyzed
+	 */
+	virtual TableStatistics *load(const DbRelation &table);
+
+	/**
+	 * Forget the statistics stored for a table.
+	 * @param table_name  table to forget
+	 */
+	virtual void remove(Identifier table_name);
+
+protected:
+	static ColumnNames& COLUMN_NAMES();
+	static ColumnAttributes& COLUMN_ATTRIBUTES();
+};
+
 typedef ColumnNames IndexNames;
 
 class Indices : public HeapTable {
@@ -129,6 +188,14 @@ public:
 	 */
 	virtual DbIndex& get_index(Identifier table_name, Identifier index_name);
 
+	/**
+	 * Build an index over again from its table's rows (e.g., after a bulk load that left it alone).
+	 * @param table_name  what table the index is on
+	 * @param index_name  name of index (unique by table)
+	 * @returns           the new DbIndex for it
+	 */
+	virtual DbIndex& rebuild(Identifier table_name, Identifier index_name);
+
 	/**
 	 * Get the list of indices on a given table.
 	 * @param table_name  which table to lookup the indices on
@@ -148,3 +215,77 @@ private:
 	static std::map<std::pair<Identifier,Identifier>,DbIndex*> index_cache;
 };
 
+
+/**
+ * @class Catalog - Process-wide cache of the rows of _tables, _columns, and _indices, so that looking up
+ * a table's columns or indices (which every INSERT does) or checking that a new name is unique doesn't
+ * scan a schema table.
+ *
+ * SQLExec loads it before it runs its first statement, and from then on the schema tables' insert and
+ * del keep it in step with their rows. Until then (e.g., while initialize_schema_tables is creating the
+ * schema tables), the schema tables answer by scanning, as they always have. Every change to the schema,
+ * or to a table's statistics, bumps the version, so a plan made under an older one can be told apart.
+ * Statements run one at a time, so there is no locking.
+ */
+class Catalog {
+public:
+	// what _indices says about an index
+	struct IndexEntry {
+		IndexEntry() : column_names(), is_hash(false), is_unique(false) {}
+		ColumnNames column_names;  // in seq_in_index order
+		bool is_hash;
+		bool is_unique;
+	};
+
+	// what _columns and _indices say about a table
+	struct TableEntry {
+		TableEntry() : column_names(), column_attributes(), index_names(), indices() {}
+		ColumnNames column_names;
+		ColumnAttributes column_attributes;
+		IndexNames index_names;  // in the order they were created
+		std::unordered_map<Identifier, IndexEntry> indices;
+	};
+
+	/**
+	 * Read the schema tables into the cache, unless it is already loaded.
+	 * @param tables   the _tables table
+	 * @param columns  the _columns table
+	 * @param indices  the _indices table
+	 */
+	static void load(DbRelation &tables, DbRelation &columns, DbRelation &indices);
+	static bool is_loaded() { return loaded; }
+
+	/**
+	 * @returns  the schema version, which changes whenever the schema (or a table's statistics) does
+	 */
+	static uint64_t get_version() { return version; }
+	static void bump_version() { version++; }
+
+	/**
+	 * @param table_name  a table
+	 * @returns           what the catalog has on it, or nullptr if there is no such table
+	 */
+	static const TableEntry *get_table(const Identifier &table_name);
+
+	/**
+	 * @param table_name  a table
+	 * @param index_name  one of its indices
+	 * @returns           what the catalog has on the index, or nullptr if there is no such index
+	 */
+	static const IndexEntry *get_index(const Identifier &table_name, const Identifier &index_name);
+
+	// called by the schema tables as their rows come and go
+	static void add_table(const Identifier &table_name);
+	static void remove_table(const Identifier &table_name);
+	static void add_column(const Identifier &table_name, const Identifier &column_name,
+	                       ColumnAttribute::DataType data_type);
+	static void remove_column(const Identifier &table_name, const Identifier &column_name);
+	static void add_index_column(const Identifier &table_name, const Identifier &index_name, uint seq_in_index,
+	                             const Identifier &column_name, bool is_hash, bool is_unique);
+	static void remove_index(const Identifier &table_name, const Identifier &index_name);
+
+protected:
+	static bool loaded;
+	static uint64_t version;
+	static std::unordered_map<Identifier, TableEntry> tables;
+};
@@ -0,0 +1,398 @@
+/**
+ * @file sort.cpp - implementation of:
+ * SortCursor
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#include <algorithm>
+#include <cstring>
+#include <tuple>
+#include "sort.h"
+using namespace std;
+
+SortCursor::SortCursor(BatchCursor *input, const SortKeys &keys, size_t limit, size_t memory_budget)
+		: input(input), keys(keys), limit(limit), memory_budget(memory_budget), sorted(false),
+		  top_n(limit <= TOP_N_ROWS), typed(false), column_names(), column_attributes(), key_positions(),
+		  prefix_exact(false), columns(), row_count(0), entries(), bytes_used(0), emitted(0), runs(), spill_count(0),
+		  sources(), heads(), merged(0) {
+}
+
+// Release the input and throw away any runs.
+SortCursor::~SortCursor() {
+	delete this->input;
+	end_merge();
+	for (HeapTable *run: this->runs) {
+		run->drop();
+		delete run;
+	}
+}
+
+// Next batch of rows in order. The first call reads all of the input.
+bool SortCursor::next(RowBatch &batch) {
+	if (this->limit == 0)
+		return false;
+	if (!this->sorted) {
+		RowBatch rows;
+		while (this->input->next(rows)) {
+			if (this->top_n) {
+				add_top_n(rows);
+			} else {
+				add_batch(rows);
+			}
+		}
+		finish_input();
+	}
+	if (!this->sources.empty())
+		return merge(batch);
+	if (this->emitted == this->entries.size())
+		return false;
+	output(batch);
+	return true;
+}
+
+// Learn the columns from the first batch of input, and how much of the keys fits in a prefix.
+void SortCursor::set_columns(RowBatch &batch) {
+	this->typed = true;
+	this->column_names = batch.get_column_names();
+	for (uint i = 0; i < this->column_names.size(); i++) {
+		this->column_attributes.push_back(ColumnAttribute(batch.column(i).data_type));
+		this->columns.push_back(ColumnVector(batch.column(i).data_type));
+	}
+	uint bytes = 0;
+	this->prefix_exact = true;
+	for (auto const &key: this->keys) {
+		uint position = (uint) batch.column_index(key.column);
+		this->key_positions.push_back(position);
+		bytes += 4;
+		if (batch.column(position).data_type == ColumnAttribute::DataType::TEXT || bytes > sizeof(uint64_t))
+			this->prefix_exact = false;
+	}
+}
+
+// Pack the leading keys of a row into 8 bytes (most significant first) that order the same way
+// the keys do, as far as they go. columns are the row's column vectors, in column_names order.
+uint64_t SortCursor::prefix(const ColumnVector *columns, uint row) const {
+	uint64_t ret = 0;
+	uint used = 0;  // bytes filled
+	for (uint k = 0; k < this->keys.size() && used < sizeof(uint64_t); k++) {
+		const ColumnVector &column = columns[this->key_positions[k]];
+		uint64_t value = 0, mask;
+		if (column.data_type == ColumnAttribute::DataType::TEXT) {
+			uint length = column.offsets[row + 1] - column.offsets[row];
+			const unsigned char *text = (const unsigned char *) column.bytes.data() + column.offsets[row];
+			for (uint i = 0; i < sizeof(uint64_t) - used; i++)
+				value = value << 8 | (i < length ? text[i] : 0);
+			mask = used == 0 ? ~(uint64_t) 0 : ((uint64_t) 1 << 8 * (sizeof(uint64_t) - used)) - 1;
+			used = sizeof(uint64_t);
+		} else {
+			if (used + 4 > sizeof(uint64_t))
+				break;
+			used += 4;
+			value = (uint64_t) ((uint32_t) column.ints[row] ^ 0x80000000u) << 8 * (sizeof(uint64_t) - used);
+			mask = (uint64_t) 0xffffffffu << 8 * (sizeof(uint64_t) - used);
+		}
+		ret |= this->keys[k].descending ? value ^ mask : value;
+	}
+	return ret;
+}
+
+// Compare two rows on the keys: negative, zero, or positive as a comes before, ties with, or comes after b.
+int SortCursor::compare(const ColumnVector *a, uint a_row, const ColumnVector *b, uint b_row) const {
+	for (uint k = 0; k < this->keys.size(); k++) {
+		const ColumnVector &x = a[this->key_positions[k]], &y = b[this->key_positions[k]];
+		int c;
+		if (x.data_type == ColumnAttribute::DataType::TEXT) {
+			uint x_length = x.offsets[a_row + 1] - x.offsets[a_row], y_length = y.offsets[b_row + 1] - y.offsets[b_row];
+			c = memcmp(x.bytes.data() + x.offsets[a_row], y.bytes.data() + y.offsets[b_row], min(x_length, y_length));
+			if (c == 0)
+				c = x_length < y_length ? -1 : x_length > y_length ? 1 : 0;
+		} else {
+			c = x.ints[a_row] < y.ints[b_row] ? -1 : x.ints[a_row] > y.ints[b_row] ? 1 : 0;
+		}
+		if (c != 0)
+			return this->keys[k].descending ? -c : c;
+	}
+	return 0;
+}
+
+// Whether one row in memory comes before another, by their prefixes if they differ.
+bool SortCursor::before(const Entry &a, const Entry &b) const {
+	if (a.prefix != b.prefix)
+		return a.prefix < b.prefix;
+	return !this->prefix_exact && compare(this->columns.data(), a.row, this->columns.data(), b.row) < 0;
+}
+
+// Copy a row of a batch into memory, as the entry with the given prefix.
+void SortCursor::add_row(RowBatch &batch, uint row, uint64_t prefix) {
+	for (uint i = 0; i < this->columns.size(); i++) {
+		ColumnVector &column = batch.column(i);
+		this->columns[i].push(column, row);
+		if (column.data_type == ColumnAttribute::DataType::TEXT)
+			this->bytes_used += column.offsets[row + 1] - column.offsets[row] + sizeof(uint32_t);
+		else
+			this->bytes_used += sizeof(int32_t);
+	}
+	this->entries.push_back(Entry{prefix, this->row_count++});
+	this->bytes_used += sizeof(Entry);
+}
+
+// Add the selected rows of a batch to the current run, spilling it whenever it outgrows the memory budget.
+void SortCursor::add_batch(RowBatch &batch) {
+	if (!this->typed)
+		set_columns(batch);
+	for (uint row = 0; row < batch.size(); row++) {
+		if (!batch.is_selected(row))
+			continue;
+		add_row(batch, row, prefix(&batch.column(0), row));
+		if (this->bytes_used > this->memory_budget)
+			spill_run();
+	}
+}
+
+// Keep the selected rows of a batch that are among the best limit rows so far. Entries are a heap
+// with the worst row we're keeping on top, so most rows of a large input are turned away by comparing
+// their prefixes with its prefix. Rows pushed out of the heap are left in the columns until compact().
+void SortCursor::add_top_n(RowBatch &batch) {
+	if (!this->typed)
+		set_columns(batch);
+	auto in_order = [this](const Entry &a, const Entry &b) { return before(a, b); };  // so the worst is on top
+	for (uint row = 0; row < batch.size(); row++) {
+		if (!batch.is_selected(row))
+			continue;
+		uint64_t row_prefix = prefix(&batch.column(0), row);
+		if (this->entries.size() == this->limit) {
+			const Entry &worst = this->entries.front();
+			if (row_prefix > worst.prefix)
+				continue;
+			if (row_prefix == worst.prefix
+					&& (this->prefix_exact || compare(&batch.column(0), row, this->columns.data(), worst.row) >= 0))
+				continue;
+			pop_heap(this->entries.begin(), this->entries.end(), in_order);
+			this->entries.pop_back();
+		}
+		add_row(batch, row, row_prefix);
+		push_heap(this->entries.begin(), this->entries.end(), in_order);
+	}
+	if (this->row_count > 2 * max(this->limit, (size_t) RowBatch::DEFAULT_ROWS))
+		compact();
+}
+
+// Drop the rows that have been pushed out of the top-N heap from the columns.
+void SortCursor::compact() {
+	vector<ColumnVector> kept;
+	for (auto const &column: this->columns)
+		kept.push_back(ColumnVector(column.data_type));
+	for (uint i = 0; i < this->entries.size(); i++) {
+		for (uint c = 0; c < kept.size(); c++)
+			kept[c].push(this->columns[c], this->entries[i].row);
+		this->entries[i].row = i;
+	}
+	this->columns.swap(kept);
+	this->row_count = (uint) this->entries.size();
+}
+
+// The input is used up: put what's in memory in order, or if we spilled, spill the rest too and merge the
+// runs down to few enough to merge in one go as the output is read.
+void SortCursor::finish_input() {
+	this->sorted = true;
+	auto in_order = [this](const Entry &a, const Entry &b) { return before(a, b); };
+	if (this->top_n) {
+		sort(this->entries.begin(), this->entries.end(), in_order);
+		return;
+	}
+	if (this->runs.empty()) {
+		sort(this->entries.begin(), this->entries.end(), in_order);
+		if (this->entries.size() > this->limit)
+			this->entries.resize(this->limit);
+		return;
+	}
+
+	if (!this->entries.empty())
+		spill_run();
+	while (this->runs.size() > MERGE_FAN_IN) {
+		start_merge(MERGE_FAN_IN);
+		HeapTable *run = new_run();
+		RowBatch batch;
+		while (merge(batch))
+			for (uint row = 0; row < batch.size(); row++)
+				write_row(run, &batch.column(0), row);
+		end_merge();
+		this->runs.push_back(run);
+	}
+	start_merge((uint) this->runs.size());
+}
+
+// A new, empty temporary table for a run.
+HeapTable *SortCursor::new_run() {
+	static uint serial = 0;
+	if (this->spill_count == 0)
+		serial++;
+	HeapTable *run = new HeapTable("_sort_" + to_string(serial) + "_" + to_string(this->spill_count++),
+			this->column_names, this->column_attributes);
+	run->create();
+	return run;
+}
+
+void SortCursor::write_row(HeapTable *run, const ColumnVector *columns, uint row) {
+	ValueDict values;
+	for (uint i = 0; i < this->column_names.size(); i++)
+		values[this->column_names[i]] = columns[i].value(row);
+	run->insert(&values);
+}
+
+// Too many rows in memory: sort them and write them out as a run (just the first limit of them, since
+// no later row of the run can make it into the output).
+void SortCursor::spill_run() {
+	sort(this->entries.begin(), this->entries.end(), [this](const Entry &a, const Entry &b) { return before(a, b); });
+	HeapTable *run = new_run();
+	for (uint i = 0; i < this->entries.size() && i < this->limit; i++)
+		write_row(run, this->columns.data(), this->entries[i].row);
+	this->runs.push_back(run);
+	for (auto &column: this->columns)
+		column.clear();
+	this->entries.clear();
+	this->row_count = 0;
+	this->bytes_used = 0;
+}
+
+// Start merging the first count runs, which are taken out of runs.
+void SortCursor::start_merge(uint count) {
+	this->merged = 0;
+	for (uint i = 0; i < count; i++) {
+		MergeSource *source = new MergeSource{this->runs[i], nullptr, RowBatch(), 0};
+		source->rows = source->run->batch_cursor(&this->column_names);
+		this->sources.push_back(source);
+		if (source->rows->next(source->batch) && source->batch.size() > 0)
+			this->heads.push_back((uint) this->sources.size() - 1);
+	}
+	this->runs.erase(this->runs.begin(), this->runs.begin() + count);
+	make_heap(this->heads.begin(), this->heads.end(), [this](uint a, uint b) {
+		return compare(&this->sources[a]->batch.column(0), this->sources[a]->row,
+				&this->sources[b]->batch.column(0), this->sources[b]->row) > 0;
+	});
+}
+
+// Fill batch with the next rows of the merge. Returns false when there are no more (or no more are wanted).
+bool SortCursor::merge(RowBatch &batch) {
+	auto later = [this](uint a, uint b) {
+		return compare(&this->sources[a]->batch.column(0), this->sources[a]->row,
+				&this->sources[b]->batch.column(0), this->sources[b]->row) > 0;
+	};
+	batch.reset(this->column_names, this->column_attributes);
+	while (!batch.full() && !this->heads.empty() && this->merged < this->limit) {
+		pop_heap(this->heads.begin(), this->heads.end(), later);
+		MergeSource &source = *this->sources[this->heads.back()];
+		for (uint i = 0; i < this->column_names.size(); i++)
+			batch.column(i).push(source.batch.column(i), source.row);
+		batch.add_row(Handle());
+		this->merged++;
+		if (++source.row == source.batch.size()) {
+			source.row = 0;
+			if (!source.rows->next(source.batch) || source.batch.size() == 0) {
+				this->heads.pop_back();
+				continue;
+			}
+		}
+		push_heap(this->heads.begin(), this->heads.end(), later);
+	}
+	return batch.size() > 0;
+}
+
+// Close and drop the runs being merged.
+void SortCursor::end_merge() {
+	for (MergeSource *source: this->sources) {
+		delete source->rows;
+		source->run->drop();
+		delete source->run;
+		delete source;
+	}
+	this->sources.clear();
+	this->heads.clear();
+}
+
+// Fill batch with the next rows in memory, in order.
+void SortCursor::output(RowBatch &batch) {
+	batch.reset(this->column_names, this->column_attributes);
+	while (!batch.full() && this->emitted < this->entries.size()) {
+		uint row = this->entries[this->emitted++].row;
+		for (uint i = 0; i < this->columns.size(); i++)
+			batch.column(i).push(this->columns[i], row);
+		batch.add_row(Handle());
+	}
+}
+
+// test function -- returns true if all tests pass
+bool test_sort() {
+	ColumnNames column_names;
+	column_names.push_back("id");
+	column_names.push_back("grp");
+	column_names.push_back("name");
+	ColumnAttributes column_attributes;
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+	HeapTable table("_test_sort", column_names, column_attributes);
+	table.create();
+	const int ROWS = 6000;
+	typedef tuple<int, int, string> Row;
+	vector<Row> expected;
+	ValueDict row;
+	for (int i = 0; i < ROWS; i++) {
+		int id = (i * 7919) % ROWS - ROWS / 2;  // every id once, out of order, some negative
+		int grp = id % 5;
+		string name = "name " + to_string(id % 97);
+		row["id"] = Value(id);
+		row["grp"] = Value(grp);
+		row["name"] = Value(name);
+		table.insert(&row);
+		expected.push_back(Row(id, grp, name));
+	}
+
+	// ORDER BY name DESC, grp, id DESC (the names' prefixes tie, so the rows have to be compared)
+	SortKeys keys;
+	keys.push_back(SortKey("name", true));
+	keys.push_back(SortKey("grp"));
+	keys.push_back(SortKey("id", true));
+	sort(expected.begin(), expected.end(), [](const Row &a, const Row &b) {
+		if (get<2>(a) != get<2>(b))
+			return get<2>(a) > get<2>(b);
+		if (get<1>(a) != get<1>(b))
+			return get<1>(a) < get<1>(b);
+		return get<0>(a) > get<0>(b);
+	});
+
+	bool ok = true;
+	for (int how = 0; how < 4; how++) {  // in memory; spilled; spilled into more runs than one merge takes; top 25
+		size_t limit = how == 3 ? 25 : SIZE_MAX;
+		size_t budget = how == 1 ? 64 * 1024 : how == 2 ? 2048 : SortCursor::DEFAULT_MEMORY_BUDGET;
+		SortCursor sort(table.batch_cursor(nullptr, nullptr, nullptr, 4, false), keys, limit, budget);
+		RowBatch batch;
+		size_t n = 0;
+		while (sort.next(batch)) {
+			for (uint i = 0; i < batch.size(); i++, n++) {
+				ValueDict *got = batch.row(i);
+				if (n >= expected.size() || got->at("id").n != get<0>(expected[n]) || got->at("grp").n != get<1>(expected[n])
+						|| got->at("name").s != get<2>(expected[n]))
+					ok = false;
+				delete got;
+			}
+		}
+		if (n != min(limit, expected.size()))
+			ok = false;
+		if ((how == 0 || how == 3) != (sort.spilled() == 0) || (how == 2 && sort.spilled() <= SortCursor::MERGE_FAN_IN))
+			ok = false;
+	}
+	cout << "sort " << (ok ? "ok" : "failed") << endl;
+
+	// ORDER BY id LIMIT 10: the heap's prefixes alone decide, since an INT key fits in one
+	SortCursor top(table.batch_cursor(), SortKeys(1, SortKey("id")), 10);
+	RowBatch batch;
+	bool top_ok = top.next(batch) && batch.size() == 10;
+	for (uint i = 0; top_ok && i < 10; i++)
+		top_ok = batch.column(0).ints[i] == (int) i - ROWS / 2;
+	top_ok = top_ok && !top.next(batch);
+	cout << "top n " << (top_ok ? "ok" : "failed") << endl;
+
+	table.drop();
+	return ok && top_ok;
+}
@@ -0,0 +1,121 @@
+/**
+ * @file sort.h - Ordering a stream of RowBatches.
+ * SortKey
+ * SortCursor
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "row_batch.h"
+#include "heap_storage.h"
+
+/**
+ * @class SortKey - one term of an ORDER BY
+ */
+class SortKey {
+public:
+	SortKey(const Identifier &column, bool descending = false) : column(column), descending(descending) {}
+
+	Identifier column;
+	bool descending;
+};
+typedef std::vector<SortKey> SortKeys;
+
+/**
+ * @class SortCursor - BatchCursor over the rows of a BatchCursor in the order of some of their columns
+ *
+ * Rows are copied into column vectors, and what gets sorted is an array of (prefix, row) entries, where
+ * the prefix packs the leading sort keys into 8 bytes that compare as an unsigned integer: 4 for each INT
+ * or BOOLEAN key and the first few bytes of a TEXT one, inverted for a descending key. Most comparisons
+ * are settled by the prefixes without touching the rows; only ties go on to compare the column values.
+ *
+ * Once the rows in memory go over memory_budget, they're sorted into a run that is written out to a
+ * temporary HeapTable, and the runs are merged (MERGE_FAN_IN at a time, in as many passes as it takes)
+ * when the input is used up. If only the first limit rows are wanted and that isn't many, the cursor
+ * instead keeps just the best limit rows seen so far in a heap, and never spills.
+ */
+class SortCursor : public BatchCursor {
+public:
+	static const size_t DEFAULT_MEMORY_BUDGET = 16 * 1024 * 1024;
+	static const uint MERGE_FAN_IN = 64;
+	static const size_t TOP_N_ROWS = 64 * 1024;  // most rows the heap is used for
+
+	/**
+	 * @param input          rows to sort (owned by the cursor)
+	 * @param keys           columns to order them by, most significant first
+	 * @param limit          how many of the rows are wanted (SIZE_MAX for all)
+	 * @param memory_budget  bytes the rows in memory may use before they are spilled
+	 */
+	SortCursor(BatchCursor *input, const SortKeys &keys, size_t limit = SIZE_MAX,
+			size_t memory_budget = DEFAULT_MEMORY_BUDGET);
+	virtual ~SortCursor();
+
+	virtual bool next(RowBatch &batch);
+
+	uint spilled() const { return this->spill_count; }  // runs written out
+
+protected:
+	// a row in memory: its key prefix and where it is in the column vectors
+	struct Entry {
+		uint64_t prefix;
+		uint32_t row;
+	};
+
+	// a sorted run being merged: its rows a batch at a time, and which one is next
+	struct MergeSource {
+		HeapTable *run;
+		BatchCursor *rows;
+		RowBatch batch;
+		uint row;
+	};
+
+	BatchCursor *input;
+	SortKeys keys;
+	size_t limit;
+	size_t memory_budget;
+	bool sorted;          // the input is used up, and what's in memory is in order
+	bool top_n;           // keeping just the best limit rows in a heap
+	bool typed;           // we've seen a batch of input, so we know the columns
+
+	ColumnNames column_names;
+	ColumnAttributes column_attributes;
+	std::vector<uint> key_positions;  // per key: its column
+	bool prefix_exact;                // prefixes that are equal mean rows that tie on every key
+
+	// the rows in memory
+	std::vector<ColumnVector> columns;  // parallel to column_names
+	uint row_count;              // rows in columns (some may no longer be in entries, if top_n)
+	std::vector<Entry> entries;  // the rows in the current run (or the heap, worst first)
+	size_t bytes_used;           // by the rows in memory, roughly
+	uint emitted;                // entries output so far
+
+	// the runs on disk
+	std::vector<HeapTable*> runs;
+	uint spill_count;            // runs written so far, counting ones written by merges
+	std::vector<MergeSource*> sources;  // the runs being merged (taken out of runs)
+	std::vector<uint> heads;     // heap of the sources with rows left, by their next rows
+	size_t merged;               // rows output by the merge so far
+
+	void set_columns(RowBatch &batch);
+	uint64_t prefix(const ColumnVector *columns, uint row) const;
+	int compare(const ColumnVector *a, uint a_row, const ColumnVector *b, uint b_row) const;
+	bool before(const Entry &a, const Entry &b) const;
+	void add_row(RowBatch &batch, uint row, uint64_t prefix);
+	void add_batch(RowBatch &batch);
+	void add_top_n(RowBatch &batch);
+	void compact();
+	void finish_input();
+	HeapTable *new_run();
+	void write_row(HeapTable *run, const ColumnVector *columns, uint row);
+	void spill_run();
+	void start_merge(uint count);
+	bool merge(RowBatch &batch);
+	void end_merge();
+	void output(RowBatch &batch);
+};
+
+bool test_sort();
@@ -6,14 +6,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <cstring>
+#include <strings.h>
 #include <iostream>
 #include <string>
+#include <vector>
+#include <cctype>
 #include <cassert>
 #include "db_cxx.h"
 #include "SQLParser.h"
 #include "ParseTreeToString.h"
 #include "SQLExec.h"
 #include "btree.h"
+#include "hash_index.h"
+#include "hash_join.h"
+#include "aggregate.h"
+#include "sort.h"
+#include "statistics.h"
+#include "copy.h"
 
 using namespace std;
 using namespace hsql;
@@ -23,6 +32,18 @@ using namespace hsql;
  */
 void initialize_environment(char *envHome);
 
+/*
+ * split an INSERT with more than one VALUES row (which the parser doesn't take) into one single-row INSERT
+ * per row; returns false (and leaves inserts alone) if query isn't one
+ */
+bool split_insert(const string &query, vector<string> &inserts);
+
+/*
+ * pick apart COPY <table> FROM | TO '<path>' [CSV | BINARY] (which the parser doesn't know either); returns
+ * false if query isn't a COPY at all, and throws SQLExecError if it is but isn't like that
+ */
+bool parse_copy(const string &query, string &table_name, bool &from, string &path, CopyFormat &format);
+
 
 /**
  * Main entry point of the sql5300 program
@@ -49,9 +70,80 @@ int main(int argc, char *argv[]) {
 		if (query == "test") {
 			cout << "test_heap_storage: " << (test_heap_storage() ? "ok" : "failed") << endl;
 			cout << "test_btree: " << (test_btree() ? "ok" : "failed") << endl; //include Btree test
+			cout << "test_hash_index: " << (test_hash_index() ? "ok" : "failed") << endl;
+			cout << "test_hash_join: " << (test_hash_join() ? "ok" : "failed") << endl;
+			cout << "test_aggregate: " << (test_aggregate() ? "ok" : "failed") << endl;
+			cout << "test_sort: " << (test_sort() ? "ok" : "failed") << endl;
+			cout << "test_statistics: " << (test_statistics() ? "ok" : "failed") << endl;
+			cout << "test_eval_plan: " << (test_eval_plan() ? "ok" : "failed") << endl;
+			cout << "test_copy: " << (test_copy() ? "ok" : "failed") << endl;
+			cout << "test_result_sink: " << (test_result_sink() ? "ok" : "failed") << endl;
+			continue;
+		}
+		if (query.compare(0, 16, "set parallelism ") == 0) {
+			SQLExec::set_parallelism((uint) atoi(query.c_str() + 16));
+			cout << "parallelism is " << SQLExec::get_parallelism() << endl;
+			continue;  // a session setting the parser doesn't know about
+		}
+		if (query.length() > 8 && strncasecmp(query.c_str(), "analyze ", 8) == 0) {
+			try {
+				size_t first = query.find_first_not_of(' ', 8), last = query.find_last_not_of(" ;");
+				QueryResult *result = SQLExec::analyze(first <= last ? query.substr(first, last - first + 1) : "");
+				cout << *result << endl;
+				delete result;
+			} catch (SQLExecError& e) {
+				cout << "Error: " << e.what() << endl;
+			}
+			continue;  // nor does it know ANALYZE
+		}
+		try {
+			string table_name, path;
+			bool from;
+			CopyFormat format;
+			if (parse_copy(query, table_name, from, path, format)) {
+				QueryResult *result = from ? SQLExec::copy_from(table_name, path, format)
+										   : SQLExec::copy_to(table_name, path, format);
+				cout << *result << endl;
+				delete result;
+				continue;
+			}
+		} catch (SQLExecError& e) {
+			cout << "Error: " << e.what() << endl;
 			continue;
 		}
 
+		vector<string> inserts;
+		if (split_insert(query, inserts)) {
+			string statements;
+			for (auto const &insert : inserts)
+				statements += insert + ";";
+			SQLParserResult* parse = SQLParser::parseSQLString(statements);
+			if (!parse->isValid()) {
+				cout << "invalid SQL: " << query << endl;
+				cout << parse->errorMsg() << endl;
+			} else {
+				try {
+					vector<const InsertStatement*> rows;
+					for (uint i = 0; i < parse->size(); ++i) {
+						if (parse->getStatement(i)->type() != kStmtInsert)
+							throw SQLExecError("not an INSERT");
+						rows.push_back((const InsertStatement*) parse->getStatement(i));
+					}
+					cout << ParseTreeToString::statement(rows.front());
+					if (rows.size() > 1)
+						cout << " (and " << rows.size() - 1 << " more rows)";
+					cout << endl;
+					QueryResult *result = SQLExec::insert_many(rows);
+					cout << *result << endl;
+					delete result;
+				} catch (SQLExecError& e) {
+					cout << "Error: " << e.what() << endl;
+				}
+			}
+			delete parse;
+			continue;  // the rows go in together
+		}
+
 		// parse and execute
 		SQLParserResult* parse = SQLParser::parseSQLString(query);
 		if (!parse->isValid()) {
@@ -62,7 +154,8 @@ int main(int argc, char *argv[]) {
 				const SQLStatement *statement = parse->getStatement(i);
 				try {
 					cout << ParseTreeToString::statement(statement) << endl;
-					QueryResult *result = SQLExec::execute(statement);
+					StreamSink rows(cout);  // rows are shown as they come, ahead of the result's message
+					QueryResult *result = SQLExec::execute(statement, &rows);
 					cout << *result << endl;
 					delete result;
 				} catch (SQLExecError& e) {
@@ -72,9 +165,74 @@ int main(int argc, char *argv[]) {
 		}
 		delete parse;
 	}
+
+	// write out every block still cached while the files are open (the buffer pool's destructor won't)
+	BufferPool::instance().flush_all();
 	return EXIT_SUCCESS;
 }
 
+// Find VALUES (outside any quotes) and each parenthesized row after it, keeping quoted text and nested
+// parentheses within their row.
+bool split_insert(const string &query, vector<string> &inserts) {
+	size_t start = query.find_first_not_of(' ');
+	if (start == string::npos || strncasecmp(query.c_str() + start, "insert ", 7) != 0)
+		return false;
+	size_t values = string::npos;
+	char quote = 0;
+	for (size_t i = start; i < query.length(); i++) {
+		if (quote != 0) {
+			if (query[i] == quote)
+				quote = 0;
+		} else if (query[i] == '\'' || query[i] == '"') {
+			quote = query[i];
+		} else if (strncasecmp(query.c_str() + i, "values", 6) == 0 && isspace(query[i - 1])
+				&& (i + 6 == query.length() || isspace(query[i + 6]) || query[i + 6] == '(')) {
+			values = i + 6;
+			break;
+		}
+	}
+	if (values == string::npos)
+		return false;
+
+	string prefix = query.substr(start, values - start);
+	vector<string> rows;
+	size_t i = values;
+	while (true) {
+		i = query.find_first_not_of(" \t", i);
+		if (i == string::npos || query[i] != '(')
+			return false;
+		size_t row_start = i;
+		int depth = 0;
+		quote = 0;
+		for (; i < query.length(); i++) {
+			if (quote != 0) {
+				if (query[i] == quote)
+					quote = 0;
+			} else if (query[i] == '\'' || query[i] == '"') {
+				quote = query[i];
+			} else if (query[i] == '(') {
+				depth++;
+			} else if (query[i] == ')' && --depth == 0) {
+				break;
+			}
+		}
+		if (i == query.length())
+			return false;
+		rows.push_back(query.substr(row_start, i - row_start + 1));
+		i = query.find_first_not_of(" \t", i + 1);
+		if (i == string::npos || query[i] == ';')
+			break;
+		if (query[i] != ',')
+			return false;
+		i++;
+	}
+	if (rows.size() < 2 || (i != string::npos && query.find_first_not_of(" \t;", i) != string::npos))
+		return false;
+	for (auto const &row : rows)
+		inserts.push_back(prefix + " " + row);
+	return true;
+}
+
 DbEnv *_DB_ENV;
 void initialize_environment(char *envHome) {
 	cout << "(sql5300: running with database environment at " << envHome
@@ -92,3 +250,40 @@ void initialize_environment(char *envHome) {
 	_DB_ENV = env;
 	initialize_schema_tables();
 }
+
+// COPY, the table name, FROM or TO, the path in single quotes, and then maybe the format, each set off by spaces.
+bool parse_copy(const string &query, string &table_name, bool &from, string &path, CopyFormat &format) {
+	size_t i = query.find_first_not_of(' ');
+	if (i == string::npos || strncasecmp(query.c_str() + i, "copy ", 5) != 0)
+		return false;
+	auto word = [&query, &i]() {
+		size_t start = query.find_first_not_of(' ', i);
+		if (start == string::npos)
+			return string();
+		i = query.find_first_of(" ;", start);
+		return query.substr(start, (i == string::npos ? query.length() : i) - start);
+	};
+	i += 5;
+	table_name = word();
+	string direction = word();
+	if (table_name.empty() || (strcasecmp(direction.c_str(), "from") != 0 && strcasecmp(direction.c_str(), "to") != 0))
+		throw SQLExecError("expected COPY <table> FROM | TO '<path>' [CSV | BINARY]");
+	from = strcasecmp(direction.c_str(), "from") == 0;
+
+	size_t start = i == string::npos ? i : query.find_first_not_of(' ', i);
+	size_t end = start == string::npos || query[start] != '\'' ? string::npos : query.find('\'', start + 1);
+	if (end == string::npos || end == start + 1)
+		throw SQLExecError("expected the path in single quotes after " + direction);
+	path = query.substr(start + 1, end - start - 1);
+
+	i = end + 1;
+	string rest = word();
+	format = COPY_CSV;
+	if (strcasecmp(rest.c_str(), "binary") == 0)
+		format = COPY_BINARY;
+	else if (!rest.empty() && strcasecmp(rest.c_str(), "csv") != 0)
+		throw SQLExecError("unknown COPY format " + rest);
+	if (!word().empty())
+		throw SQLExecError("unexpected text at the end of the COPY");
+	return true;
+}
@@ -0,0 +1,250 @@
+/**
+ * @file statistics.cpp - implementation of:
+ * ColumnStatistics
+ * TableStatistics
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <random>
+#include "statistics.h"
+#include "heap_storage.h"
+using namespace std;
+
+const double TableStatistics::DEFAULT_EQUAL_SELECTIVITY = 0.005;  // as if a column had 200 different values
+const double TableStatistics::DEFAULT_RANGE_SELECTIVITY = 1.0 / 3;
+
+// INT and BOOLEAN values compare as numbers (a literal in a WHERE clause is always an INT); TEXT compares as bytes.
+static bool less_than(const Value &a, const Value &b) {
+	if (a.data_type != ColumnAttribute::TEXT && b.data_type != ColumnAttribute::TEXT)
+		return a.n < b.n;
+	return a < b;
+}
+
+// What a value looks like as a histogram bound: TEXT is cut short.
+static Value bound(const Value &value) {
+	if (value.data_type != ColumnAttribute::TEXT || value.s.length() <= ColumnStatistics::MAX_BOUND_LENGTH)
+		return value;
+	return Value(value.s.substr(0, ColumnStatistics::MAX_BOUND_LENGTH));
+}
+
+// A value that isn't between the least and greatest values is in no row; otherwise we take the values to be
+// equally common, unless the value is the bound of more than one bucket, which means it fills the ones between.
+double ColumnStatistics::equal_selectivity(const Value &value) const {
+	if (this->bounds.empty() || this->distinct_count == 0)
+		return 0.0;
+	Value v = bound(value);
+	if (less_than(v, this->bounds.front()) || less_than(this->bounds.back(), v))
+		return 0.0;
+	uint repeats = 0;
+	for (size_t i = 1; i < this->bounds.size(); i++)
+		if (!less_than(v, this->bounds[i]) && !less_than(this->bounds[i], v))
+			repeats++;
+	double buckets = (double)(this->bounds.size() - 1);
+	return max(1.0 / (double)this->distinct_count, repeats > 1 ? (repeats - 1) / buckets : 0.0);
+}
+
+double ColumnStatistics::range_selectivity(const ValueRange &range) const {
+	if (this->bounds.empty())
+		return 0.0;
+	double low = 0.0, high = 1.0;
+	if (range.has_min)
+		low = range.min_inclusive ? fraction_below(range.min) : fraction_at_most(range.min);
+	if (range.has_max)
+		high = range.max_inclusive ? fraction_at_most(range.max) : fraction_below(range.max);
+	return max(0.0, high - low);
+}
+
+// The fraction of the rows with values less than value: the buckets wholly below it, plus a share of the one it
+// falls in, interpolated between the bucket's bounds for a number (and taken as half for TEXT).
+double ColumnStatistics::fraction_below(const Value &value) const {
+	Value v = bound(value);
+	if (!less_than(this->bounds.front(), v))
+		return 0.0;
+	if (less_than(this->bounds.back(), v))
+		return 1.0;
+	size_t i = 1;  // the bucket (bounds[i - 1], bounds[i]] that v is in
+	while (less_than(this->bounds[i], v))
+		i++;
+	const Value &low = this->bounds[i - 1], &high = this->bounds[i];
+	double share = 0.5;
+	if (v.data_type != ColumnAttribute::TEXT && low.data_type != ColumnAttribute::TEXT)
+		share = ((double)v.n - (double)low.n) / ((double)high.n - (double)low.n);
+	return ((double)(i - 1) + share) / (double)(this->bounds.size() - 1);
+}
+
+double ColumnStatistics::fraction_at_most(const Value &value) const {
+	return min(1.0, fraction_below(value) + equal_selectivity(value));
+}
+
+
+/*
+ * ANALYZE estimates each column's distinct count with a HyperLogLog sketch: each value is hashed,
+ * the hash's first HLL_BITS pick a register, and the register keeps the most leading zeros (plus one)
+ * seen in the rest of any hash that picked it. That takes 4KB a column however big the table is, and
+ * is within a few percent. Below a few thousand values it counts the registers still at zero instead
+ * (linear counting), which is closer for small counts.
+ */
+static const uint HLL_BITS = 12;
+static const uint HLL_REGISTERS = 1U << HLL_BITS;
+static const uint64_t SAMPLE_SEED = 5300;  // the sample is the same every time for the same table
+
+// std::hash<string> needn't spread its bits; this makes every bit depend on all of them (splitmix64's finisher).
+static uint64_t mix(uint64_t hash) {
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+	return hash ^ (hash >> 31);
+}
+
+static void hll_add(vector<uint8_t> &registers, uint64_t hash) {
+	uint64_t rest = hash << HLL_BITS;
+	uint8_t rank = rest == 0 ? (uint8_t)(64 - HLL_BITS + 1) : (uint8_t)(__builtin_clzll(rest) + 1);
+	uint8_t &reg = registers[hash >> (64 - HLL_BITS)];
+	if (rank > reg)
+		reg = rank;
+}
+
+static size_t hll_count(const vector<uint8_t> &registers, size_t rows) {
+	double m = HLL_REGISTERS, sum = 0.0;
+	uint zeros = 0;
+	for (uint8_t reg : registers) {
+		sum += ldexp(1.0, -(int)reg);
+		if (reg == 0)
+			zeros++;
+	}
+	double estimate = 0.7213 / (1.0 + 1.079 / m) * m * m / sum;
+	if (estimate <= 2.5 * m && zeros > 0)
+		estimate = m * log(m / zeros);
+	size_t ret = (size_t)llround(estimate);
+	return min(max(ret, rows > 0 ? (size_t)1 : (size_t)0), rows);
+}
+
+// One serial scan: count the rows and the blocks they're in, sketch every column's distinct values, and keep
+// a random sample of the rows (reservoir sampling) to build the histograms from.
+TableStatistics *TableStatistics::analyze(DbRelation &table) {
+	const ColumnNames &column_names = table.get_column_names();
+	size_t columns = column_names.size();
+	vector<vector<uint8_t>> registers(columns, vector<uint8_t>(HLL_REGISTERS, 0));
+	vector<vector<Value>> samples(columns);
+	mt19937_64 random(SAMPLE_SEED);
+
+	TableStatistics *ret = new TableStatistics();
+	BatchCursor *scan = table.batch_cursor();
+	RowBatch batch;
+	string key;
+	BlockID block_id = 0;  // blocks are numbered from 1
+	while (scan->next(batch)) {
+		for (uint row = 0; row < batch.size(); row++) {
+			if (!batch.is_selected(row))
+				continue;
+			if (batch.handle(row).first != block_id) {
+				block_id = batch.handle(row).first;
+				ret->page_count++;
+			}
+			size_t slot = ret->row_count < SAMPLE_ROWS ? ret->row_count : (size_t)(random() % (ret->row_count + 1));
+			for (uint i = 0; i < columns; i++) {
+				ColumnVector &column = batch.column(i);
+				key.clear();
+				column.append_key(key, row);
+				hll_add(registers[i], mix(hash<string>()(key)));
+				if (slot == samples[i].size())
+					samples[i].push_back(column.value(row));
+				else if (slot < SAMPLE_ROWS)
+					samples[i][slot] = column.value(row);
+			}
+			ret->row_count++;
+		}
+	}
+	delete scan;
+
+	for (uint i = 0; i < columns; i++) {
+		ColumnStatistics &column = ret->columns[column_names[i]];
+		column.distinct_count = hll_count(registers[i], ret->row_count);
+		vector<Value> &sample = samples[i];
+		if (sample.empty())
+			continue;
+		sort(sample.begin(), sample.end(), less_than);
+		size_t n = sample.size(), buckets = min((size_t)HISTOGRAM_BUCKETS, n);
+		column.bounds.push_back(bound(sample.front()));
+		for (size_t b = 1; b <= buckets; b++)
+			column.bounds.push_back(bound(sample[(b * n + buckets - 1) / buckets - 1]));
+	}
+	return ret;
+}
+
+// Predicates on different columns are taken to be independent, so their selectivities multiply.
+double TableStatistics::selectivity(const TableStatistics *statistics, const ValueDict *where,
+		const ValueRanges *ranges) {
+	double ret = 1.0;
+	if (where != nullptr) {
+		for (auto const &term : *where) {
+			if (statistics == nullptr || statistics->columns.find(term.first) == statistics->columns.end())
+				ret *= DEFAULT_EQUAL_SELECTIVITY;
+			else
+				ret *= statistics->columns.at(term.first).equal_selectivity(term.second);
+		}
+	}
+	if (ranges != nullptr) {
+		for (auto const &term : *ranges) {
+			if (statistics == nullptr || statistics->columns.find(term.first) == statistics->columns.end())
+				ret *= DEFAULT_RANGE_SELECTIVITY;
+			else
+				ret *= statistics->columns.at(term.first).range_selectivity(term.second);
+		}
+	}
+	return ret;
+}
+
+size_t TableStatistics::distinct(const TableStatistics *statistics, const Identifier &column) {
+	if (statistics == nullptr || statistics->columns.find(column) == statistics->columns.end())
+		return 0;
+	return statistics->columns.at(column).distinct_count;
+}
+
+
+// test function -- returns true if all tests pass
+bool test_statistics() {
+	ColumnNames column_names;
+	column_names.push_back("id");
+	column_names.push_back("grp");
+	column_names.push_back("name");
+	ColumnAttributes column_attributes;
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::INT));
+	column_attributes.push_back(ColumnAttribute(ColumnAttribute::TEXT));
+	HeapTable table("_test_statistics", column_names, column_attributes);
+	table.create();
+	const int ROWS = 5000;
+	ValueDict row;
+	for (int i = 0; i < ROWS; i++) {
+		row["id"] = Value((i * 7919) % ROWS);  // every id once, out of order
+		row["grp"] = Value(i % 10);
+		row["name"] = Value("name " + to_string(i % 100));
+		table.insert(&row);
+	}
+
+	TableStatistics *statistics = TableStatistics::analyze(table);
+	auto near = [](double got, double expected, double within) { return fabs(got - expected) <= within; };
+	bool ok = statistics->row_count == (size_t)ROWS && statistics->page_count > 1;
+	ok = ok && near((double)TableStatistics::distinct(statistics, "id"), ROWS, ROWS * 0.05)
+		 && TableStatistics::distinct(statistics, "grp") == 10 && near((double)TableStatistics::distinct(statistics, "name"), 100, 3)
+		 && TableStatistics::distinct(statistics, "nope") == 0;
+
+	ValueDict where;
+	where["grp"] = Value(3);
+	ok = ok && near(TableStatistics::selectivity(statistics, &where, nullptr), 0.1, 0.01);
+	where["grp"] = Value(10);  // more than any of them
+	ok = ok && TableStatistics::selectivity(statistics, &where, nullptr) == 0.0;
+	ValueRanges ranges;
+	ranges["id"].restrict_max(Value(1000), false);
+	ok = ok && near(TableStatistics::selectivity(statistics, nullptr, &ranges), 0.2, 0.02);
+	ranges["id"].restrict_min(Value(4000), true);  // an empty range
+	ok = ok && TableStatistics::selectivity(statistics, nullptr, &ranges) == 0.0;
+	ok = ok && TableStatistics::selectivity(nullptr, &where, nullptr) == TableStatistics::DEFAULT_EQUAL_SELECTIVITY;
+	delete statistics;
+
+	table.drop();
+	return ok;
+}
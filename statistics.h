@@ -0,0 +1,91 @@
+/**
+ * @file statistics.h - What ANALYZE finds out about a table, for the planner.
+ * ColumnStatistics
+ * TableStatistics
+ *
+ * @see "Seattle University, CPSC5300, Summer 2018"
+ */
+#pragma once
+
+#include <map>
+#include <vector>
+#include "storage_engine.h"
+
+/**
+ * @class ColumnStatistics - the spread of one column's values
+ *
+ * The histogram is equi-depth: bounds[0] is the least value, and bucket i holds about the same share of
+ * the rows as every other bucket, those with values in (bounds[i], bounds[i + 1]]. TEXT bounds are cut
+ * short at MAX_BOUND_LENGTH bytes, which keeps them in order.
+ */
+class ColumnStatistics {
+public:
+	static const uint MAX_BOUND_LENGTH = 32;
+
+	ColumnStatistics() : distinct_count(0), null_count(0), bounds() {}
+
+	size_t distinct_count;
+	size_t null_count;  // always 0 for now, since there are no NULLs
+	std::vector<Value> bounds;
+
+	/**
+	 * @param value  a value
+	 * @returns      the fraction of the rows expected to have that value
+	 */
+	double equal_selectivity(const Value &value) const;
+
+	/**
+	 * @param range  bounds on the column's values
+	 * @returns      the fraction of the rows expected to be in range
+	 */
+	double range_selectivity(const ValueRange &range) const;
+
+protected:
+	double fraction_below(const Value &value) const;
+	double fraction_at_most(const Value &value) const;
+};
+
+/**
+ * @class TableStatistics - row and page counts of a table, and statistics for each of its columns
+ *
+ * A table that hasn't been analyzed has none of these; the planner falls back on fixed guesses of
+ * DEFAULT_EQUAL_SELECTIVITY and DEFAULT_RANGE_SELECTIVITY for it (and for any column we know nothing of).
+ */
+class TableStatistics {
+public:
+	static const uint HISTOGRAM_BUCKETS = 32;
+	static const size_t SAMPLE_ROWS = 30000;  // rows the histograms are built from
+	static const double DEFAULT_EQUAL_SELECTIVITY;
+	static const double DEFAULT_RANGE_SELECTIVITY;
+
+	TableStatistics() : row_count(0), page_count(0), columns() {}
+
+	size_t row_count;
+	size_t page_count;
+	std::map<Identifier, ColumnStatistics> columns;
+
+	/**
+	 * Read the whole of a table to find out its statistics. Distinct counts are estimated (with a
+	 * HyperLogLog sketch per column), and histograms are built from a random sample of SAMPLE_ROWS rows.
+	 * @param table  table to analyze
+	 * @returns      its statistics (freed by caller)
+	 */
+	static TableStatistics *analyze(DbRelation &table);
+
+	/**
+	 * @param statistics  a table's statistics (nullptr if it hasn't been analyzed)
+	 * @param where       equality predicates on its columns (may be nullptr)
+	 * @param ranges      range predicates on its columns (may be nullptr)
+	 * @returns           the fraction of its rows expected to satisfy all of them (taken as independent)
+	 */
+	static double selectivity(const TableStatistics *statistics, const ValueDict *where, const ValueRanges *ranges);
+
+	/**
+	 * @param statistics  a table's statistics (nullptr if it hasn't been analyzed)
+	 * @param column      one of its columns
+	 * @returns           how many different values it has (0 if we don't know)
+	 */
+	static size_t distinct(const TableStatistics *statistics, const Identifier &column);
+};
+
+bool test_statistics();
@@ -1,12 +1,14 @@
 #include <algorithm>
 #include "storage_engine.h"
+#include "row_batch.h"
+#include "statistics.h"
 
 bool Value::operator==(const Value &other) const {
     if (this->data_type != other.data_type)
         return false;
-    if (this->data_type == ColumnAttribute::INT)
-        return this->n == other.n;
-    return this->s == other.s;
+    if (this->data_type == ColumnAttribute::TEXT)
+        return this->s == other.s;
+    return this->n == other.n;
 }
 
 bool Value::operator!=(const Value &other) const {
@@ -31,6 +33,42 @@ bool Value::operator<(const Value &other) const {
     return this->n < other.n;
 }
 
+// Keep whichever lower bound is tighter.
+void ValueRange::restrict_min(const Value &value, bool inclusive) {
+    if (!this->has_min || this->min < value || (this->min == value && !inclusive)) {
+        this->has_min = true;
+        this->min = value;
+        this->min_inclusive = inclusive;
+    }
+}
+
+// Keep whichever upper bound is tighter.
+void ValueRange::restrict_max(const Value &value, bool inclusive) {
+    if (!this->has_max || value < this->max || (this->max == value && !inclusive)) {
+        this->has_max = true;
+        this->max = value;
+        this->max_inclusive = inclusive;
+    }
+}
+
+bool ValueRange::contains(const Value &value) const {
+    if (this->has_min && (value < this->min || (!this->min_inclusive && value == this->min)))
+        return false;
+    if (this->has_max && (this->max < value || (!this->max_inclusive && value == this->max)))
+        return false;
+    return true;
+}
+
+DbRelation::~DbRelation() {
+    delete this->statistics;
+}
+
+void DbRelation::set_statistics(TableStatistics *statistics) {
+    if (statistics != this->statistics)
+        delete this->statistics;
+    this->statistics = statistics;
+}
+
 // Get only selected column attributes
 ColumnAttributes* DbRelation::get_column_attributes(const ColumnNames &select_column_names) const {
     ColumnAttributes *ret = new ColumnAttributes();
@@ -82,3 +120,90 @@ ValueDicts* DbRelation::project(Handles *handles, const ValueDict* where) {
     return ret;
 }
 
+
+// Default multi-row insert: one row at a time, taking back the ones already in if one fails.
+Handles* DbRelation::insert_many(const ValueDicts* rows) {
+    Handles* handles = new Handles();
+    try {
+        for (auto const& row: *rows)
+            handles->push_back(insert(row));
+    } catch (...) {
+        for (auto const& handle: *handles)
+            del(handle);
+        delete handles;
+        throw;
+    }
+    return handles;
+}
+
+// Default streaming select just walks the materialized answer.
+RowCursor* DbRelation::cursor(const ValueDict* where, const ValueRanges* ranges) {
+    RowCursor* rows = new HandlesCursor(select(where));
+    if (ranges != nullptr && !ranges->empty())
+        rows = new FilterCursor(*this, rows, nullptr, ranges);
+    return rows;
+}
+
+// Default streaming refinement checks each row from source against where and ranges.
+RowCursor* DbRelation::cursor(RowCursor* source, const ValueDict* where, const ValueRanges* ranges) {
+    return new FilterCursor(*this, source, where, ranges);
+}
+
+// Default batch scan projects the rows one at a time from cursor(), on this thread.
+BatchCursor* DbRelation::batch_cursor(const ColumnNames* column_names, const ValueDict* where,
+        const ValueRanges* ranges, uint parallelism, bool ordered, const BatchStep* step) {
+    BatchCursor* batches = new RowBatchCursor(*this, cursor(where, ranges), column_names);
+    return step != nullptr ? (*step)(batches) : batches;
+}
+
+size_t DbRelation::estimate_rows() {
+    RowCursor* rows = cursor();
+    Handle handle;
+    size_t count = 0;
+    while (rows->next(handle))
+        count++;
+    delete rows;
+    return count;
+}
+
+bool HandlesCursor::next(Handle &handle) {
+    if (this->handles == nullptr || this->pos >= this->handles->size())
+        return false;
+    handle = (*this->handles)[this->pos++];
+    return true;
+}
+
+FilterCursor::FilterCursor(DbRelation &relation, RowCursor* source, const ValueDict* where, const ValueRanges* ranges)
+        : relation(relation), source(source), where(), ranges(), columns() {
+    if (where != nullptr)
+        this->where = *where;
+    if (ranges != nullptr)
+        this->ranges = *ranges;
+    for (auto const& column: this->where)
+        this->columns.push_back(column.first);
+    for (auto const& column: this->ranges)
+        if (this->where.find(column.first) == this->where.end())
+            this->columns.push_back(column.first);
+}
+
+bool FilterCursor::next(Handle &handle) {
+    Handle candidate;
+    while (this->source->next(candidate)) {
+        bool match = true;
+        if (!this->columns.empty()) {
+            ValueDict* row = this->relation.project(candidate, &this->columns);
+            for (auto const& column: this->where)
+                if (row->at(column.first) != column.second)
+                    match = false;
+            for (auto const& column: this->ranges)
+                if (!column.second.contains(row->at(column.first)))
+                    match = false;
+            delete row;
+        }
+        if (match) {
+            handle = candidate;
+            return true;
+        }
+    }
+    return false;
+}
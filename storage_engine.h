@@ -10,6 +10,7 @@
 #pragma once
 
 #include <exception>
+#include <functional>
 #include <map>
 #include <utility>
 #include <vector>
@@ -247,6 +248,70 @@ typedef std::map<Identifier, Value> ValueDict;
 typedef std::vector<ValueDict*> ValueDicts;
 
 
+/**
+ * @class ValueRange - lower and/or upper bound on the values of one column
+ */
+class ValueRange {
+public:
+	ValueRange() : has_min(false), min_inclusive(true), min(), has_max(false), max_inclusive(true), max() {}
+
+	bool has_min;
+	bool min_inclusive;
+	Value min;
+	bool has_max;
+	bool max_inclusive;
+	Value max;
+
+	/**
+	 * Tighten the lower bound (no effect if the current bound is already tighter).
+	 * @param value      new lower bound
+	 * @param inclusive  whether value itself is in range
+	 */
+	void restrict_min(const Value &value, bool inclusive);
+
+	/**
+	 * Tighten the upper bound (no effect if the current bound is already tighter).
+	 * @param value      new upper bound
+	 * @param inclusive  whether value itself is in range
+	 */
+	void restrict_max(const Value &value, bool inclusive);
+
+	/**
+	 * Check a value against both bounds.
+	 * @param value  value to check
+	 * @returns      true if value is in range
+	 */
+	bool contains(const Value &value) const;
+};
+typedef std::map<Identifier, ValueRange> ValueRanges;
+
+
+/**
+ * @class RowCursor - pull-based iteration over the handles of qualifying rows
+ *
+ * Rows are produced one at a time as the underlying relation is walked, so the
+ * memory held by a scan does not grow with the size of the relation.
+ */
+class RowCursor {
+public:
+	RowCursor() {}
+	virtual ~RowCursor() {}
+	RowCursor(const RowCursor& other) = delete;
+	RowCursor& operator=(const RowCursor& other) = delete;
+
+	/**
+	 * Advance to the next qualifying row.
+	 * @param handle  returned by reference: handle of the next row
+	 * @returns       false once there are no more rows (handle is then unchanged)
+	 */
+	virtual bool next(Handle &handle) = 0;
+};
+
+
+class BatchCursor;  // see row_batch.h
+class TableStatistics;  // see statistics.h
+typedef std::function<BatchCursor*(BatchCursor*)> BatchStep;  // wraps a cursor (taking ownership of it)
+
 /**
  * @class DbRelationError - generic exception class for DbRelation
  */
@@ -272,6 +337,8 @@ public:
  *	del(handle)
  *	select()
  *	select(where)
+ *	cursor(where)
+ *	cursor(source, where)
  *	project(handle)
  *	project(handle, column_names)
  */
@@ -279,8 +346,10 @@ class DbRelation {
 public:
 	// ctor/dtor
 	DbRelation(Identifier table_name, ColumnNames column_names, ColumnAttributes column_attributes ) :
-		table_name(table_name), column_names(column_names), column_attributes(column_attributes) {}
-	virtual ~DbRelation() {}
+		table_name(table_name), column_names(column_names), column_attributes(column_attributes), statistics(nullptr) {}
+	virtual ~DbRelation();
+	DbRelation(const DbRelation& other) = delete;
+	DbRelation& operator=(const DbRelation& other) = delete;
 
 	/**
 	 * Execute: CREATE TABLE <table_name> ( <columns> )
@@ -318,6 +387,15 @@ public:
 	 */
 	virtual Handle insert(const ValueDict* row) = 0;
 
+	/**
+	 * Execute: INSERT INTO <table_name> ( <row_keys> ) VALUES ( <row_values> ), ( <row_values> ), ...
+	 * Either all the rows go in or, if one can't, none of them do. The default implementation inserts
+	 * them one at a time; storage engines that can fill a block at a time should override it.
+	 * @param rows  dictionaries keyed by column names
+	 * @returns     handles to the new rows, parallel to rows (freed by caller)
+	 */
+	virtual Handles* insert_many(const ValueDicts* rows);
+
 	/**
 	 * Conceptually, execute: UPDATE INTO <table_name> SET <new_valus> WHERE <handle>
 	 * where handle is sufficient to identify one specific record (e.g., returned
@@ -357,6 +435,47 @@ public:
 	 */
 	virtual Handles* select(Handles* current_selection, const ValueDict* where) = 0;
 
+	/**
+	 * Streaming version of select(where): qualifying rows are produced on demand.
+	 * The default implementation materializes select(where); storage engines that
+	 * can scan incrementally should override it.
+	 * @param where   where-clause equality predicates (copied; may be nullptr for all rows)
+	 * @param ranges  where-clause range predicates (copied; may be nullptr)
+	 * @returns       cursor over qualifying rows (freed by caller)
+	 */
+	virtual RowCursor* cursor(const ValueDict* where = nullptr, const ValueRanges* ranges = nullptr);
+
+	/**
+	 * Streaming version of select(current_selection, where).
+	 * @param source  cursor over the rows to restrict (owned by the returned cursor)
+	 * @param where   where-clause equality predicates (copied; may be nullptr)
+	 * @param ranges  where-clause range predicates (copied; may be nullptr)
+	 * @returns       cursor over the rows of source that satisfy where and ranges (freed by caller)
+	 */
+	virtual RowCursor* cursor(RowCursor* source, const ValueDict* where, const ValueRanges* ranges = nullptr);
+
+	/**
+	 * Stream the rows a batch at a time, decoded into column vectors.
+	 * @param column_names  columns to decode (nullptr for all of them)
+	 * @param where         only rows matching these equalities (may be nullptr)
+	 * @param ranges        only rows within these ranges (may be nullptr)
+	 * @param parallelism   how many threads may scan at once (a hint; 1 for none)
+	 * @param ordered       false if the batches may come back in any order
+	 * @param step          if given, wrapped around the cursor over each part of the relation that is scanned
+	 *                      on its own (e.g., to pre-aggregate on each scan thread), or the whole relation if none is
+	 * @returns             cursor over the batches (freed by caller)
+	 */
+	virtual BatchCursor* batch_cursor(const ColumnNames* column_names = nullptr, const ValueDict* where = nullptr,
+			const ValueRanges* ranges = nullptr, uint parallelism = 1, bool ordered = true,
+			const BatchStep* step = nullptr);
+
+	/**
+	 * Guess how many rows there are, for planning. The default implementation counts them with cursor();
+	 * storage engines that can guess more cheaply should override it.
+	 * @returns  estimated number of rows
+	 */
+	virtual size_t estimate_rows();
+
 	/**
 	 * Return a sequence of all values for handle (SELECT *).
 	 * @param handle  row to get values from
@@ -420,10 +539,57 @@ public:
 		return table_name;
 	}
 
+	/**
+	 * What the last ANALYZE found out about the relation, for the planner.
+	 * @returns  its statistics, or nullptr if it hasn't been analyzed
+	 */
+	const TableStatistics *get_statistics() const { return statistics; }
+
+	/**
+	 * Replace the relation's statistics.
+	 * @param statistics  new statistics (owned by the relation from now on; nullptr for none)
+	 */
+	void set_statistics(TableStatistics *statistics);
+
 protected:
 	Identifier table_name;
 	ColumnNames column_names;
 	ColumnAttributes column_attributes;
+	TableStatistics *statistics;
+};
+
+/**
+ * @class HandlesCursor - RowCursor over an already-materialized list of handles
+ */
+class HandlesCursor : public RowCursor {
+public:
+	HandlesCursor(Handles* handles) : handles(handles), pos(0) {}  // takes ownership of handles
+	virtual ~HandlesCursor() { delete handles; }
+
+	virtual bool next(Handle &handle);
+
+protected:
+	Handles* handles;
+	size_t pos;
+};
+
+/**
+ * @class FilterCursor - RowCursor that passes through the rows of another cursor satisfying a conjunction
+ */
+class FilterCursor : public RowCursor {
+public:
+	// takes ownership of source
+	FilterCursor(DbRelation &relation, RowCursor* source, const ValueDict* where, const ValueRanges* ranges = nullptr);
+	virtual ~FilterCursor() { delete source; }
+
+	virtual bool next(Handle &handle);
+
+protected:
+	DbRelation &relation;
+	RowCursor* source;
+	ValueDict where;
+	ValueRanges ranges;
+	ColumnNames columns;  // everything mentioned in where or ranges
 };
 
 class DbIndex {
@@ -465,6 +631,17 @@ public:
 	 */
     virtual Handles* lookup(ValueDict* key_values) const = 0;
 
+	/**
+	 * Lookup several search keys at once (e.g., for an index join).
+	 * @param keys     dictionaries of values for the search keys
+	 * @param results  set to the list of DbFile handles for each key, parallel to keys (each freed by caller)
+	 */
+    virtual void lookup_many(const ValueDicts& keys, std::vector<Handles*>& results) const {
+        results.clear();
+        for (ValueDict* key_values : keys)
+            results.push_back(lookup(key_values));
+    }
+
 	/**
 	 * Lookup a range of search keys.
 	 * @param min_key  dictionary of min (inclusive) search key
@@ -475,6 +652,36 @@ public:
         throw DbRelationError("range index query not supported");
     }
 
+	/**
+	 * Streaming lookup of a range of search keys. Either bound may be left open,
+	 * and a bound may give just a leading prefix of the key columns.
+	 * @param min_key        dictionary of lower bound search key (nullptr for none)
+	 * @param min_inclusive  whether keys equal to min_key are in range
+	 * @param max_key        dictionary of upper bound search key (nullptr for none)
+	 * @param max_inclusive  whether keys equal to max_key are in range
+	 * @returns              cursor over DbFile handles in key order (freed by caller)
+	 */
+    virtual RowCursor* range_cursor(const ValueDict* min_key, bool min_inclusive,
+                                    const ValueDict* max_key, bool max_inclusive) const {
+        throw DbRelationError("range index query not supported");
+    }
+
+	/**
+	 * Accessor for key_columns.
+	 * @returns  list of key column names, in order
+	 */
+    virtual const ColumnNames& get_key_columns() const { return key_columns; }
+
+	/**
+	 * @returns  true if the index can answer range_cursor
+	 */
+    virtual bool is_ordered() const { return false; }
+
+	/**
+	 * @returns  true if no two records may have the same key
+	 */
+    virtual bool is_unique() const { return unique; }
+
 	/**
 	 * Insert the index entry for the given record.
 	 * @param record  handle (into relation) to the record to insert
@@ -482,6 +689,17 @@ public:
 	 */
     virtual void insert(Handle record) = 0;
 
+	/**
+	 * Insert the index entries for several records (e.g., the rows of one INSERT).
+	 * The default implementation inserts them one at a time.
+	 * @param records  handles (into relation) to the records to insert
+	 *                 (all must be in the relation at time of insertion)
+	 */
+    virtual void insert_many(const Handles* records) {
+        for (auto const& record: *records)
+            insert(record);
+    }
+
 	/**
 	 * Delete the index entry for the given record.
 	 * @param record  handle (into relation) to the record to remove